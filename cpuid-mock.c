@@ -0,0 +1,114 @@
+/**
+ * collectd - cpuid-mock.c
+ * Copyright (C) 2015  Nils Steinger
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Author:
+ *   Nils Steinger <git at n-st dot de>
+ **/
+
+/*
+ * Replacement for cpuid.c in tests: a SandyBridge server system with
+ * CPUID_MOCK_NUM_CPUS packages of one single-threaded core each, whatever
+ * the machine running the tests is. Link it instead of cpuid.o, together
+ * with the mock MSR backend (see msr-mock.h).
+ */
+
+#include <string.h>
+
+#include "cpuid.h"
+
+#define CPUID_MOCK_NUM_CPUS  2
+#define CPUID_MOCK_SIGNATURE 0x206d7 /* SandyBridge server */
+
+/* The CPU whose topology is being queried. build_topology() can't actually
+ * run on CPUs the machine doesn't have, so they are taken in order: every
+ * query of the first topology level moves on to the next CPU. */
+static uint32_t cpuid_mock_cpu = CPUID_MOCK_NUM_CPUS - 1;
+
+void
+cpuid (uint32_t eax_in, uint32_t ecx_in, cpuid_info_t *info)
+{
+    memset (info, 0, sizeof (*info));
+}
+
+uint32_t
+get_processor_signature ()
+{
+    return CPUID_MOCK_SIGNATURE;
+}
+
+/* x2APIC ID (cpu << 1): one bit of SMT ID, the rest is the package ID */
+cpuid_info_t
+get_processor_topology (uint32_t level)
+{
+    cpuid_info_t info;
+
+    memset (&info, 0, sizeof (info));
+    if (level == 0)
+        cpuid_mock_cpu = (cpuid_mock_cpu + 1) % CPUID_MOCK_NUM_CPUS;
+    if (level <= 1) {
+        info.eax = 1;
+        info.ebx = 1;
+        info.ecx = ((level + 1) << 8) | level;
+        info.edx = cpuid_mock_cpu << 1;
+    }
+    return info;
+}
+
+uint32_t
+get_max_cpuid_leaf ()
+{
+    return 0xb;
+}
+
+uint32_t
+get_max_extended_cpuid_leaf ()
+{
+    return 0x80000008;
+}
+
+uint32_t
+get_processor_vendor ()
+{
+    return CPU_VENDOR_INTEL;
+}
+
+int
+has_amd_rapl ()
+{
+    return 0;
+}
+
+uint32_t
+get_hybrid_core_type ()
+{
+    return CPU_CORE_TYPE_NONE;
+}
+
+cpuid_info_t
+get_processor_topology_v2 (uint32_t level)
+{
+    cpuid_info_t info;
+
+    memset (&info, 0, sizeof (info));
+    return info;
+}
+
+uint64_t
+get_num_processors ()
+{
+    return CPUID_MOCK_NUM_CPUS;
+}
@@ -11,6 +11,10 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 */
 
 /* Written by Martin Dimitrov, Carl Strickland */
+
+#include <string.h>
+#include <unistd.h>
+
 #include "cpuid.h"
 
 
@@ -19,19 +23,24 @@ void
 cpuid(uint32_t eax_in, uint32_t ecx_in,
       cpuid_info_t *ci)
 {
-    asm (
 #if defined(__LP64__)           /* 64-bit architecture */
+    /* rbx is callee-saved, so it has to be an output rather than being
+     * overwritten behind the compiler's back */
+    asm (
         "cpuid;"                /* execute the cpuid instruction */
-        "movl %%ebx, %[ebx];"   /* save ebx output */
+        : "=a"(ci->eax), "=b"(ci->ebx), "=c"(ci->ecx), "=d"(ci->edx)
+        : "a"(eax_in), "c"(ecx_in)
+    );
 #else                           /* 32-bit architecture */
+    asm (
         "pushl %%ebx;"          /* save ebx */
         "cpuid;"                /* execute the cpuid instruction */
         "movl %%ebx, %[ebx];"   /* save ebx output */
         "popl %%ebx;"           /* restore ebx */
-#endif
         : "=a"(ci->eax), [ebx] "=r"(ci->ebx), "=c"(ci->ecx), "=d"(ci->edx)
         : "a"(eax_in), "c"(ecx_in)
     );
+#endif
 }
 
 uint32_t
@@ -50,6 +59,86 @@ get_processor_topology(uint32_t level)
     return info;
 }
 
+uint32_t
+get_max_cpuid_leaf()
+{
+    cpuid_info_t info;
+    cpuid(0x0, 0, &info);
+    return info.eax;
+}
+
+uint32_t
+get_max_extended_cpuid_leaf()
+{
+    cpuid_info_t info;
+    cpuid(0x80000000, 0, &info);
+    return info.eax;
+}
+
+uint32_t
+get_processor_vendor()
+{
+    cpuid_info_t info;
+    char vendor[13];
+
+    cpuid(0x0, 0, &info);
+    memcpy(vendor + 0, &info.ebx, 4);
+    memcpy(vendor + 4, &info.edx, 4);
+    memcpy(vendor + 8, &info.ecx, 4);
+    vendor[12] = '\0';
+
+    if (strcmp(vendor, "GenuineIntel") == 0)
+        return CPU_VENDOR_INTEL;
+    if (strcmp(vendor, "AuthenticAMD") == 0 || strcmp(vendor, "HygonGenuine") == 0)
+        return CPU_VENDOR_AMD;
+    return CPU_VENDOR_OTHER;
+}
+
+// AMD advertises RAPL in the advanced power management leaf, EDX bit 14
+// (Family 17h and later).
+int
+has_amd_rapl()
+{
+    cpuid_info_t info;
+
+    if (get_max_extended_cpuid_leaf() < 0x80000007)
+        return 0;
+    cpuid(0x80000007, 0, &info);
+    return (info.edx >> 14) & 1;
+}
+
+// Core type of the current CPU on hybrid parts (CPUID.07H:EDX[15] set), from
+// the native model ID leaf 0x1A. Must be called on the CPU in question.
+uint32_t
+get_hybrid_core_type()
+{
+    cpuid_info_t info;
+
+    if (get_max_cpuid_leaf() < 0x1a)
+        return CPU_CORE_TYPE_NONE;
+    cpuid(0x7, 0, &info);
+    if (!((info.edx >> 15) & 1))
+        return CPU_CORE_TYPE_NONE;
+    cpuid(0x1a, 0, &info);
+    return info.eax >> 24;
+}
+
+// V2 extended topology enumeration leaf, which adds module, tile and die
+// levels to leaf 0xB. Only valid if get_max_cpuid_leaf() >= 0x1f.
+cpuid_info_t
+get_processor_topology_v2(uint32_t level)
+{
+    cpuid_info_t info;
+    cpuid(0x1f, level, &info);
+    return info;
+}
+
+uint64_t
+get_num_processors()
+{
+    return sysconf(_SC_NPROCESSORS_CONF);
+}
+
 #if 0
 #include <stdio.h>
 void cast_uint_to_str(char* out, uint32_t in)
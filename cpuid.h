@@ -27,5 +27,36 @@ typedef struct cpuid_info_t {
 void cpuid(uint32_t eax_in, uint32_t ecx_in, cpuid_info_t *info);
 uint32_t get_processor_signature();
 cpuid_info_t get_processor_topology(uint32_t level);
+uint32_t get_max_cpuid_leaf();
+uint32_t get_max_extended_cpuid_leaf();
+cpuid_info_t get_processor_topology_v2(uint32_t level);
+
+/* Level types reported in ECX[15:8] by leaves 0xB and 0x1F */
+#define CPUID_TOPOLOGY_INVALID 0
+#define CPUID_TOPOLOGY_SMT     1
+#define CPUID_TOPOLOGY_CORE    2
+#define CPUID_TOPOLOGY_MODULE  3
+#define CPUID_TOPOLOGY_TILE    4
+#define CPUID_TOPOLOGY_DIE     5
+
+/* Vendors, as returned by get_processor_vendor() */
+#define CPU_VENDOR_OTHER 0
+#define CPU_VENDOR_INTEL 1
+#define CPU_VENDOR_AMD   2 /* AMD, and Hygon's Zen derivatives */
+
+uint32_t get_processor_vendor();
+int has_amd_rapl();
+
+/* Core types of hybrid parts, as reported in CPUID leaf 0x1A EAX[31:24] */
+#define CPU_CORE_TYPE_NONE 0x00 /* not a hybrid part */
+#define CPU_CORE_TYPE_ATOM 0x20 /* efficiency core (E-core) */
+#define CPU_CORE_TYPE_CORE 0x40 /* performance core (P-core) */
+
+uint32_t get_hybrid_core_type();
+
+/* Number of logical CPUs configured in the system. Comes with the CPUID
+ * functions so a replacement of this file (see cpuid-mock.c) can describe
+ * the whole processor. */
+uint64_t get_num_processors();
 
 #endif
@@ -0,0 +1,379 @@
+/**
+ * collectd - estimate.c
+ * Copyright (C) 2015  Nils Steinger
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Author:
+ *   Nils Steinger <git at n-st dot de>
+ **/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rapl.h"
+#include "estimate.h"
+
+#define ESTIMATE_VERSION 1
+/* Forgetting factor: older intervals lose weight with a half-life of about
+ * 700 trained intervals, so the model follows slow changes (e.g. in cooling
+ * or firmware settings). */
+#define ESTIMATE_LAMBDA 0.999
+/* Initial covariance, i.e. (little) confidence in the initial coefficients */
+#define ESTIMATE_P0 1e4
+
+typedef struct estimate_cpu_t {
+    uint64_t busy;
+    uint64_t total;
+    int      freq_fd;  /* scaling_cur_freq, or -1 */
+} estimate_cpu_t;
+
+static estimate_cpu_t *estimate_cpus = NULL;
+static long estimate_num_cpus = 0;
+static int estimate_stat_fd = -1;
+static char *estimate_buffer = NULL;
+static size_t estimate_buffer_size = 0;
+
+static double estimate_x[ESTIMATE_FEATURES];
+static double estimate_coef[ESTIMATE_FEATURES];
+static double estimate_p[ESTIMATE_FEATURES][ESTIMATE_FEATURES];
+static uint64_t estimate_trained = 0;
+
+static void
+estimate_reset_model (void)
+{
+    int i, j;
+
+    for (i = 0; i < ESTIMATE_FEATURES; i++) {
+        estimate_coef[i] = 0;
+        for (j = 0; j < ESTIMATE_FEATURES; j++)
+            estimate_p[i][j] = (i == j) ? ESTIMATE_P0 : 0;
+    }
+    estimate_trained = 0;
+}
+
+static uint64_t
+parse_u64 (const char **p)
+{
+    uint64_t value = 0;
+
+    while (**p == ' ')
+        (*p)++;
+    while (**p >= '0' && **p <= '9')
+        value = value * 10 + (uint64_t) (*(*p)++ - '0');
+    return value;
+}
+
+/* kHz from scaling_cur_freq, as GHz; 1 if it can't be read */
+static double
+estimate_cpu_ghz (const estimate_cpu_t *cpu)
+{
+    char buffer[32];
+    const char *p = buffer;
+    ssize_t len;
+
+    if (cpu->freq_fd < 0)
+        return 1.0;
+    len = pread (cpu->freq_fd, buffer, sizeof (buffer) - 1, 0);
+    if (len <= 0)
+        return 1.0;
+    buffer[len] = '\0';
+    return parse_u64 (&p) / 1e6;
+}
+
+/*
+ * Read the per-CPU lines of /proc/stat and update the features. With
+ * `update' unset, only the counters are stored (for the first sample).
+ */
+static int
+estimate_read_stat (int update)
+{
+    ssize_t len;
+    const char *p, *end;
+    long cpu;
+    uint64_t values[8], busy, total;
+    double u, sum_u = 0, sum_uf = 0;
+    int i, found = 0, advanced = 0;
+
+    len = pread (estimate_stat_fd, estimate_buffer, estimate_buffer_size - 1, 0);
+    if (len <= 0)
+        return MY_ERROR;
+    estimate_buffer[len] = '\0';
+    end = estimate_buffer + len;
+
+    for (p = estimate_buffer; p < end; p = strchr (p, '\n') + 1) {
+        if (strncmp (p, "cpu", 3) != 0)
+            break;
+        if (p[3] < '0' || p[3] > '9') {
+            /* the "cpu" line with the totals */
+            if (strchr (p, '\n') == NULL)
+                break;
+            continue;
+        }
+        p += 3;
+        cpu = (long) parse_u64 (&p);
+        /* user nice system idle iowait irq softirq steal; guest time is
+         * already included in user */
+        for (i = 0; i < 8; i++)
+            values[i] = parse_u64 (&p);
+        total = 0;
+        for (i = 0; i < 8; i++)
+            total += values[i];
+        busy = total - values[3] - values[4];
+
+        if (cpu < estimate_num_cpus) {
+            estimate_cpu_t *c = &estimate_cpus[cpu];
+            if (update && total > c->total) {
+                u = (double) (busy - c->busy) / (total - c->total);
+                sum_u += u;
+                sum_uf += u * estimate_cpu_ghz (c);
+                advanced++;
+            }
+            c->busy = busy;
+            c->total = total;
+            found++;
+        }
+        if (strchr (p, '\n') == NULL)
+            break;
+    }
+    if (found == 0)
+        return MY_ERROR;
+    /* No time has passed: there is nothing to compute the features from */
+    if (update && advanced == 0)
+        return MY_ERROR;
+
+    if (update) {
+        estimate_x[0] = 1.0;
+        estimate_x[1] = sum_u;
+        estimate_x[2] = sum_uf;
+    }
+    return 0;
+}
+
+int
+estimate_init (void)
+{
+    char path[96];
+    ssize_t len;
+    long i;
+
+    estimate_reset_model ();
+
+    estimate_num_cpus = sysconf (_SC_NPROCESSORS_CONF);
+    if (estimate_num_cpus < 1)
+        return MY_ERROR;
+
+    estimate_stat_fd = open ("/proc/stat", O_RDONLY);
+    if (estimate_stat_fd < 0)
+        return MY_ERROR;
+
+    estimate_cpus = calloc (estimate_num_cpus, sizeof (*estimate_cpus));
+    /* Before anything can fail: estimate_shutdown() closes the freq_fds. */
+    if (estimate_cpus != NULL)
+        for (i = 0; i < estimate_num_cpus; i++)
+            estimate_cpus[i].freq_fd = -1;
+    /* Room for every CPU's line to grow by a factor of four (the counters
+     * only ever get longer). */
+    estimate_buffer_size = 4096 + 4 * 128 * (size_t) estimate_num_cpus;
+    estimate_buffer = malloc (estimate_buffer_size);
+    if (estimate_cpus == NULL || estimate_buffer == NULL) {
+        estimate_shutdown ();
+        return MY_ERROR;
+    }
+    for (i = 0; i < estimate_num_cpus; i++) {
+        snprintf (path, sizeof (path), "/sys/devices/system/cpu/cpu%ld/cpufreq/scaling_cur_freq", i);
+        estimate_cpus[i].freq_fd = open (path, O_RDONLY);
+    }
+
+    /* /proc/stat also lists interrupt counts etc., so make sure everything
+     * up to the last CPU line fits. */
+    while ((len = pread (estimate_stat_fd, estimate_buffer, estimate_buffer_size, 0)) == (ssize_t) estimate_buffer_size) {
+        char *buffer = realloc (estimate_buffer, 2 * estimate_buffer_size);
+        if (buffer == NULL) {
+            estimate_shutdown ();
+            return MY_ERROR;
+        }
+        estimate_buffer = buffer;
+        estimate_buffer_size *= 2;
+    }
+
+    if (0 != estimate_read_stat (/* update = */ 0)) {
+        estimate_shutdown ();
+        return MY_ERROR;
+    }
+    return 0;
+}
+
+int
+estimate_sample (void)
+{
+    if (estimate_cpus == NULL)
+        return MY_ERROR;
+    return estimate_read_stat (/* update = */ 1);
+}
+
+/*
+ * Recursive least squares with forgetting factor lambda:
+ *   k = P x / (lambda + x' P x)
+ *   c = c + k (y - x' c)
+ *   P = (P - k x' P) / lambda
+ */
+void
+estimate_train (double watts)
+{
+    double px[ESTIMATE_FEATURES], k[ESTIMATE_FEATURES];
+    double denominator = ESTIMATE_LAMBDA, error = watts;
+    int i, j;
+
+    for (i = 0; i < ESTIMATE_FEATURES; i++) {
+        px[i] = 0;
+        for (j = 0; j < ESTIMATE_FEATURES; j++)
+            px[i] += estimate_p[i][j] * estimate_x[j];
+        denominator += estimate_x[i] * px[i];
+        error -= estimate_x[i] * estimate_coef[i];
+    }
+    for (i = 0; i < ESTIMATE_FEATURES; i++) {
+        k[i] = px[i] / denominator;
+        estimate_coef[i] += k[i] * error;
+    }
+    /* P is symmetric, so x' P = (P x)' */
+    for (i = 0; i < ESTIMATE_FEATURES; i++)
+        for (j = 0; j < ESTIMATE_FEATURES; j++)
+            estimate_p[i][j] = (estimate_p[i][j] - k[i] * px[j]) / ESTIMATE_LAMBDA;
+
+    estimate_trained++;
+}
+
+double
+estimate_watts (void)
+{
+    double watts = 0;
+    int i;
+
+    for (i = 0; i < ESTIMATE_FEATURES; i++)
+        watts += estimate_coef[i] * estimate_x[i];
+    return (watts > 0) ? watts : 0;
+}
+
+uint64_t
+estimate_samples (void)
+{
+    return estimate_trained;
+}
+
+/*
+ * File format (text, one item per line):
+ *
+ *   intel_cpu_energy-estimate <version>
+ *   samples <n>
+ *   coefficients <c0> <c1> <c2>
+ *   covariance <p00> <p01> ... <p22>
+ */
+int
+estimate_load (const char *file)
+{
+    FILE *fp;
+    int version, i, j, ok;
+    unsigned long long samples;
+    double coef[ESTIMATE_FEATURES], p[ESTIMATE_FEATURES][ESTIMATE_FEATURES];
+
+    fp = fopen (file, "r");
+    if (fp == NULL)
+        return MY_ERROR;
+
+    ok = (fscanf (fp, " intel_cpu_energy-estimate %d", &version) == 1 && version == ESTIMATE_VERSION);
+    ok = ok && (fscanf (fp, " samples %llu", &samples) == 1);
+    ok = ok && (fscanf (fp, " coefficients") == 0);
+    for (i = 0; ok && i < ESTIMATE_FEATURES; i++)
+        ok = (fscanf (fp, "%lf", &coef[i]) == 1);
+    ok = ok && (fscanf (fp, " covariance") == 0);
+    for (i = 0; ok && i < ESTIMATE_FEATURES; i++)
+        for (j = 0; ok && j < ESTIMATE_FEATURES; j++)
+            ok = (fscanf (fp, "%lf", &p[i][j]) == 1);
+    fclose (fp);
+
+    if (!ok) {
+        errno = EINVAL;
+        return MY_ERROR;
+    }
+
+    memcpy (estimate_coef, coef, sizeof (coef));
+    memcpy (estimate_p, p, sizeof (p));
+    estimate_trained = samples;
+    return 0;
+}
+
+int
+estimate_save (const char *file)
+{
+    char tmp[4096];
+    FILE *fp;
+    int i, j, err;
+
+    if ((size_t) snprintf (tmp, sizeof (tmp), "%s.tmp", file) >= sizeof (tmp)) {
+        errno = ENAMETOOLONG;
+        return MY_ERROR;
+    }
+
+    fp = fopen (tmp, "w");
+    if (fp == NULL)
+        return MY_ERROR;
+
+    fprintf (fp, "intel_cpu_energy-estimate %d\n", ESTIMATE_VERSION);
+    fprintf (fp, "samples %llu\n", (unsigned long long) estimate_trained);
+    fprintf (fp, "coefficients");
+    for (i = 0; i < ESTIMATE_FEATURES; i++)
+        fprintf (fp, " %.17g", estimate_coef[i]);
+    fprintf (fp, "\ncovariance");
+    for (i = 0; i < ESTIMATE_FEATURES; i++)
+        for (j = 0; j < ESTIMATE_FEATURES; j++)
+            fprintf (fp, " %.17g", estimate_p[i][j]);
+    fprintf (fp, "\n");
+
+    err = ferror (fp);
+    err |= (fclose (fp) != 0);
+    if (!err)
+        err = (rename (tmp, file) != 0);
+    if (err) {
+        unlink (tmp);
+        return MY_ERROR;
+    }
+    return 0;
+}
+
+void
+estimate_shutdown (void)
+{
+    long i;
+
+    if (estimate_cpus != NULL) {
+        for (i = 0; i < estimate_num_cpus; i++)
+            if (estimate_cpus[i].freq_fd >= 0)
+                close (estimate_cpus[i].freq_fd);
+        free (estimate_cpus);
+        estimate_cpus = NULL;
+    }
+    if (estimate_stat_fd >= 0) {
+        close (estimate_stat_fd);
+        estimate_stat_fd = -1;
+    }
+    free (estimate_buffer);
+    estimate_buffer = NULL;
+    estimate_buffer_size = 0;
+    estimate_num_cpus = 0;
+}
@@ -0,0 +1,75 @@
+/**
+ * collectd - estimate.h
+ * Copyright (C) 2015  Nils Steinger
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Author:
+ *   Nils Steinger <git at n-st dot de>
+ **/
+
+#ifndef _h_estimate
+#define _h_estimate
+
+#include <stdint.h>
+
+/*
+ * Model-based estimation of the host's package power, for when the RAPL
+ * registers can't be read (VMs, unsupported models, no msr module).
+ *
+ * The model is linear in three features, computed over the interval between
+ * two calls to estimate_sample():
+ *
+ *   watts = c0 + c1 * sum(u_i) + c2 * sum(u_i * f_i)
+ *
+ * where u_i is the fraction of time CPU i was busy (from /proc/stat) and f_i
+ * its current frequency in GHz (from cpufreq in sysfs, or 1 if unavailable).
+ * The coefficients are fitted online by recursive least squares with
+ * exponential forgetting whenever the measured power is passed to
+ * estimate_train(), and can be saved to and loaded from a small text file.
+ *
+ * All buffers are allocated by estimate_init(); estimate_sample() keeps the
+ * files open and re-reads them with pread(), so sampling and evaluating the
+ * model take O(cores) time and no allocations.
+ */
+
+#define ESTIMATE_FEATURES 3
+
+/* Allocate the per-CPU state and take the first sample. Returns 0 on
+ * success, MY_ERROR otherwise. */
+int estimate_init(void);
+
+/* Compute the features since the previous call. Returns 0 on success,
+ * MY_ERROR if /proc/stat couldn't be read or no time has passed. */
+int estimate_sample(void);
+
+/* Update the model with the power measured over the last sampled interval. */
+void estimate_train(double watts);
+
+/* Evaluate the model for the last sampled interval, in Watts. */
+double estimate_watts(void);
+
+/* Number of intervals the model has been trained with. */
+uint64_t estimate_samples(void);
+
+/* Load or save the model. Saving writes a temporary file and renames it
+ * over `file'. Both return 0 on success, MY_ERROR otherwise (with errno
+ * set, or EINVAL if the file is malformed). */
+int estimate_load(const char *file);
+int estimate_save(const char *file);
+
+/* Release all resources. */
+void estimate_shutdown(void);
+
+#endif
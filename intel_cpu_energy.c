@@ -46,6 +46,7 @@
 #ifdef COLLECTD_VERSION_LT_5_5
 # include <core/collectd.h>
 # include <core/common.h>
+# include <core/configfile.h>
 # include <core/plugin.h>
 #else
 /*
@@ -54,17 +55,30 @@
  */
 # include <core/daemon/collectd.h>
 # include <core/daemon/common.h>
+# include <core/daemon/configfile.h>
 # include <core/daemon/plugin.h>
 #endif /* COLLECTD_VERSION_LT_5_5 */
 
+#include "cpuid.h"
+#include "estimate.h"
+#include "msr.h"
+#include "perf.h"
 #include "rapl.h"
+#include "powercap.h"
+#include "shm.h"
+#include "trace.h"
 
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 /*
  * The CPUs' energy usage should be checked regularly so we won't miss any
- * counter overflows. The plugin will therefore fall back to a maximum interval
- * if the global interval is too long.
+ * counter overflows. The plugin will therefore fall back to a maximum
+ * sampling interval if the configured (or global) interval is too long.
  */
 #define MAXIMUM_INTERVAL_MS 60000
 
@@ -75,28 +89,284 @@ static const char * const RAPL_DOMAIN_NAMES[RAPL_NR_DOMAIN] = {
     "dram"
 };
 
+/* RAPL library context, see init_rapl() */
+static rapl_ctx_t *rapl_ctx = NULL;
+
 uint64_t rapl_node_count = 0;
-double **prev_sample = NULL;
-double **cum_energy_J = NULL;
-// Not to be confused with is_supported_domain()!
-double **rapl_domain_actually_supported = NULL;
+/* Energy is accumulated in raw energy status units (see
+ * get_rapl_domain_energy_unit()) so wraparounds are handled exactly. */
+uint64_t **prev_sample = NULL;
+uint64_t **cum_energy_raw = NULL;
+/* cum_energy_raw as of the last dispatch, used to compute the average power */
+uint64_t **dispatched_energy_raw = NULL;
+/* Joules per raw unit, by domain: DRAM may have a unit of its own */
+double energy_unit_J[RAPL_NR_DOMAIN];
+/* Highest power observed per (node, domain), used to detect intervals that
+ * were long enough to miss a wraparound. */
+double **peak_watts = NULL;
+
+/*
+ * Per-(node, domain) read health. A domain that can't be read is skipped for
+ * an exponentially growing number of read passes, without issuing any MSR
+ * reads, before it is probed again. All other domains are read as usual.
+ */
+#define MAXIMUM_BACKOFF_PASSES 64
+
+typedef struct domain_health_t {
+    unsigned int failures;     /* consecutive failed reads */
+    unsigned int backoff;      /* passes skipped after the latest failure */
+    unsigned int skip;         /* passes left until the next probe */
+    _Bool        has_baseline; /* prev_sample holds a valid reading */
+    double       last_read;    /* time of the last successful read */
+    double       power_since;  /* last_read as of the last power value */
+} domain_health_t;
+
+domain_health_t **domain_health = NULL;
+
+/*
+ * The nodes to read and, per node, the domains to read. These are computed
+ * once by energy_init() from the supported and the configured domains and
+ * packages, so disabled ones cost nothing at read time.
+ * Not to be confused with is_supported_domain()!
+ */
+static int *read_nodes = NULL;
+static int read_nodes_num = 0;
+static int (*read_domains)[RAPL_NR_DOMAIN] = NULL; /* indexed by node */
+static int *read_domains_num = NULL;               /* indexed by node */
+
+/* Configuration */
+static _Bool domain_enabled[RAPL_NR_DOMAIN] = { 1, 1, 1, 1 };
+static int *package_list = NULL; /* NULL: all packages */
+static int package_list_num = 0;
+
+/* The plugin reads the MSRs every sample_interval, but only dispatches values
+ * every dispatch_interval (rounded to a multiple of sample_interval). Zero
+ * means "use collectd's interval". */
+static cdtime_t sample_interval = 0;
+static cdtime_t dispatch_interval = 0;
+static unsigned int dispatch_every = 1;
+static unsigned int passes_since_dispatch = 0;
+static double last_dispatch = 0;
+
+/* Metrics to dispatch */
+static _Bool report_energy = 1; /* accumulated energy */
+static _Bool report_power = 0;  /* average power since the last dispatch */
+static _Bool report_self = 0;   /* self-instrumentation, see below */
+static _Bool report_core_types = 0; /* activity per core type, see below */
+static _Bool report_derived = 0;    /* residual and host totals, see below */
+static _Bool report_efficiency = 0; /* energy per instruction, see below */
+static _Bool report_bandwidth = 0;  /* memory traffic and energy per byte */
+static _Bool report_uncore = 0;     /* uncore frequency, see below */
+
+/*
+ * Rollups: the power of every domain between two samples, summarised over
+ * tiers of configurable length (Rollup 60 300 ...) and dispatched once per
+ * tier, independently of DispatchInterval:
+ *
+ *   [node]/energy-[domain]-[tier]s                energy used in the period
+ *   [node]/power-[domain]-[tier]s-{mean,min,max}  power between samples
+ *
+ * Each (tier, node, domain) has a fixed-size accumulator that is updated in
+ * O(1) per sample and reset when the tier is dispatched, so short peaks
+ * survive the downsampling.
+ */
+#define ROLLUP_MAX_TIERS 4
+
+typedef struct rollup_acc_t {
+    uint64_t energy_raw; /* sum of the deltas */
+    double   seconds;    /* sum of the sample intervals */
+    double   min_watts;
+    double   max_watts;
+} rollup_acc_t;
+
+typedef struct rollup_tier_t {
+    double        seconds; /* as configured */
+    unsigned int  every;   /* sampling passes per period */
+    unsigned int  passes;
+    rollup_acc_t *acc;     /* [node * RAPL_NR_DOMAIN + domain] */
+} rollup_tier_t;
+
+static rollup_tier_t rollup_tiers[ROLLUP_MAX_TIERS];
+static int rollup_tiers_num = 0;
+
+/* Power capping is disabled unless a budget is configured. */
+static powercap_config_t powercap_cfg = {
+    .budget_watts       = 0,
+    .ticks              = 1,
+    .min_write_interval = 10.0,
+    .deadband_watts     = 1.0
+};
+static int powercap_enabled = 0;
+
+/* Dispatch one energy_domains value list per node instead of one energy
+ * value list per (node, domain). */
+static _Bool combine_domains = 0;
+
+/* Dispatch the accumulated energy as a DERIVE counter in microjoules
+ * (energy_counter / energy_domains_counter) instead of a GAUGE in Joules. */
+static _Bool energy_counter = 0;
+
+/*
+ * Self-instrumentation: the plugin's own cost and health, dispatched as
+ * [host]/intel_cpu_energy-self/energy_self_counter-[counter] and
+ * [host]/intel_cpu_energy-self/energy_self_latency-[stage].
+ * The MSR access counters are maintained by msr.c (see get_msr_stats()),
+ * evicted_regions by the region listener (atomically). Everything else is
+ * only ever modified by the read callback.
+ */
+typedef struct energy_self_stats_t {
+    uint64_t wraps;           /* energy status counter wraparounds */
+    uint64_t missed_wraps;    /* intervals long enough to hide a wraparound */
+    uint64_t skipped_reads;   /* reads skipped due to backoff */
+    uint64_t evicted_regions; /* regions dropped after RegionMaxAge */
+    uint64_t read_ns;         /* last read pass: time spent reading MSRs */
+    uint64_t dispatch_ns;     /* last read pass: time spent dispatching */
+    uint64_t total_ns;        /* last read pass: total time */
+    uint64_t interval_ns;     /* time between the last two read passes */
+    uint64_t prev_start_ns;
+} energy_self_stats_t;
+
+static energy_self_stats_t self_stats;
+
+/*
+ * Package power thresholds, configured per package ("package", applied to
+ * each package individually) and for the sum of all packages ("host").
+ * They are checked on every read pass, so a crossing is reported by a
+ * notification right away instead of after the next dispatch.
+ *
+ * To keep the check cheap, the thresholds are converted to raw energy
+ * status units per second by energy_thresholds_init(), so the check is a
+ * couple of multiplications and comparisons against the raw counter delta.
+ */
+enum { THRESHOLD_OKAY, THRESHOLD_WARNING, THRESHOLD_FAILURE };
 
-int get_rapl_energy_info (uint64_t power_domain, uint64_t node, double *total_energy_consumed)
+typedef struct power_threshold_t {
+    /* configured, in Watts (NAN: disabled) */
+    double warning_max;
+    double failure_max;
+    double hysteresis;
+    /* precomputed, in raw units per second; index 0: warning, 1: failure */
+    double enter_raw[2];
+    double leave_raw[2];
+    _Bool  enabled;
+} power_threshold_t;
+
+#define POWER_THRESHOLD_INIT { NAN, NAN, 0, { INFINITY, INFINITY }, { INFINITY, INFINITY }, 0 }
+
+static power_threshold_t package_threshold = POWER_THRESHOLD_INIT;
+static power_threshold_t host_threshold = POWER_THRESHOLD_INIT;
+static int *package_threshold_state = NULL; /* indexed by node */
+static int host_threshold_state = THRESHOLD_OKAY;
+static double prev_read_pass = 0;
+
+/* Optional ring buffer trace of every read pass (see trace.h). */
+#define DEFAULT_TRACE_RECORDS 262144
+
+static char *trace_file = NULL;
+static uint64_t trace_records = DEFAULT_TRACE_RECORDS;
+static rapl_trace_t trace = { NULL, NULL, 0 };
+
+/*
+ * Power estimation (see estimate.h). With EstimateFile set, the model is
+ * trained on every dispatch while RAPL can be read, and saved to the file
+ * every ESTIMATE_SAVE_EVERY dispatches and at shutdown. If RAPL can't be
+ * initialised, the plugin instead reports the model's estimate of the
+ * package power of the whole host, as [host]/intel_cpu_energy-estimated/...,
+ * provided the model has been trained with enough intervals.
+ */
+#define ESTIMATE_SAVE_EVERY 60
+#define DEFAULT_ESTIMATE_MIN_SAMPLES 100
+
+static char *estimate_file = NULL;
+static uint64_t estimate_min_samples = DEFAULT_ESTIMATE_MIN_SAMPLES;
+static _Bool estimate_training = 0;
+static _Bool estimate_only = 0;
+static _Bool estimate_have_baseline = 0;
+static uint64_t estimate_prev_energy_raw = 0;
+static unsigned int estimate_dispatches = 0;
+static double estimate_energy_J = 0;
+
+/* Optional export of the latest state in shared memory (see shm.h). The
+ * state is collected in shm_nodes during a read pass and published at once
+ * at its end. */
+static char *shm_name = NULL;
+static rapl_shm_t shm = { NULL, 0, NULL };
+static rapl_shm_node_t *shm_nodes = NULL;
+
+/*
+ * Region markers: clients send "BEGIN <region>" and "END <region>" datagrams
+ * to a UNIX socket, and the plugin reports the energy consumed in between.
+ * The listener thread never reads MSRs; it uses the cumulative energy of all
+ * packages as of the last read pass, which the read callback publishes in
+ * region_energy_raw. The number of regions in flight is bounded, and regions
+ * that don't end within region_max_age seconds (e.g. because the client
+ * died) are evicted, so they can't fill the table for good.
+ */
+#define DEFAULT_REGION_MAX_IN_FLIGHT 64
+#define DEFAULT_REGION_MAX_AGE 3600.0
+#define REGION_NAME_LEN 64
+#define REGION_POLL_TIMEOUT_MS 500
+
+typedef struct energy_region_t {
+    char     name[REGION_NAME_LEN];
+    double   begin;                            /* marker arrival */
+    double   begin_sample;                     /* time of the last read pass */
+    uint64_t begin_raw[RAPL_NR_DOMAIN];
+} energy_region_t;
+
+static char *region_socket = NULL;
+static int region_socket_perms = 0660;
+static int region_max_in_flight = DEFAULT_REGION_MAX_IN_FLIGHT;
+static double region_max_age = DEFAULT_REGION_MAX_AGE; /* seconds, 0: never */
+
+static int region_fd = -1;
+static pthread_t region_thread;
+static _Bool region_thread_running = 0;
+static volatile _Bool region_thread_stop = 0;
+
+static energy_region_t *regions = NULL; /* in flight, only used by the listener */
+static int regions_num = 0;
+
+/* Sampler state shared with the listener, protected by region_lock */
+static pthread_mutex_t region_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t region_energy_raw[RAPL_NR_DOMAIN]; /* sum over all nodes read */
+static double region_sample_time = 0;
+static _Bool region_domain_read[RAPL_NR_DOMAIN];
+
+static double monotonic_seconds (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Used to timestamp the individual MSR reads. Unlike CLOCK_MONOTONIC, this
+ * clock isn't subject to NTP frequency adjustments. */
+static uint64_t monotonic_raw_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int get_rapl_energy_info (uint64_t power_domain, uint64_t node, uint64_t *total_energy_consumed_raw)
 {
     int          err;
 
     switch (power_domain) {
     case PKG:
-        err = get_pkg_total_energy_consumed(node, total_energy_consumed);
+        err = get_pkg_energy_status_raw(rapl_ctx, node, total_energy_consumed_raw);
         break;
     case PP0:
-        err = get_pp0_total_energy_consumed(node, total_energy_consumed);
+        err = get_pp0_energy_status_raw(rapl_ctx, node, total_energy_consumed_raw);
         break;
     case PP1:
-        err = get_pp1_total_energy_consumed(node, total_energy_consumed);
+        err = get_pp1_energy_status_raw(rapl_ctx, node, total_energy_consumed_raw);
         break;
     case DRAM:
-        err = get_dram_total_energy_consumed(node, total_energy_consumed);
+        err = get_dram_energy_status_raw(rapl_ctx, node, total_energy_consumed_raw);
         break;
     default:
         err = MY_ERROR;
@@ -106,170 +376,2311 @@ int get_rapl_energy_info (uint64_t power_domain, uint64_t node, double *total_en
     return err;
 }
 
-static int energy_submit (unsigned int cpu_id, unsigned int domain, double measurement)
+/*
+ * An Identifier is of the form host/plugin-instance/type-instance with
+ * both instance-parts being optional.
+ * In our case: [host]/intel_cpu_energy-[e.g. cpu0]/energy-[e.g. package],
+ * or [host]/intel_cpu_energy-[e.g. cpu0]/energy_domains if all domains of a
+ * node are combined into a single multi-value data set. In counter mode, the
+ * types are energy_counter and energy_domains_counter, respectively.
+ * The average power is reported as power-[e.g. package] or power_domains.
+ *
+ * The value lists are prepared once per node by energy_init(); reading only
+ * updates the values they point to and their timestamps.
+ */
+typedef struct energy_vl_t {
+    value_t      values[RAPL_NR_DOMAIN];
+    value_list_t domain_vl[RAPL_NR_DOMAIN];
+    value_list_t node_vl;
+    value_t      power_values[RAPL_NR_DOMAIN];
+    value_list_t power_domain_vl[RAPL_NR_DOMAIN];
+    value_list_t power_node_vl;
+} energy_vl_t;
+
+static energy_vl_t *energy_vl = NULL;
+
+/*
+ * Name a RAPL node after its package, plus its die on multi-die packages
+ * (which have a RAPL domain per die): "cpu1" or "cpu1-die0".
+ */
+static void energy_node_name (int node, char *buffer, size_t buffer_size)
 {
-    /*
-     * An Identifier is of the form host/plugin-instance/type-instance with
-     * both instance-parts being optional.
-     * In our case: [host]/intel_cpu_energy-[e.g. cpu0]/energy-[e.g. package]
-     */
+    uint64_t pkg_id = node, die_id = 0;
 
-    value_list_t vl = VALUE_LIST_INIT;
+    get_rapl_node_location (rapl_ctx, node, &pkg_id, &die_id);
+    if (get_num_dies_per_pkg (rapl_ctx) > 1)
+        ssnprintf (buffer, buffer_size, "cpu%lu-die%lu", pkg_id, die_id);
+    else
+        ssnprintf (buffer, buffer_size, "cpu%lu", pkg_id);
+}
 
-    value_t values[1];
-    values[0].gauge = measurement;
-    vl.values = values;
-    vl.values_len = STATIC_ARRAY_SIZE (values);
+static void energy_vl_init (energy_vl_t *evl, int node)
+{
+    value_list_t vl = VALUE_LIST_INIT;
+    int domain;
 
     sstrncpy (vl.host, hostname_g, sizeof (vl.host));
     sstrncpy (vl.plugin, "intel_cpu_energy", sizeof (vl.plugin));
-    ssnprintf (vl.plugin_instance, sizeof (vl.plugin_instance), "cpu%u", cpu_id);
-    sstrncpy (vl.type, "energy", sizeof (vl.type));
-    sstrncpy (vl.type_instance, RAPL_DOMAIN_NAMES[domain], sizeof (vl.type_instance));
+    energy_node_name (node, vl.plugin_instance, sizeof (vl.plugin_instance));
+    vl.interval = dispatch_interval;
 
-    return plugin_dispatch_values (&vl);
+    for (domain = 0; domain < RAPL_NR_DOMAIN; ++domain) {
+        /* Unsupported domains are reported as NaN (or 0 in counter mode) in
+         * the combined data set. */
+        if (energy_counter)
+            evl->values[domain].derive = 0;
+        else
+            evl->values[domain].gauge = NAN;
+        evl->power_values[domain].gauge = NAN;
+
+        evl->domain_vl[domain] = vl;
+        evl->domain_vl[domain].values = &evl->values[domain];
+        evl->domain_vl[domain].values_len = 1;
+        sstrncpy (evl->domain_vl[domain].type, energy_counter ? "energy_counter" : "energy",
+                sizeof (evl->domain_vl[domain].type));
+        sstrncpy (evl->domain_vl[domain].type_instance, RAPL_DOMAIN_NAMES[domain],
+                sizeof (evl->domain_vl[domain].type_instance));
+
+        evl->power_domain_vl[domain] = evl->domain_vl[domain];
+        evl->power_domain_vl[domain].values = &evl->power_values[domain];
+        sstrncpy (evl->power_domain_vl[domain].type, "power",
+                sizeof (evl->power_domain_vl[domain].type));
+    }
+
+    evl->node_vl = vl;
+    evl->node_vl.values = evl->values;
+    evl->node_vl.values_len = RAPL_NR_DOMAIN;
+    sstrncpy (evl->node_vl.type, energy_counter ? "energy_domains_counter" : "energy_domains",
+            sizeof (evl->node_vl.type));
+
+    evl->power_node_vl = evl->node_vl;
+    evl->power_node_vl.values = evl->power_values;
+    sstrncpy (evl->power_node_vl.type, "power_domains", sizeof (evl->power_node_vl.type));
 }
 
-static int energy_read (void)
+static int energy_config_domains (oconfig_item_t *ci)
 {
-    int err;
-    int node;
-    int domain;
-    double new_sample;
-    double delta;
+    int i, domain;
 
-    for (node = 0; node < rapl_node_count; node++) {
-        for (domain = 0; domain < RAPL_NR_DOMAIN; ++domain) {
-            if (rapl_domain_actually_supported[node][domain]) {
-                err = get_rapl_energy_info(domain, node, &new_sample);
-                if (err) {
-                    ERROR ("intel_cpu_energy plugin: Failed to get RAPL energy information for node %d, domain %d (%s): Return value %d", node, domain, RAPL_DOMAIN_NAMES[domain], err);
-                    return err;
-                }
+    if (ci->values_num < 1) {
+        WARNING ("intel_cpu_energy plugin: The `%s' option requires at least one argument.", ci->key);
+        return -1;
+    }
 
-                delta = new_sample - prev_sample[node][domain];
+    for (domain = 0; domain < RAPL_NR_DOMAIN; ++domain)
+        domain_enabled[domain] = 0;
 
-                /* Handle wraparound */
-                if (delta < 0) {
-                    delta += MAX_ENERGY_STATUS_JOULES;
-                }
+    for (i = 0; i < ci->values_num; i++) {
+        if (ci->values[i].type != OCONFIG_TYPE_STRING) {
+            WARNING ("intel_cpu_energy plugin: The `%s' option requires string arguments.", ci->key);
+            return -1;
+        }
+        for (domain = 0; domain < RAPL_NR_DOMAIN; ++domain)
+            if (strcasecmp (ci->values[i].value.string, RAPL_DOMAIN_NAMES[domain]) == 0)
+                break;
+        if (domain == RAPL_NR_DOMAIN) {
+            WARNING ("intel_cpu_energy plugin: Unknown domain `%s'.", ci->values[i].value.string);
+            return -1;
+        }
+        domain_enabled[domain] = 1;
+    }
 
-                prev_sample[node][domain] = new_sample;
-                cum_energy_J[node][domain] += delta;
+    return 0;
+}
 
-                err = energy_submit(node, domain, cum_energy_J[node][domain]);
-                if (err) {
-                    ERROR ("intel_cpu_energy plugin: Failed to submit energy information for node %d, domain %d (%s): Return value %d", node, domain, RAPL_DOMAIN_NAMES[domain], err);
-                    return err;
-                }
-            }
-        }
+static int energy_config_packages (oconfig_item_t *ci)
+{
+    int i;
+
+    if (ci->values_num < 1) {
+        WARNING ("intel_cpu_energy plugin: The `%s' option requires at least one argument.", ci->key);
+        return -1;
     }
 
+    sfree (package_list);
+    package_list_num = 0;
+    package_list = calloc (ci->values_num, sizeof (*package_list));
+    if (package_list == NULL)
+        return -1;
 
-    return (0);
+    for (i = 0; i < ci->values_num; i++) {
+        if (ci->values[i].type != OCONFIG_TYPE_NUMBER || ci->values[i].value.number < 0) {
+            WARNING ("intel_cpu_energy plugin: The `%s' option requires non-negative numeric arguments.", ci->key);
+            return -1;
+        }
+        package_list[package_list_num++] = (int) ci->values[i].value.number;
+    }
+
+    return 0;
 }
 
-static int energy_read_complex (user_data_t *user_data)
+static int energy_config_rollup (oconfig_item_t *ci)
 {
-    return energy_read ();
+    int i;
+
+    if (ci->values_num < 1 || ci->values_num > ROLLUP_MAX_TIERS) {
+        WARNING ("intel_cpu_energy plugin: The `%s' option requires one to %d arguments.", ci->key, ROLLUP_MAX_TIERS);
+        return -1;
+    }
+
+    rollup_tiers_num = 0;
+    for (i = 0; i < ci->values_num; i++) {
+        if (ci->values[i].type != OCONFIG_TYPE_NUMBER || ci->values[i].value.number <= 0) {
+            WARNING ("intel_cpu_energy plugin: The `%s' option requires positive numeric arguments.", ci->key);
+            return -1;
+        }
+        memset (&rollup_tiers[rollup_tiers_num], 0, sizeof (rollup_tiers[0]));
+        rollup_tiers[rollup_tiers_num++].seconds = ci->values[i].value.number;
+    }
+
+    return 0;
 }
 
-static int energy_init (void)
+static int energy_config_metrics (oconfig_item_t *ci)
 {
-    int err, node, domain;
+    int i;
+    const char *metric;
 
-    err = init_rapl();
-    if (0 != err) {
-        ERROR ("intel_cpu_energy plugin: RAPL initialisation failed with return value %d", err);
-        terminate_rapl();
-        return MY_ERROR;
+    if (ci->values_num < 1) {
+        WARNING ("intel_cpu_energy plugin: The `%s' option requires at least one argument.", ci->key);
+        return -1;
     }
-    rapl_node_count = get_num_rapl_nodes_pkg();
-    INFO ("intel_cpu_energy plugin: found %lu nodes (physical CPUs)", rapl_node_count);
 
-    prev_sample = calloc(rapl_node_count, sizeof(double*));
-    cum_energy_J = calloc(rapl_node_count, sizeof(double*));
-    rapl_domain_actually_supported = calloc(rapl_node_count, sizeof(double*));
-    if (prev_sample == NULL || cum_energy_J == NULL) {
-        ERROR ("intel_cpu_energy plugin: Memory allocation failed for outer persistent array");
-        return MY_ERROR;
+    report_energy = report_power = report_self = report_core_types = report_derived = 0;
+    report_efficiency = report_bandwidth = report_uncore = 0;
+
+    for (i = 0; i < ci->values_num; i++) {
+        if (ci->values[i].type != OCONFIG_TYPE_STRING) {
+            WARNING ("intel_cpu_energy plugin: The `%s' option requires string arguments.", ci->key);
+            return -1;
+        }
+        metric = ci->values[i].value.string;
+        if (strcasecmp (metric, "energy") == 0)
+            report_energy = 1;
+        else if (strcasecmp (metric, "power") == 0)
+            report_power = 1;
+        else if (strcasecmp (metric, "self") == 0)
+            report_self = 1;
+        else if (strcasecmp (metric, "coretypes") == 0)
+            report_core_types = 1;
+        else if (strcasecmp (metric, "derived") == 0)
+            report_derived = 1;
+        else if (strcasecmp (metric, "efficiency") == 0)
+            report_efficiency = 1;
+        else if (strcasecmp (metric, "bandwidth") == 0)
+            report_bandwidth = 1;
+        else if (strcasecmp (metric, "uncore") == 0)
+            report_uncore = 1;
+        else {
+            WARNING ("intel_cpu_energy plugin: Unknown metric `%s'.", metric);
+            return -1;
+        }
     }
 
-    /* Read initial values */
-    for (node = 0; node < rapl_node_count; node++) {
-        prev_sample[node] = calloc(RAPL_NR_DOMAIN, sizeof(double));
-        cum_energy_J[node] = calloc(RAPL_NR_DOMAIN, sizeof(double));
-        rapl_domain_actually_supported[node] = calloc(RAPL_NR_DOMAIN, sizeof(double));
-        if (prev_sample[node] == NULL || cum_energy_J[node] == NULL) {
-            ERROR ("intel_cpu_energy plugin: Memory allocation failed for inner persistent array (node %d)", node);
-            return MY_ERROR;
+    return 0;
+}
+
+static int energy_config_threshold (oconfig_item_t *ci)
+{
+    int i;
+    int status = 0;
+    power_threshold_t *t;
+
+    if (ci->values_num != 1 || ci->values[0].type != OCONFIG_TYPE_STRING) {
+        WARNING ("intel_cpu_energy plugin: The `%s' block requires exactly one string argument.", ci->key);
+        return -1;
+    }
+    if (strcasecmp (ci->values[0].value.string, "package") == 0)
+        t = &package_threshold;
+    else if (strcasecmp (ci->values[0].value.string, "host") == 0)
+        t = &host_threshold;
+    else {
+        WARNING ("intel_cpu_energy plugin: Unknown threshold `%s', expected \"package\" or \"host\".",
+                 ci->values[0].value.string);
+        return -1;
+    }
+
+    for (i = 0; i < ci->children_num; i++) {
+        oconfig_item_t *child = ci->children + i;
+
+        if (strcasecmp ("WarningMax", child->key) == 0)
+            status = cf_util_get_double (child, &t->warning_max);
+        else if (strcasecmp ("FailureMax", child->key) == 0)
+            status = cf_util_get_double (child, &t->failure_max);
+        else if (strcasecmp ("Hysteresis", child->key) == 0)
+            status = cf_util_get_double (child, &t->hysteresis);
+        else {
+            WARNING ("intel_cpu_energy plugin: Unknown threshold option: %s", child->key);
+            status = -1;
         }
 
-        for (domain = 0; domain < RAPL_NR_DOMAIN; ++domain) {
-            rapl_domain_actually_supported[node][domain] = 0;
+        if (status != 0)
+            return status;
+    }
+
+    t->enabled = !isnan (t->warning_max) || !isnan (t->failure_max);
+    return 0;
+}
 
-            if (is_supported_domain(domain)) {
-                DEBUG ("intel_cpu_energy plugin: Node %d claims it supports domain %d (%s)", node, domain, RAPL_DOMAIN_NAMES[domain]);
-                rapl_domain_actually_supported[node][domain] = 1;
+static int energy_config (oconfig_item_t *ci)
+{
+    int i;
+    int status = 0;
+    char *backend = NULL;
+    int number;
+
+    for (i = 0; i < ci->children_num; i++) {
+        oconfig_item_t *child = ci->children + i;
 
-                if (0 != get_rapl_energy_info(domain, node, &(prev_sample[node][domain]))) {
-                    WARNING ("intel_cpu_energy plugin: Node %d claims it supports domain %d (%s) but an attempt to read it"
-                             "has failed with return value %d. Will not try to read this domain of this node again.",
-                             node, domain, RAPL_DOMAIN_NAMES[domain], err);
-                    rapl_domain_actually_supported[node][domain] = 0;
+        if (strcasecmp ("Backend", child->key) == 0) {
+            status = cf_util_get_string (child, &backend);
+            if (status == 0) {
+                if (find_msr_backend (backend) == NULL) {
+                    WARNING ("intel_cpu_energy plugin: Unknown MSR backend `%s'.", backend);
+                    status = -1;
+                } else {
+                    set_msr_backend (find_msr_backend (backend));
                 }
+                sfree (backend);
+            }
+        } else if (strcasecmp ("Domains", child->key) == 0) {
+            status = energy_config_domains (child);
+        } else if (strcasecmp ("Packages", child->key) == 0) {
+            status = energy_config_packages (child);
+        } else if (strcasecmp ("SampleInterval", child->key) == 0) {
+            status = cf_util_get_cdtime (child, &sample_interval);
+        } else if (strcasecmp ("DispatchInterval", child->key) == 0) {
+            status = cf_util_get_cdtime (child, &dispatch_interval);
+        } else if (strcasecmp ("Metrics", child->key) == 0) {
+            status = energy_config_metrics (child);
+        } else if (strcasecmp ("Rollup", child->key) == 0) {
+            status = energy_config_rollup (child);
+        } else if (strcasecmp ("PowerThreshold", child->key) == 0) {
+            status = energy_config_threshold (child);
+        } else if (strcasecmp ("SharedMemory", child->key) == 0) {
+            status = cf_util_get_string (child, &shm_name);
+        } else if (strcasecmp ("RegionSocket", child->key) == 0) {
+            status = cf_util_get_string (child, &region_socket);
+        } else if (strcasecmp ("RegionSocketPerms", child->key) == 0) {
+            char *perms = NULL;
+            status = cf_util_get_string (child, &perms);
+            if (status == 0) {
+                region_socket_perms = (int) strtol (perms, NULL, 8);
+                sfree (perms);
+            }
+        } else if (strcasecmp ("RegionMaxInFlight", child->key) == 0) {
+            status = cf_util_get_int (child, &number);
+            if (status == 0 && number < 1) {
+                WARNING ("intel_cpu_energy plugin: RegionMaxInFlight must be at least 1.");
+                status = -1;
             }
+            if (status == 0)
+                region_max_in_flight = number;
+        } else if (strcasecmp ("RegionMaxAge", child->key) == 0) {
+            status = cf_util_get_double (child, &region_max_age);
+            if (status == 0 && region_max_age < 0) {
+                WARNING ("intel_cpu_energy plugin: RegionMaxAge must not be negative.");
+                status = -1;
+            }
+        } else if (strcasecmp ("EstimateFile", child->key) == 0) {
+            status = cf_util_get_string (child, &estimate_file);
+        } else if (strcasecmp ("EstimateMinSamples", child->key) == 0) {
+            status = cf_util_get_int (child, &number);
+            if (status == 0 && number < 1) {
+                WARNING ("intel_cpu_energy plugin: EstimateMinSamples must be at least 1.");
+                status = -1;
+            }
+            if (status == 0)
+                estimate_min_samples = number;
+        } else if (strcasecmp ("TraceFile", child->key) == 0) {
+            status = cf_util_get_string (child, &trace_file);
+        } else if (strcasecmp ("TraceRecords", child->key) == 0) {
+            status = cf_util_get_int (child, &number);
+            if (status == 0 && number < 1) {
+                WARNING ("intel_cpu_energy plugin: TraceRecords must be at least 1.");
+                status = -1;
+            }
+            if (status == 0)
+                trace_records = number;
+        } else if (strcasecmp ("CombineDomains", child->key) == 0) {
+            status = cf_util_get_boolean (child, &combine_domains);
+        } else if (strcasecmp ("EnergyCounter", child->key) == 0) {
+            status = cf_util_get_boolean (child, &energy_counter);
+        } else if (strcasecmp ("PowerCapBudget", child->key) == 0) {
+            status = cf_util_get_double (child, &powercap_cfg.budget_watts);
+        } else if (strcasecmp ("PowerCapTicks", child->key) == 0) {
+            status = cf_util_get_int (child, &number);
+            if (status == 0 && number < 1) {
+                WARNING ("intel_cpu_energy plugin: PowerCapTicks must be at least 1.");
+                status = -1;
+            }
+            if (status == 0)
+                powercap_cfg.ticks = number;
+        } else if (strcasecmp ("PowerCapMinWriteInterval", child->key) == 0) {
+            status = cf_util_get_double (child, &powercap_cfg.min_write_interval);
+        } else if (strcasecmp ("PowerCapDeadband", child->key) == 0) {
+            status = cf_util_get_double (child, &powercap_cfg.deadband_watts);
+        } else {
+            WARNING ("intel_cpu_energy plugin: Unknown config option: %s", child->key);
+            status = -1;
         }
+
+        if (status != 0)
+            break;
     }
 
-    return 0;
+    return status;
 }
 
-static int energy_shutdown (void)
+/* Convert a monotonic_raw_ns() timestamp to collectd's time base, given a
+ * reference point taken from both clocks at (nearly) the same instant. */
+static cdtime_t sample_time (uint64_t sample_ns, cdtime_t ref_cd, uint64_t ref_ns)
+{
+    if (sample_ns >= ref_ns)
+        return ref_cd + NS_TO_CDTIME_T (sample_ns - ref_ns);
+    else
+        return ref_cd - NS_TO_CDTIME_T (ref_ns - sample_ns);
+}
+
+static int energy_submit_self (const char *type, const char *type_instance, value_t value)
 {
-    terminate_rapl();
+    value_list_t vl = VALUE_LIST_INIT;
 
-    return 0;
+    vl.values = &value;
+    vl.values_len = 1;
+    vl.interval = dispatch_interval;
+    sstrncpy (vl.host, hostname_g, sizeof (vl.host));
+    sstrncpy (vl.plugin, "intel_cpu_energy", sizeof (vl.plugin));
+    sstrncpy (vl.plugin_instance, "self", sizeof (vl.plugin_instance));
+    sstrncpy (vl.type, type, sizeof (vl.type));
+    sstrncpy (vl.type_instance, type_instance, sizeof (vl.type_instance));
+
+    return plugin_dispatch_values (&vl);
 }
 
-void module_register (void)
+static void energy_submit_self_stats (void)
 {
-    plugin_register_init ("intel_cpu_energy", energy_init);
-    plugin_register_shutdown ("intel_cpu_energy", energy_shutdown);
+    msr_stats_t msr_stats;
+    value_t v;
+
+    get_msr_stats (&msr_stats);
+
+#define SUBMIT_COUNTER(name, val) \
+    do { v.derive = (derive_t) (val); energy_submit_self ("energy_self_counter", name, v); } while (0)
+#define SUBMIT_LATENCY(name, ns) \
+    do { v.gauge = (ns) / 1e9; energy_submit_self ("energy_self_latency", name, v); } while (0)
+
+    SUBMIT_COUNTER ("msr_reads", msr_stats.reads);
+    SUBMIT_COUNTER ("msr_read_failures", msr_stats.read_failures);
+    SUBMIT_COUNTER ("msr_writes", msr_stats.writes);
+    SUBMIT_COUNTER ("msr_write_failures", msr_stats.write_failures);
+    SUBMIT_COUNTER ("msr_opens", msr_stats.opens);
+    SUBMIT_COUNTER ("msr_batches", msr_stats.batches);
+
+    SUBMIT_COUNTER ("wraps", self_stats.wraps);
+    SUBMIT_COUNTER ("missed_wraps", self_stats.missed_wraps);
+    SUBMIT_COUNTER ("skipped_reads", self_stats.skipped_reads);
+    SUBMIT_COUNTER ("evicted_regions", __atomic_load_n (&self_stats.evicted_regions, __ATOMIC_RELAXED));
+
+    SUBMIT_LATENCY ("read", self_stats.read_ns);
+    SUBMIT_LATENCY ("dispatch", self_stats.dispatch_ns);
+    SUBMIT_LATENCY ("total", self_stats.total_ns);
+    if (self_stats.interval_ns > 0)
+        SUBMIT_LATENCY ("interval", self_stats.interval_ns);
+
+#undef SUBMIT_COUNTER
+#undef SUBMIT_LATENCY
+}
+
+static const char *energy_core_type_name (uint64_t core_type)
+{
+    switch (core_type) {
+    case CPU_CORE_TYPE_CORE:
+        return "pcore";
+    case CPU_CORE_TYPE_ATOM:
+        return "ecore";
+    default:
+        return "all";
+    }
+}
+
+/*
+ * Activity per core type (P-cores and E-cores on hybrid parts, or all cores
+ * otherwise), dispatched as
+ * [host]/intel_cpu_energy-[node]-[coretype]/{cpufreq,percent-active,energy-core}.
+ * The APERF/MPERF/TSC increments are aggregated by update_core_type_stats()
+ * on every dispatch, so no extra MSR reads happen between dispatches.
+ */
+static int energy_submit_core_types (int node, cdtime_t time)
+{
+    static _Bool failing = 0;
+    core_type_stats_t stats[RAPL_MAX_CORE_TYPES];
+    uint64_t t, num_types;
+    value_list_t vl = VALUE_LIST_INIT;
+    value_t v;
+    char node_name[DATA_MAX_NAME_LEN];
+    int failed = 0;
+
+    if (0 != update_core_type_stats (rapl_ctx, node, stats)) {
+        if (!failing)
+            WARNING ("intel_cpu_energy plugin: Failed to read the APERF/MPERF counters of node %d", node);
+        failing = 1;
+        return 1;
+    }
+    failing = 0;
+    num_types = get_num_core_types (rapl_ctx, node);
+
+    vl.values = &v;
+    vl.values_len = 1;
+    vl.time = time;
+    vl.interval = dispatch_interval;
+    sstrncpy (vl.host, hostname_g, sizeof (vl.host));
+    sstrncpy (vl.plugin, "intel_cpu_energy", sizeof (vl.plugin));
+    energy_node_name (node, node_name, sizeof (node_name));
+
+    for (t = 0; t < num_types; t++) {
+        ssnprintf (vl.plugin_instance, sizeof (vl.plugin_instance), "%s-%s",
+                   node_name, energy_core_type_name (stats[t].core_type));
+
+        if (!isnan (stats[t].freq_mhz)) {
+            v.gauge = stats[t].freq_mhz * 1e6;
+            sstrncpy (vl.type, "cpufreq", sizeof (vl.type));
+            vl.type_instance[0] = '\0';
+            failed += (plugin_dispatch_values (&vl) != 0);
+        }
+        if (!isnan (stats[t].residency)) {
+            v.gauge = stats[t].residency * 100;
+            sstrncpy (vl.type, "percent", sizeof (vl.type));
+            sstrncpy (vl.type_instance, "active", sizeof (vl.type_instance));
+            failed += (plugin_dispatch_values (&vl) != 0);
+        }
+        v.gauge = stats[t].energy_joules;
+        sstrncpy (vl.type, "energy", sizeof (vl.type));
+        sstrncpy (vl.type_instance, "core", sizeof (vl.type_instance));
+        failed += (plugin_dispatch_values (&vl) != 0);
+    }
+
+    return failed;
+}
 
-    uint64_t global_interval_ms = CDTIME_T_TO_MS(plugin_get_interval());
-    if (global_interval_ms <= MAXIMUM_INTERVAL_MS)
-    {
-        /* use global interval */
-        plugin_register_read ("intel_cpu_energy", energy_read);
+/*
+ * Uncore frequency, dispatched as
+ * [host]/intel_cpu_energy-[node]/cpufreq-{uncore,uncore_min,uncore_max}:
+ * the current frequency and the limits it is kept within, in Hz. With a
+ * batching MSR backend, the registers are part of the same sweep as the
+ * energy counters.
+ */
+static int energy_submit_uncore (int node, cdtime_t time)
+{
+    static _Bool failing = 0;
+    uncore_freq_t freq;
+    value_list_t vl = VALUE_LIST_INIT;
+    value_t v;
+    int failed = 0;
+
+    if (0 != get_uncore_freq (rapl_ctx, node, &freq)) {
+        if (!failing)
+            WARNING ("intel_cpu_energy plugin: Failed to read the uncore frequency of node %d", node);
+        failing = 1;
+        return 1;
+    }
+    failing = 0;
+
+    vl.values = &v;
+    vl.values_len = 1;
+    vl.time = time;
+    vl.interval = dispatch_interval;
+    sstrncpy (vl.host, hostname_g, sizeof (vl.host));
+    sstrncpy (vl.plugin, "intel_cpu_energy", sizeof (vl.plugin));
+    energy_node_name (node, vl.plugin_instance, sizeof (vl.plugin_instance));
+    sstrncpy (vl.type, "cpufreq", sizeof (vl.type));
+
+    v.gauge = freq.current_mhz * 1e6;
+    sstrncpy (vl.type_instance, "uncore", sizeof (vl.type_instance));
+    failed += (plugin_dispatch_values (&vl) != 0);
+    v.gauge = freq.min_mhz * 1e6;
+    sstrncpy (vl.type_instance, "uncore_min", sizeof (vl.type_instance));
+    failed += (plugin_dispatch_values (&vl) != 0);
+    v.gauge = freq.max_mhz * 1e6;
+    sstrncpy (vl.type_instance, "uncore_max", sizeof (vl.type_instance));
+    failed += (plugin_dispatch_values (&vl) != 0);
+
+    return failed;
+}
 
+static void energy_domain_failed (int node, int domain, int err)
+{
+    domain_health_t *h = &domain_health[node][domain];
+
+    h->failures++;
+    h->backoff = (h->backoff == 0) ? 1 : 2 * h->backoff;
+    if (h->backoff > MAXIMUM_BACKOFF_PASSES)
+        h->backoff = MAXIMUM_BACKOFF_PASSES;
+    h->skip = h->backoff;
+
+    if (h->failures == 1) {
+        WARNING ("intel_cpu_energy plugin: Failed to get RAPL energy information for node %d, domain %d (%s): Return value %d. "
+                 "Will retry with exponential backoff.", node, domain, RAPL_DOMAIN_NAMES[domain], err);
     } else {
-        /* override global interval with locally defined maximum interval */
+        DEBUG ("intel_cpu_energy plugin: Node %d, domain %d (%s) still failing after %u attempts, retrying in %u readouts",
+               node, domain, RAPL_DOMAIN_NAMES[domain], h->failures, h->backoff);
+    }
+}
 
-#ifdef COLLECTD_VERSION_LT_5_5
-        /*
-         * As of commit cce136946b879557f91183e4de58e92b81e138c8 (2015-06-06),
-         * plugin_register_complex_read expects the interval to be of type
-         * cdtime_t. Prior to that, it used to be a struct timespec.
-         * Uncomment the appropriate line for the API version you're using.
-         */
-
-        /* Anything up to, and including, version 5.5.0: */
-        struct timespec interval;
-        interval.tv_sec = MAXIMUM_INTERVAL_MS / 1000;
-        interval.tv_nsec = (MAXIMUM_INTERVAL_MS % 1000) * 1000L;
+static void energy_domain_unavailable (int node, int domain)
+{
+    /* Failed domains show up as NaN in the combined data set; counters
+     * simply keep their last value. */
+    if (!energy_counter)
+        energy_vl[node].values[domain].gauge = NAN;
+}
 
-#else
-        /*
-         * Anything that includes the commit cce1369, e.g. the master branch,
-         * but apparently not the releases 5.5.0 and 5.5.1.
-         */
-        cdtime_t interval = MS_TO_CDTIME_T(MAXIMUM_INTERVAL_MS);
+/* Convert the configured levels to raw energy units per second. */
+static void energy_threshold_init (power_threshold_t *t)
+{
+    double warning_max = t->warning_max;
+    double failure_max = t->failure_max;
 
-#endif /* COLLECTD_VERSION_LT_5_5 */
+    /* A disabled warning level coincides with the failure level, so that
+     * crossing the latter counts both. */
+    if (isnan (failure_max))
+        failure_max = INFINITY;
+    if (isnan (warning_max))
+        warning_max = failure_max;
+
+    t->enter_raw[0] = warning_max / energy_unit_J[RAPL_PKG];
+    t->enter_raw[1] = failure_max / energy_unit_J[RAPL_PKG];
+    t->leave_raw[0] = (warning_max - t->hysteresis) / energy_unit_J[RAPL_PKG];
+    t->leave_raw[1] = (failure_max - t->hysteresis) / energy_unit_J[RAPL_PKG];
+}
+
+/*
+ * Check `delta' raw energy units consumed in `elapsed' seconds against a
+ * threshold. Returns the new state, taking the hysteresis into account.
+ */
+static inline int energy_threshold_check (const power_threshold_t *t, int state,
+        uint64_t delta, double elapsed)
+{
+    double d = (double) delta;
+    int level = (d > t->enter_raw[0] * elapsed) + (d > t->enter_raw[1] * elapsed);
+
+    if (level < state) {
+        /* Only leave a state once the power dropped below the threshold by
+         * more than the hysteresis. */
+        if (d >= t->leave_raw[state - 1] * elapsed)
+            level = state;
+        else if (level == THRESHOLD_OKAY && d >= t->leave_raw[0] * elapsed)
+            level = THRESHOLD_WARNING;
+    }
+
+    return level;
+}
+
+static void energy_threshold_notify (const power_threshold_t *t, int state,
+        const char *plugin_instance, const char *what, double watts)
+{
+    notification_t n = { 0 };
+
+    n.time = cdtime ();
+    sstrncpy (n.host, hostname_g, sizeof (n.host));
+    sstrncpy (n.plugin, "intel_cpu_energy", sizeof (n.plugin));
+    sstrncpy (n.plugin_instance, plugin_instance, sizeof (n.plugin_instance));
+    sstrncpy (n.type, "power", sizeof (n.type));
+    sstrncpy (n.type_instance, "package", sizeof (n.type_instance));
+
+    switch (state) {
+    case THRESHOLD_FAILURE:
+        n.severity = NOTIF_FAILURE;
+        ssnprintf (n.message, sizeof (n.message),
+                "Package power of %s is %.1f W, above the failure threshold of %.1f W",
+                what, watts, t->failure_max);
+        break;
+    case THRESHOLD_WARNING:
+        n.severity = NOTIF_WARNING;
+        ssnprintf (n.message, sizeof (n.message),
+                "Package power of %s is %.1f W, above the warning threshold of %.1f W",
+                what, watts, isnan (t->warning_max) ? t->failure_max : t->warning_max);
+        break;
+    default:
+        n.severity = NOTIF_OKAY;
+        ssnprintf (n.message, sizeof (n.message),
+                "Package power of %s is %.1f W, back within the thresholds", what, watts);
+        break;
+    }
+
+    plugin_dispatch_notification (&n);
+}
+
+static void energy_region_submit (const char *name, const char *type,
+        const char *type_instance, gauge_t value, cdtime_t time)
+{
+    value_t v;
+    value_list_t vl = VALUE_LIST_INIT;
+
+    v.gauge = value;
+    vl.values = &v;
+    vl.values_len = 1;
+    vl.time = time;
+    sstrncpy (vl.host, hostname_g, sizeof (vl.host));
+    sstrncpy (vl.plugin, "intel_cpu_energy", sizeof (vl.plugin));
+    ssnprintf (vl.plugin_instance, sizeof (vl.plugin_instance), "region-%s", name);
+    sstrncpy (vl.type, type, sizeof (vl.type));
+    sstrncpy (vl.type_instance, type_instance, sizeof (vl.type_instance));
+
+    plugin_dispatch_values (&vl);
+}
+
+/* Drop the regions that began more than region_max_age seconds ago. */
+static void energy_region_evict (double now)
+{
+    int i = 0;
+
+    if (region_max_age <= 0)
+        return;
+
+    while (i < regions_num) {
+        if (now - regions[i].begin <= region_max_age) {
+            i++;
+            continue;
+        }
+        WARNING ("intel_cpu_energy plugin: Dropping region `%s': it didn't end within %g seconds",
+                regions[i].name, region_max_age);
+        __atomic_fetch_add (&self_stats.evicted_regions, 1, __ATOMIC_RELAXED);
+        regions[i] = regions[--regions_num];
+    }
+}
+
+static void energy_region_begin (const char *name, double now,
+        const uint64_t *energy_raw, double sample_time)
+{
+    int i;
+    energy_region_t *r = NULL;
+
+    energy_region_evict (now);
+    for (i = 0; i < regions_num; i++)
+        if (strcmp (regions[i].name, name) == 0)
+            r = &regions[i];
 
-        plugin_register_complex_read (/* group = */ NULL, "intel_cpu_energy",
-                energy_read_complex, &interval, /* user data = */ NULL);
+    if (r != NULL) {
+        WARNING ("intel_cpu_energy plugin: Region `%s' was begun again before it ended; restarting it", name);
+    } else if (regions_num >= region_max_in_flight) {
+        WARNING ("intel_cpu_energy plugin: Ignoring region `%s': %d regions are in flight already", name, regions_num);
+        return;
+    } else {
+        r = &regions[regions_num++];
+        sstrncpy (r->name, name, sizeof (r->name));
     }
+
+    r->begin = now;
+    r->begin_sample = sample_time;
+    memcpy (r->begin_raw, energy_raw, sizeof (r->begin_raw));
+}
+
+static void energy_region_end (const char *name, double now,
+        const uint64_t *energy_raw, double sample_time, const _Bool *domain_read)
+{
+    int i, domain;
+    energy_region_t *r = NULL;
+    double joules;
+    double sampled = 0;
+    cdtime_t time = cdtime ();
+
+    for (i = 0; i < regions_num; i++)
+        if (strcmp (regions[i].name, name) == 0)
+            r = &regions[i];
+    if (r == NULL) {
+        WARNING ("intel_cpu_energy plugin: Ignoring the end of region `%s', which was never begun", name);
+        return;
+    }
+
+    /* The energy is only known as of the read passes preceding the markers,
+     * so the average power refers to the time between those. */
+    sampled = sample_time - r->begin_sample;
+
+    energy_region_submit (name, "duration", "", now - r->begin, time);
+    for (domain = 0; domain < RAPL_NR_DOMAIN; domain++) {
+        if (!domain_read[domain])
+            continue;
+        joules = (energy_raw[domain] - r->begin_raw[domain]) * energy_unit_J[domain];
+        energy_region_submit (name, "energy", RAPL_DOMAIN_NAMES[domain], joules, time);
+        energy_region_submit (name, "power", RAPL_DOMAIN_NAMES[domain],
+                (sampled > 0) ? joules / sampled : NAN, time);
+    }
+
+    *r = regions[--regions_num];
+}
+
+/* Parse and handle one marker. Region names are restricted to characters
+ * that are safe in collectd identifiers. */
+static void energy_region_marker (char *msg)
+{
+    char *command, *name, *end;
+    uint64_t energy_raw[RAPL_NR_DOMAIN];
+    _Bool domain_read[RAPL_NR_DOMAIN];
+    double sample_time;
+    double now = monotonic_seconds ();
+
+    /* Snapshot the sampler state first, so parsing doesn't delay it. */
+    pthread_mutex_lock (&region_lock);
+    memcpy (energy_raw, region_energy_raw, sizeof (energy_raw));
+    memcpy (domain_read, region_domain_read, sizeof (domain_read));
+    sample_time = region_sample_time;
+    pthread_mutex_unlock (&region_lock);
+
+    command = strtok_r (msg, " \t\r\n", &end);
+    name = strtok_r (NULL, " \t\r\n", &end);
+    if (command == NULL || name == NULL || strtok_r (NULL, " \t\r\n", &end) != NULL
+            || strlen (name) >= REGION_NAME_LEN
+            || strspn (name, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_.") != strlen (name)) {
+        DEBUG ("intel_cpu_energy plugin: Ignoring malformed region marker");
+        return;
+    }
+
+    if (strcasecmp (command, "BEGIN") == 0)
+        energy_region_begin (name, now, energy_raw, sample_time);
+    else if (strcasecmp (command, "END") == 0)
+        energy_region_end (name, now, energy_raw, sample_time, domain_read);
+    else
+        DEBUG ("intel_cpu_energy plugin: Ignoring unknown region marker `%s'", command);
+}
+
+static void *energy_region_listen (void *arg)
+{
+    char buffer[REGION_NAME_LEN + 16];
+    ssize_t len;
+    struct pollfd pfd = { .fd = region_fd, .events = POLLIN };
+
+    while (!region_thread_stop) {
+        if (poll (&pfd, 1, REGION_POLL_TIMEOUT_MS) <= 0) {
+            energy_region_evict (monotonic_seconds ());
+            continue;
+        }
+
+        len = recv (region_fd, buffer, sizeof (buffer) - 1, MSG_DONTWAIT);
+        if (len <= 0)
+            continue;
+        buffer[len] = '\0';
+        energy_region_marker (buffer);
+    }
+
+    return NULL;
+}
+
+/* Publish the sampler state for the listener. Called after every read pass. */
+static void energy_region_update (double now)
+{
+    int i, j, node, domain;
+
+    pthread_mutex_lock (&region_lock);
+    memset (region_energy_raw, 0, sizeof (region_energy_raw));
+    for (i = 0; i < read_nodes_num; i++) {
+        node = read_nodes[i];
+        for (j = 0; j < read_domains_num[node]; j++) {
+            domain = read_domains[node][j];
+            region_energy_raw[domain] += cum_energy_raw[node][domain];
+            region_domain_read[domain] = 1;
+        }
+    }
+    region_sample_time = now;
+    pthread_mutex_unlock (&region_lock);
+}
+
+static int energy_region_init (void)
+{
+    int status;
+    struct sockaddr_un sa = { .sun_family = AF_UNIX };
+    char errbuf[1024];
+
+    regions = calloc(region_max_in_flight, sizeof(energy_region_t));
+    if (regions == NULL) {
+        ERROR ("intel_cpu_energy plugin: Memory allocation failed for the region table");
+        return MY_ERROR;
+    }
+
+    if (strlen (region_socket) >= sizeof (sa.sun_path)) {
+        ERROR ("intel_cpu_energy plugin: RegionSocket path is too long: %s", region_socket);
+        return MY_ERROR;
+    }
+    sstrncpy (sa.sun_path, region_socket, sizeof (sa.sun_path));
+
+    region_fd = socket (AF_UNIX, SOCK_DGRAM, 0);
+    if (region_fd < 0) {
+        ERROR ("intel_cpu_energy plugin: socket failed: %s", sstrerror (errno, errbuf, sizeof (errbuf)));
+        return MY_ERROR;
+    }
+    unlink (region_socket);
+    if (bind (region_fd, (struct sockaddr *) &sa, sizeof (sa)) != 0
+            || chmod (region_socket, region_socket_perms) != 0) {
+        ERROR ("intel_cpu_energy plugin: Failed to set up the region socket %s: %s",
+               region_socket, sstrerror (errno, errbuf, sizeof (errbuf)));
+        close (region_fd);
+        region_fd = -1;
+        return MY_ERROR;
+    }
+
+    energy_region_update (monotonic_seconds ());
+
+    region_thread_stop = 0;
+    status = pthread_create (&region_thread, NULL, energy_region_listen, NULL);
+    if (status != 0) {
+        ERROR ("intel_cpu_energy plugin: Failed to start the region listener: %s",
+               sstrerror (status, errbuf, sizeof (errbuf)));
+        close (region_fd);
+        region_fd = -1;
+        return MY_ERROR;
+    }
+    region_thread_running = 1;
+
+    INFO ("intel_cpu_energy plugin: listening for region markers on %s", region_socket);
+    return 0;
+}
+
+static void energy_region_shutdown (void)
+{
+    if (region_thread_running) {
+        region_thread_stop = 1;
+        pthread_join (region_thread, NULL);
+        region_thread_running = 0;
+    }
+    if (region_fd >= 0) {
+        close (region_fd);
+        region_fd = -1;
+        unlink (region_socket);
+    }
+    sfree (regions);
+    regions_num = 0;
+}
+
+/* Dispatch the values of one node that were updated by the current read
+ * pass. Returns the number of failed dispatches. */
+static int energy_dispatch_node (int node, cdtime_t time)
+{
+    int err;
+    int i, domain;
+    int failed = 0;
+    energy_vl_t *evl = &energy_vl[node];
+    domain_health_t *h;
+    double elapsed;
+
+    if (report_power) {
+        for (i = 0; i < read_domains_num[node]; i++) {
+            domain = read_domains[node][i];
+            h = &domain_health[node][domain];
+            if (h->failures > 0) {
+                /* Keep the reference point while the domain is failing: the
+                 * first read after it recovers covers the whole outage. */
+                evl->power_values[domain].gauge = NAN;
+                continue;
+            }
+            elapsed = h->last_read - h->power_since;
+            if (elapsed > 0 && h->has_baseline)
+                evl->power_values[domain].gauge = (cum_energy_raw[node][domain]
+                        - dispatched_energy_raw[node][domain]) * energy_unit_J[domain] / elapsed;
+            else
+                evl->power_values[domain].gauge = NAN;
+            dispatched_energy_raw[node][domain] = cum_energy_raw[node][domain];
+            h->power_since = h->last_read;
+        }
+    }
+
+    if (combine_domains) {
+        if (report_energy) {
+            evl->node_vl.time = time;
+            err = plugin_dispatch_values (&evl->node_vl);
+            if (err) {
+                ERROR ("intel_cpu_energy plugin: Failed to submit energy information for node %d: Return value %d", node, err);
+                failed++;
+            }
+        }
+        if (report_power) {
+            evl->power_node_vl.time = time;
+            err = plugin_dispatch_values (&evl->power_node_vl);
+            if (err) {
+                ERROR ("intel_cpu_energy plugin: Failed to submit power information for node %d: Return value %d", node, err);
+                failed++;
+            }
+        }
+        return failed;
+    }
+
+    for (i = 0; i < read_domains_num[node]; i++) {
+        domain = read_domains[node][i];
+        /* Domains that couldn't be read in this pass aren't dispatched. */
+        if (domain_health[node][domain].failures > 0 || domain_health[node][domain].skip > 0)
+            continue;
+
+        if (report_energy) {
+            err = plugin_dispatch_values (&evl->domain_vl[domain]);
+            if (err) {
+                ERROR ("intel_cpu_energy plugin: Failed to submit energy information for node %d, domain %d (%s): Return value %d", node, domain, RAPL_DOMAIN_NAMES[domain], err);
+                failed++;
+            }
+        }
+        if (report_power) {
+            evl->power_domain_vl[domain].time = evl->domain_vl[domain].time;
+            err = plugin_dispatch_values (&evl->power_domain_vl[domain]);
+            if (err) {
+                ERROR ("intel_cpu_energy plugin: Failed to submit power information for node %d, domain %d (%s): Return value %d", node, domain, RAPL_DOMAIN_NAMES[domain], err);
+                failed++;
+            }
+        }
+    }
+
+    return failed;
+}
+
+/*
+ * Derived series, computed from the samples of one readout so consumers don't
+ * have to combine series at query time:
+ *
+ *   [node]/energy-rest         package minus core and uncore energy
+ *   host/energy-[domain]       sum of a domain over all nodes
+ *   host/energy-rest           sum of the residuals
+ *   host/percent-dram_share    DRAM share of package plus DRAM energy since
+ *                              the previous dispatch
+ *
+ * and, with Metrics "power", the matching power-* series. The host series
+ * need all nodes to be read and are skipped in dispatches in which a node
+ * couldn't be read.
+ *
+ * Everything is computed with 64-bit integers, in the unit that is
+ * dispatched: micro-Joules in counter mode, otherwise the smallest energy
+ * unit of all domains (converted to Joules only when dispatching, which is
+ * exact since energy units are powers of two). So the dispatched parts add
+ * up exactly to the dispatched wholes.
+ */
+#define DERIVED_REST  RAPL_NR_DOMAIN /* index of the residual */
+#define DERIVED_SLOTS (RAPL_NR_DOMAIN + 1)
+
+typedef struct derived_energy_t {
+    int64_t units[DERIVED_SLOTS]; /* cumulative energy, see above */
+    _Bool   valid[DERIVED_SLOTS];
+} derived_energy_t;
+
+/* As of the previous dispatch, for the power values */
+static derived_energy_t *derived_nodes = NULL;
+static derived_energy_t derived_host;
+/* The smallest of energy_unit_J; the others are multiples of it by powers
+ * of two */
+static double derived_unit_J = 0;
+
+static int64_t energy_derived_units (uint64_t raw, int domain)
+{
+    if (energy_counter)
+        return llround (raw * energy_unit_J[domain] * 1e6);
+    return (int64_t) raw * llround (energy_unit_J[domain] / derived_unit_J);
+}
+
+static double energy_derived_joules (int64_t units)
+{
+    return energy_counter ? units / 1e6 : units * derived_unit_J;
+}
+
+/* Whether a domain of a node was read successfully in this readout */
+static _Bool energy_domain_current (int node, int domain)
+{
+    domain_health_t *h = &domain_health[node][domain];
+
+    return h->has_baseline && h->failures == 0 && h->skip == 0;
+}
+
+static void energy_derived_node (int node, derived_energy_t *e)
+{
+    int domain;
+
+    for (domain = 0; domain < RAPL_NR_DOMAIN; domain++) {
+        e->valid[domain] = energy_domain_current (node, domain);
+        e->units[domain] = e->valid[domain] ? energy_derived_units (cum_energy_raw[node][domain], domain) : 0;
+    }
+
+    /* Only if every core/uncore domain the node has could be read, so a
+     * failing domain doesn't show up as residual energy. */
+    e->valid[DERIVED_REST] = e->valid[RAPL_PKG]
+        && (e->valid[RAPL_PP0] || e->valid[RAPL_PP1])
+        && (e->valid[RAPL_PP0] || !domain_health[node][RAPL_PP0].has_baseline)
+        && (e->valid[RAPL_PP1] || !domain_health[node][RAPL_PP1].has_baseline);
+    e->units[DERIVED_REST] = e->units[RAPL_PKG] - e->units[RAPL_PP0] - e->units[RAPL_PP1];
+}
+
+static int energy_submit_derived (value_list_t *vl, const char *type_instance,
+        int64_t units, _Bool prev_valid, int64_t prev_units, double elapsed)
+{
+    int failed = 0;
+
+    sstrncpy (vl->type_instance, type_instance, sizeof (vl->type_instance));
+    if (report_energy) {
+        if (energy_counter) {
+            vl->values[0].derive = (derive_t) units;
+            sstrncpy (vl->type, "energy_counter", sizeof (vl->type));
+        } else {
+            vl->values[0].gauge = energy_derived_joules (units);
+            sstrncpy (vl->type, "energy", sizeof (vl->type));
+        }
+        failed += (plugin_dispatch_values (vl) != 0);
+    }
+    if (report_power && prev_valid && elapsed > 0) {
+        vl->values[0].gauge = energy_derived_joules (units - prev_units) / elapsed;
+        sstrncpy (vl->type, "power", sizeof (vl->type));
+        failed += (plugin_dispatch_values (vl) != 0);
+    }
+    return failed;
+}
+
+static int energy_dispatch_derived (double now, cdtime_t time)
+{
+    derived_energy_t node_e, host_e;
+    value_list_t vl = VALUE_LIST_INIT;
+    value_t v;
+    double elapsed = now - last_dispatch;
+    int64_t d_dram, d_pkg;
+    int i, node, slot, failed = 0;
+
+    vl.values = &v;
+    vl.values_len = 1;
+    vl.time = time;
+    vl.interval = dispatch_interval;
+    sstrncpy (vl.host, hostname_g, sizeof (vl.host));
+    sstrncpy (vl.plugin, "intel_cpu_energy", sizeof (vl.plugin));
+
+    memset (&host_e, 0, sizeof (host_e));
+    for (slot = 0; slot < DERIVED_SLOTS; slot++)
+        host_e.valid[slot] = (read_nodes_num == rapl_node_count);
+
+    for (i = 0; i < read_nodes_num; i++) {
+        node = read_nodes[i];
+        energy_derived_node (node, &node_e);
+
+        for (slot = 0; slot < DERIVED_SLOTS; slot++) {
+            host_e.units[slot] += node_e.units[slot];
+            /* A domain no node has is left out, one that some node failed
+             * to read invalidates the total. */
+            if (!node_e.valid[slot])
+                host_e.valid[slot] = 0;
+        }
+
+        if (node_e.valid[DERIVED_REST]) {
+            energy_node_name (node, vl.plugin_instance, sizeof (vl.plugin_instance));
+            failed += energy_submit_derived (&vl, "rest", node_e.units[DERIVED_REST],
+                    derived_nodes[node].valid[DERIVED_REST], derived_nodes[node].units[DERIVED_REST], elapsed);
+        }
+        derived_nodes[node] = node_e;
+    }
+
+    sstrncpy (vl.plugin_instance, "host", sizeof (vl.plugin_instance));
+    for (slot = 0; slot < DERIVED_SLOTS; slot++) {
+        if (!host_e.valid[slot])
+            continue;
+        failed += energy_submit_derived (&vl, (slot == DERIVED_REST) ? "rest" : RAPL_DOMAIN_NAMES[slot],
+                host_e.units[slot], derived_host.valid[slot], derived_host.units[slot], elapsed);
+    }
+
+    if (host_e.valid[RAPL_DRAM] && host_e.valid[RAPL_PKG]
+            && derived_host.valid[RAPL_DRAM] && derived_host.valid[RAPL_PKG]) {
+        d_dram = host_e.units[RAPL_DRAM] - derived_host.units[RAPL_DRAM];
+        d_pkg = host_e.units[RAPL_PKG] - derived_host.units[RAPL_PKG];
+        if (d_dram + d_pkg > 0) {
+            v.gauge = 100.0 * d_dram / (d_dram + d_pkg);
+            sstrncpy (vl.type, "percent", sizeof (vl.type));
+            sstrncpy (vl.type_instance, "dram_share", sizeof (vl.type_instance));
+            failed += (plugin_dispatch_values (&vl) != 0);
+        }
+    }
+    derived_host = host_e;
+
+    if (failed)
+        ERROR ("intel_cpu_energy plugin: Failed to submit %d derived value(s)", failed);
+    return failed;
+}
+
+/*
+ * Efficiency: the instructions and cycles counted on the CPUs of each node
+ * (perf.c), related to the node's package energy since the previous
+ * dispatch:
+ *
+ *   [node]/energy_per_ginstr-package       Joules per 10^9 instructions
+ *   [node]/instructions_per_joule-package
+ *   [node]/instructions_per_cycle
+ *
+ * The counters are read right after the energy registers, in dispatching
+ * passes only. Intervals in which the package or any CPU of the node
+ * couldn't be read are skipped.
+ */
+typedef struct efficiency_node_t {
+    uint64_t instructions;
+    uint64_t cycles;
+    uint64_t energy_raw; /* cumulative package energy */
+    _Bool    valid;
+} efficiency_node_t;
+
+static int *efficiency_cpu_node = NULL; /* node of each CPU, or -1 */
+static long efficiency_num_cpus = 0;
+static efficiency_node_t *efficiency_prev = NULL; /* as of the previous dispatch */
+static efficiency_node_t *efficiency_cur = NULL;
+
+/* Sum up the counters of the last perf_read() by node. */
+static void energy_efficiency_sample (efficiency_node_t *nodes)
+{
+    uint64_t instructions, cycles;
+    long cpu;
+    int i, node;
+
+    memset (nodes, 0, rapl_node_count * sizeof (*nodes));
+    for (i = 0; i < read_nodes_num; i++) {
+        node = read_nodes[i];
+        nodes[node].valid = energy_domain_current (node, RAPL_PKG);
+        nodes[node].energy_raw = cum_energy_raw[node][RAPL_PKG];
+    }
+
+    for (cpu = 0; cpu < efficiency_num_cpus; cpu++) {
+        node = efficiency_cpu_node[cpu];
+        if (node < 0)
+            continue;
+        if (0 != perf_get (cpu, &instructions, &cycles)) {
+            nodes[node].valid = 0;
+            continue;
+        }
+        nodes[node].instructions += instructions;
+        nodes[node].cycles += cycles;
+    }
+}
+
+static int energy_dispatch_efficiency (cdtime_t time)
+{
+    efficiency_node_t *cur, *prev;
+    value_list_t vl = VALUE_LIST_INIT;
+    value_t v;
+    double joules, instructions, cycles;
+    int i, node, failed = 0;
+
+    vl.values = &v;
+    vl.values_len = 1;
+    vl.time = time;
+    vl.interval = dispatch_interval;
+    sstrncpy (vl.host, hostname_g, sizeof (vl.host));
+    sstrncpy (vl.plugin, "intel_cpu_energy", sizeof (vl.plugin));
+
+    energy_efficiency_sample (efficiency_cur);
+
+    for (i = 0; i < read_nodes_num; i++) {
+        node = read_nodes[i];
+        cur = &efficiency_cur[node];
+        prev = &efficiency_prev[node];
+
+        /* Scaled (multiplexed) counts may go backwards slightly */
+        if (!cur->valid || !prev->valid || cur->instructions < prev->instructions
+                || cur->cycles < prev->cycles)
+            continue;
+
+        joules = (cur->energy_raw - prev->energy_raw) * energy_unit_J[RAPL_PKG];
+        instructions = cur->instructions - prev->instructions;
+        cycles = cur->cycles - prev->cycles;
+        energy_node_name (node, vl.plugin_instance, sizeof (vl.plugin_instance));
+
+        sstrncpy (vl.type_instance, "package", sizeof (vl.type_instance));
+        if (instructions > 0) {
+            v.gauge = joules / (instructions / 1e9);
+            sstrncpy (vl.type, "energy_per_ginstr", sizeof (vl.type));
+            failed += (plugin_dispatch_values (&vl) != 0);
+        }
+        if (joules > 0) {
+            v.gauge = instructions / joules;
+            sstrncpy (vl.type, "instructions_per_joule", sizeof (vl.type));
+            failed += (plugin_dispatch_values (&vl) != 0);
+        }
+        vl.type_instance[0] = '\0';
+        if (cycles > 0) {
+            v.gauge = instructions / cycles;
+            sstrncpy (vl.type, "instructions_per_cycle", sizeof (vl.type));
+            failed += (plugin_dispatch_values (&vl) != 0);
+        }
+    }
+
+    /* Swap, so the current sums become the baseline */
+    cur = efficiency_prev;
+    efficiency_prev = efficiency_cur;
+    efficiency_cur = cur;
+
+    if (failed)
+        ERROR ("intel_cpu_energy plugin: Failed to submit %d efficiency value(s)", failed);
+    return failed;
+}
+
+/*
+ * Bandwidth: the bytes moved by the memory controllers of each node (the
+ * uncore IMC counters in perf.c), related to the node's DRAM energy over the
+ * same interval:
+ *
+ *   [node]/memory_bandwidth-{read,write}  Bytes per second
+ *   [node]/energy_per_byte-dram           nano-Joules per Byte moved
+ *   [node]/power-dram                     unless Metrics "power" has it
+ *
+ * Like the efficiency metrics, the counters are read right after the energy
+ * registers and every rate is computed over the interval between two such
+ * readouts.
+ */
+typedef struct bandwidth_node_t {
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+    uint64_t energy_raw; /* cumulative DRAM energy */
+    uint64_t time_ns;    /* of the readout */
+    _Bool    valid;
+} bandwidth_node_t;
+
+static int *bandwidth_imc_node = NULL; /* node of each IMC counter group */
+static int bandwidth_imc_num = 0;
+static bandwidth_node_t *bandwidth_prev = NULL; /* as of the previous dispatch */
+static bandwidth_node_t *bandwidth_cur = NULL;
+
+/* Sum up the counters of the last perf_imc_read() by node. */
+static void energy_bandwidth_sample (bandwidth_node_t *nodes, uint64_t time_ns)
+{
+    uint64_t read_bytes, write_bytes;
+    long cpu;
+    int i, node;
+
+    memset (nodes, 0, rapl_node_count * sizeof (*nodes));
+    for (i = 0; i < read_nodes_num; i++) {
+        node = read_nodes[i];
+        nodes[node].valid = energy_domain_current (node, RAPL_DRAM);
+        nodes[node].energy_raw = cum_energy_raw[node][RAPL_DRAM];
+        nodes[node].time_ns = time_ns;
+    }
+
+    for (i = 0; i < bandwidth_imc_num; i++) {
+        node = bandwidth_imc_node[i];
+        if (node < 0)
+            continue;
+        if (0 != perf_imc_get (i, &cpu, &read_bytes, &write_bytes)) {
+            nodes[node].valid = 0;
+            continue;
+        }
+        nodes[node].read_bytes += read_bytes;
+        nodes[node].write_bytes += write_bytes;
+    }
+}
+
+static int energy_dispatch_bandwidth (uint64_t time_ns, cdtime_t time)
+{
+    bandwidth_node_t *cur, *prev;
+    value_list_t vl = VALUE_LIST_INIT;
+    value_t v;
+    double elapsed, joules, bytes;
+    int i, node, failed = 0;
+
+    vl.values = &v;
+    vl.values_len = 1;
+    vl.time = time;
+    vl.interval = dispatch_interval;
+    sstrncpy (vl.host, hostname_g, sizeof (vl.host));
+    sstrncpy (vl.plugin, "intel_cpu_energy", sizeof (vl.plugin));
+
+    energy_bandwidth_sample (bandwidth_cur, time_ns);
+
+    for (i = 0; i < read_nodes_num; i++) {
+        node = read_nodes[i];
+        cur = &bandwidth_cur[node];
+        prev = &bandwidth_prev[node];
+
+        if (!cur->valid || !prev->valid || cur->time_ns <= prev->time_ns
+                || cur->read_bytes < prev->read_bytes || cur->write_bytes < prev->write_bytes)
+            continue;
+
+        elapsed = (cur->time_ns - prev->time_ns) / 1e9;
+        joules = (cur->energy_raw - prev->energy_raw) * energy_unit_J[RAPL_DRAM];
+        bytes = (cur->read_bytes - prev->read_bytes) + (cur->write_bytes - prev->write_bytes);
+        energy_node_name (node, vl.plugin_instance, sizeof (vl.plugin_instance));
+
+        sstrncpy (vl.type, "memory_bandwidth", sizeof (vl.type));
+        v.gauge = (cur->read_bytes - prev->read_bytes) / elapsed;
+        sstrncpy (vl.type_instance, "read", sizeof (vl.type_instance));
+        failed += (plugin_dispatch_values (&vl) != 0);
+        v.gauge = (cur->write_bytes - prev->write_bytes) / elapsed;
+        sstrncpy (vl.type_instance, "write", sizeof (vl.type_instance));
+        failed += (plugin_dispatch_values (&vl) != 0);
+
+        sstrncpy (vl.type_instance, "dram", sizeof (vl.type_instance));
+        if (bytes > 0) {
+            v.gauge = joules * 1e9 / bytes;
+            sstrncpy (vl.type, "energy_per_byte", sizeof (vl.type));
+            failed += (plugin_dispatch_values (&vl) != 0);
+        }
+        if (!report_power) {
+            v.gauge = joules / elapsed;
+            sstrncpy (vl.type, "power", sizeof (vl.type));
+            failed += (plugin_dispatch_values (&vl) != 0);
+        }
+    }
+
+    cur = bandwidth_prev;
+    bandwidth_prev = bandwidth_cur;
+    bandwidth_cur = cur;
+
+    if (failed)
+        ERROR ("intel_cpu_energy plugin: Failed to submit %d bandwidth value(s)", failed);
+    return failed;
+}
+
+static void energy_rollup_add (int node, int domain, uint64_t delta, double elapsed)
+{
+    double watts = delta * energy_unit_J[domain] / elapsed;
+    rollup_acc_t *a;
+    int t;
+
+    for (t = 0; t < rollup_tiers_num; t++) {
+        a = &rollup_tiers[t].acc[node * RAPL_NR_DOMAIN + domain];
+        if (a->seconds == 0 || watts < a->min_watts)
+            a->min_watts = watts;
+        if (a->seconds == 0 || watts > a->max_watts)
+            a->max_watts = watts;
+        a->energy_raw += delta;
+        a->seconds += elapsed;
+    }
+}
+
+static int energy_dispatch_rollup (rollup_tier_t *tier, cdtime_t time)
+{
+    static const char *stats[] = { "mean", "min", "max" };
+    value_list_t vl = VALUE_LIST_INIT;
+    value_t v;
+    rollup_acc_t *a;
+    double period, watts[3];
+    int i, j, k, node, domain, failed = 0;
+
+    period = tier->every * CDTIME_T_TO_DOUBLE (sample_interval);
+
+    vl.values = &v;
+    vl.values_len = 1;
+    vl.time = time;
+    vl.interval = tier->every * sample_interval;
+    sstrncpy (vl.host, hostname_g, sizeof (vl.host));
+    sstrncpy (vl.plugin, "intel_cpu_energy", sizeof (vl.plugin));
+
+    for (i = 0; i < read_nodes_num; i++) {
+        node = read_nodes[i];
+        energy_node_name (node, vl.plugin_instance, sizeof (vl.plugin_instance));
+
+        for (j = 0; j < read_domains_num[node]; j++) {
+            domain = read_domains[node][j];
+            a = &tier->acc[node * RAPL_NR_DOMAIN + domain];
+            if (a->seconds == 0)
+                continue;
+
+            v.gauge = a->energy_raw * energy_unit_J[domain];
+            sstrncpy (vl.type, "energy", sizeof (vl.type));
+            ssnprintf (vl.type_instance, sizeof (vl.type_instance), "%s-%gs",
+                       RAPL_DOMAIN_NAMES[domain], period);
+            failed += (plugin_dispatch_values (&vl) != 0);
+
+            watts[0] = v.gauge / a->seconds;
+            watts[1] = a->min_watts;
+            watts[2] = a->max_watts;
+            sstrncpy (vl.type, "power", sizeof (vl.type));
+            for (k = 0; k < 3; k++) {
+                v.gauge = watts[k];
+                ssnprintf (vl.type_instance, sizeof (vl.type_instance), "%s-%gs-%s",
+                           RAPL_DOMAIN_NAMES[domain], period, stats[k]);
+                failed += (plugin_dispatch_values (&vl) != 0);
+            }
+
+            memset (a, 0, sizeof (*a));
+        }
+    }
+
+    if (failed)
+        ERROR ("intel_cpu_energy plugin: Failed to submit %d rollup value(s)", failed);
+    return failed;
+}
+
+/*
+ * Train the power model with the package energy of all nodes since the
+ * previous dispatch. Intervals in which a package couldn't be read are
+ * skipped, but the features are still sampled to keep them aligned.
+ */
+static void energy_estimate_train (double now)
+{
+    uint64_t energy_raw = 0;
+    double elapsed = now - last_dispatch;
+    _Bool valid = 1;
+    int node;
+
+    for (node = 0; node < rapl_node_count; node++) {
+        if (domain_health[node][RAPL_PKG].failures > 0 || !domain_health[node][RAPL_PKG].has_baseline)
+            valid = 0;
+        energy_raw += cum_energy_raw[node][RAPL_PKG];
+    }
+
+    if (0 != estimate_sample ())
+        valid = 0;
+    if (valid && estimate_have_baseline && elapsed > 0)
+        estimate_train ((energy_raw - estimate_prev_energy_raw) * energy_unit_J[RAPL_PKG] / elapsed);
+    estimate_prev_energy_raw = energy_raw;
+    estimate_have_baseline = valid;
+
+    if (++estimate_dispatches >= ESTIMATE_SAVE_EVERY) {
+        estimate_dispatches = 0;
+        if (0 != estimate_save (estimate_file)) {
+            char errbuf[1024];
+            WARNING ("intel_cpu_energy plugin: Failed to save the power model to %s: %s",
+                     estimate_file, sstrerror (errno, errbuf, sizeof (errbuf)));
+        }
+    }
+}
+
+static int energy_read (void)
+{
+    int err;
+    int i, j;
+    int node;
+    int domain;
+    int reads_ok = 0;
+    int reads_failed = 0;
+    _Bool dispatching;
+    domain_health_t *h;
+    uint64_t new_sample;
+    uint64_t delta;
+    double now;
+    double elapsed;
+    cdtime_t ref_cd;
+    uint64_t ref_ns;
+    uint64_t read_start_ns, read_end_ns;
+    uint64_t node_start_ns;
+    uint64_t pass_start_ns, dispatch_start_ns;
+    uint64_t batch_start_ns = 0, batch_end_ns = 0;
+    _Bool batch_ok = 0;
+    double watts;
+    double pass_elapsed;
+    uint64_t host_delta = 0;
+    int host_nodes = 0;
+    int state;
+    char instance[DATA_MAX_NAME_LEN];
+    rapl_trace_record_t record;
+
+    now = monotonic_seconds ();
+    pass_elapsed = now - prev_read_pass;
+    prev_read_pass = now;
+
+    ref_cd = cdtime ();
+    ref_ns = monotonic_raw_ns ();
+
+    /* The MSRs are read on every pass, but values are only dispatched every
+     * dispatch_every passes. */
+    dispatching = (++passes_since_dispatch >= dispatch_every);
+    if (dispatching)
+        passes_since_dispatch = 0;
+
+    pass_start_ns = ref_ns;
+    if (self_stats.prev_start_ns != 0)
+        self_stats.interval_ns = pass_start_ns - self_stats.prev_start_ns;
+    self_stats.prev_start_ns = pass_start_ns;
+    self_stats.read_ns = 0;
+    self_stats.dispatch_ns = 0;
+
+    /* With a batching MSR backend, all registers are read here at once and
+     * the loop below only picks up the results. If the batch fails, the
+     * domains are read one by one as usual. */
+    if (is_rapl_batch_enabled (rapl_ctx)) {
+        batch_start_ns = monotonic_raw_ns ();
+        batch_ok = (0 == sample_rapl_batch (rapl_ctx));
+        batch_end_ns = monotonic_raw_ns ();
+        self_stats.read_ns += batch_end_ns - batch_start_ns;
+    }
+
+    /* Count instructions and memory traffic up to the same instant as the
+     * energy. */
+    if (dispatching && (report_efficiency || report_bandwidth)) {
+        read_start_ns = monotonic_raw_ns ();
+        if (report_efficiency)
+            perf_read ();
+        if (report_bandwidth)
+            perf_imc_read ();
+        self_stats.read_ns += monotonic_raw_ns () - read_start_ns;
+    }
+
+    for (i = 0; i < read_nodes_num; i++) {
+        node = read_nodes[i];
+        node_start_ns = 0;
+        read_end_ns = 0;
+        record.domain_mask = 0;
+
+        for (j = 0; j < read_domains_num[node]; j++) {
+            domain = read_domains[node][j];
+
+            h = &domain_health[node][domain];
+            if (h->skip > 0) {
+                h->skip--;
+                self_stats.skipped_reads++;
+                energy_domain_unavailable (node, domain);
+                continue;
+            }
+
+            /* Timestamp each read as closely as possible, so rates
+             * computed downstream don't suffer from the jitter of the
+             * (serial) reads and dispatches. */
+            if (batch_ok) {
+                read_start_ns = batch_start_ns;
+                err = get_batch_energy_status_raw (rapl_ctx, node, domain, &new_sample);
+                read_end_ns = batch_end_ns;
+            } else {
+                read_start_ns = monotonic_raw_ns ();
+                err = get_rapl_energy_info(domain, node, &new_sample);
+                read_end_ns = monotonic_raw_ns ();
+                self_stats.read_ns += read_end_ns - read_start_ns;
+            }
+            if (err) {
+                reads_failed++;
+                energy_domain_failed (node, domain, err);
+                energy_domain_unavailable (node, domain);
+                if (shm_nodes != NULL)
+                    shm_nodes[node].domains[domain].valid = 0;
+                continue;
+            }
+            reads_ok++;
+            if (node_start_ns == 0)
+                node_start_ns = read_start_ns;
+            record.energy_raw[domain] = new_sample;
+            record.domain_mask |= 1 << domain;
+
+            if (h->failures > 0) {
+                INFO ("intel_cpu_energy plugin: Node %d, domain %d (%s) recovered after %u failed attempts",
+                      node, domain, RAPL_DOMAIN_NAMES[domain], h->failures);
+                h->failures = 0;
+                h->backoff = 0;
+            }
+
+            elapsed = now - h->last_read;
+            h->last_read = now;
+
+            if (!h->has_baseline) {
+                /* First successful read of this domain */
+                prev_sample[node][domain] = new_sample;
+                h->has_baseline = 1;
+                h->power_since = now;
+                delta = 0;
+            } else {
+                /* The energy status counter is 32 bits wide, so unsigned
+                 * arithmetic modulo 2^32 takes care of wraparounds. */
+                delta = (new_sample - prev_sample[node][domain]) & 0xffffffff;
+                if (new_sample < prev_sample[node][domain])
+                    self_stats.wraps++;
+
+                /* At the highest power seen so far, could the counter have
+                 * wrapped around more than once since the last read? */
+                if (elapsed * peak_watts[node][domain] >= 0xffffffff * energy_unit_J[domain])
+                    self_stats.missed_wraps++;
+
+                prev_sample[node][domain] = new_sample;
+                cum_energy_raw[node][domain] += delta;
+
+                if (elapsed > 0) {
+                    watts = delta * energy_unit_J[domain] / elapsed;
+                    if (watts > peak_watts[node][domain])
+                        peak_watts[node][domain] = watts;
+                    if (powercap_enabled && domain == RAPL_PKG)
+                        powercap_update (node, watts);
+                    if (rollup_tiers_num > 0)
+                        energy_rollup_add (node, domain, delta, elapsed);
+                }
+
+                if (shm_nodes != NULL) {
+                    rapl_shm_domain_t *d = &shm_nodes[node].domains[domain];
+                    d->energy_raw = cum_energy_raw[node][domain];
+                    d->energy_J = cum_energy_raw[node][domain] * energy_unit_J[domain];
+                    d->watts = (elapsed > 0) ? watts : NAN;
+                    d->time_ns = read_start_ns + (read_end_ns - read_start_ns) / 2;
+                    d->valid = 1;
+                }
+
+                if (domain == RAPL_PKG && elapsed > 0) {
+                    if (package_threshold.enabled) {
+                        state = energy_threshold_check (&package_threshold,
+                                package_threshold_state[node], delta, elapsed);
+                        if (state != package_threshold_state[node]) {
+                            package_threshold_state[node] = state;
+                            energy_node_name (node, instance, sizeof (instance));
+                            energy_threshold_notify (&package_threshold, state, instance, instance,
+                                    delta * energy_unit_J[RAPL_PKG] / elapsed);
+                        }
+                    }
+                    /* Only sum up packages whose delta spans this very
+                     * pass, i.e. that were read in the previous pass too. */
+                    if (elapsed == pass_elapsed) {
+                        host_delta += delta;
+                        host_nodes++;
+                    }
+                }
+            }
+
+            if (!dispatching)
+                continue;
+
+            if (energy_counter)
+                energy_vl[node].values[domain].derive = (derive_t) llround (cum_energy_raw[node][domain] * energy_unit_J[domain] * 1e6);
+            else
+                energy_vl[node].values[domain].gauge = cum_energy_raw[node][domain] * energy_unit_J[domain];
+            energy_vl[node].domain_vl[domain].time = sample_time (
+                    read_start_ns + (read_end_ns - read_start_ns) / 2, ref_cd, ref_ns);
+        }
+
+        if (trace.header != NULL && node_start_ns != 0) {
+            record.time_ns = node_start_ns + (read_end_ns - node_start_ns) / 2;
+            record.node = node;
+            trace_append (&trace, &record);
+        }
+
+        if (dispatching && node_start_ns != 0) {
+            cdtime_t node_time = sample_time (
+                    node_start_ns + (read_end_ns - node_start_ns) / 2, ref_cd, ref_ns);
+
+            dispatch_start_ns = monotonic_raw_ns ();
+            energy_dispatch_node (node, node_time);
+
+            if (report_core_types)
+                energy_submit_core_types (node, node_time);
+            if (report_uncore)
+                energy_submit_uncore (node, node_time);
+
+            self_stats.dispatch_ns += monotonic_raw_ns () - dispatch_start_ns;
+        }
+    }
+
+    if (dispatching && (report_derived || report_efficiency || report_bandwidth)) {
+        /* All nodes were read at the same time if the readout was batched */
+        uint64_t readout_ns = batch_ok ? batch_start_ns + (batch_end_ns - batch_start_ns) / 2 : ref_ns;
+        cdtime_t readout_time = sample_time (readout_ns, ref_cd, ref_ns);
+
+        dispatch_start_ns = monotonic_raw_ns ();
+        if (report_derived)
+            energy_dispatch_derived (now, readout_time);
+        if (report_efficiency)
+            energy_dispatch_efficiency (readout_time);
+        if (report_bandwidth)
+            energy_dispatch_bandwidth (readout_ns, readout_time);
+        self_stats.dispatch_ns += monotonic_raw_ns () - dispatch_start_ns;
+    }
+
+    for (i = 0; i < rollup_tiers_num; i++) {
+        if (++rollup_tiers[i].passes < rollup_tiers[i].every)
+            continue;
+        rollup_tiers[i].passes = 0;
+        dispatch_start_ns = monotonic_raw_ns ();
+        energy_dispatch_rollup (&rollup_tiers[i], ref_cd);
+        self_stats.dispatch_ns += monotonic_raw_ns () - dispatch_start_ns;
+    }
+
+    if (shm_nodes != NULL)
+        rapl_shm_publish (&shm, shm_nodes, monotonic_raw_ns ());
+
+    if (region_thread_running)
+        energy_region_update (now);
+
+    if (host_threshold.enabled && host_nodes == read_nodes_num && pass_elapsed > 0) {
+        state = energy_threshold_check (&host_threshold, host_threshold_state,
+                host_delta, pass_elapsed);
+        if (state != host_threshold_state) {
+            host_threshold_state = state;
+            energy_threshold_notify (&host_threshold, state, "", "the host",
+                    host_delta * energy_unit_J[RAPL_PKG] / pass_elapsed);
+        }
+    }
+
+    if (dispatching && estimate_training)
+        energy_estimate_train (now);
+
+    if (dispatching)
+        last_dispatch = now;
+
+    if (powercap_enabled) {
+        err = powercap_tick (now);
+        if (err) {
+            WARNING ("intel_cpu_energy plugin: Failed to set the package power limit on %d node(s)", err);
+        }
+    }
+
+    self_stats.total_ns = monotonic_raw_ns () - pass_start_ns;
+    if (report_self && dispatching)
+        energy_submit_self_stats ();
+
+    /* Only let collectd back off if nothing at all could be read. */
+    if (reads_failed > 0 && reads_ok == 0)
+        return MY_ERROR;
+
+    return (0);
+}
+
+/* Read callback used instead of energy_read() if RAPL is unavailable. */
+static int energy_read_estimate (void)
+{
+    value_list_t vl = VALUE_LIST_INIT;
+    value_t v;
+    double now = monotonic_seconds ();
+    double watts;
+    int failed = 0;
+
+    if (0 != estimate_sample ()) {
+        ERROR ("intel_cpu_energy plugin: Failed to read the CPU utilisation for the power estimate");
+        return MY_ERROR;
+    }
+    watts = estimate_watts ();
+    estimate_energy_J += watts * (now - last_dispatch);
+    last_dispatch = now;
+
+    vl.values = &v;
+    vl.values_len = 1;
+    vl.time = cdtime ();
+    vl.interval = dispatch_interval;
+    sstrncpy (vl.host, hostname_g, sizeof (vl.host));
+    sstrncpy (vl.plugin, "intel_cpu_energy", sizeof (vl.plugin));
+    sstrncpy (vl.plugin_instance, "estimated", sizeof (vl.plugin_instance));
+    sstrncpy (vl.type_instance, "package", sizeof (vl.type_instance));
+
+    if (report_energy) {
+        if (energy_counter) {
+            v.derive = (derive_t) llround (estimate_energy_J * 1e6);
+            sstrncpy (vl.type, "energy_counter", sizeof (vl.type));
+        } else {
+            v.gauge = estimate_energy_J;
+            sstrncpy (vl.type, "energy", sizeof (vl.type));
+        }
+        failed += (plugin_dispatch_values (&vl) != 0);
+    }
+    if (report_power) {
+        v.gauge = watts;
+        sstrncpy (vl.type, "power", sizeof (vl.type));
+        failed += (plugin_dispatch_values (&vl) != 0);
+    }
+    if (failed)
+        ERROR ("intel_cpu_energy plugin: Failed to submit %d estimated value(s)", failed);
+
+    return 0;
+}
+
+static int energy_read_complex (user_data_t *user_data)
+{
+    if (estimate_only)
+        return energy_read_estimate ();
+    return energy_read ();
+}
+
+/* Work out the sample and dispatch intervals and register the read callback
+ * accordingly. */
+static int energy_register_read (void)
+{
+    cdtime_t maximum_interval = MS_TO_CDTIME_T (MAXIMUM_INTERVAL_MS);
+
+    if (sample_interval == 0)
+        sample_interval = plugin_get_interval ();
+    if (sample_interval > maximum_interval) {
+        /* override the interval with the locally defined maximum interval */
+        INFO ("intel_cpu_energy plugin: Reading the energy status every %.3f s to catch all counter wraparounds",
+              CDTIME_T_TO_DOUBLE (maximum_interval));
+        sample_interval = maximum_interval;
+    }
+
+    if (dispatch_interval == 0)
+        dispatch_interval = plugin_get_interval ();
+    dispatch_every = (unsigned int) ((dispatch_interval + sample_interval / 2) / sample_interval);
+    if (dispatch_every < 1)
+        dispatch_every = 1;
+    dispatch_interval = dispatch_every * sample_interval;
+
+#ifdef COLLECTD_VERSION_LT_5_5
+    /*
+     * As of commit cce136946b879557f91183e4de58e92b81e138c8 (2015-06-06),
+     * plugin_register_complex_read expects the interval to be of type
+     * cdtime_t. Prior to that, it used to be a struct timespec.
+     */
+    struct timespec interval;
+    CDTIME_T_TO_TIMESPEC (sample_interval, &interval);
+
+    return plugin_register_complex_read (/* group = */ NULL, "intel_cpu_energy",
+            energy_read_complex, &interval, /* user data = */ NULL);
+#else
+    return plugin_register_complex_read (/* group = */ NULL, "intel_cpu_energy",
+            energy_read_complex, sample_interval, /* user data = */ NULL);
+#endif /* COLLECTD_VERSION_LT_5_5 */
+}
+
+/* Select the nodes and domains energy_read() will actually touch. */
+static int energy_select_reads (void)
+{
+    int i, node, domain;
+
+    read_nodes = calloc(rapl_node_count, sizeof(*read_nodes));
+    read_domains = calloc(rapl_node_count, sizeof(*read_domains));
+    read_domains_num = calloc(rapl_node_count, sizeof(*read_domains_num));
+    if (read_nodes == NULL || read_domains == NULL || read_domains_num == NULL)
+        return MY_ERROR;
+
+    /* Packages selects physical packages; all dies of a selected package
+     * are read. */
+    read_nodes_num = 0;
+    for (node = 0; node < rapl_node_count; node++) {
+        uint64_t pkg_id = node, die_id = 0;
+
+        get_rapl_node_location (rapl_ctx, node, &pkg_id, &die_id);
+        if (package_list == NULL) {
+            read_nodes[read_nodes_num++] = node;
+            continue;
+        }
+        for (i = 0; i < package_list_num; i++) {
+            if (package_list[i] == (int) pkg_id) {
+                read_nodes[read_nodes_num++] = node;
+                break;
+            }
+        }
+    }
+    for (i = 0; package_list != NULL && i < package_list_num; i++) {
+        for (node = 0; node < rapl_node_count; node++) {
+            uint64_t pkg_id = node, die_id = 0;
+
+            get_rapl_node_location (rapl_ctx, node, &pkg_id, &die_id);
+            if (package_list[i] == (int) pkg_id)
+                break;
+        }
+        if (node == rapl_node_count)
+            WARNING ("intel_cpu_energy plugin: Ignoring package %d: no such package found", package_list[i]);
+    }
+
+    for (i = 0; i < read_nodes_num; i++) {
+        node = read_nodes[i];
+        for (domain = 0; domain < RAPL_NR_DOMAIN; ++domain) {
+            if (!domain_enabled[domain] || !is_supported_domain(rapl_ctx, domain))
+                continue;
+            DEBUG ("intel_cpu_energy plugin: Reading node %d, domain %d (%s)", node, domain, RAPL_DOMAIN_NAMES[domain]);
+            read_domains[node][read_domains_num[node]++] = domain;
+        }
+    }
+
+    return 0;
+}
+
+/* Narrow the MSR batch down to the selected domains, plus the per-CPU and
+ * uncore registers only if those metrics are reported. */
+static void energy_select_batch (void)
+{
+    uint32_t *masks;
+    unsigned int groups = 0;
+    int i, j, node;
+
+    if (!is_rapl_batch_enabled (rapl_ctx))
+        return;
+    masks = calloc (rapl_node_count, sizeof (*masks));
+    if (masks == NULL)
+        return;
+    for (i = 0; i < read_nodes_num; i++) {
+        node = read_nodes[i];
+        for (j = 0; j < read_domains_num[node]; j++)
+            masks[node] |= 1u << read_domains[node][j];
+    }
+    if (report_core_types)
+        groups |= RAPL_BATCH_CPU_ACTIVITY;
+    if (report_uncore)
+        groups |= RAPL_BATCH_UNCORE;
+    if (0 != select_rapl_batch (rapl_ctx, masks, groups))
+        WARNING ("intel_cpu_energy plugin: Failed to rebuild the MSR batch; reading the registers one by one");
+    sfree (masks);
+}
+
+/* Open the perf counters for Metrics "efficiency" and take the baseline.
+ * Failing isn't fatal: the efficiency metrics are just left out. */
+static int energy_efficiency_init (void)
+{
+    char errbuf[1024];
+    uint64_t cpu, node;
+    int opened;
+
+    if (!domain_enabled[RAPL_PKG] || !is_supported_domain (rapl_ctx, RAPL_PKG)) {
+        WARNING ("intel_cpu_energy plugin: Not reporting efficiency metrics: this requires reading the package domain");
+        return MY_ERROR;
+    }
+
+    efficiency_num_cpus = (long) get_num_os_cpus (rapl_ctx);
+    opened = perf_init (efficiency_num_cpus);
+    if (opened < 0) {
+        WARNING ("intel_cpu_energy plugin: Not reporting efficiency metrics: failed to open the perf counters: %s "
+                 "(system-wide counting needs CAP_PERFMON or kernel.perf_event_paranoid <= 0)",
+                 sstrerror (errno, errbuf, sizeof (errbuf)));
+        return MY_ERROR;
+    }
+
+    efficiency_cpu_node = calloc(efficiency_num_cpus, sizeof(int));
+    efficiency_prev = calloc(rapl_node_count, sizeof(efficiency_node_t));
+    efficiency_cur = calloc(rapl_node_count, sizeof(efficiency_node_t));
+    if (efficiency_cpu_node == NULL || efficiency_prev == NULL || efficiency_cur == NULL) {
+        ERROR ("intel_cpu_energy plugin: Memory allocation failed for the efficiency metrics");
+        perf_shutdown ();
+        return MY_ERROR;
+    }
+    for (cpu = 0; cpu < (uint64_t) efficiency_num_cpus; cpu++)
+        efficiency_cpu_node[cpu] = (0 == get_cpu_rapl_node (rapl_ctx, cpu, &node)) ? (int) node : -1;
+
+    perf_read ();
+    energy_efficiency_sample (efficiency_prev);
+
+    INFO ("intel_cpu_energy plugin: reporting efficiency metrics from the perf counters of %d CPU(s)", opened);
+    return 0;
+}
+
+/* Open the IMC counters for Metrics "bandwidth" and take the baseline.
+ * Failing isn't fatal: the bandwidth metrics are just left out. */
+static int energy_bandwidth_init (void)
+{
+    char errbuf[1024];
+    uint64_t read_bytes, write_bytes, node;
+    long cpu;
+    int i;
+
+    if (!domain_enabled[RAPL_DRAM] || !is_supported_domain (rapl_ctx, RAPL_DRAM)) {
+        WARNING ("intel_cpu_energy plugin: Not reporting memory bandwidth: this requires reading the DRAM domain");
+        return MY_ERROR;
+    }
+
+    bandwidth_imc_num = perf_imc_init ();
+    if (bandwidth_imc_num < 0) {
+        bandwidth_imc_num = 0;
+        WARNING ("intel_cpu_energy plugin: Not reporting memory bandwidth: failed to open the uncore IMC counters: %s",
+                 sstrerror (errno, errbuf, sizeof (errbuf)));
+        return MY_ERROR;
+    }
+
+    bandwidth_imc_node = calloc(bandwidth_imc_num, sizeof(int));
+    bandwidth_prev = calloc(rapl_node_count, sizeof(bandwidth_node_t));
+    bandwidth_cur = calloc(rapl_node_count, sizeof(bandwidth_node_t));
+    if (bandwidth_imc_node == NULL || bandwidth_prev == NULL || bandwidth_cur == NULL) {
+        ERROR ("intel_cpu_energy plugin: Memory allocation failed for the bandwidth metrics");
+        perf_imc_shutdown ();
+        return MY_ERROR;
+    }
+
+    perf_imc_read ();
+    for (i = 0; i < bandwidth_imc_num; i++) {
+        perf_imc_get (i, &cpu, &read_bytes, &write_bytes);
+        bandwidth_imc_node[i] = (0 == get_cpu_rapl_node (rapl_ctx, (uint64_t) cpu, &node)) ? (int) node : -1;
+    }
+    energy_bandwidth_sample (bandwidth_prev, monotonic_raw_ns ());
+
+    INFO ("intel_cpu_energy plugin: reporting memory bandwidth from %d uncore IMC counter group(s)", bandwidth_imc_num);
+    return 0;
+}
+
+/* RAPL is unavailable: serve estimates from a previously trained model. */
+static int energy_init_estimate_only (void)
+{
+    char errbuf[1024];
+    int err;
+
+    if (0 != estimate_init ()) {
+        ERROR ("intel_cpu_energy plugin: Failed to read /proc/stat for the power estimate");
+        return MY_ERROR;
+    }
+    if (0 != estimate_load (estimate_file)) {
+        ERROR ("intel_cpu_energy plugin: Failed to load the power model from %s: %s",
+               estimate_file, sstrerror (errno, errbuf, sizeof (errbuf)));
+        estimate_shutdown ();
+        return MY_ERROR;
+    }
+    if (estimate_samples () < estimate_min_samples) {
+        ERROR ("intel_cpu_energy plugin: The power model in %s has only been trained with %lu of %lu intervals",
+               estimate_file, estimate_samples (), estimate_min_samples);
+        estimate_shutdown ();
+        return MY_ERROR;
+    }
+
+    /* One estimate per dispatch; /proc/stat has no wraparounds to catch. */
+    sample_interval = dispatch_interval;
+    estimate_only = 1;
+    last_dispatch = monotonic_seconds ();
+
+    err = energy_register_read ();
+    if (0 != err) {
+        ERROR ("intel_cpu_energy plugin: Failed to register the read callback: Return value %d", err);
+        return MY_ERROR;
+    }
+
+    WARNING ("intel_cpu_energy plugin: RAPL is unavailable, reporting the estimated package power "
+             "(model trained with %lu intervals)", estimate_samples ());
+    return 0;
+}
+
+static int energy_init (void)
+{
+    int err, i, j, node, domain;
+    double now;
+
+    err = init_rapl (&rapl_ctx);
+    if (0 != err) {
+        ERROR ("intel_cpu_energy plugin: RAPL initialisation failed with return value %d", err);
+        if (estimate_file != NULL)
+            return energy_init_estimate_only ();
+        return MY_ERROR;
+    }
+
+    rapl_node_count = get_num_rapl_nodes_pkg(rapl_ctx);
+    if (get_num_dies_per_pkg (rapl_ctx) > 1)
+        INFO ("intel_cpu_energy plugin: found %lu nodes (%lu dies per physical CPU)", rapl_node_count, get_num_dies_per_pkg (rapl_ctx));
+    else
+        INFO ("intel_cpu_energy plugin: found %lu nodes (physical CPUs)", rapl_node_count);
+    for (domain = 0; domain < RAPL_NR_DOMAIN; domain++) {
+        energy_unit_J[domain] = get_rapl_domain_energy_unit (rapl_ctx, domain);
+        if (derived_unit_J == 0 || energy_unit_J[domain] < derived_unit_J)
+            derived_unit_J = energy_unit_J[domain];
+    }
+    if (is_rapl_batch_enabled (rapl_ctx))
+        INFO ("intel_cpu_energy plugin: reading MSRs in batches (%s backend)", get_msr_backend ()->name);
+
+    prev_sample = calloc(rapl_node_count, sizeof(uint64_t*));
+    cum_energy_raw = calloc(rapl_node_count, sizeof(uint64_t*));
+    dispatched_energy_raw = calloc(rapl_node_count, sizeof(uint64_t*));
+    peak_watts = calloc(rapl_node_count, sizeof(double*));
+    domain_health = calloc(rapl_node_count, sizeof(domain_health_t*));
+    energy_vl = calloc(rapl_node_count, sizeof(energy_vl_t));
+    if (prev_sample == NULL || cum_energy_raw == NULL || dispatched_energy_raw == NULL || peak_watts == NULL || domain_health == NULL || energy_vl == NULL
+            || energy_select_reads () != 0) {
+        ERROR ("intel_cpu_energy plugin: Memory allocation failed for outer persistent array");
+        return MY_ERROR;
+    }
+
+    if (read_nodes_num == 0) {
+        ERROR ("intel_cpu_energy plugin: None of the configured packages exist");
+        return MY_ERROR;
+    }
+    energy_select_batch ();
+
+    /* The intervals are needed to prepare the value lists. */
+    err = energy_register_read ();
+    if (0 != err) {
+        ERROR ("intel_cpu_energy plugin: Failed to register the read callback: Return value %d", err);
+        return MY_ERROR;
+    }
+
+    for (node = 0; node < rapl_node_count; node++) {
+        prev_sample[node] = calloc(RAPL_NR_DOMAIN, sizeof(uint64_t));
+        cum_energy_raw[node] = calloc(RAPL_NR_DOMAIN, sizeof(uint64_t));
+        dispatched_energy_raw[node] = calloc(RAPL_NR_DOMAIN, sizeof(uint64_t));
+        peak_watts[node] = calloc(RAPL_NR_DOMAIN, sizeof(double));
+        domain_health[node] = calloc(RAPL_NR_DOMAIN, sizeof(domain_health_t));
+        if (prev_sample[node] == NULL || cum_energy_raw[node] == NULL || dispatched_energy_raw[node] == NULL || peak_watts[node] == NULL || domain_health[node] == NULL) {
+            ERROR ("intel_cpu_energy plugin: Memory allocation failed for inner persistent array (node %d)", node);
+            return MY_ERROR;
+        }
+
+        energy_vl_init (&energy_vl[node], node);
+    }
+
+    /* Read initial values */
+    now = monotonic_seconds ();
+    last_dispatch = now;
+    prev_read_pass = now;
+    for (i = 0; i < read_nodes_num; i++) {
+        node = read_nodes[i];
+        for (j = 0; j < read_domains_num[node]; j++) {
+            domain = read_domains[node][j];
+            err = get_rapl_energy_info(domain, node, &(prev_sample[node][domain]));
+            if (0 != err) {
+                /* energy_read() will keep probing it with backoff. */
+                energy_domain_failed (node, domain, err);
+            } else {
+                domain_health[node][domain].has_baseline = 1;
+                domain_health[node][domain].last_read = now;
+                domain_health[node][domain].power_since = now;
+            }
+        }
+        if (report_core_types) {
+            core_type_stats_t stats[RAPL_MAX_CORE_TYPES];
+
+            if (0 != update_core_type_stats (rapl_ctx, node, stats))
+                WARNING ("intel_cpu_energy plugin: Failed to read the APERF/MPERF counters of node %d", node);
+            else if (get_num_core_types (rapl_ctx, node) > 1)
+                INFO ("intel_cpu_energy plugin: node %d is hybrid, reporting its core types separately", node);
+        }
+    }
+
+    if (package_threshold.enabled || host_threshold.enabled) {
+        if (!domain_enabled[RAPL_PKG] || !is_supported_domain(rapl_ctx, RAPL_PKG)) {
+            ERROR ("intel_cpu_energy plugin: Power thresholds require reading the package domain");
+            return MY_ERROR;
+        }
+        package_threshold_state = calloc(rapl_node_count, sizeof(int));
+        if (package_threshold_state == NULL) {
+            ERROR ("intel_cpu_energy plugin: Memory allocation failed for the threshold states");
+            return MY_ERROR;
+        }
+        energy_threshold_init (&package_threshold);
+        energy_threshold_init (&host_threshold);
+    }
+
+    if (report_derived) {
+        derived_nodes = calloc(rapl_node_count, sizeof(derived_energy_t));
+        if (derived_nodes == NULL) {
+            ERROR ("intel_cpu_energy plugin: Memory allocation failed for the derived series");
+            return MY_ERROR;
+        }
+        memset (&derived_host, 0, sizeof (derived_host));
+        if (read_nodes_num != rapl_node_count)
+            WARNING ("intel_cpu_energy plugin: Not all packages are read, so no host totals will be reported");
+    }
+
+    if (report_efficiency && 0 != energy_efficiency_init ())
+        report_efficiency = 0;
+    if (report_bandwidth && 0 != energy_bandwidth_init ())
+        report_bandwidth = 0;
+    for (i = 0; i < rollup_tiers_num; i++) {
+        rollup_tier_t *tier = &rollup_tiers[i];
+
+        tier->every = (unsigned int) ((tier->seconds + CDTIME_T_TO_DOUBLE (sample_interval) / 2)
+                / CDTIME_T_TO_DOUBLE (sample_interval));
+        if (tier->every < 1)
+            tier->every = 1;
+        tier->passes = 0;
+        tier->acc = calloc(rapl_node_count * RAPL_NR_DOMAIN, sizeof(rollup_acc_t));
+        if (tier->acc == NULL) {
+            ERROR ("intel_cpu_energy plugin: Memory allocation failed for the rollup accumulators");
+            return MY_ERROR;
+        }
+        INFO ("intel_cpu_energy plugin: rolling up every %u samples (%g s)",
+              tier->every, tier->every * CDTIME_T_TO_DOUBLE (sample_interval));
+    }
+
+    if (report_uncore) {
+        if (get_uncore_freq_source (rapl_ctx) == NULL) {
+            WARNING ("intel_cpu_energy plugin: Not reporting the uncore frequency: "
+                     "no uncore MSRs for this model and no intel_uncore_frequency driver");
+            report_uncore = 0;
+        } else {
+            INFO ("intel_cpu_energy plugin: reading the uncore frequency from %s", get_uncore_freq_source (rapl_ctx));
+        }
+    }
+
+    if (shm_name != NULL) {
+        shm_nodes = calloc(rapl_node_count, sizeof(rapl_shm_node_t));
+        if (shm_nodes == NULL) {
+            ERROR ("intel_cpu_energy plugin: Memory allocation failed for the shared memory state");
+            return MY_ERROR;
+        }
+        if (0 != rapl_shm_create (&shm, shm_name, rapl_node_count, energy_unit_J[RAPL_PKG],
+                energy_unit_J[RAPL_DRAM])) {
+            char errbuf[1024];
+            ERROR ("intel_cpu_energy plugin: Failed to create the shared memory segment %s: %s",
+                   shm_name, sstrerror (errno, errbuf, sizeof (errbuf)));
+            sfree (shm_nodes);
+            return MY_ERROR;
+        }
+        for (node = 0; node < rapl_node_count; node++) {
+            uint64_t pkg_id = node, die_id = 0;
+
+            get_rapl_node_location (rapl_ctx, node, &pkg_id, &die_id);
+            shm_nodes[node].pkg_id = pkg_id;
+            shm_nodes[node].die_id = die_id;
+        }
+        INFO ("intel_cpu_energy plugin: exporting the latest state in shared memory segment %s", shm_name);
+    }
+
+    if (region_socket != NULL && 0 != energy_region_init ())
+        return MY_ERROR;
+
+    if (estimate_file != NULL) {
+        if (read_nodes_num != rapl_node_count || !domain_enabled[RAPL_PKG] || !is_supported_domain (rapl_ctx, RAPL_PKG)) {
+            WARNING ("intel_cpu_energy plugin: Not training the power model: this requires reading the package domain of all packages");
+        } else if (0 != estimate_init ()) {
+            WARNING ("intel_cpu_energy plugin: Not training the power model: failed to read /proc/stat");
+        } else {
+            if (0 != estimate_load (estimate_file) && errno != ENOENT) {
+                char errbuf[1024];
+                WARNING ("intel_cpu_energy plugin: Failed to load the power model from %s, starting from scratch: %s",
+                         estimate_file, sstrerror (errno, errbuf, sizeof (errbuf)));
+            }
+            estimate_training = 1;
+            INFO ("intel_cpu_energy plugin: training the power model in %s (%lu intervals so far)",
+                  estimate_file, estimate_samples ());
+        }
+    }
+
+    if (trace_file != NULL) {
+        if (0 != trace_create (&trace, trace_file, trace_records, energy_unit_J[RAPL_PKG],
+                energy_unit_J[RAPL_DRAM])) {
+            char errbuf[1024];
+            ERROR ("intel_cpu_energy plugin: Failed to create the trace file %s: %s",
+                   trace_file, sstrerror (errno, errbuf, sizeof (errbuf)));
+            return MY_ERROR;
+        }
+        INFO ("intel_cpu_energy plugin: tracing %lu records to %s", trace_records, trace_file);
+    }
+
+    if (powercap_cfg.budget_watts > 0) {
+        /* The controller needs the package power of every package. */
+        if (read_nodes_num != rapl_node_count || !domain_enabled[RAPL_PKG]) {
+            ERROR ("intel_cpu_energy plugin: Package power capping requires reading the package domain of all packages");
+            return MY_ERROR;
+        }
+        if (0 != powercap_init (rapl_ctx, rapl_node_count, &powercap_cfg)) {
+            ERROR ("intel_cpu_energy plugin: Failed to initialise package power capping");
+            return MY_ERROR;
+        }
+        powercap_enabled = 1;
+        INFO ("intel_cpu_energy plugin: capping package power to a total of %.1f W", powercap_cfg.budget_watts);
+    }
+
+    return 0;
+}
+
+static int energy_shutdown (void)
+{
+    int err;
+    int i;
+
+    if (powercap_enabled) {
+        err = powercap_shutdown ();
+        if (err) {
+            ERROR ("intel_cpu_energy plugin: Failed to restore the original package power limit on %d node(s)", err);
+        }
+        powercap_enabled = 0;
+    }
+
+    energy_region_shutdown ();
+
+    if (estimate_training && 0 != estimate_save (estimate_file)) {
+        char errbuf[1024];
+        WARNING ("intel_cpu_energy plugin: Failed to save the power model to %s: %s",
+                 estimate_file, sstrerror (errno, errbuf, sizeof (errbuf)));
+    }
+    estimate_training = estimate_only = 0;
+    estimate_shutdown ();
+
+    if (shm_nodes != NULL) {
+        rapl_shm_destroy (&shm);
+        sfree (shm_nodes);
+    }
+    sfree (derived_nodes);
+    if (report_efficiency) {
+        perf_shutdown ();
+        report_efficiency = 0;
+    }
+    sfree (efficiency_cpu_node);
+    sfree (efficiency_prev);
+    sfree (efficiency_cur);
+    if (report_bandwidth) {
+        perf_imc_shutdown ();
+        report_bandwidth = 0;
+    }
+    sfree (bandwidth_imc_node);
+    sfree (bandwidth_prev);
+    sfree (bandwidth_cur);
+    for (i = 0; i < rollup_tiers_num; i++)
+        sfree (rollup_tiers[i].acc);
+
+    trace_close (&trace);
+
+    terminate_rapl (rapl_ctx);
+    rapl_ctx = NULL;
+
+    return 0;
+}
+
+void module_register (void)
+{
+    plugin_register_complex_config ("intel_cpu_energy", energy_config);
+    plugin_register_init ("intel_cpu_energy", energy_init);
+    plugin_register_shutdown ("intel_cpu_energy", energy_shutdown);
+    /* The read callback is registered by energy_init(), once the sample
+     * interval is known. */
 } /* void module_register */
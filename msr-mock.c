@@ -0,0 +1,186 @@
+/**
+ * collectd - msr-mock.c
+ * Copyright (C) 2015  Nils Steinger
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Author:
+ *   Nils Steinger <git at n-st dot de>
+ **/
+
+#include <errno.h>
+#include <string.h>
+
+#include "msr-mock.h"
+
+typedef struct msr_mock_register_t {
+    int      cpu;
+    uint64_t address;
+    uint64_t value;
+    uint64_t reads;
+    uint64_t writes;
+} msr_mock_register_t;
+
+static msr_mock_register_t msr_mock_registers[MSR_MOCK_MAX_REGISTERS];
+static int msr_mock_num_registers = 0;
+
+static uint64_t msr_mock_num_batches = 0;
+static int msr_mock_batch_errno = 0;
+
+static msr_mock_register_t *
+msr_mock_find (int cpu, uint64_t address, int create)
+{
+    int i;
+
+    for (i = 0; i < msr_mock_num_registers; i++)
+        if (msr_mock_registers[i].cpu == cpu && msr_mock_registers[i].address == address)
+            return &msr_mock_registers[i];
+    if (!create || msr_mock_num_registers == MSR_MOCK_MAX_REGISTERS)
+        return NULL;
+
+    i = msr_mock_num_registers++;
+    memset (&msr_mock_registers[i], 0, sizeof (msr_mock_registers[i]));
+    msr_mock_registers[i].cpu = cpu;
+    msr_mock_registers[i].address = address;
+    return &msr_mock_registers[i];
+}
+
+static int
+msr_mock_read (int cpu, uint64_t address, uint64_t *value)
+{
+    msr_mock_register_t *r = msr_mock_find (cpu, address, 0);
+
+    if (r == NULL)
+        return MY_ERROR;
+    r->reads++;
+    *value = r->value;
+    return 0;
+}
+
+static int
+msr_mock_write (int cpu, uint64_t address, uint64_t value)
+{
+    msr_mock_register_t *r = msr_mock_find (cpu, address, 1);
+
+    if (r == NULL)
+        return MY_ERROR;
+    r->value = value;
+    r->writes++;
+    return 0;
+}
+
+/* Like msr-safe: operations on registers that don't exist fail with -EIO,
+ * and so does the ioctl as a whole, but the other operations are done. */
+int
+msr_mock_batch_submit (int fd, msr_batch_array_t *array)
+{
+    msr_mock_register_t *r;
+    msr_batch_op_t *op;
+    uint32_t i;
+    int failed = 0;
+
+    msr_mock_num_batches++;
+    if (msr_mock_batch_errno != 0) {
+        errno = msr_mock_batch_errno;
+        return -1;
+    }
+    for (i = 0; i < array->numops; i++) {
+        op = &array->ops[i];
+        r = msr_mock_find (op->cpu, op->msr, !op->isrdmsr);
+        if (r == NULL) {
+            op->err = -EIO;
+            failed = 1;
+        } else if (op->isrdmsr) {
+            op->msrdata = r->value;
+        } else {
+            r->value = op->msrdata;
+            r->writes++;
+        }
+    }
+    if (failed) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+const msr_backend_t msr_mock_backend = {
+    .name  = "mock",
+    .read  = msr_mock_read,
+    .write = msr_mock_write,
+};
+
+const msr_backend_t msr_mock_batch_backend = {
+    .name         = "mock-batch",
+    .read         = msr_mock_read,
+    .write        = msr_mock_write,
+    .batch_device = MSR_MOCK_BATCH_DEVICE,
+    .batch_submit = msr_mock_batch_submit,
+};
+
+void
+msr_mock_reset (void)
+{
+    msr_mock_num_registers = 0;
+    msr_mock_num_batches = 0;
+    msr_mock_batch_errno = 0;
+}
+
+void
+msr_mock_set (int cpu, uint64_t address, uint64_t value)
+{
+    msr_mock_register_t *r = msr_mock_find (cpu, address, 1);
+
+    if (r != NULL)
+        r->value = value;
+}
+
+int
+msr_mock_get (int cpu, uint64_t address, uint64_t *value)
+{
+    msr_mock_register_t *r = msr_mock_find (cpu, address, 0);
+
+    if (r == NULL)
+        return MY_ERROR;
+    *value = r->value;
+    return 0;
+}
+
+uint64_t
+msr_mock_reads (int cpu, uint64_t address)
+{
+    msr_mock_register_t *r = msr_mock_find (cpu, address, 0);
+
+    return (r == NULL) ? 0 : r->reads;
+}
+
+uint64_t
+msr_mock_writes (int cpu, uint64_t address)
+{
+    msr_mock_register_t *r = msr_mock_find (cpu, address, 0);
+
+    return (r == NULL) ? 0 : r->writes;
+}
+
+void
+msr_mock_batch_reject (int err)
+{
+    msr_mock_batch_errno = err;
+}
+
+uint64_t
+msr_mock_batches (void)
+{
+    return msr_mock_num_batches;
+}
@@ -0,0 +1,78 @@
+/**
+ * collectd - msr-mock.h
+ * Copyright (C) 2015  Nils Steinger
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Author:
+ *   Nils Steinger <git at n-st dot de>
+ **/
+
+#ifndef _h_msr_mock
+#define _h_msr_mock
+
+#include <stdint.h>
+
+#include "msr.h"
+
+/*
+ * In-memory MSR backend for tests.
+ *
+ * Install it with set_msr_backend(&msr_mock_backend) before init_rapl().
+ * Registers hold whatever msr_mock_set() or a write through the backend last
+ * stored; reading a register that was never set fails, like reading an MSR
+ * the processor doesn't implement. Together with cpuid-mock.c, which
+ * describes a fixed processor, the RAPL library can be exercised without
+ * real hardware.
+ *
+ * msr_mock_batch_backend additionally has a fake batch device, which performs
+ * the operations of a batch (see msr_batch_t) on the same registers. Its
+ * batch_device is a file that can always be opened; the batch itself goes to
+ * msr_mock_batch_submit().
+ */
+
+#define MSR_MOCK_MAX_REGISTERS 256
+#define MSR_MOCK_BATCH_DEVICE  "/dev/null"
+
+extern const msr_backend_t msr_mock_backend;
+extern const msr_backend_t msr_mock_batch_backend;
+
+/* Forget all registers, and accept batches again. */
+void msr_mock_reset(void);
+
+/* Set a register, without counting it as a write. */
+void msr_mock_set(int cpu, uint64_t address, uint64_t value);
+
+/* Get a register. Returns 0 on success, MY_ERROR if it was never set. */
+int msr_mock_get(int cpu, uint64_t address, uint64_t *value);
+
+/* Number of reads of a register through the backend (not the batch device). */
+uint64_t msr_mock_reads(int cpu, uint64_t address);
+
+/* Number of writes to a register through the backend. */
+uint64_t msr_mock_writes(int cpu, uint64_t address);
+
+/* The fake batch device's X86_IOC_MSR_BATCH: reads of registers that were
+ * never set fail with -EIO, which fails the whole call with errno EIO. */
+int msr_mock_batch_submit(int fd, msr_batch_array_t *array);
+
+/* Reject every batch as a whole (err: its errno, e.g. ENOTTY for an msr-safe
+ * without batch support), without performing any operation; 0 accepts them
+ * again. */
+void msr_mock_batch_reject(int err);
+
+/* Number of batches submitted to the fake batch device. */
+uint64_t msr_mock_batches(void);
+
+#endif
@@ -12,28 +12,42 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 
 /* Written by Martin Dimitrov, Carl Strickland */
 
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
 #include "msr.h"
 
+static msr_stats_t msr_stats;
+
+#define MSR_STATS_INC(counter) \
+    __atomic_fetch_add(&msr_stats.counter, 1, __ATOMIC_RELAXED)
 
 /*
- * read_msr
+ * read_msr_path
  *
+ * Read an MSR through the device file for the given CPU, where `format' is
+ * the printf format of the device file path.
  * Will return 0 on success and MY_ERROR on failure.
  */
-int
-read_msr(int       cpu,
-         uint64_t  address,
-         uint64_t *value)
+static int
+read_msr_path(const char *format,
+              int         cpu,
+              uint64_t    address,
+              uint64_t   *value)
 {
     int   err = 0;
     char  msr_path[32];
     FILE *fp;
 
-    sprintf(msr_path, "/dev/cpu/%d/msr", cpu);
+    snprintf(msr_path, sizeof(msr_path), format, cpu);
+    MSR_STATS_INC(opens);
     err = ((fp = fopen(msr_path, "r")) == NULL);
     if (!err)
         err = (fseek(fp, address, SEEK_CUR) != 0);
@@ -47,21 +61,23 @@ read_msr(int       cpu,
 
 
 /*
- * write_msr
+ * write_msr_path
  *
  * Will return 0 on success and MY_ERROR on failure.
  */
 
-int
-write_msr(int      cpu,
-          uint64_t address,
-          uint64_t value)
+static int
+write_msr_path(const char *format,
+               int         cpu,
+               uint64_t    address,
+               uint64_t    value)
 {
     int   err = 0;
     char  msr_path[32];
     FILE *fp;
 
-    sprintf(msr_path, "/dev/cpu/%d/msr", cpu);
+    snprintf(msr_path, sizeof(msr_path), format, cpu);
+    MSR_STATS_INC(opens);
     err = ((fp = fopen(msr_path, "w")) == NULL);
     if (!err)
         err = (fseek(fp, address, SEEK_CUR) != 0);
@@ -72,3 +88,581 @@ write_msr(int      cpu,
     return err;
 }
 
+
+#define MSR_DEV_PATH  "/dev/cpu/%d/msr"
+#define MSR_SAFE_PATH "/dev/cpu/%d/msr_safe"
+
+static int
+read_msr_dev(int cpu, uint64_t address, uint64_t *value)
+{
+    return read_msr_path(MSR_DEV_PATH, cpu, address, value);
+}
+
+static int
+write_msr_dev(int cpu, uint64_t address, uint64_t value)
+{
+    return write_msr_path(MSR_DEV_PATH, cpu, address, value);
+}
+
+/* The msr-safe kernel module (https://github.com/LLNL/msr-safe) exposes the
+ * MSRs on an allowlist to unprivileged users. */
+static int
+read_msr_safe(int cpu, uint64_t address, uint64_t *value)
+{
+    return read_msr_path(MSR_SAFE_PATH, cpu, address, value);
+}
+
+static int
+write_msr_safe(int cpu, uint64_t address, uint64_t value)
+{
+    return write_msr_path(MSR_SAFE_PATH, cpu, address, value);
+}
+
+
+static const msr_backend_t msr_dev_backend = {
+    .name        = "msr",
+    .read        = read_msr_dev,
+    .write       = write_msr_dev,
+    .path_format = MSR_DEV_PATH,
+};
+
+static const msr_backend_t msr_safe_backend = {
+    .name        = "msr-safe",
+    .read        = read_msr_safe,
+    .write       = write_msr_safe,
+    .path_format = MSR_SAFE_PATH,
+};
+
+
+/* msr-safe, with the periodic reads batched (see msr_batch_t); single
+ * accesses and the fallback use the msr_safe device files. */
+static const msr_backend_t msr_batch_backend = {
+    .name         = "msr-batch",
+    .read         = read_msr_safe,
+    .write        = write_msr_safe,
+    .path_format  = MSR_SAFE_PATH,
+    .batch_device = MSR_BATCH_DEVICE,
+};
+
+
+/* msr, with the periodic reads submitted through io_uring (see
+ * msr_batch_use_uring()) */
+static const msr_backend_t msr_uring_backend = {
+    .name         = "msr-uring",
+    .read         = read_msr_dev,
+    .write        = write_msr_dev,
+    .path_format  = MSR_DEV_PATH,
+    .uring        = 1,
+};
+
+
+static const msr_backend_t *msr_backends[] = {
+    &msr_dev_backend,
+    &msr_safe_backend,
+    &msr_batch_backend,
+    &msr_uring_backend,
+};
+
+static const msr_backend_t *msr_backend = &msr_dev_backend;
+
+void
+set_msr_backend(const msr_backend_t *backend)
+{
+    msr_backend = (backend != NULL) ? backend : &msr_dev_backend;
+}
+
+const msr_backend_t *
+get_msr_backend()
+{
+    return msr_backend;
+}
+
+const msr_backend_t *
+find_msr_backend(const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(msr_backends) / sizeof(msr_backends[0]); i++)
+        if (strcmp(msr_backends[i]->name, name) == 0)
+            return msr_backends[i];
+    return NULL;
+}
+
+void
+get_msr_stats(msr_stats_t *stats)
+{
+    stats->reads = __atomic_load_n(&msr_stats.reads, __ATOMIC_RELAXED);
+    stats->read_failures = __atomic_load_n(&msr_stats.read_failures, __ATOMIC_RELAXED);
+    stats->writes = __atomic_load_n(&msr_stats.writes, __ATOMIC_RELAXED);
+    stats->write_failures = __atomic_load_n(&msr_stats.write_failures, __ATOMIC_RELAXED);
+    stats->opens = __atomic_load_n(&msr_stats.opens, __ATOMIC_RELAXED);
+    stats->batches = __atomic_load_n(&msr_stats.batches, __ATOMIC_RELAXED);
+}
+
+int
+read_msr(int       cpu,
+         uint64_t  address,
+         uint64_t *value)
+{
+    int err;
+
+    MSR_STATS_INC(reads);
+    err = msr_backend->read(cpu, address, value);
+    if (err)
+        MSR_STATS_INC(read_failures);
+    return err;
+}
+
+int
+write_msr(int      cpu,
+          uint64_t address,
+          uint64_t value)
+{
+    int err;
+
+    MSR_STATS_INC(writes);
+    err = msr_backend->write(cpu, address, value);
+    if (err)
+        MSR_STATS_INC(write_failures);
+    return err;
+}
+
+int
+msr_cache_init(msr_fd_cache_t *cache,
+               int             num_cpus)
+{
+    int i;
+
+    cache->backend = get_msr_backend();
+    cache->num_cpus = num_cpus;
+    cache->read_fds = (int *) malloc(num_cpus * sizeof(int));
+    cache->write_fds = (int *) malloc(num_cpus * sizeof(int));
+    if (cache->read_fds == NULL || cache->write_fds == NULL) {
+        msr_cache_close(cache);
+        return MY_ERROR;
+    }
+    for (i = 0; i < num_cpus; i++)
+        cache->read_fds[i] = cache->write_fds[i] = -1;
+    return 0;
+}
+
+void
+msr_cache_close(msr_fd_cache_t *cache)
+{
+    int i;
+
+    for (i = 0; cache->read_fds != NULL && i < cache->num_cpus; i++)
+        if (cache->read_fds[i] >= 0)
+            close(cache->read_fds[i]);
+    for (i = 0; cache->write_fds != NULL && i < cache->num_cpus; i++)
+        if (cache->write_fds[i] >= 0)
+            close(cache->write_fds[i]);
+    free(cache->read_fds);
+    free(cache->write_fds);
+    cache->read_fds = cache->write_fds = NULL;
+    cache->num_cpus = 0;
+}
+
+/*
+ * msr_cache_fd
+ *
+ * Get the cached file descriptor of the given CPU, opening the device file
+ * if needed. Threads racing to open the same file both open it, and the
+ * loser closes its descriptor again.
+ */
+static int
+msr_cache_fd(msr_fd_cache_t *cache,
+             int            *fds,
+             int             cpu,
+             int             flags)
+{
+    char msr_path[32];
+    int  fd, expected = -1;
+
+    fd = __atomic_load_n(&fds[cpu], __ATOMIC_ACQUIRE);
+    if (fd >= 0)
+        return fd;
+
+    snprintf(msr_path, sizeof(msr_path), cache->backend->path_format, cpu);
+    MSR_STATS_INC(opens);
+    fd = open(msr_path, flags);
+    if (fd < 0)
+        return -1;
+    if (!__atomic_compare_exchange_n(&fds[cpu], &expected, fd, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        close(fd);
+        fd = expected;
+    }
+    return fd;
+}
+
+int
+read_msr_cached(msr_fd_cache_t *cache,
+                int             cpu,
+                uint64_t        address,
+                uint64_t       *value)
+{
+    int fd, err;
+
+    MSR_STATS_INC(reads);
+    if (cache->backend->path_format == NULL || cpu < 0 || cpu >= cache->num_cpus) {
+        err = cache->backend->read(cpu, address, value);
+    } else {
+        fd = msr_cache_fd(cache, cache->read_fds, cpu, O_RDONLY);
+        err = (fd < 0 || pread(fd, value, sizeof(uint64_t), address) != sizeof(uint64_t));
+    }
+    if (err)
+        MSR_STATS_INC(read_failures);
+    return err ? MY_ERROR : 0;
+}
+
+int
+write_msr_cached(msr_fd_cache_t *cache,
+                 int             cpu,
+                 uint64_t        address,
+                 uint64_t        value)
+{
+    int fd, err;
+
+    MSR_STATS_INC(writes);
+    if (cache->backend->path_format == NULL || cpu < 0 || cpu >= cache->num_cpus) {
+        err = cache->backend->write(cpu, address, value);
+    } else {
+        fd = msr_cache_fd(cache, cache->write_fds, cpu, O_WRONLY);
+        err = (fd < 0 || pwrite(fd, &value, sizeof(uint64_t), address) != sizeof(uint64_t));
+    }
+    if (err)
+        MSR_STATS_INC(write_failures);
+    return err ? MY_ERROR : 0;
+}
+
+
+/*
+ * io_uring, driven through the raw system calls to avoid a dependency on
+ * liburing. Only what msr_batch_run() needs: one ring, the device files of
+ * all CPUs registered as fixed files (indexed by CPU), and IORING_OP_READ.
+ * The msr driver reads synchronously, so the kernel hands the reads to its
+ * io-wq workers, which issue the cross-CPU calls in parallel.
+ */
+struct msr_uring_t {
+    int                  fd;
+    unsigned             entries;
+    unsigned            *sq_tail, *sq_mask, *sq_array;
+    unsigned            *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void                *sq_ring, *cq_ring;
+    size_t               sq_ring_size, cq_ring_size, sqes_size;
+    int                  fixed_files; /* fds registered, indexed by CPU */
+    int                 *fds;         /* per CPU, owned by the cache */
+};
+
+static void
+msr_uring_close(struct msr_uring_t *ring)
+{
+    if (ring == NULL)
+        return;
+    if (ring->sqes != NULL)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring != NULL)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    free(ring->fds);
+    free(ring);
+}
+
+static void *
+msr_uring_mmap(int fd, size_t size, off_t offset)
+{
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    return (p == MAP_FAILED) ? NULL : p;
+}
+
+int
+msr_batch_use_uring(msr_batch_t    *batch,
+                    msr_fd_cache_t *cache)
+{
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && defined(__NR_io_uring_register)
+    struct io_uring_params params;
+    struct msr_uring_t    *ring;
+    uint32_t               i, entries;
+    int                    cpu, fd;
+
+    if (batch->uring != NULL)
+        return 0;
+    if (cache->backend->path_format == NULL || batch->num_ops == 0)
+        return MY_ERROR;
+
+    ring = (struct msr_uring_t *) calloc(1, sizeof(struct msr_uring_t));
+    if (ring == NULL)
+        return MY_ERROR;
+    ring->fd = -1;
+    ring->fds = (int *) malloc(cache->num_cpus * sizeof(int));
+    if (ring->fds == NULL)
+        goto fail;
+    for (cpu = 0; cpu < cache->num_cpus; cpu++)
+        ring->fds[cpu] = -1;
+    for (i = 0; i < batch->num_ops; i++) {
+        cpu = batch->ops[i].cpu;
+        if (cpu >= cache->num_cpus)
+            goto fail;
+        fd = msr_cache_fd(cache, cache->read_fds, cpu, O_RDONLY);
+        if (fd < 0)
+            goto fail;
+        ring->fds[cpu] = fd;
+    }
+
+    /* Larger batches are submitted in several rounds */
+    entries = (batch->num_ops < 4096) ? batch->num_ops : 4096;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+        goto fail;
+    ring->entries = params.sq_entries;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = msr_uring_mmap(ring->fd, ring->sq_ring_size, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == NULL)
+        goto fail;
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cq_ring = ring->sq_ring;
+    else
+        ring->cq_ring = msr_uring_mmap(ring->fd, ring->cq_ring_size, IORING_OFF_CQ_RING);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe *) msr_uring_mmap(ring->fd, ring->sqes_size, IORING_OFF_SQES);
+    if (ring->cq_ring == NULL || ring->sqes == NULL)
+        goto fail;
+
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + params.cq_off.cqes);
+
+    /* Fixed files save the fd lookup of every read. Tables with unused (-1)
+     * slots need Linux 5.5; older kernels get the plain fds. */
+    ring->fixed_files = (0 == syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES,
+                                      ring->fds, cache->num_cpus));
+
+    batch->uring = ring;
+    return 0;
+
+fail:
+    msr_uring_close(ring);
+    return MY_ERROR;
+#else
+    (void)batch;
+    (void)cache;
+    return MY_ERROR;
+#endif
+}
+
+/*
+ * Submit all reads of the batch, in rounds of at most ring->entries, and wait
+ * for their completions. Returns MY_ERROR if io_uring failed as a whole (the
+ * ring is then dropped and the caller falls back to single reads).
+ */
+static int
+msr_uring_run(msr_batch_t *batch)
+{
+#if defined(__NR_io_uring_enter)
+    struct msr_uring_t  *ring = batch->uring;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    msr_batch_op_t      *op;
+    uint32_t             start, count, i, reaped;
+    unsigned             tail, head;
+    long                 ret;
+    int                  unsupported = 0;
+
+    for (start = 0; start < batch->num_ops; start += count) {
+        count = batch->num_ops - start;
+        if (count > ring->entries)
+            count = ring->entries;
+
+        tail = *ring->sq_tail;
+        for (i = 0; i < count; i++) {
+            unsigned index = (tail + i) & *ring->sq_mask;
+
+            op = &batch->ops[start + i];
+            sqe = &ring->sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = ring->fixed_files ? op->cpu : ring->fds[op->cpu];
+            sqe->flags = ring->fixed_files ? IOSQE_FIXED_FILE : 0;
+            sqe->addr = (uint64_t)(uintptr_t)&op->msrdata;
+            sqe->len = sizeof(uint64_t);
+            sqe->off = op->msr;
+            sqe->user_data = start + i;
+            ring->sq_array[index] = index;
+        }
+        __atomic_store_n(ring->sq_tail, tail + count, __ATOMIC_RELEASE);
+
+        MSR_STATS_INC(batches);
+        do {
+            ret = syscall(__NR_io_uring_enter, ring->fd, count, count, IORING_ENTER_GETEVENTS, NULL, 0);
+        } while (ret < 0 && errno == EINTR);
+        if (ret < 0)
+            goto fail;
+
+        for (reaped = 0; reaped < count; ) {
+            head = *ring->cq_head;
+            if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+                ret = syscall(__NR_io_uring_enter, ring->fd, 0, count - reaped, IORING_ENTER_GETEVENTS, NULL, 0);
+                if (ret < 0 && errno != EINTR)
+                    goto fail;
+                continue;
+            }
+            cqe = &ring->cqes[head & *ring->cq_mask];
+            op = &batch->ops[cqe->user_data];
+            op->err = (cqe->res == sizeof(uint64_t)) ? 0 : (cqe->res < 0 ? cqe->res : -EIO);
+            unsupported |= (cqe->res == -EINVAL);
+            MSR_STATS_INC(reads);
+            if (op->err != 0)
+                MSR_STATS_INC(read_failures);
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+            reaped++;
+        }
+        /* IORING_OP_READ needs Linux 5.6 */
+        if (unsupported)
+            goto fail;
+    }
+    return 0;
+
+fail:
+#endif
+    msr_uring_close(batch->uring);
+    batch->uring = NULL;
+    return MY_ERROR;
+}
+
+static int
+msr_batch_ioctl(int                fd,
+                msr_batch_array_t *array)
+{
+    return ioctl(fd, X86_IOC_MSR_BATCH, array);
+}
+
+int
+msr_batch_init(msr_batch_t *batch,
+               uint32_t     max_ops,
+               const char  *device)
+{
+    batch->ops = (msr_batch_op_t *) calloc(max_ops, sizeof(msr_batch_op_t));
+    batch->num_ops = 0;
+    batch->max_ops = max_ops;
+    batch->submit = msr_batch_ioctl;
+    batch->fd = -1;
+    batch->uring = NULL;
+    if (batch->ops == NULL && max_ops > 0)
+        return MY_ERROR;
+    if (device != NULL) {
+        MSR_STATS_INC(opens);
+        batch->fd = open(device, O_RDWR);
+    }
+    return 0;
+}
+
+int
+msr_batch_add_read(msr_batch_t *batch,
+                   int          cpu,
+                   uint64_t     address)
+{
+    msr_batch_op_t *op;
+
+    if (batch->num_ops >= batch->max_ops)
+        return MY_ERROR;
+    op = &batch->ops[batch->num_ops];
+    op->cpu = (uint16_t)cpu;
+    op->isrdmsr = 1;
+    op->msr = (uint32_t)address;
+    return (int)batch->num_ops++;
+}
+
+int
+msr_batch_run(msr_batch_t    *batch,
+              msr_fd_cache_t *fallback)
+{
+    msr_batch_array_t array;
+    uint32_t          i;
+    int               err = MY_ERROR, op_failed = 0;
+
+    if (batch->num_ops == 0)
+        return 0;
+
+    for (i = 0; i < batch->num_ops; i++) {
+        batch->ops[i].err = 0;
+        batch->ops[i].msrdata = 0;
+    }
+
+    if (batch->fd >= 0) {
+        array.numops = batch->num_ops;
+        array.ops = batch->ops;
+        MSR_STATS_INC(batches);
+        err = batch->submit(batch->fd, &array);
+        /* msr-safe fails the ioctl if any operation failed, but still
+         * reports the results of the others. Only an error without any
+         * failed operation means the batch as a whole was rejected. */
+        for (i = 0; i < batch->num_ops; i++)
+            op_failed |= (batch->ops[i].err != 0);
+        if (err == 0 || op_failed) {
+            for (i = 0; i < batch->num_ops; i++) {
+                MSR_STATS_INC(reads);
+                if (batch->ops[i].err != 0)
+                    MSR_STATS_INC(read_failures);
+            }
+            return 0;
+        }
+        /* Don't try again (e.g. an msr-safe without batch support) */
+        close(batch->fd);
+        batch->fd = -1;
+    }
+
+    if (batch->uring != NULL && 0 == msr_uring_run(batch))
+        return 0;
+
+    if (fallback == NULL)
+        return MY_ERROR;
+    for (i = 0; i < batch->num_ops; i++) {
+        msr_batch_op_t *op = &batch->ops[i];
+        if (read_msr_cached(fallback, op->cpu, op->msr, &op->msrdata))
+            op->err = -1;
+    }
+    return 0;
+}
+
+int
+msr_batch_result(const msr_batch_t *batch,
+                 int                op,
+                 uint64_t          *value)
+{
+    if (op < 0 || (uint32_t)op >= batch->num_ops || batch->ops[op].err != 0)
+        return MY_ERROR;
+    *value = batch->ops[op].msrdata;
+    return 0;
+}
+
+void
+msr_batch_close(msr_batch_t *batch)
+{
+    if (batch->fd >= 0)
+        close(batch->fd);
+    msr_uring_close(batch->uring);
+    batch->uring = NULL;
+
+    free(batch->ops);
+    batch->ops = NULL;
+    batch->num_ops = batch->max_ops = 0;
+    batch->fd = -1;
+}
@@ -16,6 +16,7 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 #define _h_msr_t
 
 #include <stdint.h>
+#include <sys/ioctl.h>
 
 #define MY_ERROR -1
 
@@ -23,7 +24,13 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
  * less than 31 (will get invalid numbers if 31 or greater) */
 #define B2POW(e) (((e) == 0) ? 1 : (2 << ((e) - 1)))
 
+/* Architectural */
+#define MSR_IA32_TIME_STAMP_COUNTER 0x010 /* Time-Stamp Counter (R/W) */
+#define MSR_IA32_MPERF              0x0e7 /* Maximum Performance Frequency Clock Count (R/W) */
+#define MSR_IA32_APERF              0x0e8 /* Actual Performance Frequency Clock Count (R/W) */
+
 /* General (Sandy Bridge Client/Server) */
+
 #define MSR_RAPL_POWER_UNIT 0x606 /* Unit Multiplier used in RAPL Interfaces (R/O) */
 
 /* PKG (Sandy Bridge Client/Server) */
@@ -49,7 +56,19 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 #define MSR_RAPL_PP1_ENERGY_STATUS 0x641 /* PP1 Energy Status (R/O) */
 #define MSR_RAPL_PP1_POLICY        0x642 /* PP1 Balance Policy (R/W) */
 
+/* Uncore (Haswell Server and later) */
+#define MSR_UNCORE_RATIO_LIMIT 0x620 /* Uncore Ratio Limit (R/W) */
+#define MSR_UNCORE_PERF_STATUS 0x621 /* Uncore Perf Status (R/O) */
+
+/* AMD Family 17h and later (Zen). The unit register has the same layout as
+ * MSR_RAPL_POWER_UNIT, and the energy registers the same as the Intel energy
+ * status registers. There are no power limit or DRAM registers. */
+#define MSR_AMD_RAPL_POWER_UNIT    0xc0010299 /* Unit Multiplier used in RAPL Interfaces (R/O) */
+#define MSR_AMD_CORE_ENERGY_STATUS 0xc001029a /* Per-core Energy Status (R/O) */
+#define MSR_AMD_PKG_ENERGY_STATUS  0xc001029b /* PKG Energy Status (R/O) */
+
 /* Common MSR Structures */
+
 typedef struct rapl_power_limit_control_msr_t {
     uint64_t power_limit         : 15;
     uint64_t limit_enabled       : 1;
@@ -91,6 +110,19 @@ typedef struct balance_policy_msr_t {
 } balance_policy_msr_t;
 
 
+/* Uncore ratios are in units of 100 MHz */
+typedef struct uncore_ratio_limit_msr_t {
+    uint64_t max_ratio : 7;
+    uint64_t           : 1;
+    uint64_t min_ratio : 7;
+    uint64_t           : 49;
+} uncore_ratio_limit_msr_t;
+
+typedef struct uncore_perf_status_msr_t {
+    uint64_t current_ratio : 7;
+    uint64_t               : 57;
+} uncore_perf_status_msr_t;
+
 /* General */
 typedef struct rapl_unit_multiplier_msr_t {
     uint64_t power  : 4;
@@ -147,6 +179,76 @@ typedef performance_throttling_status_msr_t dram_performance_throttling_status_m
  * Then use the read_msr_t/write_msr_t functions and extract_bit functions to get the info you need.
  */
 
+struct msr_batch_array_t;
+
+/**
+ * MSR access backend.
+ *
+ * All MSR accesses are routed through the currently installed backend. The
+ * default backend uses the /dev/cpu/N/msr device files provided by the msr
+ * kernel module; other backends (e.g. the in-memory mock in msr-mock.h, for
+ * testing the power limiting code without touching real hardware) can be
+ * installed with set_msr_backend().
+ */
+typedef struct msr_backend_t {
+    const char *name;
+    int (*read)(int cpu, uint64_t address, uint64_t *val);
+    int (*write)(int cpu, uint64_t address, uint64_t val);
+    /* printf format of the per-CPU device file, if the backend is file
+     * based; lets an msr_fd_cache_t keep the files open. May be NULL. */
+    const char *path_format;
+    /* Device accepting X86_IOC_MSR_BATCH, if the backend can batch accesses
+     * (see msr_batch_t). May be NULL. */
+    const char *batch_device;
+    /* Submits a batch to the batch_device (see msr_batch_t). NULL: the
+     * X86_IOC_MSR_BATCH ioctl. */
+    int       (*batch_submit)(int fd, struct msr_batch_array_t *array);
+    /* Non-zero if batches are submitted as one set of asynchronous reads of
+     * the path_format files through io_uring (see msr_batch_use_uring()). */
+    int         uring;
+} msr_backend_t;
+
+/**
+ * Install the given MSR backend. Passing NULL restores the default backend.
+ */
+void set_msr_backend(const msr_backend_t *backend);
+
+/**
+ * Get the currently installed MSR backend.
+ */
+const msr_backend_t *get_msr_backend();
+
+/**
+ * Look up one of the built-in backends by name: "msr" (/dev/cpu/N/msr, the
+ * default), "msr-safe" (/dev/cpu/N/msr_safe), "msr-batch" (msr-safe, with
+ * periodic reads batched through /dev/cpu/msr_batch) or "msr-uring" (msr,
+ * with periodic reads submitted together through io_uring).
+ *
+ * @return            the backend, or NULL if there is no backend of that name
+ */
+const msr_backend_t *find_msr_backend(const char *name);
+
+/**
+ * MSR access statistics, accumulated since startup.
+ *
+ * The counters are updated with atomic increments, so they can be read at any
+ * time without locking.
+ */
+typedef struct msr_stats_t {
+    uint64_t reads;          /* read_msr[_cached]() calls */
+    uint64_t read_failures;  /* read_msr[_cached]() calls that failed */
+    uint64_t writes;         /* write_msr[_cached]() calls */
+    uint64_t write_failures; /* write_msr[_cached]() calls that failed */
+    uint64_t opens;          /* device files opened by the backend */
+    uint64_t batches;        /* batch submissions (X86_IOC_MSR_BATCH ioctls
+                                or io_uring_enter() calls) */
+} msr_stats_t;
+
+/**
+ * Get a snapshot of the MSR access statistics.
+ */
+void get_msr_stats(msr_stats_t *stats);
+
 /**
  * Read the given MSR on the given CPU.
  *
@@ -160,4 +262,132 @@ int read_msr(int cpu, uint64_t address, uint64_t *val);
  * @return            0 on success and MY_ERROR on failure
  */
 int write_msr(int cpu, uint64_t address, uint64_t val);
+
+/**
+ * Cache of open MSR device files, one per CPU.
+ *
+ * read_msr()/write_msr() open and close the device file on every access. A
+ * cache keeps the files of the backend that was installed when it was
+ * initialised open, and accesses them with pread()/pwrite(), which is both
+ * cheaper and safe to use from several threads at once. Backends without a
+ * path_format are called directly.
+ */
+typedef struct msr_fd_cache_t {
+    const msr_backend_t *backend;
+    int                  num_cpus;
+    int                 *read_fds;  /* -1 until first used */
+    int                 *write_fds; /* -1 until first used */
+} msr_fd_cache_t;
+
+/**
+ * Prepare a cache for the given number of CPUs, using the currently
+ * installed backend. No files are opened until they are needed.
+ *
+ * @return            0 on success, MY_ERROR otherwise
+ */
+int msr_cache_init(msr_fd_cache_t *cache, int num_cpus);
+
+/**
+ * Close all files and release the cache.
+ */
+void msr_cache_close(msr_fd_cache_t *cache);
+
+int read_msr_cached(msr_fd_cache_t *cache, int cpu, uint64_t address, uint64_t *value);
+int write_msr_cached(msr_fd_cache_t *cache, int cpu, uint64_t address, uint64_t value);
+
+/**
+ * Batched MSR reads through the msr-safe kernel module.
+ *
+ * msr-safe (https://github.com/LLNL/msr-safe) provides /dev/cpu/msr_batch,
+ * which performs an array of MSR operations on any number of CPUs in a single
+ * ioctl. The structures below mirror the module's <msr_safe.h>.
+ */
+#define MSR_BATCH_DEVICE "/dev/cpu/msr_batch"
+
+typedef struct msr_batch_op_t {
+    uint16_t cpu;     /* in: CPU to execute the operation on */
+    uint16_t isrdmsr; /* in: non-zero for rdmsr, 0 for wrmsr */
+    int32_t  err;     /* out: negative errno if the operation failed */
+    uint32_t msr;     /* in: MSR address */
+    uint64_t msrdata; /* in/out: value written or read */
+    uint64_t wmask;   /* out: write mask applied to wrmsr */
+} msr_batch_op_t;
+
+typedef struct msr_batch_array_t {
+    uint32_t        numops; /* in: number of operations */
+    msr_batch_op_t *ops;    /* in: array of numops operations */
+} msr_batch_array_t;
+
+#define X86_IOC_MSR_BATCH _IOWR('c', 0xA2, msr_batch_array_t)
+
+/**
+ * A fixed list of MSR reads, issued together by msr_batch_run().
+ *
+ * Without a batch device, the reads can instead be submitted together as
+ * asynchronous reads through io_uring (see msr_batch_use_uring()), which lets
+ * the kernel issue the cross-CPU reads in parallel.
+ *
+ * If neither is available, or the batch device rejects the whole batch, the
+ * reads are performed one by one through an msr_fd_cache_t instead. `submit'
+ * issues the ioctl; it can be replaced (e.g. by the backend's batch_submit)
+ * to test the batching code against a fake device.
+ */
+typedef struct msr_batch_t {
+    msr_batch_op_t   *ops;
+    uint32_t          num_ops;
+    uint32_t          max_ops;
+    int               fd;        /* batch device, or -1 */
+    int             (*submit)(int fd, msr_batch_array_t *array);
+    struct msr_uring_t *uring;   /* io_uring state, or NULL */
+} msr_batch_t;
+
+/**
+ * Prepare an empty batch with room for max_ops reads and open the given
+ * batch device (NULL: no device, always fall back to single reads).
+ *
+ * @return            0 on success (even if the device couldn't be opened),
+ *                    MY_ERROR otherwise
+ */
+int msr_batch_init(msr_batch_t *batch, uint32_t max_ops, const char *device);
+
+/**
+ * Append a read of the given MSR on the given CPU.
+ *
+ * @return            the index of the operation, or MY_ERROR if the batch is
+ *                    full
+ */
+int msr_batch_add_read(msr_batch_t *batch, int cpu, uint64_t address);
+
+/**
+ * Submit the reads of the batch through io_uring from now on. Opens the
+ * device files of all CPUs in the batch (through the cache, whose backend
+ * must have a path_format) and registers them with the ring. Call after the
+ * last msr_batch_add_read().
+ *
+ * @return            0 on success, MY_ERROR if io_uring is unavailable (the
+ *                    batch then keeps working without it)
+ */
+int msr_batch_use_uring(msr_batch_t *batch, msr_fd_cache_t *cache);
+
+/**
+ * Perform all reads of the batch, with a single ioctl or io_uring submission
+ * if possible and otherwise one by one through the given cache.
+ *
+ * @return            0 if the batch was run (individual reads may still have
+ *                    failed, see msr_batch_result()), MY_ERROR otherwise
+ */
+int msr_batch_run(msr_batch_t *batch, msr_fd_cache_t *fallback);
+
+/**
+ * Get the result of the given operation of the last msr_batch_run().
+ *
+ * @return            0 on success and MY_ERROR if the read failed
+ */
+int msr_batch_result(const msr_batch_t *batch, int op, uint64_t *value);
+
+/**
+ * Close the batch device and release the batch.
+ */
+void msr_batch_close(msr_batch_t *batch);
+
 #endif
@@ -0,0 +1,514 @@
+/**
+ * collectd - pack.c
+ * Copyright (C) 2015  Nils Steinger
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Author:
+ *   Nils Steinger <git at n-st dot de>
+ **/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pack.h"
+
+/* Widths of the three short forms of a delta of deltas */
+static const int PACK_TIME_WIDTHS[3] = { 8, 14, 20 };
+static const int PACK_ENERGY_WIDTHS[3] = { 6, 10, 16 };
+
+typedef struct pack_bits_t {
+    uint8_t       *buf;   /* writer */
+    const uint8_t *in;    /* reader */
+    size_t         size;
+    size_t         pos;
+    uint64_t       acc;
+    int            n;     /* bits pending in acc */
+    int            overrun;
+} pack_bits_t;
+
+static void pack_put (pack_bits_t *b, uint64_t value, int bits)
+{
+    if (bits > 32) {
+        pack_put (b, value >> 32, bits - 32);
+        value &= 0xffffffff;
+        bits = 32;
+    }
+    b->acc = (b->acc << bits) | (value & ((1ULL << bits) - 1));
+    b->n += bits;
+    while (b->n >= 8) {
+        b->n -= 8;
+        b->buf[b->pos++] = (uint8_t) (b->acc >> b->n);
+    }
+}
+
+static void pack_flush (pack_bits_t *b)
+{
+    if (b->n > 0)
+        pack_put (b, 0, 8 - b->n);
+}
+
+static uint64_t pack_get (pack_bits_t *b, int bits)
+{
+    uint64_t value;
+
+    if (bits > 32) {
+        value = pack_get (b, bits - 32) << 32;
+        return value | pack_get (b, 32);
+    }
+    while (b->n < bits) {
+        if (b->pos < b->size) {
+            b->acc = (b->acc << 8) | b->in[b->pos++];
+        } else {
+            b->acc <<= 8;
+            b->overrun = 1;
+        }
+        b->n += 8;
+    }
+    b->n -= bits;
+    return (b->acc >> b->n) & ((1ULL << bits) - 1);
+}
+
+static uint64_t pack_zigzag (int64_t value)
+{
+    return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+}
+
+static int64_t pack_unzigzag (uint64_t value)
+{
+    return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+}
+
+static void pack_put_delta (pack_bits_t *b, int64_t dod, const int *widths)
+{
+    uint64_t z = pack_zigzag (dod);
+    int i;
+
+    if (z == 0) {
+        pack_put (b, 0, 1);
+        return;
+    }
+    for (i = 0; i < 3; i++) {
+        if (z < (1ULL << widths[i])) {
+            /* i+1 ones and a zero */
+            pack_put (b, ((1ULL << (i + 1)) - 1) << 1, i + 2);
+            pack_put (b, z, widths[i]);
+            return;
+        }
+    }
+    pack_put (b, 0xf, 4);
+    pack_put (b, z, 64);
+}
+
+static int64_t pack_get_delta (pack_bits_t *b, const int *widths)
+{
+    int i;
+
+    for (i = 0; i < 4; i++)
+        if (pack_get (b, 1) == 0)
+            break;
+    if (i == 0)
+        return 0;
+    return pack_unzigzag (pack_get (b, (i < 4) ? widths[i - 1] : 64));
+}
+
+static void pack_reset (rapl_pack_state_t *state)
+{
+    uint32_t i;
+
+    /* Nodes are usually sampled in order, one record each */
+    for (i = 0; i < RAPL_PACK_MAX_NODES; i++) {
+        state->nodes[i].seen = 0;
+        state->nodes[i].domain_mask = 0;
+        state->next_node[i] = i + 1;
+    }
+    state->next_node[RAPL_PACK_MAX_NODES] = 0;
+    state->prev_node = RAPL_PACK_MAX_NODES;
+}
+
+size_t
+pack_encode (rapl_pack_state_t *state, const rapl_trace_record_t *records, size_t count, uint8_t *out)
+{
+    pack_bits_t b = { .buf = out };
+    const rapl_trace_record_t *r;
+    rapl_pack_node_t *s;
+    uint64_t delta;
+    size_t i;
+    int domain;
+
+    pack_reset (state);
+    for (i = 0; i < count; i++) {
+        r = &records[i];
+        if (r->node >= RAPL_PACK_MAX_NODES) {
+            errno = EINVAL;
+            return 0;
+        }
+        s = &state->nodes[r->node];
+
+        if (r->node == state->next_node[state->prev_node]) {
+            pack_put (&b, 0, 1);
+        } else {
+            pack_put (&b, 1, 1);
+            pack_put (&b, r->node, 32);
+            state->next_node[state->prev_node] = r->node;
+        }
+        state->prev_node = r->node;
+
+        if (r->domain_mask == s->domain_mask) {
+            pack_put (&b, 0, 1);
+        } else {
+            pack_put (&b, 1, 1);
+            pack_put (&b, r->domain_mask, RAPL_NR_DOMAIN);
+            s->domain_mask = r->domain_mask;
+        }
+
+        if (!(s->seen & (1 << RAPL_NR_DOMAIN))) {
+            pack_put (&b, r->time_ns, 64);
+            s->time_delta = 0;
+            s->seen |= 1 << RAPL_NR_DOMAIN;
+        } else {
+            delta = r->time_ns - s->time_ns;
+            pack_put_delta (&b, (int64_t) (delta - s->time_delta), PACK_TIME_WIDTHS);
+            s->time_delta = delta;
+        }
+        s->time_ns = r->time_ns;
+
+        for (domain = 0; domain < RAPL_NR_DOMAIN; domain++) {
+            if (!(r->domain_mask & (1 << domain)))
+                continue;
+            if (!(s->seen & (1 << domain))) {
+                pack_put (&b, r->energy_raw[domain], 64);
+                s->energy_delta[domain] = 0;
+                s->seen |= 1 << domain;
+            } else {
+                delta = r->energy_raw[domain] - s->energy_raw[domain];
+                pack_put_delta (&b, (int64_t) (delta - s->energy_delta[domain]), PACK_ENERGY_WIDTHS);
+                s->energy_delta[domain] = delta;
+            }
+            s->energy_raw[domain] = r->energy_raw[domain];
+        }
+    }
+    pack_flush (&b);
+    return b.pos;
+}
+
+int
+pack_decode (rapl_pack_state_t *state, const uint8_t *in, size_t size, rapl_trace_record_t *records, size_t count)
+{
+    pack_bits_t b = { .in = in, .size = size };
+    rapl_trace_record_t *r;
+    rapl_pack_node_t *s;
+    uint32_t node;
+    size_t i;
+    int domain;
+
+    pack_reset (state);
+    for (i = 0; i < count && !b.overrun; i++) {
+        r = &records[i];
+
+        if (pack_get (&b, 1) == 0) {
+            node = state->next_node[state->prev_node];
+        } else {
+            node = (uint32_t) pack_get (&b, 32);
+            state->next_node[state->prev_node] = node;
+        }
+        if (node >= RAPL_PACK_MAX_NODES)
+            return MY_ERROR;
+        state->prev_node = node;
+        s = &state->nodes[node];
+        r->node = node;
+
+        if (pack_get (&b, 1) == 1)
+            s->domain_mask = (uint32_t) pack_get (&b, RAPL_NR_DOMAIN);
+        r->domain_mask = s->domain_mask;
+
+        if (!(s->seen & (1 << RAPL_NR_DOMAIN))) {
+            s->time_ns = pack_get (&b, 64);
+            s->time_delta = 0;
+            s->seen |= 1 << RAPL_NR_DOMAIN;
+        } else {
+            s->time_delta += (uint64_t) pack_get_delta (&b, PACK_TIME_WIDTHS);
+            s->time_ns += s->time_delta;
+        }
+        r->time_ns = s->time_ns;
+
+        for (domain = 0; domain < RAPL_NR_DOMAIN; domain++) {
+            if (!(r->domain_mask & (1 << domain))) {
+                r->energy_raw[domain] = 0;
+                continue;
+            }
+            if (!(s->seen & (1 << domain))) {
+                s->energy_raw[domain] = pack_get (&b, 64);
+                s->energy_delta[domain] = 0;
+                s->seen |= 1 << domain;
+            } else {
+                s->energy_delta[domain] += (uint64_t) pack_get_delta (&b, PACK_ENERGY_WIDTHS);
+                s->energy_raw[domain] += s->energy_delta[domain];
+            }
+            r->energy_raw[domain] = s->energy_raw[domain];
+        }
+    }
+    return b.overrun ? MY_ERROR : 0;
+}
+
+/* Encode and write the records of the current block */
+static int pack_write_block (rapl_pack_writer_t *w)
+{
+    rapl_pack_block_t block, *index;
+    size_t bytes;
+    uint32_t i;
+
+    if (w->count == 0)
+        return 0;
+
+    bytes = pack_encode (w->state, w->records, w->count, w->buffer);
+    if (bytes == 0)
+        return MY_ERROR;
+
+    memset (&block, 0, sizeof (block));
+    block.first_time_ns = w->records[0].time_ns;
+    for (i = 0; i < w->count; i++)
+        if (w->records[i].time_ns > block.last_time_ns)
+            block.last_time_ns = w->records[i].time_ns;
+    block.records = w->count;
+    block.bytes = (uint32_t) bytes;
+
+    if (fwrite (&block, sizeof (block), 1, w->fp) != 1
+            || fwrite (w->buffer, bytes, 1, w->fp) != 1)
+        return MY_ERROR;
+    block.offset = w->offset + sizeof (block);
+    w->offset += sizeof (block) + bytes;
+
+    if (w->num_blocks == w->index_size) {
+        index = realloc (w->index, 2 * (w->index_size + 8) * sizeof (*index));
+        if (index == NULL)
+            return MY_ERROR;
+        w->index = index;
+        w->index_size = 2 * (w->index_size + 8);
+    }
+    w->index[w->num_blocks++] = block;
+    w->count = 0;
+    return 0;
+}
+
+static void pack_free_writer (rapl_pack_writer_t *w)
+{
+    if (w->fp != NULL)
+        fclose (w->fp);
+    free (w->state);
+    free (w->records);
+    free (w->buffer);
+    free (w->index);
+    memset (w, 0, sizeof (*w));
+}
+
+int
+pack_create (rapl_pack_writer_t *w, const char *path, uint32_t block_records,
+        double energy_unit_J, double dram_energy_unit_J, uint64_t ref_realtime_ns,
+        uint64_t ref_monotonic_ns)
+{
+    rapl_pack_header_t h;
+
+    memset (w, 0, sizeof (*w));
+    w->block_records = (block_records > 0) ? block_records : RAPL_PACK_BLOCK_RECORDS;
+    w->state = malloc (sizeof (*w->state));
+    w->records = malloc (w->block_records * sizeof (*w->records));
+    w->buffer = malloc (RAPL_PACK_MAX_BYTES (w->block_records));
+    if (w->state == NULL || w->records == NULL || w->buffer == NULL) {
+        pack_free_writer (w);
+        errno = ENOMEM;
+        return MY_ERROR;
+    }
+
+    w->fp = fopen (path, "wb");
+    if (w->fp == NULL) {
+        pack_free_writer (w);
+        return MY_ERROR;
+    }
+
+    memset (&h, 0, sizeof (h));
+    memcpy (h.magic, RAPL_PACK_MAGIC, sizeof (h.magic));
+    h.version = RAPL_PACK_VERSION;
+    h.block_records = w->block_records;
+    h.energy_unit_J = energy_unit_J;
+    h.dram_energy_unit_J = dram_energy_unit_J;
+    h.ref_realtime_ns = ref_realtime_ns;
+    h.ref_monotonic_ns = ref_monotonic_ns;
+    if (fwrite (&h, sizeof (h), 1, w->fp) != 1) {
+        pack_free_writer (w);
+        return MY_ERROR;
+    }
+    w->offset = sizeof (h);
+    return 0;
+}
+
+int
+pack_append (rapl_pack_writer_t *w, const rapl_trace_record_t *record)
+{
+    if (record->node >= RAPL_PACK_MAX_NODES) {
+        errno = EINVAL;
+        return MY_ERROR;
+    }
+    w->records[w->count++] = *record;
+    if (w->count == w->block_records)
+        return pack_write_block (w);
+    return 0;
+}
+
+int
+pack_finish (rapl_pack_writer_t *w)
+{
+    rapl_pack_footer_t footer;
+    int err;
+
+    err = pack_write_block (w);
+    if (!err) {
+        memset (&footer, 0, sizeof (footer));
+        footer.index_offset = w->offset;
+        footer.num_blocks = w->num_blocks;
+        memcpy (footer.magic, RAPL_PACK_MAGIC, sizeof (footer.magic));
+        if ((w->num_blocks > 0 && fwrite (w->index, sizeof (*w->index), w->num_blocks, w->fp) != w->num_blocks)
+                || fwrite (&footer, sizeof (footer), 1, w->fp) != 1)
+            err = MY_ERROR;
+    }
+    if (0 != fclose (w->fp))
+        err = MY_ERROR;
+    w->fp = NULL;
+    pack_free_writer (w);
+    return err;
+}
+
+/* Rebuild the index of a file without one from the block headers */
+static int pack_scan_blocks (rapl_pack_reader_t *r)
+{
+    rapl_pack_block_t block, *index;
+    uint64_t size = 0;
+    long offset = sizeof (rapl_pack_header_t);
+    long end;
+
+    if (fseek (r->fp, 0, SEEK_END) != 0 || (end = ftell (r->fp)) < 0)
+        return MY_ERROR;
+
+    /* Up to the first incomplete block */
+    while (fseek (r->fp, offset, SEEK_SET) == 0 && fread (&block, sizeof (block), 1, r->fp) == 1) {
+        if (block.records == 0 || block.records > r->header.block_records
+                || block.bytes > RAPL_PACK_MAX_BYTES (block.records)
+                || offset + (long) sizeof (block) + (long) block.bytes > end)
+            break;
+
+        if (r->num_blocks == size) {
+            index = realloc (r->index, 2 * (size + 8) * sizeof (*index));
+            if (index == NULL)
+                return MY_ERROR;
+            r->index = index;
+            size = 2 * (size + 8);
+        }
+        block.offset = offset + sizeof (block);
+        r->index[r->num_blocks++] = block;
+        offset += sizeof (block) + block.bytes;
+    }
+    return 0;
+}
+
+int
+pack_open (rapl_pack_reader_t *r, const char *path)
+{
+    rapl_pack_footer_t footer;
+    int valid;
+
+    memset (r, 0, sizeof (*r));
+    r->fp = fopen (path, "rb");
+    if (r->fp == NULL)
+        return MY_ERROR;
+
+    valid = (fread (&r->header, sizeof (r->header), 1, r->fp) == 1
+            && memcmp (r->header.magic, RAPL_PACK_MAGIC, sizeof (r->header.magic)) == 0
+            && r->header.version == RAPL_PACK_VERSION
+            && r->header.block_records > 0);
+    if (valid) {
+        r->state = malloc (sizeof (*r->state));
+        r->records = malloc (r->header.block_records * sizeof (*r->records));
+        r->buffer = malloc (RAPL_PACK_MAX_BYTES (r->header.block_records));
+        if (r->state == NULL || r->records == NULL || r->buffer == NULL) {
+            pack_close (r);
+            errno = ENOMEM;
+            return MY_ERROR;
+        }
+    }
+
+    if (valid && fseek (r->fp, -(long) sizeof (footer), SEEK_END) == 0
+            && fread (&footer, sizeof (footer), 1, r->fp) == 1
+            && memcmp (footer.magic, RAPL_PACK_MAGIC, sizeof (footer.magic)) == 0) {
+        r->index = malloc ((footer.num_blocks + 1) * sizeof (*r->index));
+        valid = (r->index != NULL && fseek (r->fp, (long) footer.index_offset, SEEK_SET) == 0
+                && fread (r->index, sizeof (*r->index), footer.num_blocks, r->fp) == footer.num_blocks);
+        r->num_blocks = footer.num_blocks;
+    } else if (valid) {
+        valid = (0 == pack_scan_blocks (r));
+    }
+
+    if (!valid) {
+        pack_close (r);
+        errno = EINVAL;
+        return MY_ERROR;
+    }
+    return 0;
+}
+
+void
+pack_seek (rapl_pack_reader_t *r, uint64_t time_ns)
+{
+    uint64_t i;
+
+    for (i = 0; i < r->num_blocks; i++)
+        if (r->index[i].last_time_ns >= time_ns)
+            break;
+    r->block = i;
+    r->count = r->next = 0;
+}
+
+int
+pack_next (rapl_pack_reader_t *r, rapl_trace_record_t *record)
+{
+    rapl_pack_block_t *block;
+
+    if (r->next == r->count) {
+        if (r->block >= r->num_blocks)
+            return 0;
+        block = &r->index[r->block++];
+        if (block->records > r->header.block_records
+                || block->bytes > RAPL_PACK_MAX_BYTES (block->records)
+                || fseek (r->fp, (long) block->offset, SEEK_SET) != 0
+                || fread (r->buffer, 1, block->bytes, r->fp) != block->bytes
+                || 0 != pack_decode (r->state, r->buffer, block->bytes, r->records, block->records))
+            return MY_ERROR;
+        r->count = block->records;
+        r->next = 0;
+    }
+    *record = r->records[r->next++];
+    return 1;
+}
+
+void
+pack_close (rapl_pack_reader_t *r)
+{
+    if (r->fp != NULL)
+        fclose (r->fp);
+    free (r->state);
+    free (r->index);
+    free (r->records);
+    free (r->buffer);
+    memset (r, 0, sizeof (*r));
+}
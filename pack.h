@@ -0,0 +1,175 @@
+/**
+ * collectd - pack.h
+ * Copyright (C) 2015  Nils Steinger
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Author:
+ *   Nils Steinger <git at n-st dot de>
+ **/
+
+#ifndef _h_pack
+#define _h_pack
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "trace.h"
+
+/*
+ * Compressed files of raw energy samples (rapl_trace_record_t), for
+ * exporting high-rate traces from rapl-sample or rapl-trace.
+ *
+ * Records are encoded in blocks of up to block_records records, as a bit
+ * stream in the spirit of Facebook's Gorilla:
+ *
+ *   node         '0' if it is the node that followed the previous record's
+ *                node last time, else '1' and 32 bits
+ *   domain_mask  '0' if unchanged for the node, else '1' and 4 bits
+ *   time_ns      per node, the delta of the deltas ("delta-of-delta")
+ *   energy_raw   per node and valid domain, the delta of the deltas
+ *
+ * Signed deltas of deltas are zigzag-encoded and stored with a prefix
+ * selecting the width: '0' (zero), '10', '110', '1110' with three
+ * increasing widths, or '1111' and 64 bits. The first record of a node in a
+ * block stores its time and registers in full instead, so every block can be
+ * decoded on its own. At 1 kHz with a few microseconds of jitter, a record
+ * takes about 2 bytes per register value.
+ *
+ * File layout (host byte order):
+ *
+ *   rapl_pack_header_t
+ *   for each block: rapl_pack_block_t, then `bytes' bytes of bit stream
+ *   rapl_pack_block_t[num_blocks]  index, with the blocks' file offsets
+ *   rapl_pack_footer_t
+ *
+ * A file whose writer didn't get to write the index (e.g. it was killed) is
+ * still readable: the reader then walks the block headers instead.
+ */
+
+#define RAPL_PACK_MAGIC        "RAPLPAK1"
+#define RAPL_PACK_VERSION      1
+#define RAPL_PACK_MAX_NODES    256  /* nodes 0 ... RAPL_PACK_MAX_NODES-1 */
+#define RAPL_PACK_BLOCK_RECORDS 1024 /* default */
+
+/* Upper bound of the encoded size of `count' records */
+#define RAPL_PACK_MAX_BYTES(count) ((size_t) (count) * (16 + 9 * (RAPL_NR_DOMAIN + 1)) + 8)
+
+typedef struct rapl_pack_header_t {
+    char     magic[8];
+    uint32_t version;
+    uint32_t block_records;    /* maximum records per block */
+    double   energy_unit_J;    /* Joules per raw energy status unit */
+    /* reference point to convert time_ns to wall clock time */
+    uint64_t ref_realtime_ns;
+    uint64_t ref_monotonic_ns;
+    double   dram_energy_unit_J; /* Joules per raw DRAM energy status unit */
+    uint64_t reserved[2];
+} rapl_pack_header_t;
+
+typedef struct rapl_pack_block_t {
+    uint64_t first_time_ns;    /* of the first record */
+    uint64_t last_time_ns;     /* highest time_ns in the block */
+    uint64_t offset;           /* of the bit stream (in the index only) */
+    uint32_t records;
+    uint32_t bytes;            /* of the bit stream */
+} rapl_pack_block_t;
+
+typedef struct rapl_pack_footer_t {
+    uint64_t index_offset;
+    uint64_t num_blocks;
+    char     magic[8];
+} rapl_pack_footer_t;
+
+/* Encoder or decoder state, reset at the start of every block */
+typedef struct rapl_pack_node_t {
+    uint64_t time_ns;
+    uint64_t time_delta;       /* deltas wrap around like the values */
+    uint64_t energy_raw[RAPL_NR_DOMAIN];
+    uint64_t energy_delta[RAPL_NR_DOMAIN];
+    uint32_t domain_mask;
+    uint32_t seen;             /* bit RAPL_NR_DOMAIN: time, bit n: domain n */
+} rapl_pack_node_t;
+
+typedef struct rapl_pack_state_t {
+    rapl_pack_node_t nodes[RAPL_PACK_MAX_NODES];
+    uint32_t next_node[RAPL_PACK_MAX_NODES + 1]; /* predicted successor */
+    uint32_t prev_node;
+} rapl_pack_state_t;
+
+/* Encode `count' records into out, which must have room for
+ * RAPL_PACK_MAX_BYTES(count) bytes. Returns the number of bytes used, or 0
+ * with errno set to EINVAL if a record's node is out of range. */
+size_t pack_encode(rapl_pack_state_t *state, const rapl_trace_record_t *records, size_t count, uint8_t *out);
+
+/* Decode `count' records from `size' bytes. Returns 0 on success, MY_ERROR
+ * if the input is truncated or corrupt. */
+int pack_decode(rapl_pack_state_t *state, const uint8_t *in, size_t size, rapl_trace_record_t *records, size_t count);
+
+typedef struct rapl_pack_writer_t {
+    FILE                *fp;
+    rapl_pack_state_t   *state;
+    rapl_trace_record_t *records;   /* current block */
+    uint32_t             count;
+    uint32_t             block_records;
+    uint8_t             *buffer;
+    rapl_pack_block_t   *index;
+    uint64_t             num_blocks;
+    uint64_t             index_size;
+    uint64_t             offset;    /* of the end of the file */
+} rapl_pack_writer_t;
+
+/* Create (or truncate) a compressed file. block_records of 0 selects
+ * RAPL_PACK_BLOCK_RECORDS. Returns 0 on success, MY_ERROR otherwise (errno
+ * is set). */
+int pack_create(rapl_pack_writer_t *writer, const char *path, uint32_t block_records,
+        double energy_unit_J, double dram_energy_unit_J, uint64_t ref_realtime_ns,
+        uint64_t ref_monotonic_ns);
+
+/* Append a record; a full block is encoded and written. Returns 0 on
+ * success, MY_ERROR otherwise. */
+int pack_append(rapl_pack_writer_t *writer, const rapl_trace_record_t *record);
+
+/* Write the last block, the index and the footer, and close the file.
+ * Returns 0 on success, MY_ERROR otherwise. */
+int pack_finish(rapl_pack_writer_t *writer);
+
+typedef struct rapl_pack_reader_t {
+    FILE                *fp;
+    rapl_pack_header_t   header;
+    rapl_pack_state_t   *state;
+    rapl_pack_block_t   *index;
+    uint64_t             num_blocks;
+    uint64_t             block;     /* next block to decode */
+    rapl_trace_record_t *records;   /* decoded block */
+    uint32_t             count;
+    uint32_t             next;      /* next record to return */
+    uint8_t             *buffer;
+} rapl_pack_reader_t;
+
+/* Open a compressed file and load its index. Returns 0 on success,
+ * MY_ERROR otherwise (errno is set, EINVAL if it isn't a valid file). */
+int pack_open(rapl_pack_reader_t *reader, const char *path);
+
+/* Continue reading at the block that holds the first record at or after
+ * time_ns (or a few records earlier). */
+void pack_seek(rapl_pack_reader_t *reader, uint64_t time_ns);
+
+/* Read the next record. Returns 1 if a record was read, 0 at the end of the
+ * file and MY_ERROR if a block couldn't be read or decoded. */
+int pack_next(rapl_pack_reader_t *reader, rapl_trace_record_t *record);
+
+void pack_close(rapl_pack_reader_t *reader);
+
+#endif
@@ -0,0 +1,409 @@
+/**
+ * collectd - perf.c
+ * Copyright (C) 2015  Nils Steinger
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Author:
+ *   Nils Steinger <git at n-st dot de>
+ **/
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include "rapl.h"
+#include "perf.h"
+
+#define PERF_EVENTS 2 /* instructions (group leader), cycles; CAS reads, writes */
+
+#define PERF_PMU_PATH "/sys/bus/event_source/devices"
+#define PERF_CAS_BYTES 64 /* one cache line per CAS command */
+
+enum { PERF_CPU_NONE, PERF_CPU_OFFLINE, PERF_CPU_OK, PERF_CPU_FAILED };
+
+typedef struct perf_cpu_t {
+    int      state;
+    int      fds[PERF_EVENTS];
+    uint64_t counts[PERF_EVENTS];
+} perf_cpu_t;
+
+/* Layout of a PERF_FORMAT_GROUP read with the enabled/running times */
+typedef struct perf_group_read_t {
+    uint64_t nr;
+    uint64_t time_enabled;
+    uint64_t time_running;
+    uint64_t values[PERF_EVENTS];
+} perf_group_read_t;
+
+/* A group of IMC counters, read on the CPU the PMU designates for a socket */
+typedef struct perf_imc_t {
+    long     cpu;
+    int      fds[PERF_EVENTS];
+    uint64_t counts[PERF_EVENTS];
+    _Bool    ok;
+} perf_imc_t;
+
+static perf_cpu_t *perf_cpus = NULL;
+static long perf_num_cpus = 0;
+
+static perf_imc_t *perf_imcs = NULL;
+static int perf_imc_num = 0;
+
+static int perf_open (uint32_t type, uint64_t config, long cpu, int group_fd)
+{
+    struct perf_event_attr attr;
+
+    memset (&attr, 0, sizeof (attr));
+    attr.size = sizeof (attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = (group_fd < 0);
+    /* Uncore PMUs reject the exclude_* flags */
+    attr.exclude_hv = (type == PERF_TYPE_HARDWARE);
+    attr.read_format = PERF_FORMAT_GROUP
+        | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    return (int) syscall (__NR_perf_event_open, &attr, -1, (int) cpu, group_fd, 0);
+}
+
+/* Open and enable a group of PERF_EVENTS events; fds[0] is the leader. */
+static int perf_open_group (int *fds, uint32_t type, const uint64_t *configs, long cpu)
+{
+    int i;
+
+    for (i = 0; i < PERF_EVENTS; i++) {
+        fds[i] = perf_open (type, configs[i], cpu, (i == 0) ? -1 : fds[0]);
+        if (fds[i] < 0) {
+            while (--i >= 0) {
+                close (fds[i]);
+                fds[i] = -1;
+            }
+            return MY_ERROR;
+        }
+    }
+    ioctl (fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl (fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return 0;
+}
+
+/* Read a group, scaling the counts up if they only ran part of the time. */
+static int perf_read_group (int leader, uint64_t *counts)
+{
+    perf_group_read_t data;
+    int i;
+
+    if (read (leader, &data, sizeof (data)) != sizeof (data) || data.nr != PERF_EVENTS)
+        return MY_ERROR;
+    for (i = 0; i < PERF_EVENTS; i++) {
+        if (data.time_running > 0 && data.time_running < data.time_enabled)
+            counts[i] = (uint64_t) ((double) data.values[i] * data.time_enabled / data.time_running);
+        else
+            counts[i] = data.values[i];
+    }
+    return 0;
+}
+
+static void perf_close_group (int *fds)
+{
+    int i;
+
+    for (i = PERF_EVENTS - 1; i >= 0; i--) {
+        if (fds[i] >= 0)
+            close (fds[i]);
+        fds[i] = -1;
+    }
+}
+
+int
+perf_init (long num_cpus)
+{
+    static const uint64_t configs[PERF_EVENTS] = {
+        PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CPU_CYCLES
+    };
+    long cpu;
+    int i, opened = 0, err = 0;
+
+    perf_cpus = calloc (num_cpus, sizeof (*perf_cpus));
+    if (perf_cpus == NULL)
+        return MY_ERROR;
+    perf_num_cpus = num_cpus;
+
+    for (cpu = 0; cpu < num_cpus; cpu++) {
+        perf_cpu_t *c = &perf_cpus[cpu];
+
+        for (i = 0; i < PERF_EVENTS; i++)
+            c->fds[i] = -1;
+        if (0 == perf_open_group (c->fds, PERF_TYPE_HARDWARE, configs, cpu)) {
+            c->state = PERF_CPU_OK;
+            opened++;
+        } else if (errno == ENODEV) {
+            c->state = PERF_CPU_OFFLINE;
+        } else {
+            c->state = PERF_CPU_NONE;
+            err = errno;
+        }
+    }
+
+    if (opened == 0) {
+        perf_shutdown ();
+        errno = err ? err : ENODEV;
+        return MY_ERROR;
+    }
+    return opened;
+}
+
+int
+perf_read (void)
+{
+    long cpu;
+    int failed = 0;
+
+    for (cpu = 0; cpu < perf_num_cpus; cpu++) {
+        perf_cpu_t *c = &perf_cpus[cpu];
+
+        if (c->state != PERF_CPU_OK && c->state != PERF_CPU_FAILED)
+            continue;
+        if (0 != perf_read_group (c->fds[0], c->counts)) {
+            c->state = PERF_CPU_FAILED;
+            failed++;
+        } else {
+            c->state = PERF_CPU_OK;
+        }
+    }
+    return failed;
+}
+
+int
+perf_get (long cpu, uint64_t *instructions, uint64_t *cycles)
+{
+    if (cpu < 0 || cpu >= perf_num_cpus)
+        return MY_ERROR;
+    switch (perf_cpus[cpu].state) {
+    case PERF_CPU_OFFLINE:
+        *instructions = *cycles = 0;
+        return 0;
+    case PERF_CPU_OK:
+        *instructions = perf_cpus[cpu].counts[0];
+        *cycles = perf_cpus[cpu].counts[1];
+        return 0;
+    default:
+        return MY_ERROR;
+    }
+}
+
+void
+perf_shutdown (void)
+{
+    long cpu;
+
+    for (cpu = 0; perf_cpus != NULL && cpu < perf_num_cpus; cpu++)
+        perf_close_group (perf_cpus[cpu].fds);
+    free (perf_cpus);
+    perf_cpus = NULL;
+    perf_num_cpus = 0;
+}
+
+static ssize_t perf_read_file (const char *path, char *buffer, size_t size)
+{
+    ssize_t len;
+    int fd;
+
+    fd = open (path, O_RDONLY);
+    if (fd < 0)
+        return MY_ERROR;
+    len = read (fd, buffer, size - 1);
+    close (fd);
+    if (len < 0)
+        return MY_ERROR;
+    buffer[len] = '\0';
+    return len;
+}
+
+/*
+ * Translate a named event of a dynamic PMU, like "event=0x04,umask=0x03",
+ * into its config using the PMU's format descriptions ("config:8-15").
+ * Only terms that map to (contiguous bits of) config are supported.
+ */
+static int perf_pmu_event (const char *pmu, const char *event, uint64_t *config)
+{
+    char path[512], buffer[256], format[64];
+    char *term, *value, *save = NULL;
+    unsigned int lo, hi;
+
+    snprintf (path, sizeof (path), PERF_PMU_PATH "/%s/events/%s", pmu, event);
+    if (perf_read_file (path, buffer, sizeof (buffer)) <= 0)
+        return MY_ERROR;
+
+    *config = 0;
+    for (term = strtok_r (buffer, ",\n", &save); term != NULL; term = strtok_r (NULL, ",\n", &save)) {
+        value = strchr (term, '=');
+        if (value == NULL)
+            return MY_ERROR;
+        *value++ = '\0';
+
+        snprintf (path, sizeof (path), PERF_PMU_PATH "/%s/format/%s", pmu, term);
+        if (perf_read_file (path, format, sizeof (format)) <= 0)
+            return MY_ERROR;
+        switch (sscanf (format, "config:%u-%u", &lo, &hi)) {
+        case 1:
+            hi = lo;
+            /* fall through */
+        case 2:
+            break;
+        default:
+            return MY_ERROR;
+        }
+        if (lo > hi || hi > 63)
+            return MY_ERROR;
+        *config |= (strtoull (value, NULL, 0) << lo)
+            & (~0ULL >> (63 - hi)) & (~0ULL << lo);
+    }
+    return 0;
+}
+
+/* Open the CAS counters of one IMC PMU on every CPU in its cpumask (one per
+ * socket). */
+static int perf_imc_open_pmu (const char *pmu)
+{
+    char path[512], buffer[4096], *p;
+    uint64_t configs[PERF_EVENTS];
+    perf_imc_t *imcs;
+    long first, last, cpu;
+    int type, opened = 0;
+
+    snprintf (path, sizeof (path), PERF_PMU_PATH "/%s/type", pmu);
+    if (perf_read_file (path, buffer, sizeof (buffer)) <= 0)
+        return MY_ERROR;
+    type = atoi (buffer);
+    if (0 != perf_pmu_event (pmu, "cas_count_read", &configs[0])
+            || 0 != perf_pmu_event (pmu, "cas_count_write", &configs[1]))
+        return MY_ERROR;
+
+    snprintf (path, sizeof (path), PERF_PMU_PATH "/%s/cpumask", pmu);
+    if (perf_read_file (path, buffer, sizeof (buffer)) <= 0)
+        return MY_ERROR;
+
+    /* A CPU list like "0,28" or "0-1" */
+    for (p = buffer; *p >= '0' && *p <= '9'; ) {
+        first = last = strtol (p, &p, 10);
+        if (*p == '-')
+            last = strtol (p + 1, &p, 10);
+        for (cpu = first; cpu <= last; cpu++) {
+            imcs = realloc (perf_imcs, (perf_imc_num + 1) * sizeof (*perf_imcs));
+            if (imcs == NULL)
+                return MY_ERROR;
+            perf_imcs = imcs;
+            memset (&perf_imcs[perf_imc_num], 0, sizeof (*perf_imcs));
+            perf_imcs[perf_imc_num].cpu = cpu;
+            if (0 != perf_open_group (perf_imcs[perf_imc_num].fds, (uint32_t) type, configs, cpu))
+                return MY_ERROR;
+            perf_imc_num++;
+            opened++;
+        }
+        if (*p == ',')
+            p++;
+    }
+    return opened;
+}
+
+/* uncore_imc or uncore_imc_<n>, not the free-running counters */
+static int perf_is_imc_pmu (const char *name)
+{
+    const char *p = name + strlen ("uncore_imc");
+
+    if (strncmp (name, "uncore_imc", strlen ("uncore_imc")) != 0)
+        return 0;
+    if (*p == '\0')
+        return 1;
+    if (*p++ != '_' || *p == '\0')
+        return 0;
+    while (*p >= '0' && *p <= '9')
+        p++;
+    return *p == '\0';
+}
+
+int
+perf_imc_init (void)
+{
+    DIR *dir;
+    struct dirent *entry;
+    int err = ENOENT;
+
+    dir = opendir (PERF_PMU_PATH);
+    if (dir == NULL)
+        return MY_ERROR;
+    while ((entry = readdir (dir)) != NULL) {
+        if (!perf_is_imc_pmu (entry->d_name))
+            continue;
+        if (perf_imc_open_pmu (entry->d_name) < 0) {
+            err = errno;
+            break;
+        }
+        err = 0;
+    }
+    closedir (dir);
+
+    if (err != 0 || perf_imc_num == 0) {
+        perf_imc_shutdown ();
+        errno = err ? err : ENOENT;
+        return MY_ERROR;
+    }
+    return perf_imc_num;
+}
+
+int
+perf_imc_read (void)
+{
+    int i, failed = 0;
+
+    for (i = 0; i < perf_imc_num; i++) {
+        perf_imcs[i].ok = (0 == perf_read_group (perf_imcs[i].fds[0], perf_imcs[i].counts));
+        failed += !perf_imcs[i].ok;
+    }
+    return failed;
+}
+
+int
+perf_imc_get (int i, long *cpu, uint64_t *read_bytes, uint64_t *write_bytes)
+{
+    if (i < 0 || i >= perf_imc_num)
+        return MY_ERROR;
+    *cpu = perf_imcs[i].cpu;
+    if (!perf_imcs[i].ok)
+        return MY_ERROR;
+    *read_bytes = perf_imcs[i].counts[0] * PERF_CAS_BYTES;
+    *write_bytes = perf_imcs[i].counts[1] * PERF_CAS_BYTES;
+    return 0;
+}
+
+void
+perf_imc_shutdown (void)
+{
+    int i;
+
+    for (i = 0; i < perf_imc_num; i++)
+        perf_close_group (perf_imcs[i].fds);
+    free (perf_imcs);
+    perf_imcs = NULL;
+    perf_imc_num = 0;
+}
+
@@ -0,0 +1,83 @@
+/**
+ * collectd - perf.h
+ * Copyright (C) 2015  Nils Steinger
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Author:
+ *   Nils Steinger <git at n-st dot de>
+ **/
+
+#ifndef _h_perf
+#define _h_perf
+
+#include <stdint.h>
+
+/*
+ * Per-CPU hardware performance counters: retired instructions and unhalted
+ * cycles, opened as one event group per CPU (system-wide, all processes) so
+ * that both are read with a single read() using PERF_FORMAT_GROUP.
+ *
+ * perf_read() reads the groups of all CPUs back to back, so the counts are
+ * as close to one instant as a loop of read()s gets; the caller is expected
+ * to call it right next to its energy readout. Counts are cumulative and
+ * scaled up if the kernel had to multiplex the counters.
+ *
+ * System-wide counting needs CAP_PERFMON (or CAP_SYS_ADMIN), or a
+ * kernel.perf_event_paranoid setting of 0 or lower.
+ */
+
+/* Open and enable the counters of CPUs 0 ... num_cpus-1. CPUs that are
+ * offline are skipped (and count nothing). Returns the number of CPUs with
+ * counters, or MY_ERROR with errno set if none could be opened. */
+int perf_init(long num_cpus);
+
+/* Read the counters of all CPUs. Returns the number of CPUs whose counters
+ * couldn't be read. */
+int perf_read(void);
+
+/* Counts of a CPU as of the last perf_read(). Offline CPUs report zero.
+ * Returns 0 on success, MY_ERROR if the CPU has no counters or its last
+ * read failed. */
+int perf_get(long cpu, uint64_t *instructions, uint64_t *cycles);
+
+/* Close all counters. */
+void perf_shutdown(void);
+
+/*
+ * Memory traffic from the uncore memory controller (IMC) PMUs of server
+ * parts: the cas_count_read and cas_count_write events of every
+ * uncore_imc_<n> PMU, grouped and opened on the CPU the PMU's cpumask names
+ * for each socket. Each CAS command moves one 64-byte cache line. The event
+ * encodings are taken from sysfs, so no model tables are needed.
+ */
+
+/* Open the counters of all IMC PMUs. Returns the number of counter groups
+ * (PMUs times sockets), or MY_ERROR with errno set (ENOENT if there are no
+ * IMC PMUs). */
+int perf_imc_init(void);
+
+/* Read all IMC counters. Returns the number of groups that couldn't be read. */
+int perf_imc_read(void);
+
+/* Cumulative bytes read and written through counter group i (0 ... the
+ * value returned by perf_imc_init()-1) as of the last perf_imc_read(), and
+ * the CPU it is read on. Returns 0 on success, MY_ERROR if i is out of range
+ * (cpu is not set) or its last read failed (cpu is set). */
+int perf_imc_get(int i, long *cpu, uint64_t *read_bytes, uint64_t *write_bytes);
+
+/* Close all IMC counters. */
+void perf_imc_shutdown(void);
+
+#endif
@@ -0,0 +1,253 @@
+/**
+ * collectd - powercap.c
+ * Copyright (C) 2015  Nils Steinger
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Author:
+ *   Nils Steinger <git at n-st dot de>
+ **/
+
+#include <stdlib.h>
+#include <math.h>
+
+#include "rapl.h"
+#include "powercap.h"
+
+typedef struct powercap_node_t {
+    int      managed;     /* 0 if the limit register is locked or unreadable */
+    int      written;     /* original limits have been overwritten */
+    pkg_rapl_power_limit_control_t original;
+    double   min_watts;
+    double   max_watts;
+    double   limit_watts; /* limit currently programmed by us */
+    double   last_write;
+    double   demand_sum;
+    uint64_t demand_samples;
+    double   demand;      /* average power of the last round with samples */
+    int      measured;    /* there were samples this round */
+    double   alloc;       /* scratch space for powercap_distribute() */
+    int      fixed;       /* dito */
+} powercap_node_t;
+
+static rapl_ctx_t *powercap_rapl = NULL;
+static powercap_config_t powercap_config;
+static powercap_node_t *powercap_nodes = NULL;
+static uint64_t powercap_num_nodes = 0;
+static uint64_t powercap_ticks = 0;
+
+int
+powercap_init (rapl_ctx_t *ctx, uint64_t num_nodes, const powercap_config_t *config)
+{
+    uint64_t node;
+    pkg_rapl_parameters_t params;
+
+    if (config->budget_watts <= 0 || config->ticks == 0)
+        return MY_ERROR;
+
+    powercap_nodes = calloc (num_nodes, sizeof (*powercap_nodes));
+    if (powercap_nodes == NULL)
+        return MY_ERROR;
+
+    powercap_rapl = ctx;
+    powercap_config = *config;
+    powercap_num_nodes = num_nodes;
+    powercap_ticks = 0;
+
+    for (node = 0; node < num_nodes; node++) {
+        powercap_node_t *n = &powercap_nodes[node];
+
+        if (0 != get_pkg_rapl_power_limit_control_t (powercap_rapl, node, &n->original))
+            continue;
+        if (n->original.lock_enabled)
+            continue;
+
+        n->min_watts = 0;
+        n->max_watts = config->budget_watts;
+        if (0 == get_pkg_rapl_parameters_t (powercap_rapl, node, &params)) {
+            n->min_watts = params.minimum_power_watts;
+            if (params.maximum_power_watts > 0)
+                n->max_watts = params.maximum_power_watts;
+            else if (params.thermal_spec_power_watts > 0)
+                n->max_watts = params.thermal_spec_power_watts;
+        }
+        if (n->min_watts > n->max_watts)
+            n->min_watts = n->max_watts;
+
+        n->limit_watts = n->original.power_limit_watts_1;
+        n->last_write = -INFINITY;
+        n->managed = 1;
+    }
+
+    return 0;
+}
+
+void
+powercap_update (uint64_t node, double watts)
+{
+    if (powercap_nodes == NULL || node >= powercap_num_nodes)
+        return;
+
+    powercap_nodes[node].demand_sum += watts;
+    powercap_nodes[node].demand_samples++;
+}
+
+/*
+ * Split the budget across all managed packages in proportion to their demand,
+ * keeping every share within the package's [min, max] range. Shares that hit
+ * a bound are fixed and the remainder is redistributed among the others.
+ * Packages without a measurement this round keep their current limit.
+ */
+static void
+powercap_distribute (double budget)
+{
+    uint64_t node, unfixed;
+    uint64_t round;
+    double demand, remaining, share;
+    int changed;
+
+    for (node = 0; node < powercap_num_nodes; node++) {
+        powercap_node_t *n = &powercap_nodes[node];
+        n->fixed = !n->managed || !n->measured;
+        if (n->managed && !n->measured)
+            n->alloc = n->limit_watts;
+    }
+
+    for (round = 0; round <= powercap_num_nodes; round++) {
+        demand = 0;
+        remaining = budget;
+        unfixed = 0;
+        for (node = 0; node < powercap_num_nodes; node++) {
+            powercap_node_t *n = &powercap_nodes[node];
+            if (!n->managed)
+                continue;
+            if (n->fixed) {
+                remaining -= n->alloc;
+            } else {
+                demand += n->demand;
+                unfixed++;
+            }
+        }
+        if (unfixed == 0)
+            break;
+
+        changed = 0;
+        for (node = 0; node < powercap_num_nodes; node++) {
+            powercap_node_t *n = &powercap_nodes[node];
+            if (n->fixed)
+                continue;
+
+            if (demand > 0)
+                share = remaining * n->demand / demand;
+            else
+                share = remaining / unfixed;
+
+            if (share < n->min_watts) {
+                n->alloc = n->min_watts;
+                n->fixed = changed = 1;
+            } else if (share > n->max_watts) {
+                n->alloc = n->max_watts;
+                n->fixed = changed = 1;
+            } else {
+                n->alloc = share;
+            }
+        }
+        if (!changed)
+            break;
+    }
+}
+
+int
+powercap_tick (double now)
+{
+    uint64_t node;
+    double budget;
+    int failed = 0;
+
+    if (powercap_nodes == NULL)
+        return 0;
+
+    if (++powercap_ticks < powercap_config.ticks)
+        return 0;
+    powercap_ticks = 0;
+
+    /* Unmanaged (locked) packages draw from the same budget; without a
+     * measurement this round, their last known demand is used. */
+    budget = powercap_config.budget_watts;
+    for (node = 0; node < powercap_num_nodes; node++) {
+        powercap_node_t *n = &powercap_nodes[node];
+        n->measured = (n->demand_samples > 0);
+        if (n->measured)
+            n->demand = n->demand_sum / n->demand_samples;
+        if (!n->managed)
+            budget -= n->demand;
+    }
+    if (budget < 0)
+        budget = 0;
+
+    powercap_distribute (budget);
+
+    for (node = 0; node < powercap_num_nodes; node++) {
+        powercap_node_t *n = &powercap_nodes[node];
+        pkg_rapl_power_limit_control_t limit;
+
+        n->demand_sum = 0;
+        n->demand_samples = 0;
+
+        if (!n->managed || !n->measured)
+            continue;
+        if (fabs (n->alloc - n->limit_watts) < powercap_config.deadband_watts)
+            continue;
+        if (now - n->last_write < powercap_config.min_write_interval)
+            continue;
+
+        limit = n->original;
+        limit.power_limit_watts_1 = n->alloc;
+        limit.limit_enabled_1 = 1;
+        limit.clamp_enabled_1 = 1;
+        limit.lock_enabled = 0;
+
+        n->last_write = now;
+        n->written = 1;
+        if (0 != set_pkg_rapl_power_limit_control_t (powercap_rapl, node, &limit)) {
+            failed++;
+            continue;
+        }
+        n->limit_watts = n->alloc;
+    }
+
+    return failed;
+}
+
+int
+powercap_shutdown ()
+{
+    uint64_t node;
+    int failed = 0;
+
+    if (powercap_nodes == NULL)
+        return 0;
+
+    for (node = 0; node < powercap_num_nodes; node++) {
+        powercap_node_t *n = &powercap_nodes[node];
+        if (n->written && 0 != set_pkg_rapl_power_limit_control_t (powercap_rapl, node, &n->original))
+            failed++;
+    }
+
+    free (powercap_nodes);
+    powercap_nodes = NULL;
+    powercap_num_nodes = 0;
+
+    return failed;
+}
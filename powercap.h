@@ -0,0 +1,77 @@
+/**
+ * collectd - powercap.h
+ * Copyright (C) 2015  Nils Steinger
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Author:
+ *   Nils Steinger <git at n-st dot de>
+ **/
+
+#ifndef _h_powercap
+#define _h_powercap
+
+#include <stdint.h>
+
+#include "rapl.h"
+
+/*
+ * Closed-loop package power capping.
+ *
+ * A host-wide power budget is split across all packages in proportion to
+ * their measured power draw. Every `ticks' calls to powercap_tick(), the
+ * average power recorded for each package via powercap_update() is used to
+ * compute new PKG power limits, which are written using the RAPL library's
+ * set_pkg_rapl_power_limit_control_t().
+ *
+ * Packages whose power limit register is locked are never written; their
+ * measured power is deducted from the budget instead. Writes to a package are
+ * rate-limited to at most one per `min_write_interval' seconds and are
+ * suppressed if the limit would change by less than `deadband_watts'.
+ *
+ * A package without a measurement since the last redistribution (e.g. because
+ * its energy register couldn't be read) keeps its limit, which is deducted
+ * from the budget of the others.
+ *
+ * The original power limits are saved by powercap_init() and written back by
+ * powercap_shutdown().
+ *
+ * All MSR accesses go through the RAPL library (and thus through the
+ * currently installed MSR backend, see set_msr_backend()), so the controller
+ * can be exercised without real hardware (see test-powercap.c).
+ */
+
+typedef struct powercap_config_t {
+    double   budget_watts;       /* host-wide budget, split across packages */
+    uint64_t ticks;              /* redistribute every N sampling ticks */
+    double   min_write_interval; /* seconds between writes to one package */
+    double   deadband_watts;     /* ignore changes smaller than this */
+} powercap_config_t;
+
+/* Save the current limits of all packages and prepare the controller.
+ * Returns 0 on success, MY_ERROR otherwise. */
+int powercap_init(rapl_ctx_t *ctx, uint64_t num_nodes, const powercap_config_t *config);
+
+/* Record the power measured on the given package since the last tick. */
+void powercap_update(uint64_t node, double watts);
+
+/* Advance the controller by one sampling tick. `now' is a monotonic timestamp
+ * in seconds. Returns the number of power limit writes that failed. */
+int powercap_tick(double now);
+
+/* Restore the original power limits and release all resources.
+ * Returns the number of packages that could not be restored. */
+int powercap_shutdown();
+
+#endif
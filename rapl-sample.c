@@ -0,0 +1,590 @@
+/**
+ * rapl-sample - rapl-sample.c
+ * Copyright (C) 2015  Nils Steinger
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Author:
+ *   Nils Steinger <git at n-st dot de>
+ **/
+
+/*
+ * Standalone RAPL sampler.
+ *
+ * Samples the energy status registers of all packages and domains at a fixed
+ * rate (up to 1 kHz) using the same RAPL library as the collectd plugin, and
+ * either shows a live top-style view or streams the samples to a file, as
+ * CSV, as binary records (see rapl_sample_header_t / rapl_trace_record_t) or
+ * compressed (see pack.h).
+ * On exit, the achieved sample period and its jitter are reported on stderr.
+ *
+ * In precision mode (-P), the package energy register is read by spinning until
+ * it updates, and records are timestamped with the TSC at the update (see
+ * get_pkg_energy_status_precise()), which removes the up to ~1 ms uncertainty
+ * of when the value was current. This costs up to one update period of busy
+ * waiting per package and sample, bounded by the given number of reads.
+ *
+ * The benchmark mode (-B) compares the two ways of reading the per-CPU
+ * registers of a sampling sweep: one pread() per register, and a single
+ * io_uring submission for all of them (see msr_batch_use_uring()).
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "msr.h"
+#include "pack.h"
+#include "rapl.h"
+#include "trace.h"
+
+#define MINIMUM_PERIOD_NS 1000000 /* 1 kHz */
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+#define TOP_REFRESH_NS 1000000000
+#define CALIBRATION_UPDATES 100
+
+static const char * const RAPL_DOMAIN_NAMES[RAPL_NR_DOMAIN] = {
+    "package",
+    "core",
+    "uncore",
+    "dram"
+};
+
+/*
+ * Binary output format: one header, followed by one record per package and
+ * sample. The records have the same layout as those of the plugin's trace
+ * file (see trace.h). All fields are in host byte order.
+ */
+#define RAPL_SAMPLE_MAGIC "RAPLSMP2"
+
+typedef struct rapl_sample_header_t {
+    char     magic[8];
+    uint32_t num_nodes;
+    uint32_t num_domains;
+    double   energy_unit_J; /* Joules per raw energy status unit */
+    double   dram_energy_unit_J; /* the same for the DRAM domain */
+} rapl_sample_header_t;
+
+enum output_format { FORMAT_TOP, FORMAT_CSV, FORMAT_BINARY, FORMAT_PACKED };
+
+static rapl_ctx_t *rapl_ctx = NULL;
+static volatile sig_atomic_t stop = 0;
+
+static void handle_signal (int sig)
+{
+    stop = 1;
+}
+
+static uint64_t timespec_to_ns (const struct timespec *ts)
+{
+    return (uint64_t) ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+static uint64_t now_ns (clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime (clock, &ts);
+    return timespec_to_ns (&ts);
+}
+
+static int read_domain (int domain, uint64_t node, uint64_t *raw)
+{
+    switch (domain) {
+    case RAPL_PKG:
+        return get_pkg_energy_status_raw (rapl_ctx, node, raw);
+    case RAPL_PP0:
+        return get_pp0_energy_status_raw (rapl_ctx, node, raw);
+    case RAPL_PP1:
+        return get_pp1_energy_status_raw (rapl_ctx, node, raw);
+    case RAPL_DRAM:
+        return get_dram_energy_status_raw (rapl_ctx, node, raw);
+    default:
+        return MY_ERROR;
+    }
+}
+
+static void usage (const char *name)
+{
+    fprintf (stderr,
+            "Usage: %s [options]\n"
+            "\n"
+            "  -i <ms>        sample period in milliseconds (default: 100, minimum: 1)\n"
+            "  -d <seconds>   stop after this many seconds (default: run until interrupted)\n"
+            "  -f <format>    top (default), csv, binary or packed\n"
+            "  -o <file>      write samples to <file> instead of stdout\n"
+            "  -b <backend>   MSR backend: msr (default), msr-safe, msr-batch or msr-uring\n"
+            "  -P <spins>     precision mode: align package samples to register updates,\n"
+            "                 spinning for at most <spins> reads per package and sample\n"
+            "  -B <sweeps>    benchmark reading APERF/MPERF/TSC of all CPUs with pread()\n"
+            "                 against io_uring, over <sweeps> sweeps each, and exit\n"
+            "  -h             show this help\n",
+            name);
+}
+
+/*
+ * Benchmark (-B): read APERF, MPERF and the TSC of every CPU, the registers of
+ * a per-core sampling sweep, first with one pread() each and then with one
+ * io_uring submission per sweep, and report the wall-clock time per sweep.
+ * Needs no RAPL support, only the device files of the selected backend.
+ */
+static int benchmark_sweeps (const char *name, uint64_t sweeps)
+{
+    static const uint64_t registers[] = {
+        MSR_IA32_APERF, MSR_IA32_MPERF, MSR_IA32_TIME_STAMP_COUNTER
+    };
+    static const char * const mode_names[2] = { "pread", "io_uring" };
+    long num_cpus = sysconf (_SC_NPROCESSORS_CONF);
+    msr_fd_cache_t cache;
+    msr_batch_t batch;
+    msr_stats_t before, after;
+    uint64_t i, s, value, start_ns, elapsed_ns;
+    uint64_t total_ns[2] = { 0, 0 }, min_ns[2] = { UINT64_MAX, UINT64_MAX };
+    uint64_t failures[2] = { 0, 0 };
+    double syscalls[2] = { 0, 0 };
+    int cpu, mode, modes = 2;
+    size_t r;
+
+    if (num_cpus < 1 || get_msr_backend ()->path_format == NULL) {
+        fprintf (stderr, "%s: the benchmark needs a file based MSR backend\n", name);
+        return 1;
+    }
+    if (0 != msr_cache_init (&cache, num_cpus))
+        return 1;
+    if (0 != msr_batch_init (&batch, num_cpus * 3, NULL)) {
+        msr_cache_close (&cache);
+        return 1;
+    }
+    for (cpu = 0; cpu < num_cpus; cpu++)
+        for (r = 0; r < sizeof (registers) / sizeof (registers[0]); r++)
+            msr_batch_add_read (&batch, cpu, registers[r]);
+
+    /* Open all device files up front, so neither mode pays for it */
+    for (i = 0, s = 0; i < batch.num_ops; i++)
+        s += (0 == read_msr_cached (&cache, batch.ops[i].cpu, batch.ops[i].msr, &value));
+    if (s == 0) {
+        fprintf (stderr, "%s: can't read the MSRs through the %s backend\n", name, get_msr_backend ()->name);
+        msr_batch_close (&batch);
+        msr_cache_close (&cache);
+        return 1;
+    }
+    if (0 != msr_batch_use_uring (&batch, &cache)) {
+        fprintf (stderr, "%s: io_uring unavailable, benchmarking pread() only\n", name);
+        modes = 1;
+    }
+
+    for (mode = 0; mode < modes; mode++) {
+        get_msr_stats (&before);
+        for (s = 0; s < sweeps; s++) {
+            start_ns = now_ns (CLOCK_MONOTONIC);
+            if (mode == 0) {
+                for (i = 0; i < batch.num_ops; i++)
+                    read_msr_cached (&cache, batch.ops[i].cpu, batch.ops[i].msr, &value);
+            } else {
+                msr_batch_run (&batch, &cache);
+            }
+            elapsed_ns = now_ns (CLOCK_MONOTONIC) - start_ns;
+            total_ns[mode] += elapsed_ns;
+            if (elapsed_ns < min_ns[mode])
+                min_ns[mode] = elapsed_ns;
+        }
+        get_msr_stats (&after);
+        failures[mode] = after.read_failures - before.read_failures;
+        syscalls[mode] = (mode == 0) ? batch.num_ops : (double) (after.batches - before.batches) / sweeps;
+        if (mode == 1 && batch.uring == NULL)
+            fprintf (stderr, "%s: io_uring failed, the numbers below are for pread()\n", name);
+    }
+
+    printf ("%s: %ld CPUs, %u registers per sweep, %lu sweeps\n", name, num_cpus, batch.num_ops, sweeps);
+    for (mode = 0; mode < modes; mode++)
+        printf ("  %-8s  mean %9.1f us  min %9.1f us  %7.1f syscalls/sweep  %lu failed reads\n",
+                mode_names[mode], total_ns[mode] / 1e3 / sweeps, min_ns[mode] / 1e3,
+                syscalls[mode], failures[mode]);
+    if (modes == 2 && total_ns[1] > 0)
+        printf ("  speedup   %.2fx\n", (double) total_ns[0] / total_ns[1]);
+
+    msr_batch_close (&batch);
+    msr_cache_close (&cache);
+    return 0;
+}
+
+/* Live view: average power per package and domain since the last refresh. */
+static void print_top (uint64_t num_nodes, uint64_t **raw, uint64_t **prev_raw,
+        uint32_t *mask, double elapsed, const double *energy_unit_J,
+        uint64_t samples, double mean_period_ms)
+{
+    uint64_t node;
+    int domain;
+
+    printf ("\033[H\033[2J");
+    printf ("rapl-sample: %lu samples, mean period %.3f ms\n\n", samples, mean_period_ms);
+    printf ("%-6s", "node");
+    for (domain = 0; domain < RAPL_NR_DOMAIN; domain++)
+        printf (" %10s", RAPL_DOMAIN_NAMES[domain]);
+    printf ("\n");
+
+    for (node = 0; node < num_nodes; node++) {
+        printf ("cpu%-3lu", node);
+        for (domain = 0; domain < RAPL_NR_DOMAIN; domain++) {
+            if (mask[node] & (1 << domain))
+                printf (" %8.2f W", ((raw[node][domain] - prev_raw[node][domain]) & 0xffffffff)
+                        * energy_unit_J[domain] / elapsed);
+            else
+                printf (" %10s", "-");
+            prev_raw[node][domain] = raw[node][domain];
+        }
+        printf ("\n");
+    }
+    fflush (stdout);
+}
+
+int main (int argc, char **argv)
+{
+    int opt;
+    int err;
+    int domain;
+    uint64_t node;
+    uint64_t num_nodes;
+    uint64_t period_ns = 100000000;
+    double duration = 0;
+    enum output_format format = FORMAT_TOP;
+    const char *output = NULL;
+    FILE *out = stdout;
+    char *out_buffer = NULL;
+    double energy_unit_J[RAPL_NR_DOMAIN];
+    uint64_t **raw, **prev_raw;
+    uint32_t *mask;
+    int supported[RAPL_NR_DOMAIN];
+    struct timespec deadline;
+    uint64_t start_ns, end_ns = 0, sample_ns, prev_sample_ns = 0, last_top_ns;
+    uint64_t samples = 0, overruns = 0, read_errors = 0;
+    double period, sum = 0, sum_sq = 0, min_period = INFINITY, max_period = 0;
+    double mean, jitter;
+    rapl_sample_header_t header;
+    rapl_trace_record_t record;
+    rapl_pack_writer_t packer;
+    struct sigaction sa;
+    uint64_t max_spins = 0;
+    uint64_t *node_time_ns;
+    uint64_t tsc_ref = 0, ns_ref = 0, spin_misses = 0;
+    double tsc_hz = 0, update_period;
+    rapl_precise_sample_t precise;
+    uint64_t bench_sweeps = 0;
+
+    while ((opt = getopt (argc, argv, "i:d:f:o:b:P:B:h")) != -1) {
+        switch (opt) {
+        case 'i':
+            period_ns = (uint64_t) (atof (optarg) * 1e6);
+            if (period_ns < MINIMUM_PERIOD_NS) {
+                fprintf (stderr, "%s: sample period must be at least 1 ms\n", argv[0]);
+                return 1;
+            }
+            break;
+        case 'd':
+            duration = atof (optarg);
+            break;
+        case 'f':
+            if (strcmp (optarg, "top") == 0)
+                format = FORMAT_TOP;
+            else if (strcmp (optarg, "csv") == 0)
+                format = FORMAT_CSV;
+            else if (strcmp (optarg, "binary") == 0)
+                format = FORMAT_BINARY;
+            else if (strcmp (optarg, "packed") == 0)
+                format = FORMAT_PACKED;
+            else {
+                fprintf (stderr, "%s: unknown format `%s'\n", argv[0], optarg);
+                return 1;
+            }
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'b':
+            if (find_msr_backend (optarg) == NULL) {
+                fprintf (stderr, "%s: unknown MSR backend `%s'\n", argv[0], optarg);
+                return 1;
+            }
+            set_msr_backend (find_msr_backend (optarg));
+            break;
+        case 'P':
+            max_spins = strtoull (optarg, NULL, 10);
+            if (max_spins == 0) {
+                fprintf (stderr, "%s: the number of spins must be positive\n", argv[0]);
+                return 1;
+            }
+            break;
+        case 'B':
+            bench_sweeps = strtoull (optarg, NULL, 10);
+            if (bench_sweeps == 0) {
+                fprintf (stderr, "%s: the number of sweeps must be positive\n", argv[0]);
+                return 1;
+            }
+            break;
+        case 'h':
+            usage (argv[0]);
+            return 0;
+        default:
+            usage (argv[0]);
+            return 1;
+        }
+    }
+
+    if (bench_sweeps > 0)
+        return benchmark_sweeps (argv[0], bench_sweeps);
+
+    if ((format == FORMAT_BINARY || format == FORMAT_PACKED) && output == NULL) {
+        fprintf (stderr, "%s: binary output requires -o <file>\n", argv[0]);
+        return 1;
+    }
+
+    if (0 != init_rapl (&rapl_ctx)) {
+        fprintf (stderr, "%s: RAPL initialisation failed\n", argv[0]);
+        return 1;
+    }
+    num_nodes = get_num_rapl_nodes_pkg (rapl_ctx);
+    for (domain = 0; domain < RAPL_NR_DOMAIN; domain++) {
+        supported[domain] = is_supported_domain (rapl_ctx, domain);
+        energy_unit_J[domain] = get_rapl_domain_energy_unit (rapl_ctx, domain);
+    }
+
+    raw = calloc (num_nodes, sizeof (*raw));
+    prev_raw = calloc (num_nodes, sizeof (*prev_raw));
+    mask = calloc (num_nodes, sizeof (*mask));
+    node_time_ns = calloc (num_nodes, sizeof (*node_time_ns));
+    if (raw == NULL || prev_raw == NULL || mask == NULL || node_time_ns == NULL) {
+        fprintf (stderr, "%s: out of memory\n", argv[0]);
+        return 1;
+    }
+    for (node = 0; node < num_nodes; node++) {
+        raw[node] = calloc (RAPL_NR_DOMAIN, sizeof (**raw));
+        prev_raw[node] = calloc (RAPL_NR_DOMAIN, sizeof (**prev_raw));
+        if (raw[node] == NULL || prev_raw[node] == NULL) {
+            fprintf (stderr, "%s: out of memory\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (format == FORMAT_PACKED) {
+        if (0 != pack_create (&packer, output, 0, energy_unit_J[RAPL_PKG], energy_unit_J[RAPL_DRAM],
+                    now_ns (CLOCK_REALTIME), now_ns (CLOCK_MONOTONIC_RAW))) {
+            fprintf (stderr, "%s: %s: %s\n", argv[0], output, strerror (errno));
+            return 1;
+        }
+    } else if (output != NULL) {
+        out = fopen (output, format == FORMAT_BINARY ? "wb" : "w");
+        if (out == NULL) {
+            fprintf (stderr, "%s: %s: %s\n", argv[0], output, strerror (errno));
+            return 1;
+        }
+    }
+    if (format == FORMAT_CSV || format == FORMAT_BINARY) {
+        /* Keep the sampling loop clear of write(2) calls as far as possible. */
+        out_buffer = malloc (OUTPUT_BUFFER_SIZE);
+        if (out_buffer != NULL)
+            setvbuf (out, out_buffer, _IOFBF, OUTPUT_BUFFER_SIZE);
+    }
+
+    if (format == FORMAT_CSV) {
+        fprintf (out, "time_ns,node");
+        for (domain = 0; domain < RAPL_NR_DOMAIN; domain++)
+            fprintf (out, ",%s_raw", RAPL_DOMAIN_NAMES[domain]);
+        fprintf (out, "\n# energy_unit_J=%.12g dram_energy_unit_J=%.12g\n",
+                energy_unit_J[RAPL_PKG], energy_unit_J[RAPL_DRAM]);
+    } else if (format == FORMAT_BINARY) {
+        memset (&header, 0, sizeof (header));
+        memcpy (header.magic, RAPL_SAMPLE_MAGIC, sizeof (header.magic));
+        header.num_nodes = num_nodes;
+        header.num_domains = RAPL_NR_DOMAIN;
+        header.energy_unit_J = energy_unit_J[RAPL_PKG];
+        header.dram_energy_unit_J = energy_unit_J[RAPL_DRAM];
+        fwrite (&header, sizeof (header), 1, out);
+    }
+
+    if (max_spins > 0) {
+        if (!supported[RAPL_PKG]) {
+            fprintf (stderr, "%s: precision mode requires the package domain\n", argv[0]);
+            return 1;
+        }
+        for (node = 0; node < num_nodes; node++) {
+            if (0 != estimate_pkg_energy_update_period (rapl_ctx, node, CALIBRATION_UPDATES, max_spins,
+                        &update_period, &tsc_hz)) {
+                fprintf (stderr, "%s: no package energy update on cpu%lu within %lu reads\n",
+                        argv[0], node, max_spins);
+                return 1;
+            }
+            fprintf (stderr, "cpu%lu: energy update period %.1f us\n", node, update_period * 1e6);
+        }
+        fprintf (stderr, "TSC frequency %.3f MHz\n", tsc_hz / 1e6);
+        read_tsc (&tsc_ref);
+        ns_ref = now_ns (CLOCK_MONOTONIC_RAW);
+    }
+
+    memset (&sa, 0, sizeof (sa));
+    sa.sa_handler = handle_signal;
+    sigaction (SIGINT, &sa, NULL);
+    sigaction (SIGTERM, &sa, NULL);
+
+    /* Sample on absolute deadlines, so the period doesn't drift with the
+     * time spent reading and writing. */
+    clock_gettime (CLOCK_MONOTONIC, &deadline);
+    start_ns = timespec_to_ns (&deadline);
+    if (duration > 0)
+        end_ns = start_ns + (uint64_t) (duration * 1e9);
+    last_top_ns = now_ns (CLOCK_MONOTONIC_RAW);
+
+    while (!stop) {
+        sample_ns = now_ns (CLOCK_MONOTONIC_RAW);
+        for (node = 0; node < num_nodes; node++) {
+            mask[node] = 0;
+            node_time_ns[node] = sample_ns;
+            for (domain = 0; domain < RAPL_NR_DOMAIN; domain++) {
+                if (!supported[domain])
+                    continue;
+                if (max_spins > 0 && domain == RAPL_PKG) {
+                    if (0 == get_pkg_energy_status_precise (rapl_ctx, node, max_spins, &precise)) {
+                        raw[node][domain] = precise.energy_raw;
+                        node_time_ns[node] = ns_ref + (int64_t) ((int64_t) (precise.tsc - tsc_ref) / tsc_hz * 1e9);
+                        mask[node] |= 1 << domain;
+                    } else {
+                        spin_misses++;
+                    }
+                    continue;
+                }
+                if (0 != read_domain (domain, node, &raw[node][domain])) {
+                    read_errors++;
+                    continue;
+                }
+                mask[node] |= 1 << domain;
+            }
+        }
+
+        if (prev_sample_ns != 0) {
+            period = (sample_ns - prev_sample_ns) / 1e6;
+            sum += period;
+            sum_sq += period * period;
+            if (period < min_period)
+                min_period = period;
+            if (period > max_period)
+                max_period = period;
+        }
+        prev_sample_ns = sample_ns;
+        samples++;
+
+        switch (format) {
+        case FORMAT_TOP:
+            if (samples == 1) {
+                for (node = 0; node < num_nodes; node++)
+                    memcpy (prev_raw[node], raw[node], RAPL_NR_DOMAIN * sizeof (**raw));
+            } else if (sample_ns - last_top_ns >= TOP_REFRESH_NS) {
+                print_top (num_nodes, raw, prev_raw, mask, (sample_ns - last_top_ns) / 1e9,
+                        energy_unit_J, samples, samples > 1 ? sum / (samples - 1) : 0);
+                last_top_ns = sample_ns;
+            }
+            break;
+        case FORMAT_CSV:
+            for (node = 0; node < num_nodes; node++) {
+                fprintf (out, "%lu,%lu", node_time_ns[node], node);
+                for (domain = 0; domain < RAPL_NR_DOMAIN; domain++) {
+                    if (mask[node] & (1 << domain))
+                        fprintf (out, ",%lu", raw[node][domain]);
+                    else
+                        fprintf (out, ",");
+                }
+                fprintf (out, "\n");
+            }
+            break;
+        case FORMAT_BINARY:
+            for (node = 0; node < num_nodes; node++) {
+                record.time_ns = node_time_ns[node];
+                record.node = node;
+                record.domain_mask = mask[node];
+                memcpy (record.energy_raw, raw[node], sizeof (record.energy_raw));
+                fwrite (&record, sizeof (record), 1, out);
+            }
+            break;
+        case FORMAT_PACKED:
+            /* Encodes and writes a block every RAPL_PACK_BLOCK_RECORDS records */
+            for (node = 0; node < num_nodes; node++) {
+                record.time_ns = node_time_ns[node];
+                record.node = node;
+                record.domain_mask = mask[node];
+                memcpy (record.energy_raw, raw[node], sizeof (record.energy_raw));
+                if (0 != pack_append (&packer, &record)) {
+                    fprintf (stderr, "%s: %s: %s\n", argv[0], output, strerror (errno));
+                    stop = 1;
+                    break;
+                }
+            }
+            break;
+        }
+
+        deadline.tv_nsec += period_ns % 1000000000;
+        deadline.tv_sec += period_ns / 1000000000 + deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        if (end_ns != 0 && timespec_to_ns (&deadline) >= end_ns)
+            break;
+
+        if (now_ns (CLOCK_MONOTONIC) > timespec_to_ns (&deadline)) {
+            /* We're late; skip the missed deadlines instead of bursting. */
+            overruns++;
+            while (now_ns (CLOCK_MONOTONIC) > timespec_to_ns (&deadline)) {
+                deadline.tv_nsec += period_ns % 1000000000;
+                deadline.tv_sec += period_ns / 1000000000 + deadline.tv_nsec / 1000000000;
+                deadline.tv_nsec %= 1000000000;
+            }
+        }
+        while ((err = clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL)) == EINTR && !stop)
+            ;
+    }
+
+    if (format == FORMAT_PACKED && 0 != pack_finish (&packer))
+        fprintf (stderr, "%s: %s: %s\n", argv[0], output, strerror (errno));
+    if (out != stdout)
+        fclose (out);
+    else
+        fflush (out);
+
+    free (out_buffer);
+
+    if (samples > 1) {
+        mean = sum / (samples - 1);
+        jitter = sqrt (fmax (0, sum_sq / (samples - 1) - mean * mean));
+        fprintf (stderr, "%lu samples, requested period %.3f ms, achieved period %.3f ms "
+                "(min %.3f, max %.3f, jitter %.3f ms stddev), %lu overruns, %lu read errors\n",
+                samples, period_ns / 1e6, mean, min_period, max_period, jitter, overruns, read_errors);
+    }
+    if (spin_misses > 0)
+        fprintf (stderr, "%lu package reads saw no update within %lu reads\n", spin_misses, max_spins);
+
+    for (node = 0; node < num_nodes; node++) {
+        free (raw[node]);
+        free (prev_raw[node]);
+    }
+    free (raw);
+    free (prev_raw);
+    free (mask);
+    free (node_time_ns);
+    terminate_rapl (rapl_ctx);
+
+    return 0;
+}
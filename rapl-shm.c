@@ -0,0 +1,120 @@
+/**
+ * rapl-shm - rapl-shm.c
+ * Copyright (C) 2015  Nils Steinger
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Author:
+ *   Nils Steinger <git at n-st dot de>
+ **/
+
+/*
+ * Print the power state exported by the intel_cpu_energy plugin in shared
+ * memory (see shm.h). Also serves as an example of using the reader API.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "shm.h"
+
+#define MAXIMUM_RETRIES 1000
+
+static const char * const RAPL_DOMAIN_NAMES[RAPL_NR_DOMAIN] = {
+    "package",
+    "core",
+    "uncore",
+    "dram"
+};
+
+static void usage (const char *name)
+{
+    fprintf (stderr,
+            "Usage: %s [options]\n"
+            "\n"
+            "  -n <name>      shared memory segment name (default: %s)\n"
+            "  -w <seconds>   print a snapshot every <seconds> seconds\n"
+            "  -h             show this help\n",
+            name, RAPL_SHM_DEFAULT_NAME);
+}
+
+int main (int argc, char **argv)
+{
+    int opt;
+    int domain;
+    int num_nodes, node;
+    const char *name = RAPL_SHM_DEFAULT_NAME;
+    double watch = 0;
+    rapl_shm_t shm;
+    rapl_shm_node_t *nodes;
+    uint64_t time_ns;
+
+    while ((opt = getopt (argc, argv, "n:w:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            name = optarg;
+            break;
+        case 'w':
+            watch = atof (optarg);
+            break;
+        case 'h':
+            usage (argv[0]);
+            return 0;
+        default:
+            usage (argv[0]);
+            return 1;
+        }
+    }
+
+    if (0 != rapl_shm_open (&shm, name)) {
+        fprintf (stderr, "%s: %s: %s\n", argv[0], name, strerror (errno));
+        return 1;
+    }
+    nodes = calloc (shm.header->num_nodes, sizeof (*nodes));
+    if (nodes == NULL) {
+        fprintf (stderr, "%s: out of memory\n", argv[0]);
+        return 1;
+    }
+
+    do {
+        num_nodes = rapl_shm_snapshot (&shm, nodes, shm.header->num_nodes, &time_ns, MAXIMUM_RETRIES);
+        if (num_nodes < 0) {
+            fprintf (stderr, "%s: couldn't take a consistent snapshot\n", argv[0]);
+            return 1;
+        }
+
+        printf ("updated at %.6f (CLOCK_MONOTONIC_RAW)\n", time_ns / 1e9);
+        for (node = 0; node < num_nodes; node++) {
+            for (domain = 0; domain < RAPL_NR_DOMAIN; domain++) {
+                rapl_shm_domain_t *d = &nodes[node].domains[domain];
+                if (!d->valid)
+                    continue;
+                printf ("cpu%u die%u %-8s %14.3f J %9.3f W\n",
+                        nodes[node].pkg_id, nodes[node].die_id, RAPL_DOMAIN_NAMES[domain],
+                        d->energy_J, d->watts);
+            }
+        }
+
+        if (watch > 0)
+            usleep ((useconds_t) (watch * 1e6));
+    } while (watch > 0);
+
+    free (nodes);
+    rapl_shm_close (&shm);
+    return 0;
+}
@@ -0,0 +1,420 @@
+/**
+ * rapl-trace - rapl-trace.c
+ * Copyright (C) 2015  Nils Steinger
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Author:
+ *   Nils Steinger <git at n-st dot de>
+ **/
+
+/*
+ * Decode a time window of a trace file written by the intel_cpu_energy
+ * plugin (see trace.h), or of a compressed file written by rapl-sample or
+ * rapl-trace (see pack.h), as CSV: the wall clock time of each record, the
+ * node and the average power of each domain since the node's previous
+ * record. With -o, the window is written as a compressed file instead.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pack.h"
+#include "trace.h"
+
+static const char * const RAPL_DOMAIN_NAMES[RAPL_NR_DOMAIN] = {
+    "package",
+    "core",
+    "uncore",
+    "dram"
+};
+
+/* A trace file or a compressed file, read in order */
+typedef struct trace_input_t {
+    int                packed;
+    rapl_trace_t       trace;
+    rapl_pack_reader_t pack;
+    uint64_t           index;     /* next record in the trace file */
+    uint64_t           head;
+    uint64_t           skipped;   /* records overwritten while reading */
+    double             energy_unit_J[RAPL_NR_DOMAIN];
+    uint64_t           ref_realtime_ns;
+    uint64_t           ref_monotonic_ns;
+} trace_input_t;
+
+static void usage (const char *name)
+{
+    fprintf (stderr,
+            "Usage: %s [options] <trace file>\n"
+            "\n"
+            "  -s <time>      start of the window, in seconds since the epoch\n"
+            "  -e <time>      end of the window, in seconds since the epoch\n"
+            "  -l <seconds>   only the last <seconds> of the trace\n"
+            "  -r             print the raw register values instead of Watts\n"
+            "  -o <file>      write the window as a compressed file instead of CSV\n"
+            "  -B             measure the compression ratio and speed on the window\n"
+            "  -h             show this help\n",
+            name);
+}
+
+static uint64_t now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Files written before the DRAM unit was recorded have 0 there. */
+static void input_set_units (trace_input_t *in, double energy_unit_J, double dram_energy_unit_J)
+{
+    int domain;
+
+    for (domain = 0; domain < RAPL_NR_DOMAIN; domain++)
+        in->energy_unit_J[domain] = energy_unit_J;
+    if (dram_energy_unit_J > 0)
+        in->energy_unit_J[RAPL_DRAM] = dram_energy_unit_J;
+}
+
+static int input_open (trace_input_t *in, const char *path)
+{
+    char magic[sizeof (RAPL_PACK_MAGIC) - 1];
+    FILE *fp;
+
+    memset (in, 0, sizeof (*in));
+    fp = fopen (path, "rb");
+    if (fp == NULL)
+        return -1;
+    in->packed = (fread (magic, sizeof (magic), 1, fp) == 1
+            && memcmp (magic, RAPL_PACK_MAGIC, sizeof (magic)) == 0);
+    fclose (fp);
+
+    if (in->packed) {
+        if (0 != pack_open (&in->pack, path))
+            return -1;
+        input_set_units (in, in->pack.header.energy_unit_J, in->pack.header.dram_energy_unit_J);
+        in->ref_realtime_ns = in->pack.header.ref_realtime_ns;
+        in->ref_monotonic_ns = in->pack.header.ref_monotonic_ns;
+    } else {
+        if (0 != trace_open (&in->trace, path))
+            return -1;
+        in->head = trace_head (&in->trace);
+        /* The oldest slot is the next one to be overwritten. */
+        in->index = (in->head >= in->trace.header->capacity) ? in->head - in->trace.header->capacity + 1 : 0;
+        input_set_units (in, in->trace.header->energy_unit_J, in->trace.header->dram_energy_unit_J);
+        in->ref_realtime_ns = in->trace.header->ref_realtime_ns;
+        in->ref_monotonic_ns = in->trace.header->ref_monotonic_ns;
+    }
+    return 0;
+}
+
+/* Time of the last record; returns 0 if there is one */
+static int input_last_ns (trace_input_t *in, uint64_t *time_ns)
+{
+    rapl_trace_record_t record;
+
+    if (in->packed) {
+        if (in->pack.num_blocks == 0)
+            return -1;
+        *time_ns = in->pack.index[in->pack.num_blocks - 1].last_time_ns;
+        return 0;
+    }
+    if (in->head == 0 || 0 != trace_read (&in->trace, in->head - 1, &record))
+        return -1;
+    *time_ns = record.time_ns;
+    return 0;
+}
+
+/* Returns 1 if a record was read, 0 at the end and -1 on errors */
+static int input_next (trace_input_t *in, rapl_trace_record_t *record)
+{
+    if (in->packed)
+        return pack_next (&in->pack, record);
+    for (; in->index < in->head; in->index++) {
+        if (0 == trace_read (&in->trace, in->index, record)) {
+            in->index++;
+            return 1;
+        }
+        in->skipped++;
+    }
+    return 0;
+}
+
+static void input_close (trace_input_t *in)
+{
+    if (in->packed)
+        pack_close (&in->pack);
+    else
+        trace_close (&in->trace);
+}
+
+/*
+ * Encode and decode the records in blocks of RAPL_PACK_BLOCK_RECORDS, as
+ * the writer does, for at least a second, check that they come back
+ * unchanged and report the size and throughput.
+ */
+static int benchmark (const char *name, rapl_trace_record_t *records, size_t count)
+{
+    rapl_pack_state_t *state;
+    rapl_trace_record_t *decoded;
+    uint8_t *buffer;
+    size_t *bytes;
+    size_t i, block, num_blocks, offset, total = 0, values = 0;
+    uint64_t encode_ns = 0, decode_ns = 0, t, rounds = 0;
+    double raw_MB;
+    int domain, ret = 1;
+
+    if (count == 0) {
+        fprintf (stderr, "%s: no records in the window\n", name);
+        return 1;
+    }
+
+    /* Registers of invalid domains aren't stored. */
+    for (i = 0; i < count; i++)
+        for (domain = 0; domain < RAPL_NR_DOMAIN; domain++) {
+            if (records[i].domain_mask & (1 << domain))
+                values++;
+            else
+                records[i].energy_raw[domain] = 0;
+        }
+
+    num_blocks = (count + RAPL_PACK_BLOCK_RECORDS - 1) / RAPL_PACK_BLOCK_RECORDS;
+    state = malloc (sizeof (*state));
+    decoded = malloc (count * sizeof (*decoded));
+    buffer = malloc (RAPL_PACK_MAX_BYTES (count) + num_blocks * 8);
+    bytes = malloc (num_blocks * sizeof (*bytes));
+    if (state == NULL || decoded == NULL || buffer == NULL || bytes == NULL) {
+        fprintf (stderr, "%s: out of memory\n", name);
+        goto out;
+    }
+
+    do {
+        t = now_ns ();
+        for (block = 0, offset = 0; block < num_blocks; block++) {
+            i = block * RAPL_PACK_BLOCK_RECORDS;
+            bytes[block] = pack_encode (state, records + i,
+                    (count - i < RAPL_PACK_BLOCK_RECORDS) ? count - i : RAPL_PACK_BLOCK_RECORDS,
+                    buffer + offset);
+            if (bytes[block] == 0) {
+                fprintf (stderr, "%s: node out of range\n", name);
+                goto out;
+            }
+            offset += bytes[block];
+        }
+        encode_ns += now_ns () - t;
+        total = offset;
+
+        t = now_ns ();
+        for (block = 0, offset = 0; block < num_blocks; block++) {
+            i = block * RAPL_PACK_BLOCK_RECORDS;
+            if (0 != pack_decode (state, buffer + offset, bytes[block], decoded + i,
+                        (count - i < RAPL_PACK_BLOCK_RECORDS) ? count - i : RAPL_PACK_BLOCK_RECORDS)) {
+                fprintf (stderr, "%s: decoding failed\n", name);
+                goto out;
+            }
+            offset += bytes[block];
+        }
+        decode_ns += now_ns () - t;
+        rounds++;
+    } while (encode_ns + decode_ns < 1000000000);
+
+    if (memcmp (records, decoded, count * sizeof (*records)) != 0) {
+        fprintf (stderr, "%s: decoded records differ\n", name);
+        goto out;
+    }
+
+    raw_MB = count * sizeof (*records) * rounds / 1e6;
+    printf ("records  %zu (%zu register values)\n", count, values);
+    printf ("raw      %zu bytes, %.2f per record\n", count * sizeof (*records), (double) sizeof (*records));
+    printf ("packed   %zu bytes, %.2f per record, %.2f per register value (%.1fx smaller)\n",
+            total, (double) total / count, values > 0 ? (double) total / values : 0,
+            (double) (count * sizeof (*records)) / total);
+    printf ("encode   %.1f MB/s, %.2f M records/s\n", raw_MB / (encode_ns / 1e9),
+            count * rounds / (encode_ns / 1e3));
+    printf ("decode   %.1f MB/s, %.2f M records/s\n", raw_MB / (decode_ns / 1e9),
+            count * rounds / (decode_ns / 1e3));
+    ret = 0;
+
+out:
+    free (bytes);
+    free (buffer);
+    free (decoded);
+    free (state);
+    return ret;
+}
+
+int main (int argc, char **argv)
+{
+    int opt, ret, error = 0;
+    int domain;
+    int raw_output = 0, bench = 0;
+    const char *output = NULL;
+    double start = 0, end = 0, last = 0;
+    trace_input_t in;
+    rapl_pack_writer_t packer;
+    rapl_trace_record_t record;
+    rapl_trace_record_t *prev;
+    rapl_trace_record_t *window = NULL;
+    size_t window_count = 0, window_size = 0;
+    uint64_t index;
+    uint64_t start_ns = 0, end_ns = UINT64_MAX, last_ns;
+    uint64_t max_node = 0;
+    double elapsed, unix_time;
+
+    while ((opt = getopt (argc, argv, "s:e:l:ro:Bh")) != -1) {
+        switch (opt) {
+        case 's':
+            start = atof (optarg);
+            break;
+        case 'e':
+            end = atof (optarg);
+            break;
+        case 'l':
+            last = atof (optarg);
+            break;
+        case 'r':
+            raw_output = 1;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'B':
+            bench = 1;
+            break;
+        case 'h':
+            usage (argv[0]);
+            return 0;
+        default:
+            usage (argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage (argv[0]);
+        return 1;
+    }
+
+    if (0 != input_open (&in, argv[optind])) {
+        fprintf (stderr, "%s: %s: %s\n", argv[0], argv[optind], strerror (errno));
+        return 1;
+    }
+    if (0 != input_last_ns (&in, &last_ns)) {
+        input_close (&in);
+        return 0;
+    }
+
+    /* Convert the window to the trace's clock. */
+    if (start > 0)
+        start_ns = (uint64_t) (start * 1e9) - in.ref_realtime_ns + in.ref_monotonic_ns;
+    if (end > 0)
+        end_ns = (uint64_t) (end * 1e9) - in.ref_realtime_ns + in.ref_monotonic_ns;
+    if (last > 0)
+        start_ns = last_ns - (uint64_t) (last * 1e9);
+
+    /* Previous record per node, to compute the power. */
+    if (in.packed) {
+        max_node = RAPL_PACK_MAX_NODES - 1;
+        pack_seek (&in.pack, start_ns);
+    } else {
+        for (index = in.index; index < in.head; index++)
+            if (0 == trace_read (&in.trace, index, &record) && record.node > max_node)
+                max_node = record.node;
+    }
+    prev = calloc (max_node + 1, sizeof (*prev));
+    if (prev == NULL) {
+        fprintf (stderr, "%s: out of memory\n", argv[0]);
+        return 1;
+    }
+
+    if (output != NULL) {
+        if (0 != pack_create (&packer, output, 0, in.energy_unit_J[RAPL_PKG],
+                    in.energy_unit_J[RAPL_DRAM], in.ref_realtime_ns, in.ref_monotonic_ns)) {
+            fprintf (stderr, "%s: %s: %s\n", argv[0], output, strerror (errno));
+            return 1;
+        }
+    } else if (!bench) {
+        printf ("time,node");
+        for (domain = 0; domain < RAPL_NR_DOMAIN; domain++)
+            printf (raw_output ? ",%s_raw" : ",%s_W", RAPL_DOMAIN_NAMES[domain]);
+        printf ("\n");
+    }
+
+    while ((ret = input_next (&in, &record)) == 1) {
+        if (record.node > max_node || record.time_ns > end_ns)
+            continue;
+        if (record.time_ns < start_ns) {
+            prev[record.node] = record;
+            continue;
+        }
+
+        if (output != NULL) {
+            if (0 != pack_append (&packer, &record)) {
+                fprintf (stderr, "%s: %s: %s\n", argv[0], output, strerror (errno));
+                error = 1;
+                break;
+            }
+        } else if (bench) {
+            if (window_count == window_size) {
+                rapl_trace_record_t *w;
+                window_size = window_size ? 2 * window_size : 65536;
+                w = realloc (window, window_size * sizeof (*window));
+                if (w == NULL) {
+                    fprintf (stderr, "%s: out of memory\n", argv[0]);
+                    error = 1;
+                    break;
+                }
+                window = w;
+            }
+            window[window_count++] = record;
+        } else {
+            unix_time = (record.time_ns - in.ref_monotonic_ns + in.ref_realtime_ns) / 1e9;
+            elapsed = (record.time_ns - prev[record.node].time_ns) / 1e9;
+            printf ("%.6f,%u", unix_time, record.node);
+            for (domain = 0; domain < RAPL_NR_DOMAIN; domain++) {
+                if (!(record.domain_mask & (1 << domain)))
+                    printf (",");
+                else if (raw_output)
+                    printf (",%lu", record.energy_raw[domain]);
+                else if ((prev[record.node].domain_mask & (1 << domain)) && elapsed > 0)
+                    printf (",%.3f", ((record.energy_raw[domain] - prev[record.node].energy_raw[domain]) & 0xffffffff)
+                            * in.energy_unit_J[domain] / elapsed);
+                else
+                    printf (",");
+            }
+            printf ("\n");
+        }
+        prev[record.node] = record;
+    }
+    if (ret < 0)
+        fprintf (stderr, "%s: %s: corrupt block\n", argv[0], argv[optind]);
+
+    if (output != NULL && 0 != pack_finish (&packer)) {
+        fprintf (stderr, "%s: %s: %s\n", argv[0], output, strerror (errno));
+        error = 1;
+    }
+    if (bench && !error && ret == 0)
+        error = benchmark (argv[0], window, window_count);
+
+    if (in.skipped > 0)
+        fprintf (stderr, "%s: %lu records were overwritten while reading\n", argv[0], in.skipped);
+
+    free (window);
+    free (prev);
+    input_close (&in);
+    return (ret < 0 || error) ? 1 : 0;
+}
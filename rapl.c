@@ -23,6 +23,7 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 #define _GNU_SOURCE
 #endif
 
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -30,6 +31,7 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 #include <math.h>
 #include <stdint.h>
 #include <sched.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "cpuid.h"
@@ -38,26 +40,87 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 
 /* rapl msr availablility */
 #define MSR_SUPPORT_MASK 0xff
-unsigned char *msr_support_table;
 
-/* Global Variables */
-double RAPL_TIME_UNIT;
-double RAPL_ENERGY_UNIT;
-double RAPL_POWER_UNIT;
+/* Where the uncore frequency comes from */
+#define UNCORE_SYSFS_PATH "/sys/devices/system/cpu/intel_uncore_frequency"
+
+/* Server parts since Haswell-EP count DRAM energy in fixed units of 2^-16 J
+ * (15.3 uJ), regardless of the energy unit in MSR_RAPL_POWER_UNIT. */
+#define DRAM_ENERGY_UNIT_FIXED (1.0 / 65536)
+enum { UNCORE_NONE, UNCORE_MSR, UNCORE_SYSFS };
+static const char *UNCORE_SYSFS_FILES[3] = { "current_freq_khz", "min_freq_khz", "max_freq_khz" };
+
+/* State of update_core_type_stats() */
+typedef struct cpu_activity_t {
+    uint64_t aperf;
+    uint64_t mperf;
+    uint64_t tsc;
+    int      valid;
+} cpu_activity_t;
+
+typedef struct node_activity_t {
+    uint64_t energy_raw;
+    double   energy_joules[RAPL_MAX_CORE_TYPES];
+    struct timespec time;
+    int      valid;
+} node_activity_t;
 
-uint64_t  num_nodes = 0;
-uint64_t num_core_threads = 0; // number of physical threads per core
-uint64_t num_pkg_threads = 0;  // number of physical threads per package
-uint64_t num_pkg_cores = 0;    // number of cores per package
-uint64_t os_cpu_count = 0;     // numbeer of OS cpus
-
-APIC_ID_t *os_map;
-APIC_ID_t **pkg_map;
+/*
+ * Library state. Everything a context refers to is owned by it, so separate
+ * contexts can be used concurrently. A single context may be used by several
+ * threads at once as long as they work on different nodes; init_rapl() and
+ * terminate_rapl() must not race with anything else.
+ */
+struct rapl_ctx_t {
+    unsigned char msr_support_table[MSR_SUPPORT_MASK + 1];
+
+    double time_unit;
+    double energy_unit;
+    double power_unit;
+    double dram_energy_unit;   // DRAM_ENERGY_UNIT_FIXED or energy_unit
+
+    double max_energy_status_joules;
+    double max_throttled_time_seconds;
+
+    uint64_t num_nodes;        // number of RAPL nodes, one per (package, die)
+    uint64_t num_core_threads; // number of physical threads per core
+    uint64_t num_pkg_threads;  // number of physical threads per package
+    uint64_t num_pkg_cores;    // number of cores per package
+    uint64_t num_pkg_dies;     // highest number of dies per package
+    uint64_t os_cpu_count;     // numbeer of OS cpus
+
+    APIC_ID_t *os_map;
+    APIC_ID_t **pkg_map;       // pkg_map[node][0 ... node_threads[node]-1]
+    uint64_t *node_threads;    // number of threads per RAPL node
+
+    cpu_activity_t *cpu_activity;   // indexed by OS CPU
+    node_activity_t *node_activity; // indexed by node
+
+    /* Registers whose address depends on the vendor */
+    uint32_t cpu_vendor;
+    uint64_t msr_power_unit;
+    uint64_t msr_pkg_energy_status;
+    uint64_t msr_pp0_energy_status;
+
+    msr_fd_cache_t msr;
+
+    /* Batched sampling, only if the MSR backend supports it */
+    msr_batch_t batch;
+    int *batch_energy_op;  // [node * RAPL_NR_DOMAIN + domain], or -1
+    int *batch_perf_op;    // [node * RAPL_NR_DOMAIN + domain], or -1
+    int *batch_cpu_op;     // [os cpu]: APERF, followed by MPERF and TSC
+    int *batch_uncore_op;  // [node]: uncore perf status, followed by ratio limit
+    int  batch_valid;      // sample_rapl_batch() has succeeded
+
+    /* Uncore frequency */
+    int  uncore_source;    // UNCORE_*
+    int *uncore_fd;        // [node * 3 + i], UNCORE_SYSFS_FILES[i]
+};
 
 /* Pre-computed variables used for time-window calculation */
-const double LN2 = 0.69314718055994530941723212145817656807550013436025;
-const double A_F[4] = { 1.0, 1.1, 1.2, 1.3 };
-const double A_LNF[4] = {
+static const double LN2 = 0.69314718055994530941723212145817656807550013436025;
+static const double A_F[4] = { 1.0, 1.1, 1.2, 1.3 };
+static const double A_LNF[4] = {
     0.0000000000000000000000000000000000000000000000000000000,
     0.0953101798043249348602046211453853175044059753417968750,
     0.1823215567939545922460098381634452380239963531494140625,
@@ -92,9 +155,6 @@ typedef struct rapl_parameters_t {
 // However, I found that numactl-devel is not included by default
 // in SLES11.1, which would make it harder to setup the tool.
 // This is uglier, but hopefully everyone has numacta
-uint64_t  get_num_rapl_nodes_pkg();
-uint64_t  get_num_rapl_nodes_pkg();
-uint64_t  get_num_rapl_nodes_pkg();
 
 // OS specific
 int
@@ -147,85 +207,189 @@ parse_apic_id(cpuid_info_t info_l0, cpuid_info_t info_l1, APIC_ID_t *my_id){
     // Get the package ID
     uint64_t pkg_mask = (-1) << core_mask_width;
     my_id->pkg_id = (info_l1.edx & pkg_mask) >> core_mask_width;
+    my_id->die_id = 0;
 }
 
+// Parse the x2APIC ID using the V2 extended topology leaf 0x1F, which may
+// report module, tile and die levels between the core and package levels.
+// Returns MY_ERROR if the leaf doesn't enumerate any levels.
+// Must be called on the CPU in question.
+int
+parse_apic_id_v2(APIC_ID_t *my_id){
+
+    uint32_t level, type, shift;
+    uint32_t x2apic_id = 0;
+    uint32_t smt_shift = 0, core_shift = 0, die_lower_shift = 0, die_shift = 0;
+    uint32_t prev_shift = 0;
+    int have_die = 0;
+    cpuid_info_t info;
+
+    for (level = 0; ; level++) {
+        info = get_processor_topology_v2(level);
+        type = (info.ecx >> 8) & 0xff;
+        if (type == CPUID_TOPOLOGY_INVALID)
+            break;
+
+        shift = info.eax & 0x1f;
+        x2apic_id = info.edx;
+        switch (type) {
+        case CPUID_TOPOLOGY_SMT:
+            smt_shift = shift;
+            break;
+        case CPUID_TOPOLOGY_CORE:
+            core_shift = shift;
+            break;
+        case CPUID_TOPOLOGY_DIE:
+            die_lower_shift = prev_shift;
+            die_shift = shift;
+            have_die = 1;
+            break;
+        }
+        prev_shift = shift;
+    }
+    if (level == 0)
+        return MY_ERROR;
+
+    // prev_shift is now the width of everything below the package level
+    my_id->smt_id = x2apic_id & ~(~0U << smt_shift);
+    my_id->core_id = (x2apic_id & ~(~0U << core_shift)) >> smt_shift;
+    my_id->die_id = have_die ? (x2apic_id & ~(~0U << die_shift)) >> die_lower_shift : 0;
+    my_id->pkg_id = x2apic_id >> prev_shift;
+
+    return 0;
+}
+
+// Fall back on the kernel's idea of the die, for parts that have multiple
+// dies but don't enumerate them in CPUID.
+static void
+read_sysfs_die_id(APIC_ID_t *my_id)
+{
+    char path[64];
+    FILE *fp;
+    unsigned long die_id;
+
+    sprintf(path, "/sys/devices/system/cpu/cpu%lu/topology/die_id", my_id->os_id);
+    fp = fopen(path, "r");
+    if (fp == NULL)
+        return;
+    if (fscanf(fp, "%lu", &die_id) == 1)
+        my_id->die_id = die_id;
+    fclose(fp);
+}
 
 
 // For documentation, see:
 // http://software.intel.com/en-us/articles/intel-64-architecture-processor-topology-enumeration
+//
+// RAPL is reported per die on multi-die packages (e.g. Cascade Lake-AP), so
+// there is one RAPL node per (package, die). Nodes are numbered in order of
+// package, then die.
 int
-build_topology() {
+build_topology(rapl_ctx_t *ctx) {
 
-    int err;
-    uint64_t i;
-    uint64_t max_pkg = 0;
-    os_cpu_count = sysconf(_SC_NPROCESSORS_CONF);
+    int err = 0;
+    uint64_t i, j, n;
+    uint64_t max_pkg = 0, max_die = 0;
+    int use_v2 = (get_max_cpuid_leaf() >= 0x1f);
+    uint64_t *node_of;       // node_of[pkg * (max_die + 1) + die], or -1
     cpu_set_t prev_context;
 
-    // Construct an os map: os_map[APIC_ID ... APIC_ID]
-    os_map = (APIC_ID_t *) malloc(os_cpu_count * sizeof(APIC_ID_t));
+    // Construct an os map: ctx->os_map[APIC_ID ... APIC_ID]
+    ctx->os_map = (APIC_ID_t *) malloc(ctx->os_cpu_count * sizeof(APIC_ID_t));
+    if (ctx->os_map == NULL)
+        return MY_ERROR;
 
-    for(i=0; i < os_cpu_count; i++){
+    for(i=0; i < ctx->os_cpu_count; i++){
 
         err = bind_cpu(i, &prev_context);
 
         cpuid_info_t info_l0 = get_processor_topology(0);
         cpuid_info_t info_l1 = get_processor_topology(1);
 
-        os_map[i].os_id = i;
-        parse_apic_id(info_l0, info_l1, &os_map[i]);
+        ctx->os_map[i].os_id = i;
+        ctx->os_map[i].core_type = get_hybrid_core_type();
+        if (!use_v2 || 0 != parse_apic_id_v2(&ctx->os_map[i]))
+            parse_apic_id(info_l0, info_l1, &ctx->os_map[i]);
+        if (!use_v2)
+            read_sysfs_die_id(&ctx->os_map[i]);
 
-        num_core_threads = info_l0.ebx & 0xffff;
-        num_pkg_threads = info_l1.ebx & 0xffff;
+        ctx->num_core_threads = info_l0.ebx & 0xffff;
+        ctx->num_pkg_threads = info_l1.ebx & 0xffff;
 
-        if(os_map[i].pkg_id > max_pkg)
-            max_pkg = os_map[i].pkg_id;
+        if(ctx->os_map[i].pkg_id > max_pkg)
+            max_pkg = ctx->os_map[i].pkg_id;
+        if(ctx->os_map[i].die_id > max_die)
+            max_die = ctx->os_map[i].die_id;
 
         err = bind_context(&prev_context, NULL);
 
-        //printf("smt_id: %u core_id: %u pkg_id: %u os_id: %u\n",
-        //   os_map[i].smt_id, os_map[i].core_id, os_map[i].pkg_id, os_map[i].os_id);
+        //printf("smt_id: %u core_id: %u die_id: %u pkg_id: %u os_id: %u\n",
+        //   ctx->os_map[i].smt_id, ctx->os_map[i].core_id, ctx->os_map[i].die_id, ctx->os_map[i].pkg_id, ctx->os_map[i].os_id);
 
     }
 
-    num_pkg_cores = num_pkg_threads / num_core_threads;
-    num_nodes = max_pkg + 1;
+    ctx->num_pkg_cores = ctx->num_pkg_threads / ctx->num_core_threads;
 
-    // Construct a pkg map: pkg_map[pkg id][APIC_ID ... APIC_ID]
-    pkg_map = (APIC_ID_t **) malloc(num_nodes * sizeof(APIC_ID_t*));
-    for(i = 0; i < num_nodes; i++)
-        pkg_map[i] = (APIC_ID_t *) malloc(num_pkg_threads * sizeof(APIC_ID_t));
+    // Number the (package, die) pairs that actually exist
+    node_of = (uint64_t *) malloc((max_pkg + 1) * (max_die + 1) * sizeof(uint64_t));
+    if (node_of == NULL)
+        return MY_ERROR;
+    for(i = 0; i < (max_pkg + 1) * (max_die + 1); i++)
+        node_of[i] = (uint64_t) -1;
+    for(i = 0; i < ctx->os_cpu_count; i++)
+        node_of[ctx->os_map[i].pkg_id * (max_die + 1) + ctx->os_map[i].die_id] = 0;
+
+    ctx->num_nodes = 0;
+    for(i = 0; i <= max_pkg; i++) {
+        n = 0;
+        for(j = 0; j <= max_die; j++)
+            if(node_of[i * (max_die + 1) + j] == 0) {
+                node_of[i * (max_die + 1) + j] = ctx->num_nodes++;
+                n++;
+            }
+        if(n > ctx->num_pkg_dies)
+            ctx->num_pkg_dies = n;
+    }
 
-    uint64_t p, t;
-    for(i = 0; i < os_cpu_count; i++){
-        p = os_map[i].pkg_id;
-        t = os_map[i].smt_id * num_pkg_cores + os_map[i].core_id;
-        pkg_map[p][t] = os_map[i];
+    // Construct a node map: ctx->pkg_map[node][APIC_ID ... APIC_ID]
+    ctx->pkg_map = (APIC_ID_t **) calloc(ctx->num_nodes, sizeof(APIC_ID_t*));
+    ctx->node_threads = (uint64_t *) calloc(ctx->num_nodes, sizeof(uint64_t));
+    if (ctx->pkg_map == NULL || ctx->node_threads == NULL) {
+        free(node_of);
+        return MY_ERROR;
+    }
+    for(i = 0; i < ctx->os_cpu_count; i++) {
+        ctx->os_map[i].node = node_of[ctx->os_map[i].pkg_id * (max_die + 1) + ctx->os_map[i].die_id];
+        ctx->node_threads[ctx->os_map[i].node]++;
+    }
+    for(i = 0; i < ctx->num_nodes; i++) {
+        ctx->pkg_map[i] = (APIC_ID_t *) malloc(ctx->node_threads[i] * sizeof(APIC_ID_t));
+        if (ctx->pkg_map[i] == NULL)
+            err = MY_ERROR;
+        ctx->node_threads[i] = 0;
+    }
+    for(i = 0; !err && i < ctx->os_cpu_count; i++){
+        n = ctx->os_map[i].node;
+        ctx->pkg_map[n][ctx->node_threads[n]++] = ctx->os_map[i];
     }
 
-    //for(i=0; i< num_nodes; i++)
-    //    for(j=0; j<num_pkg_threads; j++)
-    //        printf("smt_id: %u core_id: %u pkg_id: %u os_id: %u\n",
-    //            pkg_map[i][j].smt_id, pkg_map[i][j].core_id,
-    //            pkg_map[i][j].pkg_id, pkg_map[i][j].os_id);
+    free(node_of);
+
+    //for(i=0; i< ctx->num_nodes; i++)
+    //    for(j=0; j<ctx->node_threads[i]; j++)
+    //        printf("smt_id: %u core_id: %u die_id: %u pkg_id: %u os_id: %u\n",
+    //            ctx->pkg_map[i][j].smt_id, ctx->pkg_map[i][j].core_id, ctx->pkg_map[i][j].die_id,
+    //            ctx->pkg_map[i][j].pkg_id, ctx->pkg_map[i][j].os_id);
 
     return err;
 }
 
-/*!
- * \brief Intialize the power_gov library for use.
- *
- * This function must be called before calling any other function from the power_gov library.
- * \return 0 on success, -1 otherwise
- */
-int
-init_rapl()
+static int
+init_intel_rapl(rapl_ctx_t *ctx, uint32_t processor_signature)
 {
-    int      err = 0;
-    uint32_t processor_signature;
-
-    processor_signature = get_processor_signature();
-    msr_support_table = (unsigned char*) calloc(MSR_SUPPORT_MASK, sizeof(unsigned char));
+    ctx->msr_power_unit = MSR_RAPL_POWER_UNIT;
+    ctx->msr_pkg_energy_status = MSR_RAPL_PKG_ENERGY_STATUS;
+    ctx->msr_pp0_energy_status = MSR_RAPL_PP0_ENERGY_STATUS;
 
     /* RAPL MSRs by Table
      *   35-11: SandyBridge
@@ -254,159 +418,345 @@ init_rapl()
 
     switch (processor_signature & 0xfffffff0) {
     case 0x306e0: /* IvyBridge server: 0x306eX (Tables 35:11,12,14,15,16) */
-        msr_support_table[MSR_RAPL_POWER_UNIT & MSR_SUPPORT_MASK]          = 1;
-        msr_support_table[MSR_RAPL_PKG_POWER_LIMIT & MSR_SUPPORT_MASK]     = 1;
-        msr_support_table[MSR_RAPL_PKG_ENERGY_STATUS & MSR_SUPPORT_MASK]   = 1;
-        msr_support_table[MSR_RAPL_PKG_PERF_STATUS & MSR_SUPPORT_MASK]     = 1;
-        msr_support_table[MSR_RAPL_PKG_POWER_INFO & MSR_SUPPORT_MASK]      = 1;
-        msr_support_table[MSR_RAPL_DRAM_POWER_LIMIT & MSR_SUPPORT_MASK]    = 1;
-        msr_support_table[MSR_RAPL_DRAM_ENERGY_STATUS & MSR_SUPPORT_MASK]  = 1;
-        msr_support_table[MSR_RAPL_DRAM_PERF_STATUS & MSR_SUPPORT_MASK]    = 1;
-        msr_support_table[MSR_RAPL_DRAM_POWER_INFO & MSR_SUPPORT_MASK]     = 1;
-        msr_support_table[MSR_RAPL_PP0_POWER_LIMIT & MSR_SUPPORT_MASK]     = 1;
-        msr_support_table[MSR_RAPL_PP0_ENERGY_STATUS & MSR_SUPPORT_MASK]   = 1;
-        msr_support_table[MSR_RAPL_PP0_POLICY & MSR_SUPPORT_MASK]          = 1;
-        msr_support_table[MSR_RAPL_PP0_PERF_STATUS & MSR_SUPPORT_MASK]     = 1;
-        msr_support_table[MSR_RAPL_PP1_POWER_LIMIT & MSR_SUPPORT_MASK]     = 1;
-        msr_support_table[MSR_RAPL_PP1_ENERGY_STATUS & MSR_SUPPORT_MASK]   = 1;
-        msr_support_table[MSR_RAPL_PP1_POLICY & MSR_SUPPORT_MASK]          = 1;
+        ctx->msr_support_table[MSR_RAPL_POWER_UNIT & MSR_SUPPORT_MASK]          = 1;
+        ctx->msr_support_table[MSR_RAPL_PKG_POWER_LIMIT & MSR_SUPPORT_MASK]     = 1;
+        ctx->msr_support_table[MSR_RAPL_PKG_ENERGY_STATUS & MSR_SUPPORT_MASK]   = 1;
+        ctx->msr_support_table[MSR_RAPL_PKG_PERF_STATUS & MSR_SUPPORT_MASK]     = 1;
+        ctx->msr_support_table[MSR_RAPL_PKG_POWER_INFO & MSR_SUPPORT_MASK]      = 1;
+        ctx->msr_support_table[MSR_RAPL_DRAM_POWER_LIMIT & MSR_SUPPORT_MASK]    = 1;
+        ctx->msr_support_table[MSR_RAPL_DRAM_ENERGY_STATUS & MSR_SUPPORT_MASK]  = 1;
+        ctx->msr_support_table[MSR_RAPL_DRAM_PERF_STATUS & MSR_SUPPORT_MASK]    = 1;
+        ctx->msr_support_table[MSR_RAPL_DRAM_POWER_INFO & MSR_SUPPORT_MASK]     = 1;
+        ctx->msr_support_table[MSR_RAPL_PP0_POWER_LIMIT & MSR_SUPPORT_MASK]     = 1;
+        ctx->msr_support_table[MSR_RAPL_PP0_ENERGY_STATUS & MSR_SUPPORT_MASK]   = 1;
+        ctx->msr_support_table[MSR_RAPL_PP0_POLICY & MSR_SUPPORT_MASK]          = 1;
+        ctx->msr_support_table[MSR_RAPL_PP0_PERF_STATUS & MSR_SUPPORT_MASK]     = 1;
+        ctx->msr_support_table[MSR_RAPL_PP1_POWER_LIMIT & MSR_SUPPORT_MASK]     = 1;
+        ctx->msr_support_table[MSR_RAPL_PP1_ENERGY_STATUS & MSR_SUPPORT_MASK]   = 1;
+        ctx->msr_support_table[MSR_RAPL_PP1_POLICY & MSR_SUPPORT_MASK]          = 1;
         break;
+    case 0xb06f0: /* Raptor Lake S:      0xb06fX (hybrid) */
+    case 0xb06a0: /* Raptor Lake P:      0xb06aX (hybrid) */
+    case 0xb0670: /* Raptor Lake S:      0xb067X (hybrid) */
+    case 0x906a0: /* Alder Lake P:       0x906aX (hybrid) */
+    case 0x90670: /* Alder Lake S:       0x9067X (hybrid) */
     case 0x40660: /* Haswell:            0x4066X (Tables 35:11,12,14,17,19) */
     case 0x40650: /* Haswell:            0x4065X (Tables 35:11,12,14,17,18,19) */
     case 0x306c0: /* Haswell:            0x306cX (Tables 35:11,12,14,17,19) */
     case 0x306a0: /* IvyBridge client:   0x306aX (Tables 35:11,12,14) */
     case 0x206a0: /* SandyBridge client: 0x206aX (Tables 35:11,12) */
-        msr_support_table[MSR_RAPL_POWER_UNIT & MSR_SUPPORT_MASK]          = 1;
-        msr_support_table[MSR_RAPL_PKG_POWER_LIMIT & MSR_SUPPORT_MASK]     = 1;
-        msr_support_table[MSR_RAPL_PKG_ENERGY_STATUS & MSR_SUPPORT_MASK]   = 1;
-        msr_support_table[MSR_RAPL_PKG_PERF_STATUS & MSR_SUPPORT_MASK]     = 0; //
-        msr_support_table[MSR_RAPL_PKG_POWER_INFO & MSR_SUPPORT_MASK]      = 1;
-        msr_support_table[MSR_RAPL_DRAM_POWER_LIMIT & MSR_SUPPORT_MASK]    = 0; //
-        msr_support_table[MSR_RAPL_DRAM_ENERGY_STATUS & MSR_SUPPORT_MASK]  = 0; //
-        msr_support_table[MSR_RAPL_DRAM_PERF_STATUS & MSR_SUPPORT_MASK]    = 0; //
-        msr_support_table[MSR_RAPL_DRAM_POWER_INFO & MSR_SUPPORT_MASK]     = 0; //
-        msr_support_table[MSR_RAPL_PP0_POWER_LIMIT & MSR_SUPPORT_MASK]     = 1;
-        msr_support_table[MSR_RAPL_PP0_ENERGY_STATUS & MSR_SUPPORT_MASK]   = 1;
-        msr_support_table[MSR_RAPL_PP0_POLICY & MSR_SUPPORT_MASK]          = 1;
-        msr_support_table[MSR_RAPL_PP0_PERF_STATUS & MSR_SUPPORT_MASK]     = 1;
-        msr_support_table[MSR_RAPL_PP1_POWER_LIMIT & MSR_SUPPORT_MASK]     = 1; //
-        msr_support_table[MSR_RAPL_PP1_ENERGY_STATUS & MSR_SUPPORT_MASK]   = 1; //
-        msr_support_table[MSR_RAPL_PP1_POLICY & MSR_SUPPORT_MASK]          = 1; //
+        ctx->msr_support_table[MSR_RAPL_POWER_UNIT & MSR_SUPPORT_MASK]          = 1;
+        ctx->msr_support_table[MSR_RAPL_PKG_POWER_LIMIT & MSR_SUPPORT_MASK]     = 1;
+        ctx->msr_support_table[MSR_RAPL_PKG_ENERGY_STATUS & MSR_SUPPORT_MASK]   = 1;
+        ctx->msr_support_table[MSR_RAPL_PKG_PERF_STATUS & MSR_SUPPORT_MASK]     = 0; //
+        ctx->msr_support_table[MSR_RAPL_PKG_POWER_INFO & MSR_SUPPORT_MASK]      = 1;
+        ctx->msr_support_table[MSR_RAPL_DRAM_POWER_LIMIT & MSR_SUPPORT_MASK]    = 0; //
+        ctx->msr_support_table[MSR_RAPL_DRAM_ENERGY_STATUS & MSR_SUPPORT_MASK]  = 0; //
+        ctx->msr_support_table[MSR_RAPL_DRAM_PERF_STATUS & MSR_SUPPORT_MASK]    = 0; //
+        ctx->msr_support_table[MSR_RAPL_DRAM_POWER_INFO & MSR_SUPPORT_MASK]     = 0; //
+        ctx->msr_support_table[MSR_RAPL_PP0_POWER_LIMIT & MSR_SUPPORT_MASK]     = 1;
+        ctx->msr_support_table[MSR_RAPL_PP0_ENERGY_STATUS & MSR_SUPPORT_MASK]   = 1;
+        ctx->msr_support_table[MSR_RAPL_PP0_POLICY & MSR_SUPPORT_MASK]          = 1;
+        ctx->msr_support_table[MSR_RAPL_PP0_PERF_STATUS & MSR_SUPPORT_MASK]     = 1;
+        ctx->msr_support_table[MSR_RAPL_PP1_POWER_LIMIT & MSR_SUPPORT_MASK]     = 1; //
+        ctx->msr_support_table[MSR_RAPL_PP1_ENERGY_STATUS & MSR_SUPPORT_MASK]   = 1; //
+        ctx->msr_support_table[MSR_RAPL_PP1_POLICY & MSR_SUPPORT_MASK]          = 1; //
+        break;
+    case 0x50650: /* Skylake/Cascade Lake/Cooper Lake server: 0x5065X */
+        ctx->msr_support_table[MSR_RAPL_POWER_UNIT & MSR_SUPPORT_MASK]          = 1;
+        ctx->msr_support_table[MSR_RAPL_PKG_POWER_LIMIT & MSR_SUPPORT_MASK]     = 1;
+        ctx->msr_support_table[MSR_RAPL_PKG_ENERGY_STATUS & MSR_SUPPORT_MASK]   = 1;
+        ctx->msr_support_table[MSR_RAPL_PKG_PERF_STATUS & MSR_SUPPORT_MASK]     = 1;
+        ctx->msr_support_table[MSR_RAPL_PKG_POWER_INFO & MSR_SUPPORT_MASK]      = 1;
+        ctx->msr_support_table[MSR_RAPL_DRAM_POWER_LIMIT & MSR_SUPPORT_MASK]    = 1;
+        ctx->msr_support_table[MSR_RAPL_DRAM_ENERGY_STATUS & MSR_SUPPORT_MASK]  = 1;
+        ctx->msr_support_table[MSR_RAPL_DRAM_PERF_STATUS & MSR_SUPPORT_MASK]    = 1;
+        ctx->msr_support_table[MSR_RAPL_DRAM_POWER_INFO & MSR_SUPPORT_MASK]     = 1;
+        ctx->msr_support_table[MSR_RAPL_PP0_POWER_LIMIT & MSR_SUPPORT_MASK]     = 0; //
+        ctx->msr_support_table[MSR_RAPL_PP0_ENERGY_STATUS & MSR_SUPPORT_MASK]   = 0; //
+        ctx->msr_support_table[MSR_RAPL_PP0_POLICY & MSR_SUPPORT_MASK]          = 0; //
+        ctx->msr_support_table[MSR_RAPL_PP0_PERF_STATUS & MSR_SUPPORT_MASK]     = 0; //
+        ctx->msr_support_table[MSR_RAPL_PP1_POWER_LIMIT & MSR_SUPPORT_MASK]     = 0; //
+        ctx->msr_support_table[MSR_RAPL_PP1_ENERGY_STATUS & MSR_SUPPORT_MASK]   = 0; //
+        ctx->msr_support_table[MSR_RAPL_PP1_POLICY & MSR_SUPPORT_MASK]          = 0; //
+        ctx->msr_support_table[MSR_UNCORE_RATIO_LIMIT & MSR_SUPPORT_MASK]       = 1;
+        ctx->msr_support_table[MSR_UNCORE_PERF_STATUS & MSR_SUPPORT_MASK]       = 1;
+        ctx->dram_energy_unit = DRAM_ENERGY_UNIT_FIXED;
         break;
     //case 0x20650: /* Valgrind */
     case 0x206d0: /* SandyBridge server: 0x206dX (Tables 35:11,13) */
-        msr_support_table[MSR_RAPL_POWER_UNIT & MSR_SUPPORT_MASK]          = 1;
-        msr_support_table[MSR_RAPL_PKG_POWER_LIMIT & MSR_SUPPORT_MASK]     = 1;
-        msr_support_table[MSR_RAPL_PKG_ENERGY_STATUS & MSR_SUPPORT_MASK]   = 1;
-        msr_support_table[MSR_RAPL_PKG_PERF_STATUS & MSR_SUPPORT_MASK]     = 1; //
-        msr_support_table[MSR_RAPL_PKG_POWER_INFO & MSR_SUPPORT_MASK]      = 1;
-        msr_support_table[MSR_RAPL_DRAM_POWER_LIMIT & MSR_SUPPORT_MASK]    = 1; //
-        msr_support_table[MSR_RAPL_DRAM_ENERGY_STATUS & MSR_SUPPORT_MASK]  = 1; //
-        msr_support_table[MSR_RAPL_DRAM_PERF_STATUS & MSR_SUPPORT_MASK]    = 1; //
-        msr_support_table[MSR_RAPL_DRAM_POWER_INFO & MSR_SUPPORT_MASK]     = 1; //
-        msr_support_table[MSR_RAPL_PP0_POWER_LIMIT & MSR_SUPPORT_MASK]     = 1;
-        msr_support_table[MSR_RAPL_PP0_ENERGY_STATUS & MSR_SUPPORT_MASK]   = 1;
-        msr_support_table[MSR_RAPL_PP0_POLICY & MSR_SUPPORT_MASK]          = 1;
-        msr_support_table[MSR_RAPL_PP0_PERF_STATUS & MSR_SUPPORT_MASK]     = 1;
-        msr_support_table[MSR_RAPL_PP1_POWER_LIMIT & MSR_SUPPORT_MASK]     = 0; //
-        msr_support_table[MSR_RAPL_PP1_ENERGY_STATUS & MSR_SUPPORT_MASK]   = 0; //
-        msr_support_table[MSR_RAPL_PP1_POLICY & MSR_SUPPORT_MASK]          = 0; //
+        ctx->msr_support_table[MSR_RAPL_POWER_UNIT & MSR_SUPPORT_MASK]          = 1;
+        ctx->msr_support_table[MSR_RAPL_PKG_POWER_LIMIT & MSR_SUPPORT_MASK]     = 1;
+        ctx->msr_support_table[MSR_RAPL_PKG_ENERGY_STATUS & MSR_SUPPORT_MASK]   = 1;
+        ctx->msr_support_table[MSR_RAPL_PKG_PERF_STATUS & MSR_SUPPORT_MASK]     = 1; //
+        ctx->msr_support_table[MSR_RAPL_PKG_POWER_INFO & MSR_SUPPORT_MASK]      = 1;
+        ctx->msr_support_table[MSR_RAPL_DRAM_POWER_LIMIT & MSR_SUPPORT_MASK]    = 1; //
+        ctx->msr_support_table[MSR_RAPL_DRAM_ENERGY_STATUS & MSR_SUPPORT_MASK]  = 1; //
+        ctx->msr_support_table[MSR_RAPL_DRAM_PERF_STATUS & MSR_SUPPORT_MASK]    = 1; //
+        ctx->msr_support_table[MSR_RAPL_DRAM_POWER_INFO & MSR_SUPPORT_MASK]     = 1; //
+        ctx->msr_support_table[MSR_RAPL_PP0_POWER_LIMIT & MSR_SUPPORT_MASK]     = 1;
+        ctx->msr_support_table[MSR_RAPL_PP0_ENERGY_STATUS & MSR_SUPPORT_MASK]   = 1;
+        ctx->msr_support_table[MSR_RAPL_PP0_POLICY & MSR_SUPPORT_MASK]          = 1;
+        ctx->msr_support_table[MSR_RAPL_PP0_PERF_STATUS & MSR_SUPPORT_MASK]     = 1;
+        ctx->msr_support_table[MSR_RAPL_PP1_POWER_LIMIT & MSR_SUPPORT_MASK]     = 0; //
+        ctx->msr_support_table[MSR_RAPL_PP1_ENERGY_STATUS & MSR_SUPPORT_MASK]   = 0; //
+        ctx->msr_support_table[MSR_RAPL_PP1_POLICY & MSR_SUPPORT_MASK]          = 0; //
         break;
     default:
         fprintf(stderr, "RAPL not supported, or machine model %x not recognized.\n", processor_signature);
         return MY_ERROR;
     }
 
-    err = read_rapl_units();
-    err += build_topology();
+    return 0;
+}
+
+/*
+ * AMD Family 17h and later (Zen) only have the unit, package energy and
+ * per-core energy registers; see the "Processor Programming Reference (PPR)"
+ * of the respective family, MSRs C001_0299h to C001_029Bh. The PP0 domain
+ * is the sum of the per-core registers of the node.
+ */
+static int
+init_amd_rapl(rapl_ctx_t *ctx, uint32_t processor_signature)
+{
+    if (!has_amd_rapl()) {
+        fprintf(stderr, "RAPL not supported on AMD processor %x.\n", processor_signature);
+        return MY_ERROR;
+    }
+
+    ctx->msr_power_unit = MSR_AMD_RAPL_POWER_UNIT;
+    ctx->msr_pkg_energy_status = MSR_AMD_PKG_ENERGY_STATUS;
+    ctx->msr_pp0_energy_status = MSR_AMD_CORE_ENERGY_STATUS;
+
+    ctx->msr_support_table[MSR_AMD_RAPL_POWER_UNIT & MSR_SUPPORT_MASK]    = 1;
+    ctx->msr_support_table[MSR_AMD_PKG_ENERGY_STATUS & MSR_SUPPORT_MASK]  = 1;
+    ctx->msr_support_table[MSR_AMD_CORE_ENERGY_STATUS & MSR_SUPPORT_MASK] = 1;
+
+    return 0;
+}
+
+static int init_rapl_batch(rapl_ctx_t *ctx);
+static void init_uncore(rapl_ctx_t *ctx);
+
+/*!
+ * \brief Intialize the power_gov library for use.
+ *
+ * This function must be called before calling any other function from the power_gov library.
+ * It allocates a new context, which all other functions take as their first argument. The
+ * MSR backend (see set_msr_backend()) is captured here, so select it beforehand.
+ * \return 0 on success (*ctx is set), -1 otherwise (*ctx is NULL)
+ */
+int
+init_rapl(rapl_ctx_t **ctx_out)
+{
+    int      err = 0;
+    uint32_t processor_signature;
+    rapl_ctx_t *ctx;
+
+    *ctx_out = NULL;
+    ctx = (rapl_ctx_t *) calloc(1, sizeof(rapl_ctx_t));
+    if (NULL == ctx)
+        return MY_ERROR;
+    ctx->num_pkg_dies = 1;
+
+    ctx->os_cpu_count = get_num_processors();
+    err = msr_cache_init(&ctx->msr, ctx->os_cpu_count);
+    if (err) {
+        free(ctx);
+        return MY_ERROR;
+    }
+
+    processor_signature = get_processor_signature();
+    ctx->cpu_vendor = get_processor_vendor();
+
+    if (CPU_VENDOR_AMD == ctx->cpu_vendor)
+        err = init_amd_rapl(ctx, processor_signature);
+    else
+        err = init_intel_rapl(ctx, processor_signature);
+
+    if (!err)
+        err = read_rapl_units(ctx);
+    if (!err)
+        err = build_topology(ctx);
+    if (!err) {
+        ctx->cpu_activity = (cpu_activity_t *) calloc(ctx->os_cpu_count, sizeof(cpu_activity_t));
+        ctx->node_activity = (node_activity_t *) calloc(ctx->num_nodes, sizeof(node_activity_t));
+        if (NULL == ctx->cpu_activity || NULL == ctx->node_activity)
+            err = MY_ERROR;
+    }
+    if (!err)
+        init_uncore(ctx);
+    if (!err && (NULL != ctx->msr.backend->batch_device || ctx->msr.backend->uring))
+        err = init_rapl_batch(ctx);
+    if (err) {
+        terminate_rapl(ctx);
+        return MY_ERROR;
+    }
 
     /* 32 is the width of these fields when they are stored */
-    MAX_ENERGY_STATUS_JOULES = (double)(RAPL_ENERGY_UNIT * (pow(2, 32) - 1));
-    MAX_THROTTLED_TIME_SECONDS = (double)(RAPL_TIME_UNIT * (pow(2, 32) - 1));
+    ctx->max_energy_status_joules = (double)(ctx->energy_unit * (pow(2, 32) - 1));
+    ctx->max_throttled_time_seconds = (double)(ctx->time_unit * (pow(2, 32) - 1));
 
-    return err;
+    *ctx_out = ctx;
+    return 0;
 }
 
 /*!
  * \brief Terminate the power_gov library.
  *
  * Call this function function to cleanup resources and terminate the
- * power_gov library.
+ * power_gov library. ctx is freed; passing NULL is allowed.
  * \return 0 on success
  */
 int
-terminate_rapl()
+terminate_rapl(rapl_ctx_t *ctx)
 {
     uint64_t i;
 
-    if(NULL != os_map)
-        free(os_map);
+    if(NULL == ctx)
+        return 0;
+
+    if(NULL != ctx->os_map)
+        free(ctx->os_map);
+
+    if(NULL != ctx->pkg_map){
+        for(i = 0; i < ctx->num_nodes; i++)
+            free(ctx->pkg_map[i]);
+        free(ctx->pkg_map);
+    }
+
+    if(NULL != ctx->node_threads)
+        free(ctx->node_threads);
+
+    if(NULL != ctx->cpu_activity)
+        free(ctx->cpu_activity);
+
+    if(NULL != ctx->node_activity)
+        free(ctx->node_activity);
 
-    if(NULL != pkg_map){
-        for(i = 0; i < num_nodes; i++)
-            free(pkg_map[i]);
-        free(pkg_map);
+    if(NULL != ctx->batch_cpu_op)
+        msr_batch_close(&ctx->batch);
+    free(ctx->batch_energy_op);
+    free(ctx->batch_perf_op);
+    free(ctx->batch_cpu_op);
+    free(ctx->batch_uncore_op);
+
+    if(NULL != ctx->uncore_fd){
+        for(i = 0; i < ctx->num_nodes * 3; i++)
+            if(ctx->uncore_fd[i] >= 0)
+                close(ctx->uncore_fd[i]);
+        free(ctx->uncore_fd);
     }
 
-    if(NULL != msr_support_table)
-        free(msr_support_table);
+    msr_cache_close(&ctx->msr);
+    free(ctx);
 
     return 0;
 }
 
+
 /*!
  * \brief Check if MSR is supported on this machine.
  * \return 1 if supported, 0 otherwise
  */
 uint64_t
-is_supported_msr(uint64_t msr)
+is_supported_msr(rapl_ctx_t *ctx, uint64_t msr)
 {
-    return (uint64_t)msr_support_table[msr & MSR_SUPPORT_MASK];
+    return (uint64_t)ctx->msr_support_table[msr & MSR_SUPPORT_MASK];
 }
 
 /*!
  * \brief Check if power domain (PKG, PP0, PP1, DRAM) is supported on this machine.
  *
  * Currently server parts support: PKG, PP0 and DRAM and
- * client parts support PKG, PP0 and PP1.
+ * client parts support PKG, PP0 and PP1. AMD parts support PKG and PP0, but
+ * no power limits.
  *
- * \return 1 if supported, 0 otherwise
+ * \return 1 if the domain's energy can be read, 0 otherwise
  */
 uint64_t
-is_supported_domain(uint64_t power_domain)
+is_supported_domain(rapl_ctx_t *ctx, uint64_t power_domain)
 {
     uint64_t supported = 0;
 
     switch (power_domain) {
     case RAPL_PKG:
-        supported = is_supported_msr(MSR_RAPL_PKG_POWER_LIMIT);
+        supported = is_supported_msr(ctx, ctx->msr_pkg_energy_status);
         break;
     case RAPL_PP0:
-        supported = is_supported_msr(MSR_RAPL_PP0_POWER_LIMIT);
+        supported = is_supported_msr(ctx, ctx->msr_pp0_energy_status);
         break;
     case RAPL_PP1:
-        supported = is_supported_msr(MSR_RAPL_PP1_POWER_LIMIT);
+        supported = is_supported_msr(ctx, MSR_RAPL_PP1_ENERGY_STATUS);
         break;
     case RAPL_DRAM:
-        supported = is_supported_msr(MSR_RAPL_DRAM_POWER_LIMIT);
+        supported = is_supported_msr(ctx, MSR_RAPL_DRAM_ENERGY_STATUS);
         break;
     }
 
     return supported;
 }
 
+/*!
+ * \brief Get the package and die a RAPL node belongs to.
+ * \return 0 on success, -1 if there is no such node
+ */
+int
+get_rapl_node_location(rapl_ctx_t *ctx, uint64_t node, uint64_t *pkg_id, uint64_t *die_id)
+{
+    if (node >= ctx->num_nodes)
+        return MY_ERROR;
+
+    *pkg_id = ctx->pkg_map[node][0].pkg_id;
+    *die_id = ctx->pkg_map[node][0].die_id;
+    return 0;
+}
+
+/*!
+ * \brief Get the RAPL node an OS CPU belongs to.
+ * \return 0 on success, -1 if there is no such CPU
+ */
+int
+get_cpu_rapl_node(rapl_ctx_t *ctx, uint64_t os_cpu, uint64_t *node)
+{
+    if (os_cpu >= ctx->os_cpu_count)
+        return MY_ERROR;
+
+    *node = ctx->os_map[os_cpu].node;
+    return 0;
+}
+
+/*!
+ * \brief Get the number of OS CPUs known to the library.
+ */
+uint64_t
+get_num_os_cpus(rapl_ctx_t *ctx)
+{
+    return ctx->os_cpu_count;
+}
+
+/*!
+ * \brief Get the highest number of dies (and thus RAPL nodes) per package.
+ */
+uint64_t
+get_num_dies_per_pkg(rapl_ctx_t *ctx)
+{
+    return ctx->num_pkg_dies;
+}
+
 /*!
  * \brief Get the number of RAPL nodes (package domain) on this machine.
  *
  * Get the number of package power domains, that you can control using RAPL.
- * This is equal to the number of CPU packages in the system.
+ * This is equal to the number of CPU packages in the system, times the
+ * number of dies per package on multi-die parts.
  *
  * \return number of RAPL nodes.
  */
 uint64_t
-get_num_rapl_nodes_pkg()
+get_num_rapl_nodes_pkg(rapl_ctx_t *ctx)
 {
-    return num_nodes;
+    return ctx->num_nodes;
 }
 
 /*!
@@ -420,9 +770,9 @@ get_num_rapl_nodes_pkg()
  * \return number of RAPL nodes.
  */
 uint64_t
-get_num_rapl_nodes_pp0()
+get_num_rapl_nodes_pp0(rapl_ctx_t *ctx)
 {
-    return num_nodes;
+    return ctx->num_nodes;
 }
 
 /*!
@@ -434,9 +784,9 @@ get_num_rapl_nodes_pp0()
  * \return number of RAPL nodes.
  */
 uint64_t
-get_num_rapl_nodes_pp1()
+get_num_rapl_nodes_pp1(rapl_ctx_t *ctx)
 {
-    return num_nodes;
+    return ctx->num_nodes;
 }
 
 /*!
@@ -448,75 +798,78 @@ get_num_rapl_nodes_pp1()
  * \return number of RAPL nodes.
  */
 uint64_t
-get_num_rapl_nodes_dram()
+get_num_rapl_nodes_dram(rapl_ctx_t *ctx)
 {
-    return num_nodes;
+    return ctx->num_nodes;
 }
 
 uint64_t
-pkg_node_to_cpu(uint64_t node)
+pkg_node_to_cpu(rapl_ctx_t *ctx, uint64_t node)
 {
-    return pkg_map[node][0].os_id;
+    return ctx->pkg_map[node][0].os_id;
 }
 
 uint64_t
-pp0_node_to_cpu(uint64_t node)
+pp0_node_to_cpu(rapl_ctx_t *ctx, uint64_t node)
 {
-    return pkg_map[node][0].os_id;
+    return ctx->pkg_map[node][0].os_id;
 }
 
 uint64_t
-pp1_node_to_cpu(uint64_t node)
+pp1_node_to_cpu(rapl_ctx_t *ctx, uint64_t node)
 {
-    return pkg_map[node][0].os_id;
+    return ctx->pkg_map[node][0].os_id;
 }
 
 uint64_t
-dram_node_to_cpu(uint64_t node)
+dram_node_to_cpu(rapl_ctx_t *ctx, uint64_t node)
 {
-    return pkg_map[node][0].os_id;
+    return ctx->pkg_map[node][0].os_id;
 }
 
 double
-convert_to_watts(uint64_t raw)
+convert_to_watts(rapl_ctx_t *ctx, uint64_t raw)
 {
-    return RAPL_POWER_UNIT * raw;
+    return ctx->power_unit * raw;
 }
 
 double
-convert_to_joules(uint64_t raw)
+convert_to_joules(rapl_ctx_t *ctx, uint64_t raw)
 {
-    return RAPL_ENERGY_UNIT * raw;
+    return ctx->energy_unit * raw;
 }
 
 double
-convert_to_seconds(uint64_t raw)
+convert_to_seconds(rapl_ctx_t *ctx, uint64_t raw)
 {
-    return RAPL_TIME_UNIT * raw;
+    return ctx->time_unit * raw;
 }
 
 double
-convert_from_limit_time_window(uint64_t Y,
+convert_from_limit_time_window(rapl_ctx_t *ctx,
+                               uint64_t Y,
                                uint64_t F)
 {
-    return B2POW(Y) * A_F[F] * RAPL_TIME_UNIT;
+    return B2POW(Y) * A_F[F] * ctx->time_unit;
 }
 
 uint64_t
-convert_from_watts(double converted)
+convert_from_watts(rapl_ctx_t *ctx, double converted)
 {
-    return converted / RAPL_POWER_UNIT;
+    return converted / ctx->power_unit;
 }
 
 uint64_t
-compute_Y(uint64_t F,
+compute_Y(rapl_ctx_t *ctx,
+          uint64_t F,
           double   time)
 {
-    return (log((double)(time / RAPL_TIME_UNIT)) - A_LNF[F]) / LN2;
+    return (log((double)(time / ctx->time_unit)) - A_LNF[F]) / LN2;
 }
 
 void
-convert_to_limit_time_window(double    time,
+convert_to_limit_time_window(rapl_ctx_t *ctx,
+                             double    time,
                              uint64_t *Y,
                              uint64_t *F)
 {
@@ -526,8 +879,8 @@ convert_to_limit_time_window(double    time,
     double       current_delta = 0.0;
     double       delta = 2147483648.0;
     for (current_F = 0; current_F < 4; ++current_F) {
-        current_Y = compute_Y(current_F, time);
-        current_time = convert_from_limit_time_window(current_Y, current_F);
+        current_Y = compute_Y(ctx, current_F, time);
+        current_time = convert_from_limit_time_window(ctx, current_Y, current_F);
         current_delta = time - current_time;
         if (current_delta >= 0 && current_delta < delta) {
             delta = current_delta;
@@ -538,16 +891,17 @@ convert_to_limit_time_window(double    time,
 }
 
 int
-get_rapl_unit_multiplier(uint64_t                cpu,
+get_rapl_unit_multiplier(rapl_ctx_t *ctx,
+                         uint64_t                cpu,
                          rapl_unit_multiplier_t *unit_obj)
 {
     int                        err = 0;
     uint64_t                   msr;
     rapl_unit_multiplier_msr_t unit_msr;
 
-    err = !is_supported_msr(MSR_RAPL_POWER_UNIT);
+    err = !is_supported_msr(ctx, ctx->msr_power_unit);
     if (!err) {
-        err = read_msr(cpu, MSR_RAPL_POWER_UNIT, &msr);
+        err = read_msr_cached(&ctx->msr, cpu, ctx->msr_power_unit, &msr);
     }
     if (!err) {
         unit_msr = *(rapl_unit_multiplier_msr_t *)&msr;
@@ -563,7 +917,8 @@ get_rapl_unit_multiplier(uint64_t                cpu,
 /* Common methods (should not be interfaced directly) */
 
 int
-get_rapl_power_limit_control(uint64_t                    cpu,
+get_rapl_power_limit_control(rapl_ctx_t *ctx,
+                             uint64_t                    cpu,
                              uint64_t                    msr_address,
                              rapl_power_limit_control_t *domain_obj)
 {
@@ -572,18 +927,18 @@ get_rapl_power_limit_control(uint64_t                    cpu,
     rapl_power_limit_control_msr_t domain_msr;
     cpu_set_t old_context;
 
-    err = !is_supported_msr(msr_address);
+    err = !is_supported_msr(ctx, msr_address);
     if (!err) {
         bind_cpu(cpu, &old_context); // improve performance on Linux
-        err = read_msr(cpu, msr_address, &msr);
+        err = read_msr_cached(&ctx->msr, cpu, msr_address, &msr);
         bind_context(&old_context, NULL);
     }
 
     if (!err) {
         domain_msr = *(rapl_power_limit_control_msr_t *)&msr;
 
-        domain_obj->power_limit_watts = convert_to_watts(domain_msr.power_limit);
-        domain_obj->limit_time_window_seconds = convert_from_limit_time_window(domain_msr.limit_time_window_y,
+        domain_obj->power_limit_watts = convert_to_watts(ctx, domain_msr.power_limit);
+        domain_obj->limit_time_window_seconds = convert_from_limit_time_window(ctx, domain_msr.limit_time_window_y,
                                                 domain_msr.limit_time_window_f);
         domain_obj->limit_enabled = domain_msr.limit_enabled;
         domain_obj->clamp_enabled = domain_msr.clamp_enabled;
@@ -594,33 +949,118 @@ get_rapl_power_limit_control(uint64_t                    cpu,
 }
 
 int
-get_total_energy_consumed(uint64_t  cpu,
-                          uint64_t  msr_address,
-                          double   *total_energy_consumed_joules)
+get_energy_status_raw(rapl_ctx_t *ctx,
+                      uint64_t  cpu,
+                      uint64_t  msr_address,
+                      uint64_t *total_energy_consumed_raw)
 {
     int                 err = 0;
     uint64_t            msr;
     energy_status_msr_t domain_msr;
     cpu_set_t old_context;
 
-    err = !is_supported_msr(msr_address);
+    err = !is_supported_msr(ctx, msr_address);
     if (!err) {
         bind_cpu(cpu, &old_context); // improve performance on Linux
-        err = read_msr(cpu, msr_address, &msr);
+        err = read_msr_cached(&ctx->msr, cpu, msr_address, &msr);
         bind_context(&old_context, NULL);
     }
 
     if(!err) {
         domain_msr = *(energy_status_msr_t *)&msr;
 
-        *total_energy_consumed_joules = convert_to_joules(domain_msr.total_energy_consumed);
+        *total_energy_consumed_raw = domain_msr.total_energy_consumed;
     }
 
     return err;
 }
 
+/*
+ * Spin on an energy status register until its value changes, and record the
+ * TSC at the transition. Each read is assumed to take effect at the midpoint
+ * of the TSC values taken around it, and the update is placed halfway between
+ * the last read returning the old value and the first one returning the new
+ * value.
+ */
 int
-get_rapl_parameters(uint64_t           cpu,
+get_energy_status_precise(rapl_ctx_t *ctx,
+                          uint64_t               cpu,
+                          uint64_t               msr_address,
+                          uint64_t               max_spins,
+                          rapl_precise_sample_t *sample)
+{
+    int                 err = 0;
+    uint64_t            msr, first;
+    uint64_t            t0, t1;
+    uint64_t            mid, prev_mid;
+    uint64_t            spins;
+    cpu_set_t           old_context;
+    energy_status_msr_t domain_msr;
+
+    err = !is_supported_msr(ctx, msr_address);
+    if (err)
+        return MY_ERROR;
+
+    bind_cpu(cpu, &old_context);
+
+    read_tsc(&t0);
+    err = read_msr_cached(&ctx->msr, cpu, msr_address, &first);
+    read_tsc(&t1);
+    memcpy(&domain_msr, &first, sizeof(domain_msr));
+    first = domain_msr.total_energy_consumed;
+    prev_mid = t0 + (t1 - t0) / 2;
+
+    for (spins = 1; !err && spins <= max_spins; spins++) {
+        read_tsc(&t0);
+        err = read_msr_cached(&ctx->msr, cpu, msr_address, &msr);
+        read_tsc(&t1);
+        if (err)
+            break;
+
+        memcpy(&domain_msr, &msr, sizeof(domain_msr));
+        msr = domain_msr.total_energy_consumed;
+        mid = t0 + (t1 - t0) / 2;
+        if (msr != first) {
+            sample->energy_raw = msr;
+            sample->tsc = prev_mid + (mid - prev_mid) / 2;
+            sample->tsc_uncertainty = (mid - prev_mid) / 2;
+            sample->spins = spins;
+            break;
+        }
+        prev_mid = mid;
+    }
+
+    bind_context(&old_context, NULL);
+
+    if (!err && spins > max_spins)
+        err = MY_ERROR; /* no update within max_spins reads */
+
+    return err ? MY_ERROR : 0;
+}
+
+int
+get_total_energy_consumed(rapl_ctx_t *ctx,
+                          uint64_t  cpu,
+                          uint64_t  msr_address,
+                          double   *total_energy_consumed_joules)
+{
+    int      err = 0;
+    uint64_t raw;
+
+    err = get_energy_status_raw(ctx, cpu, msr_address, &raw);
+    if(!err) {
+        if(MSR_RAPL_DRAM_ENERGY_STATUS == msr_address)
+            *total_energy_consumed_joules = ctx->dram_energy_unit * raw;
+        else
+            *total_energy_consumed_joules = convert_to_joules(ctx, raw);
+    }
+
+    return err;
+}
+
+int
+get_rapl_parameters(rapl_ctx_t *ctx,
+                    uint64_t           cpu,
                     uint64_t           msr_address,
                     rapl_parameters_t *domain_obj)
 {
@@ -629,27 +1069,28 @@ get_rapl_parameters(uint64_t           cpu,
     rapl_parameters_msr_t domain_msr;
     cpu_set_t old_context;
 
-    err = !is_supported_msr(msr_address);
+    err = !is_supported_msr(ctx, msr_address);
     if (!err) {
         bind_cpu(cpu, &old_context); // improve performance on Linux
-        err = read_msr(cpu, msr_address, &msr);
+        err = read_msr_cached(&ctx->msr, cpu, msr_address, &msr);
         bind_context(&old_context, NULL);
     }
 
     if (!err) {
         domain_msr = *(rapl_parameters_msr_t *)&msr;
 
-        domain_obj->thermal_spec_power_watts = convert_to_watts(domain_msr.thermal_spec_power);
-        domain_obj->minimum_power_watts = convert_to_watts(domain_msr.minimum_power);
-        domain_obj->maximum_power_watts = convert_to_watts(domain_msr.maximum_power);
-        domain_obj->maximum_limit_time_window_seconds = convert_to_seconds(domain_msr.maximum_limit_time_window);
+        domain_obj->thermal_spec_power_watts = convert_to_watts(ctx, domain_msr.thermal_spec_power);
+        domain_obj->minimum_power_watts = convert_to_watts(ctx, domain_msr.minimum_power);
+        domain_obj->maximum_power_watts = convert_to_watts(ctx, domain_msr.maximum_power);
+        domain_obj->maximum_limit_time_window_seconds = convert_to_seconds(ctx, domain_msr.maximum_limit_time_window);
     }
 
     return err;
 }
 
 int
-get_accumulated_throttled_time(uint64_t  cpu,
+get_accumulated_throttled_time(rapl_ctx_t *ctx,
+                               uint64_t  cpu,
                                uint64_t  msr_address,
                                double   *accumulated_throttled_time_seconds)
 {
@@ -658,24 +1099,25 @@ get_accumulated_throttled_time(uint64_t  cpu,
     performance_throttling_status_msr_t domain_msr;
     cpu_set_t old_context;
 
-    err = !is_supported_msr(msr_address);
+    err = !is_supported_msr(ctx, msr_address);
     if (!err) {
         bind_cpu(cpu, &old_context); // improve performance on Linux
-        err = read_msr(cpu, msr_address, &msr);
+        err = read_msr_cached(&ctx->msr, cpu, msr_address, &msr);
         bind_context(&old_context, NULL);
     }
 
     if (!err) {
         domain_msr = *(performance_throttling_status_msr_t *)&msr;
 
-        *accumulated_throttled_time_seconds = convert_to_seconds(domain_msr.accumulated_throttled_time);
+        *accumulated_throttled_time_seconds = convert_to_seconds(ctx, domain_msr.accumulated_throttled_time);
     }
 
     return err;
 }
 
 int
-get_balance_policy(uint64_t  cpu,
+get_balance_policy(rapl_ctx_t *ctx,
+                   uint64_t  cpu,
                    uint64_t  msr_address,
                    uint64_t *priority_level)
 {
@@ -684,10 +1126,10 @@ get_balance_policy(uint64_t  cpu,
     balance_policy_msr_t domain_msr;
     cpu_set_t old_context;
 
-    err = !is_supported_msr(msr_address);
+    err = !is_supported_msr(ctx, msr_address);
     if (!err) {
         bind_cpu(cpu, &old_context); // improve performance on Linux
-        err = read_msr(cpu, msr_address, &msr);
+        err = read_msr_cached(&ctx->msr, cpu, msr_address, &msr);
         bind_context(&old_context, NULL);
     }
 
@@ -701,7 +1143,8 @@ get_balance_policy(uint64_t  cpu,
 }
 
 int
-set_rapl_power_limit_control(uint64_t                    cpu,
+set_rapl_power_limit_control(rapl_ctx_t *ctx,
+                             uint64_t                    cpu,
                              uint64_t                    msr_address,
                              rapl_power_limit_control_t *domain_obj)
 {
@@ -713,33 +1156,34 @@ set_rapl_power_limit_control(uint64_t                    cpu,
     uint64_t y;
     uint64_t f;
 
-    err = !is_supported_msr(msr_address);
+    err = !is_supported_msr(ctx, msr_address);
     if (!err) {
         bind_cpu(cpu, &old_context); // improve performance on Linux
-        err = read_msr(cpu, msr_address, &msr);
+        err = read_msr_cached(&ctx->msr, cpu, msr_address, &msr);
         bind_context(&old_context, NULL);
     }
 
     if (!err) {
         domain_msr = *(rapl_power_limit_control_msr_t *)&msr;
 
-        domain_msr.power_limit = convert_from_watts(domain_obj->power_limit_watts);
+        domain_msr.power_limit = convert_from_watts(ctx, domain_obj->power_limit_watts);
         domain_msr.limit_enabled = domain_obj->limit_enabled;
         domain_msr.clamp_enabled = domain_obj->clamp_enabled;
-        convert_to_limit_time_window(domain_obj->limit_time_window_seconds, &y, &f);
+        convert_to_limit_time_window(ctx, domain_obj->limit_time_window_seconds, &y, &f);
         domain_msr.limit_time_window_y = y;
         domain_msr.limit_time_window_f = f;
         domain_msr.lock_enabled = domain_obj->lock_enabled;
 
         msr = *(uint64_t *)&domain_msr;
-        err = write_msr(cpu, msr_address, msr);
+        err = write_msr_cached(&ctx->msr, cpu, msr_address, msr);
     }
 
     return err;
 }
 
 int
-set_balance_policy(uint64_t cpu,
+set_balance_policy(rapl_ctx_t *ctx,
+                   uint64_t cpu,
                    uint64_t msr_address,
                    uint64_t priority_level)
 {
@@ -748,10 +1192,10 @@ set_balance_policy(uint64_t cpu,
     balance_policy_msr_t domain_msr;
     cpu_set_t old_context;
 
-    err = !is_supported_msr(msr_address);
+    err = !is_supported_msr(ctx, msr_address);
     if (!err) {
         bind_cpu(cpu, &old_context); // improve performance on Linux
-        err = read_msr(cpu, msr_address, &msr);
+        err = read_msr_cached(&ctx->msr, cpu, msr_address, &msr);
         bind_context(&old_context, NULL);
     }
 
@@ -761,7 +1205,7 @@ set_balance_policy(uint64_t cpu,
         domain_msr.priority_level = priority_level;
 
         msr = *(uint64_t *)&domain_msr;
-        err = write_msr(cpu, msr_address, msr);
+        err = write_msr_cached(&ctx->msr, cpu, msr_address, msr);
     }
 
     return err;
@@ -790,31 +1234,32 @@ set_balance_policy(uint64_t cpu,
  * \return 0 on success, -1 otherwise
  */
 int
-get_pkg_rapl_power_limit_control(uint64_t                        node,
-                                 pkg_rapl_power_limit_control_t *pkg_obj)
+get_pkg_rapl_power_limit_control_t(rapl_ctx_t *ctx,
+                                   uint64_t                        node,
+                                   pkg_rapl_power_limit_control_t *pkg_obj)
 {
     int                                err = 0;
     uint64_t                           msr;
-    uint64_t cpu = pkg_node_to_cpu(node);
+    uint64_t cpu = pkg_node_to_cpu(ctx, node);
     pkg_rapl_power_limit_control_msr_t pkg_msr;
     cpu_set_t old_context;
 
-    err = !is_supported_msr(MSR_RAPL_PKG_POWER_LIMIT);
+    err = !is_supported_msr(ctx, MSR_RAPL_PKG_POWER_LIMIT);
     if (!err) {
         bind_cpu(cpu, &old_context); // improve performance on Linux
-        err = read_msr(cpu, MSR_RAPL_PKG_POWER_LIMIT, &msr);
+        err = read_msr_cached(&ctx->msr, cpu, MSR_RAPL_PKG_POWER_LIMIT, &msr);
         bind_context(&old_context, NULL);
     }
 
     if (!err) {
         pkg_msr = *(pkg_rapl_power_limit_control_msr_t *)&msr;
 
-        pkg_obj->power_limit_watts_1 = convert_to_watts(pkg_msr.power_limit_1);
-        pkg_obj->limit_time_window_seconds_1 = convert_from_limit_time_window(pkg_msr.limit_time_window_y_1, pkg_msr.limit_time_window_f_1);
+        pkg_obj->power_limit_watts_1 = convert_to_watts(ctx, pkg_msr.power_limit_1);
+        pkg_obj->limit_time_window_seconds_1 = convert_from_limit_time_window(ctx, pkg_msr.limit_time_window_y_1, pkg_msr.limit_time_window_f_1);
         pkg_obj->limit_enabled_1 = pkg_msr.limit_enabled_1;
         pkg_obj->clamp_enabled_1 = pkg_msr.clamp_enabled_1;
-        pkg_obj->power_limit_watts_2 = convert_to_watts(pkg_msr.power_limit_2);
-        pkg_obj->limit_time_window_seconds_2 = convert_from_limit_time_window(pkg_msr.limit_time_window_y_2, pkg_msr.limit_time_window_f_2);
+        pkg_obj->power_limit_watts_2 = convert_to_watts(ctx, pkg_msr.power_limit_2);
+        pkg_obj->limit_time_window_seconds_2 = convert_from_limit_time_window(ctx, pkg_msr.limit_time_window_y_2, pkg_msr.limit_time_window_f_2);
         pkg_obj->limit_enabled_2 = pkg_msr.limit_enabled_2;
         pkg_obj->clamp_enabled_2 = pkg_msr.clamp_enabled_2;
         pkg_obj->lock_enabled = pkg_msr.lock_enabled;
@@ -832,11 +1277,130 @@ get_pkg_rapl_power_limit_control(uint64_t                        node,
  * \return 0 on success, -1 otherwise
  */
 int
-get_pkg_total_energy_consumed(uint64_t  node,
+get_pkg_total_energy_consumed(rapl_ctx_t *ctx,
+                              uint64_t  node,
                               double   *total_energy_consumed_joules)
 {
-    uint64_t cpu = pkg_node_to_cpu(node);
-    return get_total_energy_consumed(cpu, MSR_RAPL_PKG_ENERGY_STATUS, total_energy_consumed_joules);
+    uint64_t cpu = pkg_node_to_cpu(ctx, node);
+    return get_total_energy_consumed(ctx, cpu, ctx->msr_pkg_energy_status, total_energy_consumed_joules);
+}
+
+/*!
+ * \brief Get the raw value of the RAPL PKG energy status register.
+ *
+ * The value is the 32 bit energy counter in units of get_rapl_energy_unit()
+ * Joules. Unlike get_pkg_total_energy_consumed(), this allows wraparounds to be
+ * handled with exact integer arithmetic.
+ *
+ * \return 0 on success, -1 otherwise
+ */
+int
+get_pkg_energy_status_raw(rapl_ctx_t *ctx,
+                          uint64_t  node,
+                          uint64_t *total_energy_consumed_raw)
+{
+    uint64_t cpu = pkg_node_to_cpu(ctx, node);
+    return get_energy_status_raw(ctx, cpu, ctx->msr_pkg_energy_status, total_energy_consumed_raw);
+}
+
+/*!
+ * \brief Read the RAPL PKG energy status register right after an update.
+ *
+ * Reads the register repeatedly (at most max_spins + 1 times) until its value
+ * changes, and records the TSC at the transition. This removes the up to one
+ * update period of uncertainty about when the value was current, at the cost
+ * of busy-waiting for up to one update period.
+ *
+ * \return 0 on success, -1 on failure or if there was no update within
+ *         max_spins reads
+ */
+int
+get_pkg_energy_status_precise(rapl_ctx_t *ctx,
+                              uint64_t               node,
+                              uint64_t               max_spins,
+                              rapl_precise_sample_t *sample)
+{
+    uint64_t cpu = pkg_node_to_cpu(ctx, node);
+    return get_energy_status_precise(ctx, cpu, ctx->msr_pkg_energy_status, max_spins, sample);
+}
+
+/*!
+ * \brief Estimate the update period of the RAPL PKG energy status register.
+ *
+ * Waits for updates+1 consecutive updates of the register (each within
+ * max_spins reads) and computes the average time between them. The TSC
+ * frequency is calibrated against CLOCK_MONOTONIC_RAW over the same span and
+ * stored in tsc_hz, unless it is NULL, so that TSC values of precise samples
+ * can be converted to time.
+ *
+ * This busy-waits for about updates update periods (~1 ms each).
+ *
+ * \return 0 on success, -1 otherwise
+ */
+int
+estimate_pkg_energy_update_period(rapl_ctx_t *ctx,
+                                  uint64_t  node,
+                                  uint64_t  updates,
+                                  uint64_t  max_spins,
+                                  double   *period_seconds,
+                                  double   *tsc_hz)
+{
+    int                   err = 0;
+    uint64_t              i;
+    uint64_t              tsc_start, tsc_end;
+    struct timespec       ts_start, ts_end;
+    rapl_precise_sample_t first, last;
+    double                elapsed, hz;
+
+    if (updates == 0)
+        return MY_ERROR;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts_start);
+    read_tsc(&tsc_start);
+
+    err = get_pkg_energy_status_precise(ctx, node, max_spins, &first);
+    last = first;
+    for (i = 0; !err && i < updates; i++)
+        err = get_pkg_energy_status_precise(ctx, node, max_spins, &last);
+
+    read_tsc(&tsc_end);
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts_end);
+
+    if (err)
+        return MY_ERROR;
+
+    elapsed = (ts_end.tv_sec - ts_start.tv_sec) + (ts_end.tv_nsec - ts_start.tv_nsec) / 1e9;
+    if (elapsed <= 0 || tsc_end <= tsc_start)
+        return MY_ERROR;
+    hz = (tsc_end - tsc_start) / elapsed;
+
+    *period_seconds = (last.tsc - first.tsc) / (double)updates / hz;
+    if (tsc_hz != NULL)
+        *tsc_hz = hz;
+
+    return 0;
+}
+
+/*!
+ * \brief Interpolate the energy consumed in an arbitrary TSC interval.
+ *
+ * Assumes constant power between the two precise samples a and b (taken in
+ * that order, less than one counter wraparound apart), and returns the energy
+ * consumed between tsc_start and tsc_end in Joules.
+ */
+double
+interpolate_energy_joules(rapl_ctx_t *ctx,
+                          const rapl_precise_sample_t *a,
+                          const rapl_precise_sample_t *b,
+                          uint64_t                     tsc_start,
+                          uint64_t                     tsc_end)
+{
+    uint64_t delta = (b->energy_raw - a->energy_raw) & 0xffffffff;
+
+    if (b->tsc <= a->tsc || tsc_end <= tsc_start)
+        return 0;
+
+    return convert_to_joules(ctx, delta) * (double)(tsc_end - tsc_start) / (double)(b->tsc - a->tsc);
 }
 
 /*!
@@ -849,11 +1413,12 @@ get_pkg_total_energy_consumed(uint64_t  node,
  * \return 0 on success, -1 otherwise
  */
 int
-get_pkg_rapl_parameters(uint64_t               node,
-                        pkg_rapl_parameters_t *pkg_obj)
+get_pkg_rapl_parameters_t(rapl_ctx_t *ctx,
+                          uint64_t               node,
+                          pkg_rapl_parameters_t *pkg_obj)
 {
-    uint64_t cpu = pkg_node_to_cpu(node);
-    return get_rapl_parameters(cpu, MSR_RAPL_PKG_POWER_INFO, (rapl_parameters_t*)pkg_obj);
+    uint64_t cpu = pkg_node_to_cpu(ctx, node);
+    return get_rapl_parameters(ctx, cpu, MSR_RAPL_PKG_POWER_INFO, (rapl_parameters_t*)pkg_obj);
 }
 
 /*!
@@ -866,11 +1431,12 @@ get_pkg_rapl_parameters(uint64_t               node,
  * \return 0 on success, -1 otherwise
  */
 int
-get_pkg_accumulated_throttled_time(uint64_t  node,
+get_pkg_accumulated_throttled_time(rapl_ctx_t *ctx,
+                                   uint64_t  node,
                                    double   *accumulated_throttled_time_seconds)
 {
-    uint64_t cpu = pkg_node_to_cpu(node);
-    return get_accumulated_throttled_time(cpu, MSR_RAPL_PKG_PERF_STATUS, accumulated_throttled_time_seconds);
+    uint64_t cpu = pkg_node_to_cpu(ctx, node);
+    return get_accumulated_throttled_time(ctx, cpu, MSR_RAPL_PKG_PERF_STATUS, accumulated_throttled_time_seconds);
 }
 
 /*!
@@ -882,44 +1448,45 @@ get_pkg_accumulated_throttled_time(uint64_t  node,
  * \return 0 on success, -1 otherwise
  */
 int
-set_pkg_rapl_power_limit_control(uint64_t                        node,
-                                 pkg_rapl_power_limit_control_t *pkg_obj)
+set_pkg_rapl_power_limit_control_t(rapl_ctx_t *ctx,
+                                   uint64_t                        node,
+                                   pkg_rapl_power_limit_control_t *pkg_obj)
 {
     int      err = 0;
     uint64_t msr;
-    uint64_t cpu = pkg_node_to_cpu(node);
+    uint64_t cpu = pkg_node_to_cpu(ctx, node);
     pkg_rapl_power_limit_control_msr_t pkg_msr;
     cpu_set_t old_context;
 
     uint64_t y;
     uint64_t f;
 
-    err = !is_supported_msr(MSR_RAPL_PKG_POWER_LIMIT);
+    err = !is_supported_msr(ctx, MSR_RAPL_PKG_POWER_LIMIT);
     if (!err) {
         bind_cpu(cpu, &old_context); // improve performance on Linux
-        err = read_msr(cpu, MSR_RAPL_PKG_POWER_LIMIT, &msr);
+        err = read_msr_cached(&ctx->msr, cpu, MSR_RAPL_PKG_POWER_LIMIT, &msr);
         bind_context(&old_context, NULL);
     }
 
     if(!err) {
         pkg_msr = *(pkg_rapl_power_limit_control_msr_t *)&msr;
 
-        pkg_msr.power_limit_1 = convert_from_watts(pkg_obj->power_limit_watts_1);
+        pkg_msr.power_limit_1 = convert_from_watts(ctx, pkg_obj->power_limit_watts_1);
         pkg_msr.limit_enabled_1 = pkg_obj->limit_enabled_1;
         pkg_msr.clamp_enabled_1 = pkg_obj->clamp_enabled_1;
-        convert_to_limit_time_window(pkg_obj->limit_time_window_seconds_1, &y, &f);
+        convert_to_limit_time_window(ctx, pkg_obj->limit_time_window_seconds_1, &y, &f);
         pkg_msr.limit_time_window_y_1 = y;
         pkg_msr.limit_time_window_f_1 = f;
-        pkg_msr.power_limit_2 = convert_from_watts(pkg_obj->power_limit_watts_2);
+        pkg_msr.power_limit_2 = convert_from_watts(ctx, pkg_obj->power_limit_watts_2);
         pkg_msr.limit_enabled_2 = pkg_obj->limit_enabled_2;
         pkg_msr.clamp_enabled_2 = pkg_obj->clamp_enabled_2;
-        convert_to_limit_time_window(pkg_obj->limit_time_window_seconds_2, &y, &f);
+        convert_to_limit_time_window(ctx, pkg_obj->limit_time_window_seconds_2, &y, &f);
         pkg_msr.limit_time_window_y_2 = y;
         pkg_msr.limit_time_window_f_2 = f;
         pkg_msr.lock_enabled = pkg_obj->lock_enabled;
 
         msr = *(uint64_t *)&pkg_msr;
-        err = write_msr(cpu, MSR_RAPL_PKG_POWER_LIMIT, msr);
+        err = write_msr_cached(&ctx->msr, cpu, MSR_RAPL_PKG_POWER_LIMIT, msr);
     }
 
     return err;
@@ -947,11 +1514,12 @@ set_pkg_rapl_power_limit_control(uint64_t                        node,
  * \return 0 on success, -1 otherwise
  */
 int
-get_dram_rapl_power_limit_control(uint64_t                         node,
-                                  dram_rapl_power_limit_control_t *dram_obj)
+get_dram_rapl_power_limit_control_t(rapl_ctx_t *ctx,
+                                    uint64_t                         node,
+                                    dram_rapl_power_limit_control_t *dram_obj)
 {
-    uint64_t cpu = dram_node_to_cpu(node);
-    return get_rapl_power_limit_control(cpu, MSR_RAPL_DRAM_POWER_LIMIT, (rapl_power_limit_control_t*)dram_obj);
+    uint64_t cpu = dram_node_to_cpu(ctx, node);
+    return get_rapl_power_limit_control(ctx, cpu, MSR_RAPL_DRAM_POWER_LIMIT, (rapl_power_limit_control_t*)dram_obj);
 }
 
 /*!
@@ -965,11 +1533,34 @@ get_dram_rapl_power_limit_control(uint64_t                         node,
  * \return 0 on success, -1 otherwise
  */
 int
-get_dram_total_energy_consumed(uint64_t  node,
+get_dram_total_energy_consumed(rapl_ctx_t *ctx,
+                               uint64_t  node,
                                double   *total_energy_consumed_joules)
 {
-    uint64_t cpu = dram_node_to_cpu(node);
-    return get_total_energy_consumed(cpu, MSR_RAPL_DRAM_ENERGY_STATUS, total_energy_consumed_joules);
+    uint64_t cpu = dram_node_to_cpu(ctx, node);
+    return get_total_energy_consumed(ctx, cpu, MSR_RAPL_DRAM_ENERGY_STATUS, total_energy_consumed_joules);
+}
+
+/*!
+ * \brief Get the raw value of the RAPL DRAM energy status register.
+ *
+ * (Server parts only)
+ *
+ * The value is the 32 bit energy counter in units of
+ * get_rapl_domain_energy_unit(ctx, RAPL_DRAM) Joules, which differ from those
+ * of the other domains on some server parts. Unlike
+ * get_dram_total_energy_consumed(), this allows wraparounds to be
+ * handled with exact integer arithmetic.
+ *
+ * \return 0 on success, -1 otherwise
+ */
+int
+get_dram_energy_status_raw(rapl_ctx_t *ctx,
+                           uint64_t  node,
+                           uint64_t *total_energy_consumed_raw)
+{
+    uint64_t cpu = dram_node_to_cpu(ctx, node);
+    return get_energy_status_raw(ctx, cpu, MSR_RAPL_DRAM_ENERGY_STATUS, total_energy_consumed_raw);
 }
 
 /*!
@@ -984,11 +1575,12 @@ get_dram_total_energy_consumed(uint64_t  node,
  * \return 0 on success, -1 otherwise
  */
 int
-get_dram_rapl_parameters(uint64_t                node,
-                         dram_rapl_parameters_t *dram_obj)
+get_dram_rapl_parameters_t(rapl_ctx_t *ctx,
+                           uint64_t                node,
+                           dram_rapl_parameters_t *dram_obj)
 {
-    uint64_t cpu = dram_node_to_cpu(node);
-    return get_rapl_parameters(cpu, MSR_RAPL_DRAM_POWER_INFO, (rapl_parameters_t*)dram_obj);
+    uint64_t cpu = dram_node_to_cpu(ctx, node);
+    return get_rapl_parameters(ctx, cpu, MSR_RAPL_DRAM_POWER_INFO, (rapl_parameters_t*)dram_obj);
 }
 
 /*!
@@ -1003,11 +1595,12 @@ get_dram_rapl_parameters(uint64_t                node,
  * \return 0 on success, -1 otherwise
  */
 int
-get_dram_accumulated_throttled_time(uint64_t  node,
+get_dram_accumulated_throttled_time(rapl_ctx_t *ctx,
+                                    uint64_t  node,
                                     double   *accumulated_throttled_time_seconds)
 {
-    uint64_t cpu = dram_node_to_cpu(node);
-    return get_accumulated_throttled_time(cpu, MSR_RAPL_DRAM_PERF_STATUS, accumulated_throttled_time_seconds);
+    uint64_t cpu = dram_node_to_cpu(ctx, node);
+    return get_accumulated_throttled_time(ctx, cpu, MSR_RAPL_DRAM_PERF_STATUS, accumulated_throttled_time_seconds);
 }
 
 /*!
@@ -1021,11 +1614,12 @@ get_dram_accumulated_throttled_time(uint64_t  node,
  * \return 0 on success, -1 otherwise
  */
 int
-set_dram_rapl_power_limit_control(uint64_t                         node,
-                                  dram_rapl_power_limit_control_t *dram_obj)
+set_dram_rapl_power_limit_control_t(rapl_ctx_t *ctx,
+                                    uint64_t                         node,
+                                    dram_rapl_power_limit_control_t *dram_obj)
 {
-    uint64_t cpu = dram_node_to_cpu(node);
-    return set_rapl_power_limit_control(cpu, MSR_RAPL_DRAM_POWER_LIMIT, (rapl_power_limit_control_t*)dram_obj);
+    uint64_t cpu = dram_node_to_cpu(ctx, node);
+    return set_rapl_power_limit_control(ctx, cpu, MSR_RAPL_DRAM_POWER_LIMIT, (rapl_power_limit_control_t*)dram_obj);
 }
 
 
@@ -1048,11 +1642,12 @@ set_dram_rapl_power_limit_control(uint64_t                         node,
  * \return 0 on success, -1 otherwise
  */
 int
-get_pp0_rapl_power_limit_control(uint64_t                        node,
-                                 pp0_rapl_power_limit_control_t *pp0_obj)
+get_pp0_rapl_power_limit_control_t(rapl_ctx_t *ctx,
+                                   uint64_t                        node,
+                                   pp0_rapl_power_limit_control_t *pp0_obj)
 {
-    uint64_t cpu = pp0_node_to_cpu(node);
-    return get_rapl_power_limit_control(cpu, MSR_RAPL_PP0_POWER_LIMIT, (rapl_power_limit_control_t*)pp0_obj);
+    uint64_t cpu = pp0_node_to_cpu(ctx, node);
+    return get_rapl_power_limit_control(ctx, cpu, MSR_RAPL_PP0_POWER_LIMIT, (rapl_power_limit_control_t*)pp0_obj);
 }
 
 /*!
@@ -1064,13 +1659,87 @@ get_pp0_rapl_power_limit_control(uint64_t                        node,
  * \return 0 on success, -1 otherwise
  */
 int
-get_pp0_total_energy_consumed(uint64_t  node,
+get_pp0_total_energy_consumed(rapl_ctx_t *ctx,
+                              uint64_t  node,
                               double   *total_energy_consumed_joules)
 {
-    uint64_t cpu = pp0_node_to_cpu(node);
-    return get_total_energy_consumed(cpu, MSR_RAPL_PP0_ENERGY_STATUS, total_energy_consumed_joules);
+    int      err = 0;
+    uint64_t raw;
+
+    err = get_pp0_energy_status_raw(ctx, node, &raw);
+    if(!err) {
+        *total_energy_consumed_joules = convert_to_joules(ctx, raw);
+    }
+
+    return err;
 }
 
+/*!
+ * \brief Get the raw value of the RAPL PP0 energy status register.
+ *
+ * The value is the 32 bit energy counter in units of get_rapl_energy_unit()
+ * Joules. Unlike get_pp0_total_energy_consumed(), this allows wraparounds to be
+ * handled with exact integer arithmetic.
+ *
+ * \return 0 on success, -1 otherwise
+ */
+int
+get_pp0_energy_status_raw(rapl_ctx_t *ctx,
+                          uint64_t  node,
+                          uint64_t *total_energy_consumed_raw)
+{
+    int      err = 0;
+    uint64_t i, raw, sum = 0;
+    uint64_t cpu = pp0_node_to_cpu(ctx, node);
+
+    if (CPU_VENDOR_AMD != ctx->cpu_vendor)
+        return get_energy_status_raw(ctx, cpu, MSR_RAPL_PP0_ENERGY_STATUS, total_energy_consumed_raw);
+
+    // Sum up the per-core registers, once per physical core. The sum is kept
+    // to 32 bits, like a single register, so differences between two sums
+    // modulo 2^32 are still exact (as long as the cores together don't wrap
+    // around 2^32 between the two reads).
+    for(i = 0; !err && i < ctx->node_threads[node]; i++) {
+        if(ctx->pkg_map[node][i].smt_id != 0)
+            continue;
+        err = get_core_energy_status_raw(ctx, ctx->pkg_map[node][i].os_id, &raw);
+        sum += raw;
+    }
+    if(!err)
+        *total_energy_consumed_raw = sum & 0xffffffff;
+
+    return err;
+}
+
+/*!
+ * \brief Get the raw value of a per-core energy status register (AMD only).
+ *
+ * The value is the 32 bit energy counter of the physical core the given OS
+ * CPU belongs to, in units of get_rapl_energy_unit() Joules.
+ *
+ * \return 0 on success, -1 otherwise
+ */
+int
+get_core_energy_status_raw(rapl_ctx_t *ctx,
+                           uint64_t  os_cpu,
+                           uint64_t *total_energy_consumed_raw)
+{
+    int                 err = 0;
+    uint64_t            msr;
+    energy_status_msr_t domain_msr;
+
+    err = !is_supported_msr(ctx, MSR_AMD_CORE_ENERGY_STATUS);
+    if (!err)
+        err = read_msr_cached(&ctx->msr, os_cpu, MSR_AMD_CORE_ENERGY_STATUS, &msr);
+    if (!err) {
+        memcpy(&domain_msr, &msr, sizeof(domain_msr));
+        *total_energy_consumed_raw = domain_msr.total_energy_consumed;
+    }
+
+    return err ? MY_ERROR : 0;
+}
+
+
 /*!
  * \brief Get a pointer to the RAPL PP0 priority level register
  *
@@ -1086,11 +1755,12 @@ get_pp0_total_energy_consumed(uint64_t  node,
  * \return 0 on success, -1 otherwise
  */
 int
-get_pp0_balance_policy(uint64_t  node,
+get_pp0_balance_policy(rapl_ctx_t *ctx,
+                       uint64_t  node,
                        uint64_t *priority_level)
 {
-    uint64_t cpu = pp0_node_to_cpu(node);
-    return get_balance_policy(cpu, MSR_RAPL_PP0_POLICY, priority_level);
+    uint64_t cpu = pp0_node_to_cpu(ctx, node);
+    return get_balance_policy(ctx, cpu, MSR_RAPL_PP0_POLICY, priority_level);
 }
 
 /*!
@@ -1103,11 +1773,12 @@ get_pp0_balance_policy(uint64_t  node,
  * \return 0 on success, -1 otherwise
  */
 int
-get_pp0_accumulated_throttled_time(uint64_t  node,
+get_pp0_accumulated_throttled_time(rapl_ctx_t *ctx,
+                                   uint64_t  node,
                                    double   *accumulated_throttled_time_seconds)
 {
-    uint64_t cpu = pp0_node_to_cpu(node);
-    return get_accumulated_throttled_time(cpu, MSR_RAPL_PP0_PERF_STATUS, accumulated_throttled_time_seconds);
+    uint64_t cpu = pp0_node_to_cpu(ctx, node);
+    return get_accumulated_throttled_time(ctx, cpu, MSR_RAPL_PP0_PERF_STATUS, accumulated_throttled_time_seconds);
 }
 
 /*!
@@ -1119,11 +1790,12 @@ get_pp0_accumulated_throttled_time(uint64_t  node,
  * \return 0 on success, -1 otherwise
  */
 int
-set_pp0_rapl_power_limit_control(uint64_t                        node,
-                                 pp0_rapl_power_limit_control_t *pp0_obj)
+set_pp0_rapl_power_limit_control_t(rapl_ctx_t *ctx,
+                                   uint64_t                        node,
+                                   pp0_rapl_power_limit_control_t *pp0_obj)
 {
-    uint64_t cpu = pp0_node_to_cpu(node);
-    return set_rapl_power_limit_control(cpu, MSR_RAPL_PP0_POWER_LIMIT, (rapl_power_limit_control_t*)pp0_obj);
+    uint64_t cpu = pp0_node_to_cpu(ctx, node);
+    return set_rapl_power_limit_control(ctx, cpu, MSR_RAPL_PP0_POWER_LIMIT, (rapl_power_limit_control_t*)pp0_obj);
 }
 
 /*!
@@ -1139,11 +1811,12 @@ set_pp0_rapl_power_limit_control(uint64_t                        node,
  * \return 0 on success, -1 otherwise
  */
 int
-set_pp0_balance_policy(uint64_t node,
+set_pp0_balance_policy(rapl_ctx_t *ctx,
+                       uint64_t node,
                        uint64_t priority_level)
 {
-    uint64_t cpu = pp0_node_to_cpu(node);
-    return set_balance_policy(cpu, MSR_RAPL_PP0_POLICY, priority_level);
+    uint64_t cpu = pp0_node_to_cpu(ctx, node);
+    return set_balance_policy(ctx, cpu, MSR_RAPL_PP0_POLICY, priority_level);
 }
 
 
@@ -1168,11 +1841,12 @@ set_pp0_balance_policy(uint64_t node,
  * \return 0 on success, -1 otherwise
  */
 int
-get_pp1_rapl_power_limit_control(uint64_t                        node,
-                                 pp1_rapl_power_limit_control_t *pp1_obj)
+get_pp1_rapl_power_limit_control_t(rapl_ctx_t *ctx,
+                                   uint64_t                        node,
+                                   pp1_rapl_power_limit_control_t *pp1_obj)
 {
-    uint64_t cpu = pp1_node_to_cpu(node);
-    return get_rapl_power_limit_control(cpu, MSR_RAPL_PP1_POWER_LIMIT, (rapl_power_limit_control_t*)pp1_obj);
+    uint64_t cpu = pp1_node_to_cpu(ctx, node);
+    return get_rapl_power_limit_control(ctx, cpu, MSR_RAPL_PP1_POWER_LIMIT, (rapl_power_limit_control_t*)pp1_obj);
 }
 
 /*!
@@ -1186,11 +1860,32 @@ get_pp1_rapl_power_limit_control(uint64_t                        node,
  * \return 0 on success, -1 otherwise
  */
 int
-get_pp1_total_energy_consumed(uint64_t  node,
+get_pp1_total_energy_consumed(rapl_ctx_t *ctx,
+                              uint64_t  node,
                               double   *total_energy_consumed_joules)
 {
-    uint64_t cpu = pp1_node_to_cpu(node);
-    return get_total_energy_consumed(cpu, MSR_RAPL_PP1_ENERGY_STATUS, total_energy_consumed_joules);
+    uint64_t cpu = pp1_node_to_cpu(ctx, node);
+    return get_total_energy_consumed(ctx, cpu, MSR_RAPL_PP1_ENERGY_STATUS, total_energy_consumed_joules);
+}
+
+/*!
+ * \brief Get the raw value of the RAPL PP1 energy status register.
+ *
+ * (Client parts only)
+ *
+ * The value is the 32 bit energy counter in units of get_rapl_energy_unit()
+ * Joules. Unlike get_pp1_total_energy_consumed(), this allows wraparounds to be
+ * handled with exact integer arithmetic.
+ *
+ * \return 0 on success, -1 otherwise
+ */
+int
+get_pp1_energy_status_raw(rapl_ctx_t *ctx,
+                          uint64_t  node,
+                          uint64_t *total_energy_consumed_raw)
+{
+    uint64_t cpu = pp1_node_to_cpu(ctx, node);
+    return get_energy_status_raw(ctx, cpu, MSR_RAPL_PP1_ENERGY_STATUS, total_energy_consumed_raw);
 }
 
 /*!
@@ -1208,11 +1903,12 @@ get_pp1_total_energy_consumed(uint64_t  node,
  * \return 0 on success, -1 otherwise
  */
 int
-get_pp1_balance_policy(uint64_t  node,
+get_pp1_balance_policy(rapl_ctx_t *ctx,
+                       uint64_t  node,
                        uint64_t *priority_level)
 {
-    uint64_t cpu = pp1_node_to_cpu(node);
-    return get_balance_policy(cpu, MSR_RAPL_PP1_POLICY, priority_level);
+    uint64_t cpu = pp1_node_to_cpu(ctx, node);
+    return get_balance_policy(ctx, cpu, MSR_RAPL_PP1_POLICY, priority_level);
 }
 
 /*!
@@ -1226,11 +1922,12 @@ get_pp1_balance_policy(uint64_t  node,
  * \return 0 on success, -1 otherwise
  */
 int
-set_pp1_rapl_power_limit_control(uint64_t                        node,
-                                 pp1_rapl_power_limit_control_t *pp1_obj)
+set_pp1_rapl_power_limit_control_t(rapl_ctx_t *ctx,
+                                   uint64_t                        node,
+                                   pp1_rapl_power_limit_control_t *pp1_obj)
 {
-    uint64_t cpu = pp1_node_to_cpu(node);
-    return set_rapl_power_limit_control(cpu, MSR_RAPL_PP1_POWER_LIMIT, (rapl_power_limit_control_t*)pp1_obj);
+    uint64_t cpu = pp1_node_to_cpu(ctx, node);
+    return set_rapl_power_limit_control(ctx, cpu, MSR_RAPL_PP1_POWER_LIMIT, (rapl_power_limit_control_t*)pp1_obj);
 }
 
 /*!
@@ -1246,26 +1943,416 @@ set_pp1_rapl_power_limit_control(uint64_t                        node,
  * \return 0 on success, -1 otherwise
  */
 int
-set_pp1_balance_policy(uint64_t node,
+set_pp1_balance_policy(rapl_ctx_t *ctx,
+                       uint64_t node,
                        uint64_t priority_level)
 {
-    uint64_t cpu = pp1_node_to_cpu(node);
-    return set_balance_policy(cpu, MSR_RAPL_PP1_POLICY, priority_level);
+    uint64_t cpu = pp1_node_to_cpu(ctx, node);
+    return set_balance_policy(ctx, cpu, MSR_RAPL_PP1_POLICY, priority_level);
+}
+
+/* Batched sampling */
+
+static int
+domain_energy_status_msr(rapl_ctx_t *ctx, uint64_t power_domain, uint64_t *msr)
+{
+    switch (power_domain) {
+    case RAPL_PKG:  *msr = ctx->msr_pkg_energy_status; break;
+    case RAPL_PP0:  *msr = ctx->msr_pp0_energy_status; break;
+    case RAPL_PP1:  *msr = MSR_RAPL_PP1_ENERGY_STATUS; break;
+    case RAPL_DRAM: *msr = MSR_RAPL_DRAM_ENERGY_STATUS; break;
+    default:        return MY_ERROR;
+    }
+    return 0;
+}
+
+static int
+domain_perf_status_msr(uint64_t power_domain, uint64_t *msr)
+{
+    switch (power_domain) {
+    case RAPL_PKG:  *msr = MSR_RAPL_PKG_PERF_STATUS; break;
+    case RAPL_PP0:  *msr = MSR_RAPL_PP0_PERF_STATUS; break;
+    case RAPL_DRAM: *msr = MSR_RAPL_DRAM_PERF_STATUS; break;
+    default:        return MY_ERROR;
+    }
+    return 0;
+}
+
+/*
+ * Build the list of registers read by sample_rapl_batch(): the energy status
+ * registers of the domains in domain_masks[node] (all of them if NULL) and
+ * the register groups in `groups' of the same nodes. On AMD, PP0 is the sum
+ * of the per-core registers and isn't batched. If the batch can't be rebuilt,
+ * batching is disabled.
+ */
+static int
+build_rapl_batch(rapl_ctx_t     *ctx,
+                 const uint32_t *domain_masks,
+                 unsigned int    groups)
+{
+    uint64_t node, domain, cpu, msr, i;
+    uint32_t mask;
+    uint64_t max_ops = ctx->num_nodes * (RAPL_NR_DOMAIN * 2 + 2) + ctx->os_cpu_count * 3;
+
+    if (NULL != ctx->batch.ops)
+        msr_batch_close(&ctx->batch);
+    ctx->batch_valid = 0;
+    if (0 != msr_batch_init(&ctx->batch, max_ops, ctx->msr.backend->batch_device)) {
+        free(ctx->batch_cpu_op);
+        ctx->batch_cpu_op = NULL;
+        return MY_ERROR;
+    }
+    if (NULL != ctx->msr.backend->batch_submit)
+        ctx->batch.submit = ctx->msr.backend->batch_submit;
+
+    for (cpu = 0; cpu < ctx->os_cpu_count; cpu++)
+        ctx->batch_cpu_op[cpu] = -1;
+    for (node = 0; node < ctx->num_nodes; node++) {
+        mask = (NULL == domain_masks) ? ~0u : domain_masks[node];
+        cpu = pkg_node_to_cpu(ctx, node);
+        for (domain = 0; domain < RAPL_NR_DOMAIN; domain++) {
+            ctx->batch_energy_op[node * RAPL_NR_DOMAIN + domain] = -1;
+            ctx->batch_perf_op[node * RAPL_NR_DOMAIN + domain] = -1;
+            if (!(mask & (1u << domain)) || !is_supported_domain(ctx, domain))
+                continue;
+            if (0 == domain_energy_status_msr(ctx, domain, &msr) &&
+                !(CPU_VENDOR_AMD == ctx->cpu_vendor && RAPL_PP0 == domain))
+                ctx->batch_energy_op[node * RAPL_NR_DOMAIN + domain] = msr_batch_add_read(&ctx->batch, cpu, msr);
+            if ((groups & RAPL_BATCH_PERF_STATUS) &&
+                0 == domain_perf_status_msr(domain, &msr) && is_supported_msr(ctx, msr))
+                ctx->batch_perf_op[node * RAPL_NR_DOMAIN + domain] = msr_batch_add_read(&ctx->batch, cpu, msr);
+        }
+        ctx->batch_uncore_op[node] = -1;
+        if (0 == mask)
+            continue;
+        if ((groups & RAPL_BATCH_UNCORE) && UNCORE_MSR == ctx->uncore_source) {
+            ctx->batch_uncore_op[node] = msr_batch_add_read(&ctx->batch, cpu, MSR_UNCORE_PERF_STATUS);
+            msr_batch_add_read(&ctx->batch, cpu, MSR_UNCORE_RATIO_LIMIT);
+        }
+        if (!(groups & RAPL_BATCH_CPU_ACTIVITY))
+            continue;
+        for (i = 0; i < ctx->node_threads[node]; i++) {
+            cpu = ctx->pkg_map[node][i].os_id;
+            ctx->batch_cpu_op[cpu] = msr_batch_add_read(&ctx->batch, cpu, MSR_IA32_APERF);
+            msr_batch_add_read(&ctx->batch, cpu, MSR_IA32_MPERF);
+            msr_batch_add_read(&ctx->batch, cpu, MSR_IA32_TIME_STAMP_COUNTER);
+        }
+    }
+
+    /* Without io_uring, the batch is read one register at a time */
+    if (ctx->msr.backend->uring)
+        msr_batch_use_uring(&ctx->batch, &ctx->msr);
+
+    return 0;
+}
+
+/*
+ * Set up batched sampling, reading all registers until select_rapl_batch()
+ * narrows the batch down.
+ */
+static int
+init_rapl_batch(rapl_ctx_t *ctx)
+{
+    uint64_t slots = ctx->num_nodes * RAPL_NR_DOMAIN;
+
+    ctx->batch.fd = -1;
+
+    ctx->batch_energy_op = (int *) malloc(slots * sizeof(int));
+    ctx->batch_perf_op = (int *) malloc(slots * sizeof(int));
+    ctx->batch_cpu_op = (int *) malloc(ctx->os_cpu_count * sizeof(int));
+    ctx->batch_uncore_op = (int *) malloc(ctx->num_nodes * sizeof(int));
+    if (NULL == ctx->batch_energy_op || NULL == ctx->batch_perf_op || NULL == ctx->batch_cpu_op ||
+        NULL == ctx->batch_uncore_op)
+        return MY_ERROR;
+
+    return build_rapl_batch(ctx, NULL, RAPL_BATCH_ALL);
+}
+
+/*!
+ * \brief Restrict sample_rapl_batch() to the registers that are used.
+ *
+ * The batch then holds the energy status registers of the domains set in
+ * domain_masks[node] (bit 1 << domain; NULL selects all domains of all
+ * nodes) and, for nodes with a non-zero mask, the RAPL_BATCH_* register
+ * groups in `groups'. Registers left out are read directly when asked for.
+ *
+ * \return 0 on success, -1 if batching is not enabled or the batch couldn't
+ * be rebuilt (batching is then disabled)
+ */
+int
+select_rapl_batch(rapl_ctx_t     *ctx,
+                  const uint32_t *domain_masks,
+                  unsigned int    groups)
+{
+    if (!is_rapl_batch_enabled(ctx))
+        return MY_ERROR;
+    return build_rapl_batch(ctx, domain_masks, groups);
+}
+
+/*!
+ * \brief Check if the MSR backend batches periodic reads.
+ * \return 1 if sample_rapl_batch() can be used, 0 otherwise
+ */
+int
+is_rapl_batch_enabled(rapl_ctx_t *ctx)
+{
+    return NULL != ctx->batch_cpu_op;
+}
+
+/*!
+ * \brief Read the registers selected by select_rapl_batch() at once: by
+ * default, the energy, perf status and uncore frequency registers of all
+ * nodes and the APERF, MPERF and TSC of all CPUs.
+ *
+ * With msr-safe's batch device, this is a single system call; with io_uring,
+ * one submission of asynchronous reads per up to 4096 registers; otherwise
+ * the registers are read one by one. The values are then available through the
+ * get_batch_*() functions and update_core_type_stats().
+ *
+ * \return 0 on success, -1 if batching is not enabled or the batch failed
+ */
+int
+sample_rapl_batch(rapl_ctx_t *ctx)
+{
+    if (!is_rapl_batch_enabled(ctx))
+        return MY_ERROR;
+    if (0 != msr_batch_run(&ctx->batch, &ctx->msr)) {
+        ctx->batch_valid = 0;
+        return MY_ERROR;
+    }
+    ctx->batch_valid = 1;
+    return 0;
+}
+
+/*!
+ * \brief Get an energy status counter as of the last sample_rapl_batch().
+ *
+ * Domains that aren't part of the batch are read directly.
+ * \return 0 on success, -1 otherwise
+ */
+int
+get_batch_energy_status_raw(rapl_ctx_t *ctx,
+                            uint64_t    node,
+                            uint64_t    power_domain,
+                            uint64_t   *total_energy_consumed_raw)
+{
+    uint64_t msr;
+    int      op;
+
+    if (node >= ctx->num_nodes || power_domain >= RAPL_NR_DOMAIN)
+        return MY_ERROR;
+    op = ctx->batch_valid ? ctx->batch_energy_op[node * RAPL_NR_DOMAIN + power_domain] : -1;
+    if (op < 0) {
+        switch (power_domain) {
+        case RAPL_PKG:  return get_pkg_energy_status_raw(ctx, node, total_energy_consumed_raw);
+        case RAPL_PP0:  return get_pp0_energy_status_raw(ctx, node, total_energy_consumed_raw);
+        case RAPL_PP1:  return get_pp1_energy_status_raw(ctx, node, total_energy_consumed_raw);
+        default:        return get_dram_energy_status_raw(ctx, node, total_energy_consumed_raw);
+        }
+    }
+    if (0 != msr_batch_result(&ctx->batch, op, &msr))
+        return MY_ERROR;
+    *total_energy_consumed_raw = msr & 0xffffffff;
+    return 0;
+}
+
+/*!
+ * \brief Get a perf status (throttled time) counter as of the last
+ * sample_rapl_batch(), in units of the RAPL time unit.
+ * \return 0 on success, -1 if the register isn't part of the batch or failed
+ */
+int
+get_batch_perf_status_raw(rapl_ctx_t *ctx,
+                          uint64_t    node,
+                          uint64_t    power_domain,
+                          uint64_t   *accumulated_throttled_time_raw)
+{
+    uint64_t msr;
+    int      op;
+
+    if (!ctx->batch_valid || node >= ctx->num_nodes || power_domain >= RAPL_NR_DOMAIN)
+        return MY_ERROR;
+    op = ctx->batch_perf_op[node * RAPL_NR_DOMAIN + power_domain];
+    if (0 != msr_batch_result(&ctx->batch, op, &msr))
+        return MY_ERROR;
+    *accumulated_throttled_time_raw = msr & 0xffffffff;
+    return 0;
+}
+
+/* Uncore frequency */
+
+/*
+ * The uncore frequency is read from MSR_UNCORE_PERF_STATUS and
+ * MSR_UNCORE_RATIO_LIMIT where the model table lists them, and otherwise from
+ * the intel_uncore_frequency driver's files in sysfs (one directory per
+ * package and die), which are kept open.
+ */
+static void
+init_uncore(rapl_ctx_t *ctx)
+{
+    char     path[128];
+    uint64_t node, pkg_id, die_id, i;
+
+    if (is_supported_msr(ctx, MSR_UNCORE_PERF_STATUS) && is_supported_msr(ctx, MSR_UNCORE_RATIO_LIMIT)) {
+        ctx->uncore_source = UNCORE_MSR;
+        return;
+    }
+
+    ctx->uncore_fd = (int *) malloc(ctx->num_nodes * 3 * sizeof(int));
+    if (NULL == ctx->uncore_fd)
+        return;
+    for (i = 0; i < ctx->num_nodes * 3; i++)
+        ctx->uncore_fd[i] = -1;
+
+    for (node = 0; node < ctx->num_nodes; node++) {
+        get_rapl_node_location(ctx, node, &pkg_id, &die_id);
+        for (i = 0; i < 3; i++) {
+            snprintf(path, sizeof(path), "%s/package_%02lu_die_%02lu/%s",
+                     UNCORE_SYSFS_PATH, pkg_id, die_id, UNCORE_SYSFS_FILES[i]);
+            ctx->uncore_fd[node * 3 + i] = open(path, O_RDONLY);
+            if (ctx->uncore_fd[node * 3 + i] < 0)
+                return; // left as UNCORE_NONE, terminate_rapl() closes the rest
+        }
+    }
+    ctx->uncore_source = UNCORE_SYSFS;
+}
+
+static int
+read_uncore_sysfs(int fd, double *mhz)
+{
+    char    buffer[32];
+    ssize_t len;
+
+    len = pread(fd, buffer, sizeof(buffer) - 1, 0);
+    if (len <= 0)
+        return MY_ERROR;
+    buffer[len] = '\0';
+    *mhz = strtoull(buffer, NULL, 10) / 1000.0;
+    return 0;
+}
+
+/*!
+ * \brief Check where the uncore frequency can be read from.
+ * \return "msr", "sysfs", or NULL if it can't be read
+ */
+const char *
+get_uncore_freq_source(rapl_ctx_t *ctx)
+{
+    switch (ctx->uncore_source) {
+    case UNCORE_MSR:   return "msr";
+    case UNCORE_SYSFS: return "sysfs";
+    default:           return NULL;
+    }
+}
+
+/*!
+ * \brief Get the current uncore frequency of a node and its limits.
+ *
+ * With a batching MSR backend, the registers are taken from the last
+ * sample_rapl_batch(), i.e. from the same sweep as the energy counters.
+ * \return 0 on success, -1 otherwise
+ */
+int
+get_uncore_freq(rapl_ctx_t *ctx, uint64_t node, uncore_freq_t *freq)
+{
+    int                      err = 0;
+    int                      op;
+    uint64_t                 cpu, status, limit;
+    uncore_perf_status_msr_t status_msr;
+    uncore_ratio_limit_msr_t limit_msr;
+
+    if (node >= ctx->num_nodes)
+        return MY_ERROR;
+
+    switch (ctx->uncore_source) {
+    case UNCORE_MSR:
+        op = (ctx->batch_valid && NULL != ctx->batch_uncore_op) ? ctx->batch_uncore_op[node] : -1;
+        if (op >= 0) {
+            err = msr_batch_result(&ctx->batch, op, &status);
+            if (!err)
+                err = msr_batch_result(&ctx->batch, op + 1, &limit);
+        } else {
+            cpu = pkg_node_to_cpu(ctx, node);
+            err = read_msr_cached(&ctx->msr, cpu, MSR_UNCORE_PERF_STATUS, &status);
+            if (!err)
+                err = read_msr_cached(&ctx->msr, cpu, MSR_UNCORE_RATIO_LIMIT, &limit);
+        }
+        if (!err) {
+            memcpy(&status_msr, &status, sizeof(status_msr));
+            memcpy(&limit_msr, &limit, sizeof(limit_msr));
+
+            freq->current_mhz = status_msr.current_ratio * 100.0;
+            freq->min_mhz = limit_msr.min_ratio * 100.0;
+            freq->max_mhz = limit_msr.max_ratio * 100.0;
+        }
+        return err;
+    case UNCORE_SYSFS:
+        err = read_uncore_sysfs(ctx->uncore_fd[node * 3], &freq->current_mhz);
+        if (!err)
+            err = read_uncore_sysfs(ctx->uncore_fd[node * 3 + 1], &freq->min_mhz);
+        if (!err)
+            err = read_uncore_sysfs(ctx->uncore_fd[node * 3 + 2], &freq->max_mhz);
+        return err;
+    default:
+        return MY_ERROR;
+    }
 }
 
 /* Utilities */
 
+/*!
+ * \brief Get the size of one energy status register increment in Joules.
+ */
+double
+get_rapl_energy_unit(rapl_ctx_t *ctx)
+{
+    return ctx->energy_unit;
+}
+
+/*!
+ * \brief Get the size of one energy status register increment of a domain in Joules.
+ *
+ * This is get_rapl_energy_unit() except for the DRAM domain of server parts
+ * that count DRAM energy in a fixed unit.
+ */
+double
+get_rapl_domain_energy_unit(rapl_ctx_t *ctx, int domain)
+{
+    return (RAPL_DRAM == domain) ? ctx->dram_energy_unit : ctx->energy_unit;
+}
+
+/*!
+ * \brief Get the wraparound value of the total energy consumed, in Joules.
+ */
+double
+get_max_energy_status_joules(rapl_ctx_t *ctx)
+{
+    return ctx->max_energy_status_joules;
+}
+
+/*!
+ * \brief Get the wraparound value of the accumulated throttled time, in seconds.
+ */
+double
+get_max_throttled_time_seconds(rapl_ctx_t *ctx)
+{
+    return ctx->max_throttled_time_seconds;
+}
+
+
 int
-read_rapl_units()
+read_rapl_units(rapl_ctx_t *ctx)
 {
     int                    err = 0;
     rapl_unit_multiplier_t unit_multiplier;
 
-    err = get_rapl_unit_multiplier(0, &unit_multiplier);
+    err = get_rapl_unit_multiplier(ctx, 0, &unit_multiplier);
     if (!err) {
-        RAPL_TIME_UNIT = unit_multiplier.time;
-        RAPL_ENERGY_UNIT = unit_multiplier.energy;
-        RAPL_POWER_UNIT = unit_multiplier.power;
+        ctx->time_unit = unit_multiplier.time;
+        ctx->energy_unit = unit_multiplier.energy;
+        ctx->power_unit = unit_multiplier.power;
+        if (0 == ctx->dram_energy_unit)
+            ctx->dram_energy_unit = ctx->energy_unit;
     }
 
     return err;
@@ -1320,33 +2407,193 @@ get_os_freq(uint64_t cpu, uint64_t *freq)
 }
 
 
+/*!
+ * \brief Get the number of distinct core types on a RAPL node.
+ *
+ * This is 1 on non-hybrid parts, and 2 (P-cores and E-cores) on hybrid parts
+ * like Alder Lake and Raptor Lake.
+ */
+uint64_t
+get_num_core_types(rapl_ctx_t *ctx, uint64_t node)
+{
+    uint64_t i, n = 0;
+    uint64_t types[RAPL_MAX_CORE_TYPES];
+    uint64_t t;
+
+    for(i = 0; i < ctx->node_threads[node]; i++) {
+        for(t = 0; t < n; t++)
+            if(types[t] == ctx->pkg_map[node][i].core_type)
+                break;
+        if(t == n && n < RAPL_MAX_CORE_TYPES)
+            types[n++] = ctx->pkg_map[node][i].core_type;
+    }
+
+    return n;
+}
+
+/* APERF, MPERF and TSC of one CPU, from the last batch if batching */
+static int
+read_cpu_activity(rapl_ctx_t *ctx, uint64_t cpu, uint64_t *aperf, uint64_t *mperf, uint64_t *tsc)
+{
+    int op, err = 0;
+
+    op = ctx->batch_valid ? ctx->batch_cpu_op[cpu] : -1;
+    if(op >= 0) {
+        err = msr_batch_result(&ctx->batch, op, aperf);
+        if(!err)
+            err = msr_batch_result(&ctx->batch, op + 1, mperf);
+        if(!err)
+            err = msr_batch_result(&ctx->batch, op + 2, tsc);
+        return err;
+    }
+
+    err = read_msr_cached(&ctx->msr, cpu, MSR_IA32_APERF, aperf);
+    if(!err)
+        err = read_msr_cached(&ctx->msr, cpu, MSR_IA32_MPERF, mperf);
+    if(!err)
+        err = read_msr_cached(&ctx->msr, cpu, MSR_IA32_TIME_STAMP_COUNTER, tsc);
+    return err;
+}
+
+/*!
+ * \brief Update the per core type activity of a RAPL node.
+ *
+ * Reads APERF, MPERF and the TSC of all CPUs of the node and aggregates the
+ * increments since the previous call per core type: the average frequency
+ * while not halted (APERF/MPERF times the TSC rate), the C0 residency
+ * (MPERF/TSC) and the core energy, which is split between the core types in
+ * proportion to their unhalted cycles (APERF). The core energy is taken from
+ * the PP0 domain, or the PKG domain if there is no PP0 domain.
+ *
+ * stats must have room for get_num_core_types(node) entries, in which the
+ * types are reported in order of first appearance on the node. The first
+ * call for a node only establishes the baseline; its frequency and residency
+ * are NaN.
+ *
+ * With a batching MSR backend, the registers are taken from the last
+ * sample_rapl_batch() instead of being read here.
+ *
+ * \return 0 on success, -1 otherwise
+ */
+int
+update_core_type_stats(rapl_ctx_t *ctx, uint64_t node, core_type_stats_t *stats)
+{
+    int      err = 0;
+    uint64_t i, t, n = 0;
+    uint64_t aperf, mperf, tsc, energy_raw;
+    uint64_t d_aperf[RAPL_MAX_CORE_TYPES] = { 0 };
+    uint64_t d_mperf[RAPL_MAX_CORE_TYPES] = { 0 };
+    uint64_t d_tsc[RAPL_MAX_CORE_TYPES] = { 0 };
+    uint64_t num_valid[RAPL_MAX_CORE_TYPES] = { 0 };
+    uint64_t d_aperf_total = 0;
+    double   energy_joules;
+    double   elapsed = 0;
+    struct timespec now;
+    cpu_activity_t *a;
+    node_activity_t *na;
+
+    if(node >= ctx->num_nodes)
+        return MY_ERROR;
+
+    na = &ctx->node_activity[node];
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if(na->valid)
+        elapsed = (now.tv_sec - na->time.tv_sec) + (now.tv_nsec - na->time.tv_nsec) / 1e9;
+    na->time = now;
+
+    for(i = 0; i < ctx->node_threads[node]; i++) {
+        for(t = 0; t < n; t++)
+            if(stats[t].core_type == ctx->pkg_map[node][i].core_type)
+                break;
+        if(t == n) {
+            if(n == RAPL_MAX_CORE_TYPES)
+                continue;
+            stats[n].core_type = ctx->pkg_map[node][i].core_type;
+            stats[n].num_cpus = 0;
+            n++;
+        }
+        stats[t].num_cpus++;
+
+        a = &ctx->cpu_activity[ctx->pkg_map[node][i].os_id];
+        err = read_cpu_activity(ctx, ctx->pkg_map[node][i].os_id, &aperf, &mperf, &tsc);
+        if(err)
+            return MY_ERROR;
+
+        if(a->valid) {
+            d_aperf[t] += aperf - a->aperf;
+            d_mperf[t] += mperf - a->mperf;
+            d_tsc[t] += tsc - a->tsc;
+            d_aperf_total += aperf - a->aperf;
+            num_valid[t]++;
+        }
+        a->aperf = aperf;
+        a->mperf = mperf;
+        a->tsc = tsc;
+        a->valid = 1;
+    }
+
+    if(ctx->batch_valid)
+        err = get_batch_energy_status_raw(ctx, node, is_supported_domain(ctx, RAPL_PP0) ? RAPL_PP0 : RAPL_PKG, &energy_raw);
+    else if(is_supported_domain(ctx, RAPL_PP0))
+        err = get_pp0_energy_status_raw(ctx, node, &energy_raw);
+    else
+        err = get_pkg_energy_status_raw(ctx, node, &energy_raw);
+    if(err)
+        return MY_ERROR;
+    energy_joules = na->valid ? convert_to_joules(ctx, (energy_raw - na->energy_raw) & 0xffffffff) : 0;
+    na->energy_raw = energy_raw;
+
+    for(t = 0; t < n; t++) {
+        if(d_aperf_total > 0)
+            na->energy_joules[t] += energy_joules * d_aperf[t] / d_aperf_total;
+        else
+            na->energy_joules[t] += energy_joules * stats[t].num_cpus / ctx->node_threads[node];
+        stats[t].energy_joules = na->energy_joules[t];
+
+        // MPERF counts at the TSC rate while not halted
+        stats[t].freq_mhz = NAN;
+        stats[t].residency = NAN;
+        if(d_tsc[t] > 0 && elapsed > 0) {
+            stats[t].residency = (double) d_mperf[t] / d_tsc[t];
+            if(d_mperf[t] > 0)
+                stats[t].freq_mhz = (double) d_aperf[t] / d_mperf[t]
+                    * ((double) d_tsc[t] / num_valid[t]) / elapsed / 1e6;
+        }
+    }
+    na->valid = 1;
+
+    return 0;
+}
+
 // Uses the OS (and not the PMU counters) to retrieve the frequency
+
 int
-get_pp0_freq_mhz(uint64_t node, uint64_t *freq)
+get_pp0_freq_mhz(rapl_ctx_t *ctx, uint64_t node, uint64_t *freq)
 {
     int ret = 0;
     int i;
 
     // If all the cores are on the same power domain, report the average freq
-    if( get_num_rapl_nodes_pp0() == get_num_rapl_nodes_pkg())
+    if( get_num_rapl_nodes_pp0(ctx) == get_num_rapl_nodes_pkg(ctx))
     {
         uint64_t sum_freq = 0;
         uint64_t cpu_freq = 0;
 
-        for(i=0; i<num_pkg_threads; i++)
+        for(i=0; i<ctx->node_threads[node]; i++)
         {
-            uint64_t os_cpu = pkg_map[node][i].os_id;
+            uint64_t os_cpu = ctx->pkg_map[node][i].os_id;
             ret = get_os_freq(os_cpu, &cpu_freq);
             sum_freq += cpu_freq;
         }
 
         if(0 == ret)
-            *freq =  (sum_freq / num_pkg_threads) / 1000.0;
+            *freq =  (sum_freq / ctx->node_threads[node]) / 1000.0;
     }
     else
     {
         uint64_t cpu_freq = 0;
-        uint64_t os_cpu = pp0_node_to_cpu(node);
+        uint64_t os_cpu = pp0_node_to_cpu(ctx, node);
         ret = get_os_freq(os_cpu, &cpu_freq);
         if(0 == ret)
             *freq = cpu_freq / 1000.0;
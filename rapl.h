@@ -36,25 +36,44 @@ enum RAPL_DOMAIN { PKG, PP0, PP1, DRAM };
 typedef struct APIC_ID_t {
     uint64_t smt_id;
     uint64_t core_id;
+    uint64_t die_id;  /* 0 unless the package has multiple dies */
     uint64_t pkg_id;
     uint64_t os_id;
+    uint64_t node;    /* RAPL node, one per (package, die) */
+    uint64_t core_type; /* CPU_CORE_TYPE_*, see cpuid.h */
 } APIC_ID_t;
 
-int init_rapl();
-int terminate_rapl();
+/*! \brief Library state, created by init_rapl() and passed to every other function.
+ *
+ *  Contexts are independent of each other. One context may be shared by
+ *  several threads as long as they work on different nodes.
+ */
+typedef struct rapl_ctx_t rapl_ctx_t;
+
+int init_rapl(rapl_ctx_t **ctx);
+int terminate_rapl(rapl_ctx_t *ctx);
 
 /* Wraparound values for total energy consumed and accumulated throttled time.
  * These values are computed within init_rapl(). */
-double MAX_ENERGY_STATUS_JOULES;   /* default: 65536 */
-double MAX_THROTTLED_TIME_SECONDS; /* default: 4194304 */
-
-uint64_t get_num_rapl_nodes_pkg();
-uint64_t get_num_rapl_nodes_pp0();
-uint64_t get_num_rapl_nodes_pp1();
-uint64_t get_num_rapl_nodes_dram();
-
-uint64_t is_supported_msr(uint64_t msr);
-uint64_t is_supported_domain(uint64_t power_domain);
+double get_max_energy_status_joules(rapl_ctx_t *ctx);   /* default: 65536 */
+double get_max_throttled_time_seconds(rapl_ctx_t *ctx); /* default: 4194304 */
+
+uint64_t get_num_rapl_nodes_pkg(rapl_ctx_t *ctx);
+uint64_t get_num_rapl_nodes_pp0(rapl_ctx_t *ctx);
+uint64_t get_num_rapl_nodes_pp1(rapl_ctx_t *ctx);
+uint64_t get_num_rapl_nodes_dram(rapl_ctx_t *ctx);
+
+/*! \brief Get the package and die a RAPL node belongs to */
+int get_rapl_node_location(rapl_ctx_t *ctx, uint64_t node, uint64_t *pkg_id, uint64_t *die_id);
+/*! \brief Get the highest number of dies (RAPL nodes) per package */
+uint64_t get_num_dies_per_pkg(rapl_ctx_t *ctx);
+/*! \brief Get the RAPL node an OS CPU belongs to */
+int get_cpu_rapl_node(rapl_ctx_t *ctx, uint64_t os_cpu, uint64_t *node);
+/*! \brief Get the number of OS CPUs */
+uint64_t get_num_os_cpus(rapl_ctx_t *ctx);
+
+uint64_t is_supported_msr(rapl_ctx_t *ctx, uint64_t msr);
+uint64_t is_supported_domain(rapl_ctx_t *ctx, uint64_t power_domain);
 
 /* General */
 
@@ -78,11 +97,12 @@ typedef struct pkg_rapl_parameters_t {
     double maximum_power_watts;
     double maximum_limit_time_window_seconds;
 } pkg_rapl_parameters_t;
-int get_pkg_rapl_power_limit_control_t(uint64_t node, pkg_rapl_power_limit_control_t *rapl_power_limit_control);
-int get_pkg_total_energy_consumed(uint64_t node, double *total_energy_consumed);
-int get_pkg_rapl_parameters_t(uint64_t node, pkg_rapl_parameters_t *rapl_parameters);
-int get_pkg_accumulated_throttled_time(uint64_t node, double *accumulated_throttled_time_seconds);
-int set_pkg_rapl_power_limit_control_t(uint64_t node, pkg_rapl_power_limit_control_t *rapl_power_limit_control);
+int get_pkg_rapl_power_limit_control_t(rapl_ctx_t *ctx, uint64_t node, pkg_rapl_power_limit_control_t *rapl_power_limit_control);
+int get_pkg_total_energy_consumed(rapl_ctx_t *ctx, uint64_t node, double *total_energy_consumed);
+int get_pkg_energy_status_raw(rapl_ctx_t *ctx, uint64_t node, uint64_t *total_energy_consumed_raw);
+int get_pkg_rapl_parameters_t(rapl_ctx_t *ctx, uint64_t node, pkg_rapl_parameters_t *rapl_parameters);
+int get_pkg_accumulated_throttled_time(rapl_ctx_t *ctx, uint64_t node, double *accumulated_throttled_time_seconds);
+int set_pkg_rapl_power_limit_control_t(rapl_ctx_t *ctx, uint64_t node, pkg_rapl_power_limit_control_t *rapl_power_limit_control);
 
 /*! \brief RAPL power limit control structure, DRAM domain */
 typedef struct dram_rapl_power_limit_control_t {
@@ -100,11 +120,12 @@ typedef struct dram_rapl_parameters_t {
     double maximum_power_watts;
     double maximum_limit_time_window_seconds;
 } dram_rapl_parameters_t;
-int get_dram_rapl_power_limit_control_t(uint64_t node, dram_rapl_power_limit_control_t *rapl_power_limit_control);
-int get_dram_total_energy_consumed(uint64_t node, double *total_energy_consumed);
-int get_dram_rapl_parameters_t(uint64_t node, dram_rapl_parameters_t *rapl_parameters);
-int get_dram_accumulated_throttled_time(uint64_t node, double *accumulated_throttled_time_seconds);
-int set_dram_rapl_power_limit_control_t(uint64_t node, dram_rapl_power_limit_control_t *rapl_power_limit_control);
+int get_dram_rapl_power_limit_control_t(rapl_ctx_t *ctx, uint64_t node, dram_rapl_power_limit_control_t *rapl_power_limit_control);
+int get_dram_total_energy_consumed(rapl_ctx_t *ctx, uint64_t node, double *total_energy_consumed);
+int get_dram_energy_status_raw(rapl_ctx_t *ctx, uint64_t node, uint64_t *total_energy_consumed_raw);
+int get_dram_rapl_parameters_t(rapl_ctx_t *ctx, uint64_t node, dram_rapl_parameters_t *rapl_parameters);
+int get_dram_accumulated_throttled_time(rapl_ctx_t *ctx, uint64_t node, double *accumulated_throttled_time_seconds);
+int set_dram_rapl_power_limit_control_t(rapl_ctx_t *ctx, uint64_t node, dram_rapl_power_limit_control_t *rapl_power_limit_control);
 
 
 /*! \brief RAPL power limit control structure, PP0 domain */
@@ -115,12 +136,16 @@ typedef struct pp0_rapl_power_limit_control_t {
     uint64_t clamp_enabled;
     uint64_t lock_enabled;
 } pp0_rapl_power_limit_control_t;
-int get_pp0_rapl_power_limit_control_t(uint64_t node, pp0_rapl_power_limit_control_t *rapl_power_limit_control);
-int get_pp0_total_energy_consumed(uint64_t node, double *total_energy_consumed);
-int get_pp0_balance_policy(uint64_t node, uint64_t *priority_level);
-int get_pp0_accumulated_throttled_time(uint64_t node, double *accumulated_throttled_time_seconds);
-int set_pp0_rapl_power_limit_control_t(uint64_t node, pp0_rapl_power_limit_control_t *rapl_power_limit_control);
-int set_pp0_balance_policy(uint64_t node, uint64_t priority_level);
+int get_pp0_rapl_power_limit_control_t(rapl_ctx_t *ctx, uint64_t node, pp0_rapl_power_limit_control_t *rapl_power_limit_control);
+int get_pp0_total_energy_consumed(rapl_ctx_t *ctx, uint64_t node, double *total_energy_consumed);
+int get_pp0_energy_status_raw(rapl_ctx_t *ctx, uint64_t node, uint64_t *total_energy_consumed_raw);
+int get_pp0_balance_policy(rapl_ctx_t *ctx, uint64_t node, uint64_t *priority_level);
+int get_pp0_accumulated_throttled_time(rapl_ctx_t *ctx, uint64_t node, double *accumulated_throttled_time_seconds);
+int set_pp0_rapl_power_limit_control_t(rapl_ctx_t *ctx, uint64_t node, pp0_rapl_power_limit_control_t *rapl_power_limit_control);
+int set_pp0_balance_policy(rapl_ctx_t *ctx, uint64_t node, uint64_t priority_level);
+
+/* Per-core energy (AMD only; on AMD, PP0 is the sum of all cores) */
+int get_core_energy_status_raw(rapl_ctx_t *ctx, uint64_t os_cpu, uint64_t *total_energy_consumed_raw);
 
 
 /*! \brief RAPL power limit control structure, PP1 domain */
@@ -131,20 +156,80 @@ typedef struct pp1_rapl_power_limit_control_t {
     uint64_t clamp_enabled;
     uint64_t lock_enabled;
 } pp1_rapl_power_limit_control_t;
-int get_pp1_rapl_power_limit_control_t(uint64_t node, pp1_rapl_power_limit_control_t *rapl_power_limit_control);
-int get_pp1_total_energy_consumed(uint64_t node, double *total_energy_consumed);
-int get_pp1_balance_policy(uint64_t node, uint64_t *priority_level);
-int set_pp1_rapl_power_limit_control_t(uint64_t node, pp1_rapl_power_limit_control_t *rapl_power_limit_control);
-int set_pp1_balance_policy(uint64_t node, uint64_t priority_level);
+int get_pp1_rapl_power_limit_control_t(rapl_ctx_t *ctx, uint64_t node, pp1_rapl_power_limit_control_t *rapl_power_limit_control);
+int get_pp1_total_energy_consumed(rapl_ctx_t *ctx, uint64_t node, double *total_energy_consumed);
+int get_pp1_energy_status_raw(rapl_ctx_t *ctx, uint64_t node, uint64_t *total_energy_consumed_raw);
+int get_pp1_balance_policy(rapl_ctx_t *ctx, uint64_t node, uint64_t *priority_level);
+int set_pp1_rapl_power_limit_control_t(rapl_ctx_t *ctx, uint64_t node, pp1_rapl_power_limit_control_t *rapl_power_limit_control);
+int set_pp1_balance_policy(rapl_ctx_t *ctx, uint64_t node, uint64_t priority_level);
+
+/* Precision sampling (opt-in, busy-waits for up to one counter update) */
+
+/*! \brief Energy status register value captured right after an update */
+typedef struct rapl_precise_sample_t {
+    uint64_t energy_raw;      /* new register value */
+    uint64_t tsc;             /* estimated TSC at the update */
+    uint64_t tsc_uncertainty; /* +/- this many TSC ticks */
+    uint64_t spins;           /* register reads needed to see the update */
+} rapl_precise_sample_t;
+int get_pkg_energy_status_precise(rapl_ctx_t *ctx, uint64_t node, uint64_t max_spins, rapl_precise_sample_t *sample);
+int estimate_pkg_energy_update_period(rapl_ctx_t *ctx, uint64_t node, uint64_t updates, uint64_t max_spins, double *period_seconds, double *tsc_hz);
+double interpolate_energy_joules(rapl_ctx_t *ctx, const rapl_precise_sample_t *a, const rapl_precise_sample_t *b, uint64_t tsc_start, uint64_t tsc_end);
+
+/* Activity per core type (P-cores and E-cores on hybrid parts) */
+
+#define RAPL_MAX_CORE_TYPES 2
+
+/*! \brief Activity of the CPUs of one core type on a RAPL node */
+typedef struct core_type_stats_t {
+    uint64_t core_type;     /* CPU_CORE_TYPE_*, CPU_CORE_TYPE_NONE if not hybrid */
+    uint64_t num_cpus;      /* OS CPUs of this type on the node */
+    double   freq_mhz;      /* average frequency while not halted */
+    double   residency;     /* average fraction of time not halted (C0) */
+    double   energy_joules; /* attributed core energy since the first update */
+} core_type_stats_t;
+uint64_t get_num_core_types(rapl_ctx_t *ctx, uint64_t node);
+int update_core_type_stats(rapl_ctx_t *ctx, uint64_t node, core_type_stats_t *stats);
+
+/* Batched sampling (with the "msr-batch" or "msr-uring" MSR backends) */
+
+/*! \brief Check if sample_rapl_batch() can be used */
+int is_rapl_batch_enabled(rapl_ctx_t *ctx);
+/*! \brief Register groups of select_rapl_batch() besides the energy status */
+#define RAPL_BATCH_PERF_STATUS  0x1 /* perf status of the selected domains */
+#define RAPL_BATCH_UNCORE       0x2 /* uncore frequency */
+#define RAPL_BATCH_CPU_ACTIVITY 0x4 /* APERF, MPERF and TSC of the node's CPUs */
+#define RAPL_BATCH_ALL          0x7
+int select_rapl_batch(rapl_ctx_t *ctx, const uint32_t *domain_masks, unsigned int groups);
+/*! \brief Read the selected (by default all) energy/perf status, uncore and APERF/MPERF/TSC registers at once */
+int sample_rapl_batch(rapl_ctx_t *ctx);
+int get_batch_energy_status_raw(rapl_ctx_t *ctx, uint64_t node, uint64_t power_domain, uint64_t *total_energy_consumed_raw);
+int get_batch_perf_status_raw(rapl_ctx_t *ctx, uint64_t node, uint64_t power_domain, uint64_t *accumulated_throttled_time_raw);
+
+/* Uncore frequency (MSR_UNCORE_PERF_STATUS/RATIO_LIMIT, or intel_uncore_frequency in sysfs) */
+
+/*! \brief Uncore frequency of a RAPL node */
+typedef struct uncore_freq_t {
+    double current_mhz;
+    double min_mhz;     /* ratio limits */
+    double max_mhz;
+} uncore_freq_t;
+const char *get_uncore_freq_source(rapl_ctx_t *ctx);
+int get_uncore_freq(rapl_ctx_t *ctx, uint64_t node, uncore_freq_t *freq);
 
 /* Utilities */
 
-int read_rapl_units();
+int read_rapl_units(rapl_ctx_t *ctx);
+
+/*! \brief Size of one energy status register increment, in Joules */
+double get_rapl_energy_unit(rapl_ctx_t *ctx);
+/*! \brief The same for one domain (the DRAM unit may differ), in Joules */
+double get_rapl_domain_energy_unit(rapl_ctx_t *ctx, int domain);
 
 /*! \brief Use the RDTSC instruction to read the time-stamp counter */
 int read_tsc(uint64_t *tsc);
 
 /* Required by Power Gadget */
-int get_pp0_freq_mhz(uint64_t node, uint64_t *freq);
+int get_pp0_freq_mhz(rapl_ctx_t *ctx, uint64_t node, uint64_t *freq);
 
 #endif
@@ -0,0 +1,204 @@
+/**
+ * collectd - shm.c
+ * Copyright (C) 2015  Nils Steinger
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Author:
+ *   Nils Steinger <git at n-st dot de>
+ **/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "shm.h"
+
+#define RAPL_SHM_NODES(h) ((char *) (h) + (h)->header_size)
+
+int
+rapl_shm_create (rapl_shm_t *shm, const char *name, uint32_t num_nodes, double energy_unit_J,
+        double dram_energy_unit_J)
+{
+    int fd;
+    void *map;
+    size_t size;
+    rapl_shm_header_t *h;
+
+    size = sizeof (rapl_shm_header_t) + num_nodes * sizeof (rapl_shm_node_t);
+
+    /* Start from scratch, so readers of a stale segment notice. */
+    shm_unlink (name);
+    fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0)
+        return MY_ERROR;
+    if (ftruncate (fd, size) != 0) {
+        close (fd);
+        shm_unlink (name);
+        return MY_ERROR;
+    }
+    map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close (fd);
+    if (map == MAP_FAILED) {
+        shm_unlink (name);
+        return MY_ERROR;
+    }
+
+    shm->name = strdup (name);
+    if (shm->name == NULL) {
+        munmap (map, size);
+        shm_unlink (name);
+        return MY_ERROR;
+    }
+    shm->header = map;
+    shm->size = size;
+
+    h = shm->header;
+    h->version = RAPL_SHM_VERSION;
+    h->header_size = sizeof (rapl_shm_header_t);
+    h->node_size = sizeof (rapl_shm_node_t);
+    h->num_nodes = num_nodes;
+    h->num_domains = RAPL_NR_DOMAIN;
+    h->energy_unit_J = energy_unit_J;
+    h->dram_energy_unit_J = dram_energy_unit_J;
+    h->seq = 0;
+    /* The magic goes last, so a reader never sees a half-initialised
+     * header. */
+    __atomic_thread_fence (__ATOMIC_RELEASE);
+    memcpy (h->magic, RAPL_SHM_MAGIC, sizeof (h->magic));
+
+    return 0;
+}
+
+void
+rapl_shm_publish (rapl_shm_t *shm, const rapl_shm_node_t *nodes, uint64_t time_ns)
+{
+    rapl_shm_header_t *h = shm->header;
+    uint64_t seq = h->seq; /* only ever modified by us */
+
+    __atomic_store_n (&h->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence (__ATOMIC_RELEASE);
+
+    memcpy (RAPL_SHM_NODES (h), nodes, h->num_nodes * sizeof (rapl_shm_node_t));
+    h->update_time_ns = time_ns;
+
+    __atomic_store_n (&h->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void
+rapl_shm_destroy (rapl_shm_t *shm)
+{
+    char *name = shm->name;
+
+    shm->name = NULL;
+    rapl_shm_close (shm);
+    if (name != NULL) {
+        shm_unlink (name);
+        free (name);
+    }
+}
+
+int
+rapl_shm_open (rapl_shm_t *shm, const char *name)
+{
+    int fd;
+    void *map;
+    struct stat st;
+    rapl_shm_header_t *h;
+
+    fd = shm_open (name, O_RDONLY, 0);
+    if (fd < 0)
+        return MY_ERROR;
+    if (fstat (fd, &st) != 0) {
+        close (fd);
+        return MY_ERROR;
+    }
+    if ((size_t) st.st_size < sizeof (rapl_shm_header_t)) {
+        close (fd);
+        errno = EPROTO;
+        return MY_ERROR;
+    }
+    map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close (fd);
+    if (map == MAP_FAILED)
+        return MY_ERROR;
+
+    shm->header = map;
+    shm->size = st.st_size;
+    shm->name = NULL;
+
+    h = shm->header;
+    if (memcmp (h->magic, RAPL_SHM_MAGIC, sizeof (h->magic)) != 0
+            || h->version != RAPL_SHM_VERSION
+            || h->header_size < offsetof (rapl_shm_header_t, dram_energy_unit_J)
+            || h->node_size < offsetof (rapl_shm_node_t, pkg_id)
+            || shm->size < h->header_size + (size_t) h->num_nodes * h->node_size) {
+        rapl_shm_close (shm);
+        errno = EPROTO;
+        return MY_ERROR;
+    }
+
+    return 0;
+}
+
+int
+rapl_shm_snapshot (const rapl_shm_t *shm, rapl_shm_node_t *nodes, uint32_t max_nodes,
+                   uint64_t *time_ns, unsigned int max_retries)
+{
+    const rapl_shm_header_t *h = shm->header;
+    uint32_t num_nodes = (h->num_nodes < max_nodes) ? h->num_nodes : max_nodes;
+    size_t node_size = (h->node_size < sizeof (rapl_shm_node_t)) ? h->node_size : sizeof (rapl_shm_node_t);
+    uint64_t seq;
+    uint64_t update_time_ns;
+    uint32_t node;
+    unsigned int attempt;
+
+    for (attempt = 0; attempt <= max_retries; attempt++) {
+        seq = __atomic_load_n (&h->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+
+        for (node = 0; node < num_nodes; node++) {
+            /* Fields an older writer doesn't know about read as 0. */
+            if (node_size < sizeof (rapl_shm_node_t))
+                memset (&nodes[node], 0, sizeof (rapl_shm_node_t));
+            memcpy (&nodes[node], RAPL_SHM_NODES (h) + (size_t) node * h->node_size,
+                    node_size);
+        }
+        update_time_ns = h->update_time_ns;
+
+        __atomic_thread_fence (__ATOMIC_ACQUIRE);
+        if (__atomic_load_n (&h->seq, __ATOMIC_RELAXED) == seq) {
+            if (time_ns != NULL)
+                *time_ns = update_time_ns;
+            return num_nodes;
+        }
+    }
+
+    return MY_ERROR;
+}
+
+void
+rapl_shm_close (rapl_shm_t *shm)
+{
+    if (shm->header != NULL)
+        munmap (shm->header, shm->size);
+    shm->header = NULL;
+    shm->size = 0;
+}
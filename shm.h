@@ -0,0 +1,127 @@
+/**
+ * collectd - shm.h
+ * Copyright (C) 2015  Nils Steinger
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Author:
+ *   Nils Steinger <git at n-st dot de>
+ **/
+
+#ifndef _h_shm
+#define _h_shm
+
+#include <stdint.h>
+
+#include "rapl.h"
+
+/*
+ * Shared memory export of the latest power state.
+ *
+ * The plugin publishes the state after every read pass in a POSIX shared
+ * memory segment (shm_open(3), default name "/intel_cpu_energy"), so local
+ * processes can use its measurements instead of reading the MSRs themselves.
+ *
+ * Layout (all fields in host byte order):
+ *
+ *   rapl_shm_header_t                  at offset 0
+ *   rapl_shm_node_t[header.num_nodes]  at offset header.header_size, each
+ *                                      header.node_size bytes long
+ *
+ * The segment is guarded by a sequence lock: the writer increments `seq'
+ * before and after updating the nodes, so it is odd while an update is in
+ * progress. A reader copies the nodes and retries if `seq' was odd or has
+ * changed in the meantime. Readers never block the writer and need neither
+ * locks nor system calls; rapl_shm_snapshot() implements this.
+ *
+ * Compatibility: RAPL_SHM_VERSION is only incremented for incompatible
+ * changes. New fields are only ever appended to the header and node
+ * structures, so readers must use header_size and node_size rather than
+ * sizeof() to locate the nodes (rapl_shm_snapshot() does).
+ */
+
+#define RAPL_SHM_MAGIC        "RAPLSHM1"
+#define RAPL_SHM_VERSION      1
+#define RAPL_SHM_DEFAULT_NAME "/intel_cpu_energy"
+
+/* Indexed by the RAPL_PKG, RAPL_PP0, RAPL_PP1 and RAPL_DRAM constants. */
+typedef struct rapl_shm_domain_t {
+    uint64_t energy_raw; /* energy consumed since the plugin started, in
+                            raw energy status units */
+    double   energy_J;   /* the same, in Joules */
+    double   watts;      /* average power between the last two reads */
+    uint64_t time_ns;    /* time of the last read, CLOCK_MONOTONIC_RAW */
+    uint32_t valid;      /* 0 if the domain isn't read or has never been
+                            read successfully */
+    uint32_t reserved;
+} rapl_shm_domain_t;
+
+typedef struct rapl_shm_node_t {
+    rapl_shm_domain_t domains[RAPL_NR_DOMAIN];
+    uint32_t pkg_id;     /* physical package of this RAPL node */
+    uint32_t die_id;     /* die within the package, 0 on single-die parts */
+} rapl_shm_node_t;
+
+typedef struct rapl_shm_header_t {
+    char     magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t node_size;
+    uint32_t num_nodes;
+    uint32_t num_domains;
+    uint32_t reserved;
+    double   energy_unit_J;  /* Joules per raw energy status unit */
+    uint64_t update_time_ns; /* time of the last update, CLOCK_MONOTONIC_RAW */
+    uint64_t seq;            /* sequence lock, odd while being updated */
+    /* Joules per raw DRAM energy status unit; beyond header_size of older
+     * writers, meaning energy_unit_J */
+    double   dram_energy_unit_J;
+} rapl_shm_header_t;
+
+typedef struct rapl_shm_t {
+    rapl_shm_header_t *header;
+    size_t             size;  /* of the mapping */
+    char              *name;  /* set if we created the segment */
+} rapl_shm_t;
+
+/* Writer */
+
+/* Create (or replace) the segment and map it for writing. Returns 0 on
+ * success, MY_ERROR otherwise (errno is set). */
+int rapl_shm_create(rapl_shm_t *shm, const char *name, uint32_t num_nodes, double energy_unit_J,
+        double dram_energy_unit_J);
+
+/* Publish the state of all nodes, copying it from `nodes'. */
+void rapl_shm_publish(rapl_shm_t *shm, const rapl_shm_node_t *nodes, uint64_t time_ns);
+
+/* Unmap and remove the segment. */
+void rapl_shm_destroy(rapl_shm_t *shm);
+
+/* Reader */
+
+/* Map an existing segment for reading. Returns 0 on success, MY_ERROR
+ * otherwise (errno is set; EPROTO if the layout isn't supported). */
+int rapl_shm_open(rapl_shm_t *shm, const char *name);
+
+/* Copy a consistent snapshot of up to `max_nodes' nodes to `nodes'; the time
+ * of the update is stored in `time_ns' unless it's NULL. Gives up after
+ * `max_retries' concurrent updates. Returns the number of nodes copied, or
+ * MY_ERROR if no consistent snapshot could be taken. */
+int rapl_shm_snapshot(const rapl_shm_t *shm, rapl_shm_node_t *nodes, uint32_t max_nodes,
+                      uint64_t *time_ns, unsigned int max_retries);
+
+/* Unmap the segment. */
+void rapl_shm_close(rapl_shm_t *shm);
+
+#endif
@@ -0,0 +1,262 @@
+/**
+ * collectd - test-batch.c
+ * Copyright (C) 2015  Nils Steinger
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Author:
+ *   Nils Steinger <git at n-st dot de>
+ **/
+
+/*
+ * Tests of batched MSR reads (msr_batch_t, see msr.h) against the fake batch
+ * device of the mock MSR backend: a successful batch, a batch with failed
+ * operations, a batch the device rejects as a whole, and the registers
+ * sample_rapl_batch() reads after select_rapl_batch().
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+#include "msr-mock.h"
+#include "rapl.h"
+
+#define NUM_NODES 2
+
+/* Power in 1/8 W, energy in 2^-14 J, time in 2^-10 s */
+#define POWER_UNIT 0xa0e03ULL
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf (stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+/* A batch of three reads on the fake device */
+static int batch_init (msr_batch_t *batch)
+{
+    if (0 != msr_batch_init (batch, 3, MSR_MOCK_BATCH_DEVICE))
+        return MY_ERROR;
+    batch->submit = msr_mock_batch_submit;
+    CHECK (batch->fd >= 0);
+    CHECK (0 == msr_batch_add_read (batch, 0, MSR_RAPL_PKG_ENERGY_STATUS));
+    CHECK (1 == msr_batch_add_read (batch, 1, MSR_RAPL_PKG_ENERGY_STATUS));
+    CHECK (2 == msr_batch_add_read (batch, 0, MSR_RAPL_DRAM_ENERGY_STATUS));
+    CHECK (MY_ERROR == msr_batch_add_read (batch, 1, MSR_RAPL_DRAM_ENERGY_STATUS));
+    return 0;
+}
+
+static uint64_t direct_reads (void)
+{
+    return msr_mock_reads (0, MSR_RAPL_PKG_ENERGY_STATUS) +
+           msr_mock_reads (1, MSR_RAPL_PKG_ENERGY_STATUS) +
+           msr_mock_reads (0, MSR_RAPL_DRAM_ENERGY_STATUS);
+}
+
+static void test_batch (msr_fd_cache_t *cache)
+{
+    msr_batch_t batch;
+    uint64_t value;
+
+    msr_mock_reset ();
+    msr_mock_set (0, MSR_RAPL_PKG_ENERGY_STATUS, 11);
+    msr_mock_set (1, MSR_RAPL_PKG_ENERGY_STATUS, 12);
+    msr_mock_set (0, MSR_RAPL_DRAM_ENERGY_STATUS, 13);
+    if (0 != batch_init (&batch)) {
+        CHECK (!"msr_batch_init() failed");
+        return;
+    }
+
+    CHECK (0 == msr_batch_run (&batch, cache));
+    CHECK (msr_mock_batches () == 1);
+    CHECK (direct_reads () == 0);
+    CHECK (0 == msr_batch_result (&batch, 0, &value) && value == 11);
+    CHECK (0 == msr_batch_result (&batch, 1, &value) && value == 12);
+    CHECK (0 == msr_batch_result (&batch, 2, &value) && value == 13);
+    CHECK (MY_ERROR == msr_batch_result (&batch, 3, &value));
+    CHECK (MY_ERROR == msr_batch_result (&batch, -1, &value));
+
+    /* The next run gets the new values. */
+    msr_mock_set (1, MSR_RAPL_PKG_ENERGY_STATUS, 22);
+    CHECK (0 == msr_batch_run (&batch, cache));
+    CHECK (msr_mock_batches () == 2);
+    CHECK (0 == msr_batch_result (&batch, 1, &value) && value == 22);
+
+    msr_batch_close (&batch);
+}
+
+static void test_batch_op_failed (msr_fd_cache_t *cache)
+{
+    msr_batch_t batch;
+    uint64_t value;
+
+    /* CPU 1's register doesn't exist: the ioctl fails, but reports the
+     * results of the other operations. */
+    msr_mock_reset ();
+    msr_mock_set (0, MSR_RAPL_PKG_ENERGY_STATUS, 11);
+    msr_mock_set (0, MSR_RAPL_DRAM_ENERGY_STATUS, 13);
+    if (0 != batch_init (&batch)) {
+        CHECK (!"msr_batch_init() failed");
+        return;
+    }
+
+    CHECK (0 == msr_batch_run (&batch, cache));
+    CHECK (msr_mock_batches () == 1);
+    CHECK (0 == msr_batch_result (&batch, 0, &value) && value == 11);
+    CHECK (MY_ERROR == msr_batch_result (&batch, 1, &value));
+    CHECK (0 == msr_batch_result (&batch, 2, &value) && value == 13);
+    /* ... and isn't taken for a rejection of the batch. */
+    CHECK (direct_reads () == 0);
+    CHECK (batch.fd >= 0);
+
+    /* The device is still used, and the operation can succeed again. */
+    msr_mock_set (1, MSR_RAPL_PKG_ENERGY_STATUS, 12);
+    CHECK (0 == msr_batch_run (&batch, cache));
+    CHECK (msr_mock_batches () == 2);
+    CHECK (0 == msr_batch_result (&batch, 1, &value) && value == 12);
+
+    msr_batch_close (&batch);
+}
+
+static void test_batch_rejected (msr_fd_cache_t *cache)
+{
+    msr_batch_t batch;
+    uint64_t value;
+    int fd;
+
+    msr_mock_reset ();
+    msr_mock_set (0, MSR_RAPL_PKG_ENERGY_STATUS, 11);
+    msr_mock_set (1, MSR_RAPL_PKG_ENERGY_STATUS, 12);
+    msr_mock_batch_reject (ENOTTY);
+    if (0 != batch_init (&batch)) {
+        CHECK (!"msr_batch_init() failed");
+        return;
+    }
+    fd = batch.fd;
+
+    /* The device is closed, and the registers are read one by one. */
+    CHECK (0 == msr_batch_run (&batch, cache));
+    CHECK (msr_mock_batches () == 1);
+    CHECK (batch.fd == -1);
+    CHECK (fcntl (fd, F_GETFD) == -1 && errno == EBADF);
+    CHECK (msr_mock_reads (0, MSR_RAPL_PKG_ENERGY_STATUS) == 1);
+    CHECK (msr_mock_reads (1, MSR_RAPL_PKG_ENERGY_STATUS) == 1);
+    CHECK (0 == msr_batch_result (&batch, 0, &value) && value == 11);
+    CHECK (0 == msr_batch_result (&batch, 1, &value) && value == 12);
+    CHECK (MY_ERROR == msr_batch_result (&batch, 2, &value));
+
+    /* The device isn't tried again. */
+    msr_mock_batch_reject (0);
+    CHECK (0 == msr_batch_run (&batch, cache));
+    CHECK (msr_mock_batches () == 1);
+    CHECK (msr_mock_reads (0, MSR_RAPL_PKG_ENERGY_STATUS) == 2);
+
+    /* Without a fallback, the batch can't be run. */
+    CHECK (MY_ERROR == msr_batch_run (&batch, NULL));
+
+    msr_batch_close (&batch);
+}
+
+/* Energy status register of a domain on SandyBridge server */
+static uint64_t energy_status_msr (uint64_t domain)
+{
+    switch (domain) {
+    case RAPL_PKG:  return MSR_RAPL_PKG_ENERGY_STATUS;
+    case RAPL_PP0:  return MSR_RAPL_PP0_ENERGY_STATUS;
+    case RAPL_PP1:  return MSR_RAPL_PP1_ENERGY_STATUS;
+    default:        return MSR_RAPL_DRAM_ENERGY_STATUS;
+    }
+}
+
+/* A distinct value per register; the upper half is reserved and must be
+ * masked off. */
+static uint64_t energy_status (uint64_t node, uint64_t domain)
+{
+    return 0xdead00000000ULL | (node + 1) << 8 | domain;
+}
+
+static void test_select (void)
+{
+    rapl_ctx_t *ctx;
+    /* Node 0: PKG and DRAM, node 1: PP0 */
+    uint32_t masks[NUM_NODES] = { 1u << RAPL_PKG | 1u << RAPL_DRAM, 1u << RAPL_PP0 };
+    uint64_t node, domain, msr, value, reads;
+    int selected;
+
+    msr_mock_reset ();
+    for (node = 0; node < NUM_NODES; node++) {
+        msr_mock_set (node, MSR_RAPL_POWER_UNIT, POWER_UNIT);
+        for (domain = 0; domain < RAPL_NR_DOMAIN; domain++)
+            msr_mock_set (node, energy_status_msr (domain), energy_status (node, domain));
+    }
+    if (0 != init_rapl (&ctx)) {
+        CHECK (!"init_rapl() failed");
+        return;
+    }
+    CHECK (NUM_NODES == get_num_rapl_nodes_pkg (ctx));
+    CHECK (is_rapl_batch_enabled (ctx));
+    CHECK (is_supported_domain (ctx, RAPL_PP0) && is_supported_domain (ctx, RAPL_DRAM));
+
+    CHECK (0 == select_rapl_batch (ctx, masks, 0));
+    CHECK (0 == sample_rapl_batch (ctx));
+    CHECK (msr_mock_batches () == 1);
+
+    for (node = 0; node < NUM_NODES; node++) {
+        for (domain = 0; domain < RAPL_NR_DOMAIN; domain++) {
+            if (!is_supported_domain (ctx, domain))
+                continue;
+            selected = (masks[node] >> domain) & 1;
+            msr = energy_status_msr (domain);
+            reads = msr_mock_reads (node, msr);
+            value = 0;
+            CHECK (0 == get_batch_energy_status_raw (ctx, node, domain, &value));
+            CHECK (value == (energy_status (node, domain) & 0xffffffff));
+            /* Selected domains come from the batch, the others are read
+             * directly. */
+            CHECK (msr_mock_reads (node, msr) - reads == (selected ? 0 : 1));
+        }
+    }
+
+    terminate_rapl (ctx);
+}
+
+int main (void)
+{
+    msr_fd_cache_t cache;
+
+    set_msr_backend (&msr_mock_batch_backend);
+    if (0 != msr_cache_init (&cache, NUM_NODES)) {
+        fprintf (stderr, "test-batch: msr_cache_init() failed\n");
+        return 1;
+    }
+
+    test_batch (&cache);
+    test_batch_op_failed (&cache);
+    test_batch_rejected (&cache);
+    test_select ();
+
+    msr_cache_close (&cache);
+    set_msr_backend (NULL);
+
+    if (failures > 0) {
+        fprintf (stderr, "test-batch: %d check(s) failed\n", failures);
+        return 1;
+    }
+    printf ("test-batch: all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,155 @@
+/**
+ * collectd - test-powercap.c
+ * Copyright (C) 2015  Nils Steinger
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Author:
+ *   Nils Steinger <git at n-st dot de>
+ **/
+
+/*
+ * Test of the power capping controller (see powercap.h) on two mocked
+ * packages: drives powercap_tick() through a demand step and checks the
+ * limits it writes to MSR_PKG_POWER_LIMIT.
+ */
+
+#include <stdio.h>
+
+#include "msr-mock.h"
+#include "powercap.h"
+#include "rapl.h"
+
+#define NUM_NODES 2
+
+/* Power in 1/8 W, energy in 2^-14 J, time in 2^-10 s */
+#define POWER_UNIT     0xa0e03ULL
+#define WATTS(w)       ((uint64_t) ((w) * 8))
+/* TDP 130 W, 10 W to 150 W */
+#define PKG_POWER_INFO (WATTS (130) | WATTS (10) << 16 | WATTS (150) << 32)
+/* PL1 80 W and PL2 100 W, both enabled; PL1 also clamped */
+#define PKG_POWER_LIMIT (WATTS (80) | 1ULL << 15 | 1ULL << 16 | WATTS (100) << 32 | 1ULL << 47)
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf (stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+/* PL1 as written to the package's MSR_PKG_POWER_LIMIT, in Watts */
+static double limit_watts (int node)
+{
+    uint64_t msr = 0;
+
+    if (0 != msr_mock_get (node, MSR_RAPL_PKG_POWER_LIMIT, &msr))
+        return -1;
+    return (msr & 0x7fff) / 8.0;
+}
+
+static uint64_t limit_writes (int node)
+{
+    return msr_mock_writes (node, MSR_RAPL_PKG_POWER_LIMIT);
+}
+
+/* One redistribution period of two ticks; a negative demand means the node
+ * isn't measured. */
+static int run_round (double now, double watts0, double watts1)
+{
+    int failed, tick;
+
+    for (tick = 0; tick < 2; tick++) {
+        if (watts0 >= 0)
+            powercap_update (0, watts0);
+        if (watts1 >= 0)
+            powercap_update (1, watts1);
+        failed = powercap_tick (now + tick);
+        if (failed != 0)
+            return failed;
+    }
+    return 0;
+}
+
+int main (void)
+{
+    rapl_ctx_t *ctx;
+    powercap_config_t config = {
+        .budget_watts = 100,
+        .ticks = 2,
+        .min_write_interval = 0,
+        .deadband_watts = 0.5,
+    };
+    uint64_t msr;
+    int node;
+
+    set_msr_backend (&msr_mock_backend);
+    for (node = 0; node < NUM_NODES; node++) {
+        msr_mock_set (node, MSR_RAPL_POWER_UNIT, POWER_UNIT);
+        msr_mock_set (node, MSR_RAPL_PKG_POWER_INFO, PKG_POWER_INFO);
+        msr_mock_set (node, MSR_RAPL_PKG_POWER_LIMIT, PKG_POWER_LIMIT);
+    }
+    if (0 != init_rapl (&ctx)) {
+        fprintf (stderr, "test-powercap: init_rapl() failed\n");
+        return 1;
+    }
+    CHECK (NUM_NODES == get_num_rapl_nodes_pkg (ctx));
+    CHECK (0 == powercap_init (ctx, NUM_NODES, &config));
+
+    /* Package 1 isn't measured yet: it keeps its 80 W, and package 0 gets
+     * what's left of the budget. */
+    CHECK (0 == run_round (10, 60, -1));
+    CHECK (limit_watts (0) == 20);
+    CHECK (limit_writes (0) == 1);
+    CHECK (limit_writes (1) == 0);
+
+    /* Equal demand: equal shares */
+    CHECK (0 == run_round (20, 50, 50));
+    CHECK (limit_watts (0) == 50);
+    CHECK (limit_watts (1) == 50);
+
+    /* Demand step on package 0: the budget follows the demand 3:1 */
+    CHECK (0 == run_round (30, 150, 50));
+    CHECK (limit_watts (0) == 75);
+    CHECK (limit_watts (1) == 25);
+    CHECK (limit_writes (0) == 3);
+    CHECK (limit_writes (1) == 2);
+    CHECK (0 == msr_mock_get (0, MSR_RAPL_PKG_POWER_LIMIT, &msr));
+    CHECK (msr & 1ULL << 15); /* enabled */
+    CHECK (msr & 1ULL << 16); /* clamped */
+    CHECK ((msr >> 32) == (PKG_POWER_LIMIT >> 32)); /* PL2 untouched */
+
+    /* No change within the deadband: no writes */
+    CHECK (0 == run_round (40, 150.4, 50));
+    CHECK (limit_writes (0) == 3);
+    CHECK (limit_writes (1) == 2);
+
+    /* The original limits are restored. */
+    CHECK (0 == powercap_shutdown ());
+    for (node = 0; node < NUM_NODES; node++) {
+        CHECK (0 == msr_mock_get (node, MSR_RAPL_PKG_POWER_LIMIT, &msr));
+        CHECK (msr == PKG_POWER_LIMIT);
+    }
+
+    terminate_rapl (ctx);
+    set_msr_backend (NULL);
+
+    if (failures > 0) {
+        fprintf (stderr, "test-powercap: %d check(s) failed\n", failures);
+        return 1;
+    }
+    printf ("test-powercap: all checks passed\n");
+    return 0;
+}
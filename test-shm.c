@@ -0,0 +1,259 @@
+/**
+ * collectd - test-shm.c
+ * Copyright (C) 2015  Nils Steinger
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Author:
+ *   Nils Steinger <git at n-st dot de>
+ **/
+
+/*
+ * Tests of the shared memory reader (rapl_shm_snapshot(), see shm.h):
+ * snapshots taken while another thread publishes are never torn, a reader
+ * gives up on a writer that stays in the middle of an update, and segments
+ * with shorter (older) or longer (newer) node structures are read correctly.
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "shm.h"
+
+#define NUM_NODES     4
+#define NUM_SNAPSHOTS 1000000
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf (stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+/* Fill a node so that every field is derived from `k', which lets a reader
+ * tell whether all of a snapshot comes from the same update. */
+static void fill_node (rapl_shm_node_t *node, uint64_t k)
+{
+    int domain;
+
+    for (domain = 0; domain < RAPL_NR_DOMAIN; domain++) {
+        node->domains[domain].energy_raw = k;
+        node->domains[domain].energy_J = (double) k;
+        node->domains[domain].watts = (double) k;
+        node->domains[domain].time_ns = k;
+        node->domains[domain].valid = 1;
+        node->domains[domain].reserved = 0;
+    }
+    node->pkg_id = (uint32_t) k;
+    node->die_id = (uint32_t) (k >> 32) + 1;
+}
+
+static int node_matches (const rapl_shm_node_t *node, uint64_t k)
+{
+    rapl_shm_node_t expected;
+
+    fill_node (&expected, k);
+    return memcmp (node, &expected, sizeof (expected)) == 0;
+}
+
+typedef struct writer_t {
+    rapl_shm_t *shm;
+    int stop;
+    uint64_t updates;
+} writer_t;
+
+/* Publish updates 1, 2, ... until told to stop. */
+static void *writer_main (void *arg)
+{
+    writer_t *w = arg;
+    rapl_shm_node_t nodes[NUM_NODES];
+    uint64_t k;
+    int node;
+
+    for (k = 1; !__atomic_load_n (&w->stop, __ATOMIC_RELAXED); k++) {
+        for (node = 0; node < NUM_NODES; node++)
+            fill_node (&nodes[node], k);
+        rapl_shm_publish (w->shm, nodes, k);
+    }
+    w->updates = k - 1;
+    return NULL;
+}
+
+static void test_concurrent (const char *name)
+{
+    rapl_shm_t writer_shm, reader_shm;
+    rapl_shm_node_t nodes[NUM_NODES];
+    writer_t w = { &writer_shm, 0, 0 };
+    pthread_t thread;
+    uint64_t time_ns, last = 0;
+    unsigned long i, snapshots = 0, torn = 0;
+    int n, node;
+
+    CHECK (0 == rapl_shm_create (&writer_shm, name, NUM_NODES, 1.0 / 16384, 1.0 / 65536));
+    CHECK (0 == rapl_shm_open (&reader_shm, name));
+    if (writer_shm.header == NULL || reader_shm.header == NULL)
+        return;
+    CHECK (reader_shm.header->dram_energy_unit_J == 1.0 / 65536);
+
+    CHECK (0 == pthread_create (&thread, NULL, writer_main, &w));
+    for (i = 0; i < NUM_SNAPSHOTS; i++) {
+        n = rapl_shm_snapshot (&reader_shm, nodes, NUM_NODES, &time_ns, 1000);
+        if (n < 0)
+            continue;
+        snapshots++;
+        CHECK (n == NUM_NODES);
+        /* Before the first update, the segment is all zeroes. */
+        if (time_ns == 0)
+            continue;
+        for (node = 0; node < n; node++)
+            if (!node_matches (&nodes[node], time_ns))
+                torn++;
+        CHECK (time_ns >= last);
+        last = time_ns;
+    }
+    __atomic_store_n (&w.stop, 1, __ATOMIC_RELAXED);
+    pthread_join (thread, NULL);
+
+    CHECK (snapshots > 0);
+    CHECK (torn == 0);
+    n = rapl_shm_snapshot (&reader_shm, nodes, NUM_NODES, &time_ns, 0);
+    CHECK (n == NUM_NODES && time_ns == w.updates && node_matches (&nodes[NUM_NODES - 1], w.updates));
+
+    rapl_shm_close (&reader_shm);
+    rapl_shm_destroy (&writer_shm);
+}
+
+static void test_stuck_writer (const char *name)
+{
+    rapl_shm_t shm;
+    rapl_shm_node_t nodes[NUM_NODES];
+    uint64_t time_ns = 0;
+    int node;
+
+    CHECK (0 == rapl_shm_create (&shm, name, NUM_NODES, 1.0 / 16384, 1.0 / 16384));
+    if (shm.header == NULL)
+        return;
+    for (node = 0; node < NUM_NODES; node++)
+        fill_node (&nodes[node], 7);
+    rapl_shm_publish (&shm, nodes, 7);
+
+    /* A writer that died (or stalls) in the middle of an update */
+    shm.header->seq++;
+    CHECK (MY_ERROR == rapl_shm_snapshot (&shm, nodes, NUM_NODES, &time_ns, 0));
+    CHECK (MY_ERROR == rapl_shm_snapshot (&shm, nodes, NUM_NODES, &time_ns, 100));
+    CHECK (time_ns == 0);
+
+    shm.header->seq++;
+    CHECK (NUM_NODES == rapl_shm_snapshot (&shm, nodes, NUM_NODES, &time_ns, 0));
+    CHECK (time_ns == 7);
+
+    rapl_shm_destroy (&shm);
+}
+
+/* Build a segment in memory whose nodes are `node_size' bytes apart, the
+ * first node_size bytes of each being a prefix of rapl_shm_node_t and the
+ * rest (if any) filled with junk. */
+static rapl_shm_header_t *make_segment (uint32_t node_size, rapl_shm_t *shm)
+{
+    size_t size = sizeof (rapl_shm_header_t) + NUM_NODES * (size_t) node_size;
+    rapl_shm_header_t *h = calloc (1, size);
+    rapl_shm_node_t node;
+    char *p;
+    uint32_t i;
+
+    if (h == NULL)
+        return NULL;
+    memcpy (h->magic, RAPL_SHM_MAGIC, sizeof (h->magic));
+    h->version = RAPL_SHM_VERSION;
+    h->header_size = sizeof (rapl_shm_header_t);
+    h->node_size = node_size;
+    h->num_nodes = NUM_NODES;
+    h->num_domains = RAPL_NR_DOMAIN;
+    h->update_time_ns = 42;
+    h->seq = 2;
+
+    p = (char *) h + h->header_size;
+    for (i = 0; i < NUM_NODES; i++, p += node_size) {
+        memset (p, 0xa5, node_size);
+        fill_node (&node, 100 + i);
+        memcpy (p, &node, node_size < sizeof (node) ? node_size : sizeof (node));
+    }
+
+    shm->header = h;
+    shm->size = size;
+    shm->name = NULL;
+    return h;
+}
+
+static void test_node_size (void)
+{
+    rapl_shm_t shm;
+    rapl_shm_header_t *h;
+    rapl_shm_node_t nodes[NUM_NODES];
+    rapl_shm_node_t expected;
+    uint64_t time_ns;
+    uint32_t i;
+
+    /* An older writer, without pkg_id and die_id: those read as 0 */
+    h = make_segment (offsetof (rapl_shm_node_t, pkg_id), &shm);
+    CHECK (h != NULL);
+    if (h != NULL) {
+        memset (nodes, 0xff, sizeof (nodes));
+        CHECK (NUM_NODES == rapl_shm_snapshot (&shm, nodes, NUM_NODES, &time_ns, 0));
+        CHECK (time_ns == 42);
+        for (i = 0; i < NUM_NODES; i++) {
+            fill_node (&expected, 100 + i);
+            expected.pkg_id = expected.die_id = 0;
+            CHECK (memcmp (&nodes[i], &expected, sizeof (expected)) == 0);
+        }
+        free (h);
+    }
+
+    /* A newer writer with fields we don't know about: they are skipped */
+    h = make_segment (sizeof (rapl_shm_node_t) + 24, &shm);
+    CHECK (h != NULL);
+    if (h != NULL) {
+        CHECK (NUM_NODES == rapl_shm_snapshot (&shm, nodes, NUM_NODES, &time_ns, 0));
+        for (i = 0; i < NUM_NODES; i++)
+            CHECK (node_matches (&nodes[i], 100 + i));
+
+        /* Fewer nodes than the segment has */
+        CHECK (2 == rapl_shm_snapshot (&shm, nodes, 2, &time_ns, 0));
+        free (h);
+    }
+}
+
+int main (void)
+{
+    char name[64];
+
+    snprintf (name, sizeof (name), "/intel_cpu_energy-test-%ld", (long) getpid ());
+
+    test_concurrent (name);
+    test_stuck_writer (name);
+    test_node_size ();
+
+    if (failures > 0) {
+        fprintf (stderr, "test-shm: %d check(s) failed\n", failures);
+        return 1;
+    }
+    printf ("test-shm: all checks passed\n");
+    return 0;
+}
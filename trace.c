@@ -0,0 +1,174 @@
+/**
+ * collectd - trace.c
+ * Copyright (C) 2015  Nils Steinger
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Author:
+ *   Nils Steinger <git at n-st dot de>
+ **/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+static uint64_t
+trace_clock_ns (clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime (clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+trace_map (rapl_trace_t *trace, int fd, size_t size, int prot)
+{
+    void *map;
+
+    map = mmap (NULL, size, prot, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        return MY_ERROR;
+
+    trace->header = map;
+    trace->records = (rapl_trace_record_t *) ((char *) map + sizeof (rapl_trace_header_t));
+    trace->size = size;
+    return 0;
+}
+
+int
+trace_create (rapl_trace_t *trace, const char *path, uint64_t capacity, double energy_unit_J,
+        double dram_energy_unit_J)
+{
+    int fd;
+    int err;
+    size_t size;
+    rapl_trace_header_t *h;
+
+    if (capacity == 0) {
+        errno = EINVAL;
+        return MY_ERROR;
+    }
+    size = sizeof (rapl_trace_header_t) + capacity * sizeof (rapl_trace_record_t);
+
+    fd = open (path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return MY_ERROR;
+    err = ftruncate (fd, size);
+    if (!err)
+        err = trace_map (trace, fd, size, PROT_READ | PROT_WRITE);
+    close (fd);
+    if (err)
+        return MY_ERROR;
+
+    h = trace->header;
+    memcpy (h->magic, RAPL_TRACE_MAGIC, sizeof (h->magic));
+    h->version = RAPL_TRACE_VERSION;
+    h->record_size = sizeof (rapl_trace_record_t);
+    h->capacity = capacity;
+    h->energy_unit_J = energy_unit_J;
+    h->dram_energy_unit_J = dram_energy_unit_J;
+    h->ref_realtime_ns = trace_clock_ns (CLOCK_REALTIME);
+    h->ref_monotonic_ns = trace_clock_ns (CLOCK_MONOTONIC_RAW);
+    __atomic_store_n (&h->head, 0, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+int
+trace_open (rapl_trace_t *trace, const char *path)
+{
+    int fd;
+    int err;
+    struct stat st;
+    rapl_trace_header_t *h;
+
+    fd = open (path, O_RDONLY);
+    if (fd < 0)
+        return MY_ERROR;
+    err = fstat (fd, &st);
+    if (!err && (size_t) st.st_size < sizeof (rapl_trace_header_t)) {
+        errno = EINVAL;
+        err = MY_ERROR;
+    }
+    if (!err)
+        err = trace_map (trace, fd, st.st_size, PROT_READ);
+    close (fd);
+    if (err)
+        return MY_ERROR;
+
+    h = trace->header;
+    if (memcmp (h->magic, RAPL_TRACE_MAGIC, sizeof (h->magic)) != 0
+            || h->version != RAPL_TRACE_VERSION
+            || h->record_size != sizeof (rapl_trace_record_t)
+            || trace->size < sizeof (rapl_trace_header_t) + h->capacity * sizeof (rapl_trace_record_t)) {
+        trace_close (trace);
+        errno = EINVAL;
+        return MY_ERROR;
+    }
+
+    return 0;
+}
+
+void
+trace_append (rapl_trace_t *trace, const rapl_trace_record_t *record)
+{
+    rapl_trace_header_t *h = trace->header;
+    uint64_t head = h->head; /* only ever modified by us */
+
+    trace->records[head % h->capacity] = *record;
+    __atomic_store_n (&h->head, head + 1, __ATOMIC_RELEASE);
+}
+
+uint64_t
+trace_head (const rapl_trace_t *trace)
+{
+    return __atomic_load_n (&trace->header->head, __ATOMIC_ACQUIRE);
+}
+
+int
+trace_read (const rapl_trace_t *trace, uint64_t index, rapl_trace_record_t *record)
+{
+    uint64_t capacity = trace->header->capacity;
+
+    if (index >= trace_head (trace))
+        return MY_ERROR;
+
+    *record = trace->records[index % capacity];
+
+    /* The writer may have lapped us while we were copying. Once head reaches
+     * index + capacity, it may be filling in the slot of record
+     * index + capacity, which is this slot. */
+    __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    if (trace_head (trace) >= index + capacity)
+        return MY_ERROR;
+
+    return 0;
+}
+
+void
+trace_close (rapl_trace_t *trace)
+{
+    if (trace->header != NULL)
+        munmap (trace->header, trace->size);
+    trace->header = NULL;
+    trace->records = NULL;
+    trace->size = 0;
+}
@@ -0,0 +1,101 @@
+/**
+ * collectd - trace.h
+ * Copyright (C) 2015  Nils Steinger
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Author:
+ *   Nils Steinger <git at n-st dot de>
+ **/
+
+#ifndef _h_trace
+#define _h_trace
+
+#include <stdint.h>
+
+#include "rapl.h"
+
+/*
+ * Memory-mapped ring buffer trace of raw energy samples.
+ *
+ * The trace file consists of a rapl_trace_header_t, followed by `capacity'
+ * fixed-width rapl_trace_record_t slots. Record number i (counting from the
+ * creation of the file) is stored in slot i % capacity, so the file always
+ * holds the most recent `capacity' records.
+ *
+ * There is a single writer, which never blocks: it fills in the slot and then
+ * publishes it by incrementing `head' with a release store. A reader loads
+ * `head' with acquire semantics, copies the records it is interested in and
+ * loads `head' again: records that may have been overwritten in between,
+ * or are being overwritten (index <= head - capacity), are discarded. The
+ * oldest slot is the next one the writer fills, so a reader can only rely
+ * on the most recent `capacity' - 1 records.
+ *
+ * All fields are in host byte order.
+ */
+
+#define RAPL_TRACE_MAGIC   "RAPLTRC1"
+#define RAPL_TRACE_VERSION 1
+
+typedef struct rapl_trace_record_t {
+    uint64_t time_ns;                    /* CLOCK_MONOTONIC_RAW */
+    uint32_t node;
+    uint32_t domain_mask;                /* bit n set: energy_raw[n] is valid */
+    uint64_t energy_raw[RAPL_NR_DOMAIN]; /* raw energy status registers */
+} rapl_trace_record_t;
+
+typedef struct rapl_trace_header_t {
+    char     magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t capacity;         /* number of record slots */
+    uint64_t head;             /* number of records written so far */
+    double   energy_unit_J;    /* Joules per raw energy status unit */
+    /* reference point to convert time_ns to wall clock time */
+    uint64_t ref_realtime_ns;
+    uint64_t ref_monotonic_ns;
+    /* Joules per raw DRAM energy status unit; 0 in older files, meaning
+     * energy_unit_J */
+    double   dram_energy_unit_J;
+    uint64_t reserved[1];
+} rapl_trace_header_t;
+
+typedef struct rapl_trace_t {
+    rapl_trace_header_t *header;
+    rapl_trace_record_t *records;
+    size_t               size; /* of the mapping */
+} rapl_trace_t;
+
+/* Create (or truncate) a trace file with room for `capacity' records and map
+ * it for writing. Returns 0 on success, MY_ERROR otherwise (errno is set). */
+int trace_create(rapl_trace_t *trace, const char *path, uint64_t capacity, double energy_unit_J,
+        double dram_energy_unit_J);
+
+/* Map an existing trace file for reading. Returns 0 on success, MY_ERROR
+ * otherwise. */
+int trace_open(rapl_trace_t *trace, const char *path);
+
+/* Append a record. Must only be called by the (single) writer. */
+void trace_append(rapl_trace_t *trace, const rapl_trace_record_t *record);
+
+/* Copy record number `index' to `record'. Returns 0 on success, MY_ERROR if
+ * the record hasn't been written yet or has been overwritten. */
+int trace_read(const rapl_trace_t *trace, uint64_t index, rapl_trace_record_t *record);
+
+/* Get the number of records written so far. */
+uint64_t trace_head(const rapl_trace_t *trace);
+
+void trace_close(rapl_trace_t *trace);
+
+#endif